@@ -108,6 +108,22 @@ else
 	echo "#undef HAVE_BINARY_TREE" >>include/config.h
 fi
 
+echo "Checking for epoll"
+$CC -o build/testfile $CFLAGS build/test-epoll.c 1>/dev/null 2>&1
+if test $? -eq 0; then
+	echo "#define HAVE_EPOLL 1" >>include/config.h
+else
+	echo "#undef HAVE_EPOLL" >>include/config.h
+fi
+
+echo "Checking for POSIX threads"
+$CC -o build/testfile $CFLAGS build/test-pthread.c $PTHREADLIBS 1>/dev/null 2>&1
+if test $? -eq 0; then
+	echo "#define HAVE_PTHREADS 1" >>include/config.h
+else
+	echo "#undef HAVE_PTHREADS" >>include/config.h
+fi
+
 
 echo "#endif" >>include/config.h
 
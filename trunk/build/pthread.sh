@@ -0,0 +1,28 @@
+	echo "Checking for POSIX threads ..."
+
+	PTHREADLIBS=""
+
+	cd build
+	OS=`uname -s | sed -e's@/@_@g'` $MAKE -f Makefile.test-pthread clean
+	OS=`uname -s | sed -e's@/@_@g'` $MAKE -f Makefile.test-pthread test-link-lpthread 1>/dev/null 2>&1
+	if [ $? -eq 0 ]; then
+		echo "POSIX threads require -lpthread"
+		PTHREADLIBS="-lpthread"
+	else
+		OS=`uname -s | sed -e's@/@_@g'` $MAKE -f Makefile.test-pthread test-link-pthread 1>/dev/null 2>&1
+		if [ $? -eq 0 ]; then
+			echo "POSIX threads require -pthread"
+			PTHREADLIBS="-pthread"
+		else
+			OS=`uname -s | sed -e's@/@_@g'` $MAKE -f Makefile.test-pthread test-link 1>/dev/null 2>&1
+			if [ $? -eq 0 ]; then
+				echo "POSIX threads are in the C library"
+			else
+				echo "POSIX threads not found, xymond will run without ingest threads"
+			fi
+		fi
+	fi
+	OS=`uname -s | sed -e's@/@_@g'` $MAKE -f Makefile.test-pthread clean
+
+	cd ..
+
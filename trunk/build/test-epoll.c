@@ -0,0 +1,18 @@
+#include <sys/epoll.h>
+#include <unistd.h>
+
+int main(int argc, char *argv[])
+{
+	struct epoll_event ev;
+	int fd;
+
+	fd = epoll_create(1);
+	ev.events = (EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET);
+	ev.data.ptr = NULL;
+	epoll_ctl(fd, EPOLL_CTL_ADD, 0, &ev);
+	epoll_wait(fd, &ev, 1, 0);
+	close(fd);
+
+	return 0;
+}
+
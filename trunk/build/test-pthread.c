@@ -0,0 +1,28 @@
+#include <pthread.h>
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wakeup = PTHREAD_COND_INITIALIZER;
+static int counter = 0;
+
+static void *threadfunc(void *arg)
+{
+	pthread_mutex_lock(&lock);
+	counter++;
+	pthread_cond_signal(&wakeup);
+	pthread_mutex_unlock(&lock);
+
+	return arg;
+}
+
+int main(int argc, char *argv[])
+{
+	pthread_t t;
+
+	if (pthread_create(&t, NULL, threadfunc, NULL) != 0) return 1;
+	pthread_join(t, NULL);
+
+	/* We also need the memory barrier builtin */
+	__sync_synchronize();
+
+	return (counter == 1) ? 0 : 1;
+}
@@ -57,6 +57,7 @@ typedef struct strbuffer_t {
 /* Generates HTML */
 #include "../lib/acklog.h"
 #include "../lib/eventlog.h"
+#include "../lib/eventstore.h"
 #include "../lib/headfoot.h"
 #include "../lib/htmllog.h"
 #include "../lib/notifylog.h"
@@ -74,6 +75,7 @@ typedef struct strbuffer_t {
 #include "../lib/environ.h"
 #include "../lib/errormsg.h"
 #include "../lib/files.h"
+#include "../lib/histlogstore.h"
 #include "../lib/xymonrrd.h"
 #include "../lib/holidays.h"
 #include "../lib/ipaccess.h"
@@ -104,6 +106,7 @@ typedef struct strbuffer_t {
 #include "../lib/timefunc.h"
 #include "../lib/timing.h"
 #include "../lib/tree.h"
+#include "../lib/tsdb.h"
 #include "../lib/url.h"
 #include "../lib/webaccess.h"
 #include "../lib/xymond_buffer.h"
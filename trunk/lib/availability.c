@@ -13,12 +13,15 @@
 
 static char rcsid[] = "$Id$";
 
+#include <sys/types.h>
+#include <sys/stat.h>
 #include <limits.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <string.h>
 #include <stdarg.h>
 #include <stdlib.h>
+#include <errno.h>
 
 #include "libxymon.h"
 
@@ -151,25 +154,53 @@ static unsigned long reportingduration(time_t eventstart, time_t eventduration)
 }
 
 
+static char *histlog_gets(char *buf, int bufsize, FILE *fd, char **bufptr)
+{
+	/* fgets() from either the plain logfile or a packed log in memory */
+	char *eoln;
+	int n;
+
+	if (fd) return fgets(buf, bufsize, fd);
+
+	if (**bufptr == '\0') return NULL;
+	eoln = strchr(*bufptr, '\n');
+	n = (eoln ? (eoln - *bufptr + 1) : strlen(*bufptr));
+	if (n >= bufsize) n = bufsize - 1;
+	memcpy(buf, *bufptr, n);
+	buf[n] = '\0';
+	*bufptr += n;
+
+	return buf;
+}
+
 static char *parse_histlogfile(char *hostname, char *servicename, char *timespec)
 {
 	char cause[MAX_LINE_LEN];
 	char fn[PATH_MAX];
-	char *p;
+	char *p, *hostdash, *bufptr = NULL;
 	FILE *fd;
+	strbuffer_t *packedlog = NULL;
 	char l[MAX_LINE_LEN];
 	int causefull = 0;
 
 	cause[0] = '\0';
 
 	sprintf(fn, "%s/%s", xgetenv("XYMONHISTLOGS"), commafy(hostname));
-	for (p = strrchr(fn, '/'); (*p); p++) if (*p == ',') *p = '_';
+	for (p = hostdash = strrchr(fn, '/'); (*p); p++) if (*p == ',') *p = '_';
+	hostdash = strdup(hostdash+1);
 	sprintf(p, "/%s/%s", servicename, timespec);
 
 	dbgprintf("Looking at history logfile %s\n", fn);
 	fd = fopen(fn, "r");
-	if (fd != NULL) {
-		while (!causefull && fgets(l, sizeof(l), fd)) {
+	if (fd == NULL) {
+		/* Not a plain file, but it may be in the packed histlogs */
+		packedlog = histlogstore_load(xgetenv("XYMONHISTLOGS"), hostdash, servicename, timespec);
+		if (packedlog) bufptr = STRBUF(packedlog);
+	}
+	xfree(hostdash);
+
+	if ((fd != NULL) || (packedlog != NULL)) {
+		while (!causefull && histlog_gets(l, sizeof(l), fd, &bufptr)) {
 			p = strchr(l, '\n'); if (p) *p = '\0';
 
 			if ((l[0] == '&') && (strncmp(l, "&green", 6) != 0)) {
@@ -210,7 +241,8 @@ static char *parse_histlogfile(char *hostname, char *servicename, char *timespec
 			strcat(cause, " [Truncated]");
 		}
 
-		fclose(fd);
+		if (fd) fclose(fd);
+		if (packedlog) freestrbuffer(packedlog);
 	}
 	else {
 		strcpy(cause, "No historical status available");
@@ -257,7 +289,307 @@ static char *get_historyline(char *buf, int bufsize, FILE *fd, int *err,
 	return buf;
 }
 
-static int scan_historyfile(FILE *fd, time_t fromtime, time_t totime,
+/*
+ * The history files can be very large, so xymond_history keeps an index
+ * next to each HOST.TEST file, in ".HOST.TEST.idx". It has a fixed-size
+ * record for each line in the history file, with the start time of the
+ * status and the file offset of the line. Reports use it to go directly
+ * to the first line they need. The index is only a hint: If the line it
+ * points to does not match, the history file is scanned as before.
+ */
+typedef struct histindexrec_t {
+	unsigned int start;
+	unsigned int offset;
+} histindexrec_t;
+
+static char *history_sidecar(char *histfn, char *suffix)
+{
+	static char result[PATH_MAX];
+	char *p = strrchr(histfn, '/');
+
+	if (p)
+		snprintf(result, sizeof(result), "%.*s/.%s.%s", (int)(p - histfn), histfn, p+1, suffix);
+	else
+		snprintf(result, sizeof(result), ".%s.%s", histfn, suffix);
+
+	return result;
+}
+
+char *historyindex_filename(char *histfn)
+{
+	return history_sidecar(histfn, "idx");
+}
+
+int historyindex_build(char *histfn)
+{
+	/* (Re)build the index for a history file */
+	FILE *histfd, *idxfd;
+	char l[MAX_LINE_LEN], colstr[MAX_LINE_LEN];
+	char idxfn[PATH_MAX], tmpfn[PATH_MAX];
+	histindexrec_t rec;
+	unsigned int uistart;
+	off_t pos;
+	int result = 0;
+
+	histfd = fopen(histfn, "r");
+	if (histfd == NULL) return -1;
+
+	strncpy(idxfn, historyindex_filename(histfn), sizeof(idxfn)); idxfn[sizeof(idxfn)-1] = '\0';
+	if (snprintf(tmpfn, sizeof(tmpfn), "%s.%d", idxfn, (int)getpid()) >= sizeof(tmpfn)) {
+		errprintf("History index filename for %s is too long\n", histfn);
+		fclose(histfd);
+		return -1;
+	}
+	idxfd = fopen(tmpfn, "w");
+	if (idxfd == NULL) {
+		errprintf("Cannot create history index %s: %s\n", tmpfn, strerror(errno));
+		fclose(histfd);
+		return -1;
+	}
+
+	pos = ftello(histfd);
+	while (fgets(l, sizeof(l), histfd)) {
+		if ((pos <= UINT_MAX) && (strlen(l) >= 25) && (sscanf(l+25, "%s %u", colstr, &uistart) == 2) && (parse_color(colstr) != -1)) {
+			rec.start = uistart;
+			rec.offset = pos;
+			if (fwrite(&rec, sizeof(rec), 1, idxfd) != 1) result = -1;
+		}
+		pos = ftello(histfd);
+	}
+	fclose(histfd);
+
+	if ((fclose(idxfd) != 0) || (result != 0) || (rename(tmpfn, idxfn) != 0)) {
+		errprintf("Cannot save history index %s: %s\n", idxfn, strerror(errno));
+		unlink(tmpfn);
+		return -1;
+	}
+
+	return 0;
+}
+
+void historyindex_add(char *histfn, time_t start, off_t offset)
+{
+	/* Record a new line in a history file, or index the whole file if there is no index */
+	FILE *idxfd;
+	histindexrec_t rec;
+	struct stat st;
+	char *idxfn = historyindex_filename(histfn);
+
+	if (stat(idxfn, &st) == -1) {
+		historyindex_build(histfn);
+		return;
+	}
+
+	if (offset > UINT_MAX) return;
+
+	idxfd = fopen(idxfn, "a");
+	if (idxfd == NULL) return;
+	rec.start = start;
+	rec.offset = offset;
+	fwrite(&rec, sizeof(rec), 1, idxfd);
+	fclose(idxfd);
+}
+
+static int historyindex_seek(FILE *fd, char *histfn, time_t fromtime, char *buf, size_t bufsize)
+{
+	/*
+	 * Position the history file at the line for the status that was current at "fromtime".
+	 * Returns 1 if this worked, 0 if the file must be scanned to find it.
+	 */
+	FILE *idxfd;
+	struct stat st;
+	histindexrec_t rec, found;
+	long lo, hi, mid, count;
+	off_t curpos = ftello(fd);
+	char colstr[MAX_LINE_LEN];
+	unsigned int uistart;
+
+	idxfd = fopen(historyindex_filename(histfn), "r");
+	if (idxfd == NULL) return 0;
+	if ((fstat(fileno(idxfd), &st) == -1) || ((count = st.st_size / sizeof(rec)) == 0)) {
+		fclose(idxfd);
+		return 0;
+	}
+
+	/* Find the last record starting at or before fromtime */
+	found.offset = 0; found.start = 0;
+	lo = 0; hi = count-1;
+	while (lo <= hi) {
+		mid = lo + (hi - lo) / 2;
+		if ((fseeko(idxfd, (off_t)mid*sizeof(rec), SEEK_SET) != 0) || (fread(&rec, sizeof(rec), 1, idxfd) != 1)) break;
+
+		if (rec.start <= fromtime) {
+			found = rec;
+			lo = mid + 1;
+		}
+		else hi = mid - 1;
+	}
+	fclose(idxfd);
+
+	/* No entry before fromtime, so the index does not cover the period */
+	if (found.start == 0) return 0;
+
+	/* Check that the line is what the index says */
+	if ((fseeko(fd, found.offset, SEEK_SET) == 0) && fgets(buf, bufsize, fd) &&
+	    (strlen(buf) >= 25) && (sscanf(buf+25, "%s %u", colstr, &uistart) == 2) && (uistart == found.start)) {
+		dbgprintf("History index: Entry starting %u is at offset %u\n", found.start, found.offset);
+		fseeko(fd, found.offset, SEEK_SET);
+		return 1;
+	}
+
+	dbgprintf("History index for %s does not match the file\n", histfn);
+	fseeko(fd, curpos, SEEK_SET);
+	return 0;
+}
+
+/*
+ * Daily rollups of the history: For each day (UTC), how many seconds were
+ * spent in each color, and how many times the status changed to each color.
+ * xymond_history keeps these in ".HOST.TEST.days" next to the history file
+ * and updates them when a status changes. The file has a header, and then
+ * one record per day from the day the history begins. Only completed
+ * statuses are included, i.e. up to the start of the current status.
+ */
+#define ROLLUP_MAGIC "XHR1"
+#define ROLLUP_COLORS 8
+
+typedef struct histrolluphdr_t {
+	char magic[4];
+	unsigned int firstday;
+	unsigned int coveredto;
+} histrolluphdr_t;
+
+typedef struct histrollup_t {
+	unsigned int secs[ROLLUP_COLORS];
+	unsigned int changes[ROLLUP_COLORS];
+} histrollup_t;
+
+char *historyrollup_filename(char *histfn)
+{
+	return history_sidecar(histfn, "days");
+}
+
+static int rollup_addstatus(FILE *fd, histrolluphdr_t *hdr, int color, time_t start, time_t duration)
+{
+	/* Add one completed status to the rollup file */
+	histrollup_t rec;
+	time_t daystart, t, overlap;
+	unsigned int day;
+	long recno, reccount;
+	off_t fsize;
+
+	if ((color < 0) || (color >= ROLLUP_COLORS) || (duration < 0)) return 0;
+	if ((start / 86400) < hdr->firstday) return -1;
+	if ((fseeko(fd, 0, SEEK_END) != 0) || ((fsize = ftello(fd)) < (off_t)sizeof(histrolluphdr_t))) return -1;
+	reccount = (fsize - sizeof(histrolluphdr_t)) / sizeof(histrollup_t);
+
+	t = start;
+	do {
+		day = t / 86400;
+		daystart = (time_t)day * 86400;
+		overlap = (((start + duration) < (daystart + 86400)) ? (start + duration) : (daystart + 86400)) - t;
+		recno = day - hdr->firstday;
+
+		/* Days we have not seen yet start out empty */
+		memset(&rec, 0, sizeof(rec));
+		if (recno < reccount) {
+			if ((fseeko(fd, sizeof(histrolluphdr_t) + (off_t)recno*sizeof(rec), SEEK_SET) != 0) ||
+			    (fread(&rec, sizeof(rec), 1, fd) != 1)) return -1;
+		}
+		else {
+			fseeko(fd, sizeof(histrolluphdr_t) + (off_t)reccount*sizeof(rec), SEEK_SET);
+			while (reccount < recno) {
+				if (fwrite(&rec, sizeof(rec), 1, fd) != 1) return -1;
+				reccount++;
+			}
+			reccount++;
+		}
+
+		rec.secs[color] += overlap;
+		if (t == start) rec.changes[color]++;
+		if ((fseeko(fd, sizeof(histrolluphdr_t) + (off_t)recno*sizeof(rec), SEEK_SET) != 0) ||
+		    (fwrite(&rec, sizeof(rec), 1, fd) != 1)) return -1;
+
+		t = daystart + 86400;
+	} while (t < (start + duration));
+
+	hdr->coveredto = start + duration;
+	return 0;
+}
+
+int historyrollup_build(char *histfn)
+{
+	/* (Re)build the rollups for a history file */
+	FILE *histfd, *rollfd;
+	char l[MAX_LINE_LEN], colstr[MAX_LINE_LEN];
+	char rollfn[PATH_MAX], tmpfn[PATH_MAX];
+	histrolluphdr_t hdr;
+	unsigned int uistart, uidur;
+	int scanres, err = 0, result = 0;
+
+	histfd = fopen(histfn, "r");
+	if (histfd == NULL) return -1;
+
+	strncpy(rollfn, historyrollup_filename(histfn), sizeof(rollfn)); rollfn[sizeof(rollfn)-1] = '\0';
+	if (snprintf(tmpfn, sizeof(tmpfn), "%s.%d", rollfn, (int)getpid()) >= sizeof(tmpfn)) {
+		errprintf("History rollups filename for %s is too long\n", histfn);
+		fclose(histfd);
+		return -1;
+	}
+	rollfd = fopen(tmpfn, "w+");
+	if (rollfd == NULL) {
+		errprintf("Cannot create history rollups %s: %s\n", tmpfn, strerror(errno));
+		fclose(histfd);
+		return -1;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, ROLLUP_MAGIC, sizeof(hdr.magic));
+	if (fwrite(&hdr, sizeof(hdr), 1, rollfd) != 1) result = -1;
+	while ((result == 0) && get_historyline(l, sizeof(l), histfd, &err, colstr, &uistart, &uidur, &scanres)) {
+		/* The current status has no duration yet */
+		if (scanres < 3) continue;
+
+		if (hdr.coveredto == 0) hdr.firstday = uistart / 86400;
+		strcat(colstr, " ");
+		result = rollup_addstatus(rollfd, &hdr, parse_color(colstr), uistart, uidur);
+	}
+	fclose(histfd);
+
+	if ((result == 0) && ((fseeko(rollfd, 0, SEEK_SET) != 0) || (fwrite(&hdr, sizeof(hdr), 1, rollfd) != 1))) result = -1;
+	if ((fclose(rollfd) != 0) || (result != 0) || (rename(tmpfn, rollfn) != 0)) {
+		errprintf("Cannot save history rollups %s: %s\n", rollfn, strerror(errno));
+		unlink(tmpfn);
+		return -1;
+	}
+
+	return 0;
+}
+
+void historyrollup_add(char *histfn, int color, time_t start, time_t duration)
+{
+	/*
+	 * Add a status that has just ended. If the rollups do not end where
+	 * this status starts, they are out of step with the history file and
+	 * are rebuilt from it.
+	 */
+	FILE *rollfd;
+	histrolluphdr_t hdr;
+
+	rollfd = fopen(historyrollup_filename(histfn), "r+");
+	if ((rollfd == NULL) || (fread(&hdr, sizeof(hdr), 1, rollfd) != 1) ||
+	    (memcmp(hdr.magic, ROLLUP_MAGIC, sizeof(hdr.magic)) != 0) || (hdr.coveredto != start) ||
+	    (rollup_addstatus(rollfd, &hdr, color, start, duration) != 0) ||
+	    (fseeko(rollfd, 0, SEEK_SET) != 0) || (fwrite(&hdr, sizeof(hdr), 1, rollfd) != 1)) {
+		if (rollfd) fclose(rollfd);
+		historyrollup_build(histfn);
+		return;
+	}
+
+	fclose(rollfd);
+}
+
+static int scan_historyfile(FILE *fd, char *histfn, time_t fromtime, time_t totime,
 		char *buf, size_t bufsize, 
 		time_t *starttime, time_t *duration, char *colstr)
 {
@@ -290,33 +622,38 @@ static int scan_historyfile(FILE *fd, time_t fromtime, time_t totime,
 		return 0;
 	}
 
-	/* First, do a quick scan through the file to find the approximate position where we should start */
-	while ((start+dur) < fromtime) {
-		if (get_historyline(buf, bufsize, fd, &err, colstr, &uistart, &uidur, &scanres)) {
-			start = uistart; dur = uidur;
-			if (scanres == 2) dur = getcurrenttime(NULL) - start;
-
-			if (scanres >= 2) {
-				dbgprintf("Skipped to entry starting %lu\n", start);
-
-				if ((start + dur) < fromtime) {
-					fseeko(fd, 2048, SEEK_CUR);
-					if (!fgets(buf, bufsize, fd)) {}; /* Skip partial line */
+	if (((start+dur) < fromtime) && histfn && historyindex_seek(fd, histfn, fromtime, buf, bufsize)) {
+		/* The index took us to the right place */
+	}
+	else {
+		/* First, do a quick scan through the file to find the approximate position where we should start */
+		while ((start+dur) < fromtime) {
+			if (get_historyline(buf, bufsize, fd, &err, colstr, &uistart, &uidur, &scanres)) {
+				start = uistart; dur = uidur;
+				if (scanres == 2) dur = getcurrenttime(NULL) - start;
+
+				if (scanres >= 2) {
+					dbgprintf("Skipped to entry starting %lu\n", start);
+
+					if ((start + dur) < fromtime) {
+						fseeko(fd, 2048, SEEK_CUR);
+						if (!fgets(buf, bufsize, fd)) {}; /* Skip partial line */
+					}
 				}
 			}
-		}
+			else {
+				start = getcurrenttime(NULL);
+				dur = 0;
+			}
+		};
+
+		/* We know the start position of the logfile is between current pos and (current-~2048 bytes) */
+		if (ftello(fd) < 2300)
+			rewind(fd);
 		else {
-			start = getcurrenttime(NULL);
-			dur = 0;
+			fseeko(fd, -2300, SEEK_CUR); 
+			if (!fgets(buf, bufsize, fd)) {}; /* Skip partial line */
 		}
-	};
-
-	/* We know the start position of the logfile is between current pos and (current-~2048 bytes) */
-	if (ftello(fd) < 2300)
-		rewind(fd);
-	else {
-		fseeko(fd, -2300, SEEK_CUR); 
-		if (!fgets(buf, bufsize, fd)) {}; /* Skip partial line */
 	}
 
 	/* Read one line at a time until we hit start of our report period */
@@ -340,6 +677,121 @@ static int scan_historyfile(FILE *fd, time_t fromtime, time_t totime,
 	return err;
 }
 
+static int history_segment(FILE *fd, char *histfn, time_t fromtime, time_t totime, unsigned long *duration, int *count,
+			   time_t *segstart, time_t *firststart, int *firstcolor, int *fileerrors)
+{
+	/*
+	 * Add up the time spent in each color between fromtime and totime, like
+	 * parse_historyfile() does. Returns the number of statuses found.
+	 */
+	char l[MAX_LINE_LEN], colstr[MAX_LINE_LEN];
+	time_t start, dur;
+	unsigned int uistart, uidur;
+	int scanres, color, n = 0;
+
+	*fileerrors += scan_historyfile(fd, histfn, fromtime, totime, l, sizeof(l), &start, &dur, colstr);
+	if (start > totime) return 0;
+
+	*firststart = start;
+	*firstcolor = -1;
+	if (start < fromtime) {
+		dur -= (fromtime - start);
+		start = fromtime;
+	}
+	*segstart = start;
+
+	do {
+		if ((start + dur) > totime) dur = (totime - start);
+		strcat(colstr, " "); color = parse_color(colstr);
+		if (color != -1) {
+			if (*firstcolor == -1) *firstcolor = color;
+			count[color]++;
+			duration[color] += dur;
+			n++;
+		}
+
+		if (((start + dur) < totime) && get_historyline(l, sizeof(l), fd, fileerrors, colstr, &uistart, &uidur, &scanres)) {
+			start = uistart; dur = uidur;
+			if (scanres == 2) dur = getcurrenttime(NULL) - start;
+		}
+		else break;
+	} while (1);
+
+	return n;
+}
+
+static int rollup_historyfile(FILE *fd, char *histfn, time_t fromtime, time_t totime, reportinfo_t *repinfo, int *fileerrors)
+{
+	/*
+	 * Use the daily rollups for the full days of the report period, and
+	 * the history file only for the partial days at the start and end.
+	 * Returns 0 if the rollups cannot be used.
+	 */
+	FILE *rollfd;
+	histrolluphdr_t hdr;
+	histrollup_t rec;
+	time_t firstday, lastday, segstart, firststart;
+	unsigned long taildur[COL_COUNT];
+	int tailcount[COL_COUNT];
+	int firstcolor, i, errs = 0;
+	long day;
+
+	rollfd = fopen(historyrollup_filename(histfn), "r");
+	if (rollfd == NULL) return 0;
+	if ((fread(&hdr, sizeof(hdr), 1, rollfd) != 1) || (memcmp(hdr.magic, ROLLUP_MAGIC, sizeof(hdr.magic)) != 0)) {
+		fclose(rollfd);
+		return 0;
+	}
+
+	/* The full days in the period, that have completed in the rollups */
+	firstday = (fromtime / 86400) + 1;
+	lastday = (totime / 86400);
+	if (lastday > (hdr.coveredto / 86400)) lastday = (hdr.coveredto / 86400);
+	if ((firstday >= lastday) || (firstday < hdr.firstday)) {
+		fclose(rollfd);
+		return 0;
+	}
+
+	/* The start of the period. This also tells us where the report starts. */
+	for (i = 0; (i < COL_COUNT); i++) { repinfo->fullduration[i] = 0; repinfo->count[i] = 0; }
+	if ((history_segment(fd, histfn, fromtime, firstday*86400, repinfo->fullduration, repinfo->count,
+			     &segstart, &firststart, &firstcolor, &errs) == 0) || (firststart >= firstday*86400)) {
+		fclose(rollfd);
+		return 0;
+	}
+	repinfo->reportstart = segstart;
+
+	for (day = firstday; (day < lastday); day++) {
+		if ((fseeko(rollfd, sizeof(hdr) + (off_t)(day - hdr.firstday)*sizeof(rec), SEEK_SET) != 0) ||
+		    (fread(&rec, sizeof(rec), 1, rollfd) != 1)) {
+			fclose(rollfd);
+			return 0;
+		}
+
+		for (i = 0; (i < COL_COUNT); i++) {
+			repinfo->fullduration[i] += rec.secs[i];
+			repinfo->count[i] += rec.changes[i];
+		}
+	}
+	fclose(rollfd);
+
+	/* The end of the period. The first status here has already been counted, unless it starts here. */
+	for (i = 0; (i < COL_COUNT); i++) { taildur[i] = 0; tailcount[i] = 0; }
+	if (history_segment(fd, histfn, lastday*86400, totime, taildur, tailcount, &segstart, &firststart, &firstcolor, &errs)) {
+		if ((firststart < lastday*86400) && (firstcolor != -1)) tailcount[firstcolor]--;
+		for (i = 0; (i < COL_COUNT); i++) {
+			repinfo->fullduration[i] += taildur[i];
+			repinfo->count[i] += tailcount[i];
+		}
+	}
+
+	repinfo->fullstops = 0;
+	for (i = COL_YELLOW+1; (i < COL_COUNT); i++) repinfo->fullstops += repinfo->count[i];
+
+	*fileerrors += errs;
+	return 1;
+}
+
 
 static char *timename(char *timestring)
 {
@@ -370,7 +822,67 @@ static char *timename(char *timestring)
 }
 
 
-int parse_historyfile(FILE *fd, reportinfo_t *repinfo, char *hostname, char *servicename, 
+static int history_result(reportinfo_t *repinfo, time_t totime, char *reporttime,
+			  double warnlevel, double greenlevel, int warnstops, int fileerrors)
+{
+	/* Calculate the percentages and the resulting color from the durations */
+	time_t duration;
+	int color, i;
+
+	for (i=0; (i<COL_COUNT); i++) {
+		dbgprintf("Duration for color %d: %lu\n", i, repinfo->fullduration[i]);
+		repinfo->fullpct[i] = (100.0*repinfo->fullduration[i] / (totime - repinfo->reportstart));
+	}
+	repinfo->fullavailability = 100.0 - repinfo->fullpct[COL_RED];
+
+	if (reporttime) {
+		repinfo->withreport = 1;
+		duration = repinfo->reportduration[COL_GREEN] + 
+			   repinfo->reportduration[COL_YELLOW] + 
+			   repinfo->reportduration[COL_RED] + 
+			   repinfo->reportduration[COL_CLEAR];
+
+		if (duration > 0) {
+			repinfo->reportpct[COL_GREEN] = (100.0*repinfo->reportduration[COL_GREEN] / duration);
+			repinfo->reportpct[COL_YELLOW] = (100.0*repinfo->reportduration[COL_YELLOW] / duration);
+			repinfo->reportpct[COL_RED] = (100.0*repinfo->reportduration[COL_RED] / duration);
+			repinfo->reportpct[COL_CLEAR] = (100.0*repinfo->reportduration[COL_CLEAR] / duration);
+			repinfo->reportavailability = 100.0 - repinfo->reportpct[COL_RED] - repinfo->reportpct[COL_CLEAR];
+
+			if (repinfo->reportavailability > greenlevel) color = COL_GREEN;
+			else if (repinfo->reportavailability >= warnlevel) color = COL_YELLOW;
+			else color = COL_RED;
+
+			if ((warnstops >= 0) && (repinfo->reportstops > warnstops)) color = COL_RED;
+		}
+		else {
+			/* Reporting period has no match with REPORTTIME setting */
+			repinfo->reportpct[COL_CLEAR] = 100.0;
+			repinfo->reportavailability = 100.0;
+			color = COL_GREEN;
+		}
+	}
+	else {
+		if (repinfo->fullavailability > greenlevel) color = COL_GREEN;
+		else if (repinfo->fullavailability >= warnlevel) color = COL_YELLOW;
+		else color = COL_RED;
+
+		if ((warnstops >= 0) && (repinfo->fullstops > warnstops)) color = COL_RED;
+
+		/* Copy the full percentages/durations to the SLA ones */
+		repinfo->reportavailability = repinfo->fullavailability;
+		repinfo->reportstops = repinfo->fullstops;
+		for (i=0; (i<COL_COUNT); i++) {
+			repinfo->reportduration[i] = repinfo->fullduration[i];
+			repinfo->reportpct[i] = repinfo->fullpct[i];
+		}
+	}
+
+	if (fileerrors) repinfo->fstate = "NOTOK";
+	return color;
+}
+
+int parse_historyfile(FILE *fd, char *histfn, reportinfo_t *repinfo, char *hostname, char *servicename, 
 			time_t fromtime, time_t totime, int for_history, 
 			double warnlevel, double greenlevel, int warnstops, char *reporttime)
 {
@@ -401,9 +913,19 @@ int parse_historyfile(FILE *fd, reportinfo_t *repinfo, char *hostname, char *ser
 	/* Sanity check */
 	if (totime > getcurrenttime(NULL)) totime = getcurrenttime(NULL);
 
+	/*
+	 * A plain summary over several days can use the daily rollups. 
+	 * REPORTTIME needs the individual statuses, as do the event list
+	 * and the history.cgi color-bars (for_history).
+	 */
+	if (!for_history && !hostname && !servicename && !reporttime && histfn && (fromtime > 0) &&
+	    rollup_historyfile(fd, histfn, fromtime, totime, repinfo, &fileerrors)) {
+		return history_result(repinfo, totime, reporttime, warnlevel, greenlevel, warnstops, fileerrors);
+	}
+
 	/* If for_history and fromtime is 0, dont do any seeking */
 	if (!for_history || (fromtime > 0)) {
-		fileerrors = scan_historyfile(fd, fromtime, totime, 
+		fileerrors = scan_historyfile(fd, histfn, fromtime, totime, 
 				      l, sizeof(l), &starttime, &duration, colstr);
 	}
 	else {
@@ -483,57 +1005,7 @@ int parse_historyfile(FILE *fd, reportinfo_t *repinfo, char *hostname, char *ser
 		else done = 1;
 	} while (!done);
 
-	for (i=0; (i<COL_COUNT); i++) {
-		dbgprintf("Duration for color %d: %lu\n", i, repinfo->fullduration[i]);
-		repinfo->fullpct[i] = (100.0*repinfo->fullduration[i] / (totime - repinfo->reportstart));
-	}
-	repinfo->fullavailability = 100.0 - repinfo->fullpct[COL_RED];
-
-	if (reporttime) {
-		repinfo->withreport = 1;
-		duration = repinfo->reportduration[COL_GREEN] + 
-			   repinfo->reportduration[COL_YELLOW] + 
-			   repinfo->reportduration[COL_RED] + 
-			   repinfo->reportduration[COL_CLEAR];
-
-		if (duration > 0) {
-			repinfo->reportpct[COL_GREEN] = (100.0*repinfo->reportduration[COL_GREEN] / duration);
-			repinfo->reportpct[COL_YELLOW] = (100.0*repinfo->reportduration[COL_YELLOW] / duration);
-			repinfo->reportpct[COL_RED] = (100.0*repinfo->reportduration[COL_RED] / duration);
-			repinfo->reportpct[COL_CLEAR] = (100.0*repinfo->reportduration[COL_CLEAR] / duration);
-			repinfo->reportavailability = 100.0 - repinfo->reportpct[COL_RED] - repinfo->reportpct[COL_CLEAR];
-
-			if (repinfo->reportavailability > greenlevel) color = COL_GREEN;
-			else if (repinfo->reportavailability >= warnlevel) color = COL_YELLOW;
-			else color = COL_RED;
-
-			if ((warnstops >= 0) && (repinfo->reportstops > warnstops)) color = COL_RED;
-		}
-		else {
-			/* Reporting period has no match with REPORTTIME setting */
-			repinfo->reportpct[COL_CLEAR] = 100.0;
-			repinfo->reportavailability = 100.0;
-			color = COL_GREEN;
-		}
-	}
-	else {
-		if (repinfo->fullavailability > greenlevel) color = COL_GREEN;
-		else if (repinfo->fullavailability >= warnlevel) color = COL_YELLOW;
-		else color = COL_RED;
-
-		if ((warnstops >= 0) && (repinfo->fullstops > warnstops)) color = COL_RED;
-
-		/* Copy the full percentages/durations to the SLA ones */
-		repinfo->reportavailability = repinfo->fullavailability;
-		repinfo->reportstops = repinfo->fullstops;
-		for (i=0; (i<COL_COUNT); i++) {
-			repinfo->reportduration[i] = repinfo->fullduration[i];
-			repinfo->reportpct[i] = repinfo->fullpct[i];
-		}
-	}
-
-	if (fileerrors) repinfo->fstate = "NOTOK";
-	return color;
+	return history_result(repinfo, totime, reporttime, warnlevel, greenlevel, warnstops, fileerrors);
 }
 
 
@@ -551,7 +1023,7 @@ void restore_replogs(replog_t *head)
 }
 
 
-int history_color(FILE *fd, time_t snapshot, time_t *starttime, char **histlogname)
+int history_color(FILE *fd, char *histfn, time_t snapshot, time_t *starttime, char **histlogname)
 {
 	char l[MAX_LINE_LEN];
 	time_t duration;
@@ -560,7 +1032,7 @@ int history_color(FILE *fd, time_t snapshot, time_t *starttime, char **histlogna
 	char *p;
 
 	*histlogname = NULL;
-	scan_historyfile(fd, snapshot, snapshot, 
+	scan_historyfile(fd, histfn, snapshot, snapshot, 
 		      l, sizeof(l), starttime, &duration, colstr);
 	
 	strcat(colstr, " ");
@@ -611,7 +1083,7 @@ int main(int argc, char *argv[])
 	p = strrchr(hostsvc, '/'); host = p+1;
 	while ((p = strchr(host, ','))) *p = '.';
 
-	color = parse_historyfile(fd, &repinfo, host, svc, reportstart, reportend, 0, reportwarnlevel, reportgreenlevel, warnstops, NULL);
+	color = parse_historyfile(fd, argv[1], &repinfo, host, svc, reportstart, reportend, 0, reportwarnlevel, reportgreenlevel, warnstops, NULL);
 
 	for (i=0; (i<COL_COUNT); i++) {
 		dbgprintf("Color %d: Count=%d, pct=%.2f\n", i, repinfo.count[i], repinfo.fullpct[i]);
@@ -11,6 +11,8 @@
 #ifndef __AVAILABILITY_H__
 #define __AVAILABILITY_H__
 
+#include <sys/types.h>
+
 #include "color.h"
 
 typedef struct reportinfo_t {
@@ -43,13 +45,19 @@ typedef struct replog_t {
 extern replog_t *reploghead;
 
 extern char *durationstr(time_t duration);
-extern int parse_historyfile(FILE *fd, reportinfo_t *repinfo, char *hostname, char *servicename, 
+extern int parse_historyfile(FILE *fd, char *histfn, reportinfo_t *repinfo, char *hostname, char *servicename, 
 				time_t fromtime, time_t totime, int for_history,
 				double warnlevel, double greenlevel, int warnstops,
 				char *reporttime);
 extern replog_t *save_replogs(void);
 extern void restore_replogs(replog_t *head);
-extern int history_color(FILE *fd, time_t snapshot, time_t *starttime, char **histlogname);
+extern int history_color(FILE *fd, char *histfn, time_t snapshot, time_t *starttime, char **histlogname);
+extern char *historyindex_filename(char *histfn);
+extern int historyindex_build(char *histfn);
+extern void historyindex_add(char *histfn, time_t start, off_t offset);
+extern char *historyrollup_filename(char *histfn);
+extern int historyrollup_build(char *histfn);
+extern void historyrollup_add(char *histfn, int color, time_t start, time_t duration);
 
 #endif
 
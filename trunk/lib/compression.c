@@ -83,24 +83,14 @@ void uncompress_stream_done(void *s)
 }
 
 
-strbuffer_t *uncompress_buffer(char *msg, int msglen, char *prestring)
+static strbuffer_t *inflate_buffer(z_stream *strm, char *msg, int msglen, char *prestring, int bufsz, int *streamerr)
 {
-	static z_stream *strm = NULL;
 	strbuffer_t *dbuf;
-	static int dbufmax = 0;
 	int n;
 	unsigned int nbytes, avbytes;
 
-	if (!strm) {
-		strm = uncompress_stream_init();
-		if (!strm) return NULL;
-	}
-	else {
-		inflateReset(strm);	/* We'll reuse the strm struct */
-	}
-
-	if (dbufmax < 2*msglen) dbufmax = 2*msglen;
-	dbuf = newstrbuffer(dbufmax);
+	*streamerr = 0;
+	dbuf = newstrbuffer(bufsz);
 	if (prestring) addtobuffer(dbuf, prestring);
 
 	do {
@@ -120,7 +110,7 @@ strbuffer_t *uncompress_buffer(char *msg, int msglen, char *prestring)
 
 			switch (n) {
 			  case Z_STREAM_ERROR:
-				xfree(strm); strm = NULL;
+				*streamerr = 1;
 				freestrbuffer(dbuf);
 				return NULL;
 			  case Z_NEED_DICT:
@@ -145,6 +135,42 @@ done:
 	}
 }
 
+strbuffer_t *uncompress_buffer(char *msg, int msglen, char *prestring)
+{
+	static z_stream *strm = NULL;
+	static int dbufmax = 0;
+	strbuffer_t *dbuf;
+	int streamerr;
+
+	if (!strm) {
+		strm = uncompress_stream_init();
+		if (!strm) return NULL;
+	}
+	else {
+		inflateReset(strm);	/* We'll reuse the strm struct */
+	}
+
+	if (dbufmax < 2*msglen) dbufmax = 2*msglen;
+	dbuf = inflate_buffer(strm, msg, msglen, prestring, dbufmax, &streamerr);
+	if (streamerr) { xfree(strm); strm = NULL; }
+
+	return dbuf;
+}
+
+strbuffer_t *uncompress_buffer_r(void *s, char *msg, int msglen, char *prestring)
+{
+	/*
+	 * Same as uncompress_buffer(), but using a stream owned by the caller
+	 * (from uncompress_stream_init) instead of our static one. Safe to
+	 * use from multiple threads, as long as each has its own stream.
+	 */
+	z_stream *strm = (z_stream *)s;
+	int streamerr;
+
+	inflateReset(strm);
+	return inflate_buffer(strm, msg, msglen, prestring, 2*msglen, &streamerr);
+}
+
 
 
 
@@ -19,6 +19,7 @@ extern strbuffer_t *uncompress_stream_data(void *s, char *cmsg, int clen);
 extern void uncompress_stream_done(void *s);
 
 extern strbuffer_t *uncompress_buffer(char *msg, int msglen, char *prestring);
+extern strbuffer_t *uncompress_buffer_r(void *s, char *msg, int msglen, char *prestring);
 extern strbuffer_t *compress_buffer(char *msg, int msglen);
 
 #endif
@@ -167,13 +167,12 @@ void dump_countlists(countlist_t *hosthead, countlist_t *svchead)
 	printf("\n");
 }
 
-static int  eventfilter(void *hinfo, char *testname,
+static int  eventfilter_host(void *hinfo,
 			pcre *pageregexp, pcre *expageregexp,
 			pcre *hostregexp, pcre *exhostregexp,
-			pcre *testregexp, pcre *extestregexp,
 			int ignoredialups, f_hostcheck hostcheck)
 {
-	int pagematch, hostmatch, testmatch;
+	int pagematch, hostmatch;
 	char *hostname = xmh_item(hinfo, XMH_HOSTNAME);
 	int ovector[30];
 
@@ -224,6 +223,14 @@ static int  eventfilter(void *hinfo, char *testname,
 		hostmatch = 0;
 	if (hostmatch) return 0;
 
+	return 1;
+}
+
+static int  eventfilter_test(char *testname, pcre *testregexp, pcre *extestregexp)
+{
+	int testmatch;
+	int ovector[30];
+
 	if (testregexp)
 		testmatch = (pcre_exec(testregexp, NULL, testname, strlen(testname), 0, 0, 
 				ovector, (sizeof(ovector)/sizeof(int))) >= 0);
@@ -241,6 +248,16 @@ static int  eventfilter(void *hinfo, char *testname,
 	return 1;
 }
 
+static int  eventfilter(void *hinfo, char *testname,
+			pcre *pageregexp, pcre *expageregexp,
+			pcre *hostregexp, pcre *exhostregexp,
+			pcre *testregexp, pcre *extestregexp,
+			int ignoredialups, f_hostcheck hostcheck)
+{
+	return (eventfilter_host(hinfo, pageregexp, expageregexp, hostregexp, exhostregexp, ignoredialups, hostcheck) &&
+		eventfilter_test(testname, testregexp, extestregexp));
+}
+
 
 static void count_duration(time_t fromtime, time_t totime,
 			   pcre *pageregexp, pcre *expageregexp,
@@ -488,6 +505,120 @@ nextrecord:
 	if (debug) dump_countlists(*hostcounthead, *svccounthead);
 }
 
+static event_t *addevent(event_t *eventhead, void *eventhost, htnames_t *eventcolumn,
+			 time_t eventtime, time_t changetime, time_t duration,
+			 int newcolor, int oldcolor, countsummary_t counttype)
+{
+	event_t *newevent;
+	eventcount_t *countrec;
+
+	newevent = (event_t *) malloc(sizeof(event_t));
+	newevent->host       = eventhost;
+	newevent->service    = eventcolumn;
+	newevent->eventtime  = eventtime;
+	newevent->changetime = changetime;
+	newevent->duration   = duration;
+	newevent->newcolor   = newcolor;
+	newevent->oldcolor   = oldcolor;
+	newevent->next = eventhead;
+
+	if (counttype != XYMON_COUNT_DURATION) {
+		countrec = (eventcount_t *)xmh_item(eventhost, XMH_DATA);
+		while (countrec && (countrec->service != eventcolumn)) countrec = countrec->next;
+		if (countrec == NULL) {
+			countrec = (eventcount_t *)calloc(1, sizeof(eventcount_t));
+			countrec->service = eventcolumn;
+			countrec->next = (eventcount_t *)xmh_item(eventhost, XMH_DATA);
+			xmh_set_item(eventhost, XMH_DATA, (void *)countrec);
+		}
+		countrec->count++;
+	}
+
+	return newevent;
+}
+
+static event_t *load_eventstore(eventstore_t *store, time_t lastevent,
+				pcre *pageregexp, pcre *expageregexp,
+				pcre *hostregexp, pcre *exhostregexp,
+				pcre *testregexp, pcre *extestregexp,
+				pcre *colrregexp, int ignoredialups, f_hostcheck hostcheck,
+				countsummary_t counttype)
+{
+	/*
+	 * Same as reading the allevents file, but the host- and test-filters
+	 * only depend on the name, so they are done once for each name ID.
+	 */
+	event_t *eventhead = NULL;
+	eventstorerec_t rec;
+	void **hosts = NULL;
+	htnames_t **columns = NULL;
+	char *hostok = NULL, *testok = NULL;	/* 0: Not checked yet, 1: Wanted, 2: Not wanted */
+	unsigned int namecount = 0;
+	int colrmatch[COL_COUNT+1];
+	int ovector[30];
+	int i;
+
+	/* For duration counts, record all events. We'll filter out the colors later. */
+	for (i = -1; (i < COL_COUNT); i++) {
+		char *cname = colorname(i);
+
+		colrmatch[i+1] = (!colrregexp || (counttype == XYMON_COUNT_DURATION) ||
+				  (pcre_exec(colrregexp, NULL, cname, strlen(cname), 0, 0, 
+					     ovector, (sizeof(ovector)/sizeof(int))) >= 0));
+	}
+
+	while (eventstore_next(store, &rec)) {
+		/* For DURATION counts, we must parse all events until now */
+		if ((counttype != XYMON_COUNT_DURATION) && (rec.eventtime > lastevent)) break;
+		if ((rec.newcolor < -1) || (rec.newcolor >= COL_COUNT) || (rec.oldcolor < -1) || (rec.oldcolor >= COL_COUNT)) continue;
+
+		if (eventstore_namecount(store) > namecount) {
+			unsigned int newcount = eventstore_namecount(store);
+
+			hosts = (void **)realloc(hosts, newcount*sizeof(void *));
+			columns = (htnames_t **)realloc(columns, newcount*sizeof(htnames_t *));
+			hostok = (char *)realloc(hostok, newcount);
+			testok = (char *)realloc(testok, newcount);
+			memset(hostok+namecount, 0, newcount-namecount);
+			memset(testok+namecount, 0, newcount-namecount);
+			namecount = newcount;
+		}
+
+		if (hostok[rec.hostid] == 0) {
+			hosts[rec.hostid] = hostinfo(eventstore_name(store, rec.hostid));
+			hostok[rec.hostid] = ( hosts[rec.hostid] && 
+					       !xmh_item(hosts[rec.hostid], XMH_FLAG_NONONGREEN) &&
+					       eventfilter_host(hosts[rec.hostid], 
+								pageregexp, expageregexp, 
+								hostregexp, exhostregexp, 
+								ignoredialups, hostcheck) ) ? 1 : 2;
+		}
+		if (hostok[rec.hostid] != 1) continue;
+
+		if (testok[rec.testid] == 0) {
+			char *testname = eventstore_name(store, rec.testid);
+
+			columns[rec.testid] = getname(testname, 1);
+			testok[rec.testid] = ( wanted_eventcolumn(testname) && 
+					       eventfilter_test(testname, testregexp, extestregexp) ) ? 1 : 2;
+		}
+		if (testok[rec.testid] != 1) continue;
+
+		if (!colrmatch[rec.newcolor+1] && !colrmatch[rec.oldcolor+1]) continue;
+
+		eventhead = addevent(eventhead, hosts[rec.hostid], columns[rec.testid],
+				     rec.eventtime, rec.changetime, rec.duration,
+				     rec.newcolor, rec.oldcolor, counttype);
+	}
+
+	if (hosts) xfree(hosts);
+	if (columns) xfree(columns);
+	if (hostok) xfree(hostok);
+	if (testok) xfree(testok);
+
+	return eventhead;
+}
+
 void do_eventlog(FILE *output, int maxcount, int maxminutes, char *fromtime, char *totime, 
 		char *pageregex, char *expageregex,
 		char *hostregex, char *exhostregex,
@@ -498,6 +629,8 @@ void do_eventlog(FILE *output, int maxcount, int maxminutes, char *fromtime, cha
 		countsummary_t counttype, eventsummary_t sumtype, char *periodstring)
 {
 	FILE *eventlog;
+	eventstore_t *store;
+	int usedstore = 0;
 	char eventlogfilename[PATH_MAX];
 	time_t firstevent = 0;
 	time_t lastevent = getcurrenttime(NULL);
@@ -569,8 +702,11 @@ void do_eventlog(FILE *output, int maxcount, int maxminutes, char *fromtime, cha
 	if (extestregex && *extestregex) extestregexp = pcre_compile(extestregex, PCRE_CASELESS, &errmsg, &errofs, NULL);
 	if (colrregex && *colrregex) colrregexp = pcre_compile(colrregex, PCRE_CASELESS, &errmsg, &errofs, NULL);
 
+	/* Use the event store if it covers the period, otherwise the allevents file */
+	store = eventstore_open(xgetenv("XYMONHISTDIR"), firstevent, 
+				((counttype == XYMON_COUNT_DURATION) ? getcurrenttime(NULL) : lastevent));
 	sprintf(eventlogfilename, "%s/allevents", xgetenv("XYMONHISTDIR"));
-	eventlog = fopen(eventlogfilename, "r");
+	eventlog = (store ? NULL : fopen(eventlogfilename, "r"));
 
 	if (eventlog && (stat(eventlogfilename, &st) == 0)) {
 		time_t curtime;
@@ -611,18 +747,29 @@ void do_eventlog(FILE *output, int maxcount, int maxminutes, char *fromtime, cha
 	
 	eventhead = NULL;
 
+	if (store) {
+		eventhead = load_eventstore(store, lastevent,
+					    pageregexp, expageregexp,
+					    hostregexp, exhostregexp,
+					    testregexp, extestregexp,
+					    colrregexp, ignoredialups, hostcheck, counttype);
+		eventstore_close(store);
+		usedstore = 1;
+
+		/* We have all of the events, so "unlimited" is just that */
+		if (maxcount == -1) maxcount = INT_MAX;
+	}
+
 	while (eventlog && (fgets(l, sizeof(l), eventlog))) {
 
 		time_t eventtime, changetime, duration;
 		unsigned int uievt, uicht, uidur;
 		char hostname[MAX_LINE_LEN], svcname[MAX_LINE_LEN], newcol[MAX_LINE_LEN], oldcol[MAX_LINE_LEN];
 		char *newcolname, *oldcolname;
-		int state, itemsfound, pagematch, hostmatch, testmatch, colrmatch;
-		event_t *newevent;
+		int state, itemsfound, colrmatch;
 		void *eventhost;
 		struct htnames_t *eventcolumn;
 		int ovector[30];
-		eventcount_t *countrec;
 
 		itemsfound = sscanf(l, "%s %s %u %u %u %s %s %d",
 			hostname, svcname,
@@ -658,28 +805,9 @@ void do_eventlog(FILE *output, int maxcount, int maxminutes, char *fromtime, cha
 				colrmatch = 1;
 			if (!colrmatch) continue;
 
-			newevent = (event_t *) malloc(sizeof(event_t));
-			newevent->host       = eventhost;
-			newevent->service    = eventcolumn;
-			newevent->eventtime  = eventtime;
-			newevent->changetime = changetime;
-			newevent->duration   = duration;
-			newevent->newcolor   = eventcolor(newcol);
-			newevent->oldcolor   = eventcolor(oldcol);
-			newevent->next = eventhead;
-			eventhead = newevent;
-
-			if (counttype != XYMON_COUNT_DURATION) {
-				countrec = (eventcount_t *)xmh_item(eventhost, XMH_DATA);
-				while (countrec && (countrec->service != eventcolumn)) countrec = countrec->next;
-				if (countrec == NULL) {
-					countrec = (eventcount_t *)calloc(1, sizeof(eventcount_t));
-					countrec->service = eventcolumn;
-					countrec->next = (eventcount_t *)xmh_item(eventhost, XMH_DATA);
-					xmh_set_item(eventhost, XMH_DATA, (void *)countrec);
-				}
-				countrec->count++;
-			}
+			eventhead = addevent(eventhead, eventhost, eventcolumn,
+					     eventtime, changetime, duration,
+					     eventcolor(newcol), eventcolor(oldcol), counttype);
 		}
 	}
 
@@ -818,7 +946,7 @@ void do_eventlog(FILE *output, int maxcount, int maxminutes, char *fromtime, cha
 	}
 	else if (output != NULL) {
 		/* No events during the past maxminutes */
-		if (eventlog)
+		if (eventlog || usedstore)
 			sprintf(title, "No events received in the last %d minutes", maxminutes);
 		else
 			strcpy(title, "No events logged");
@@ -0,0 +1,491 @@
+/*----------------------------------------------------------------------------*/
+/* Xymon monitor library.                                                     */
+/*                                                                            */
+/* This is a library module, part of libxymon.                                */
+/* It contains a binary store of the status changes, written by               */
+/* xymond_history alongside the allevents file and used by the eventlog.      */
+/*                                                                            */
+/* Copyright (C) 2002-2011 Henrik Storner <henrik@storner.dk>                 */
+/*                                                                            */
+/* This program is released under the GNU General Public License (GPL),       */
+/* version 2. See the file "COPYING" for details.                             */
+/*                                                                            */
+/*----------------------------------------------------------------------------*/
+
+static char rcsid[] = "$Id$";
+
+/*
+ * The store is kept in the $XYMONHISTDIR/allevents.d/ directory:
+ *
+ * "names" holds the host- and test-names, one per line. The line number
+ * is the ID used for the name in the event records. It is append-only,
+ * so an ID never changes.
+ *
+ * "since" holds the time from which the store has all of the events.
+ * Queries for events before that must use the allevents file. It is
+ * moved forward when events were logged to allevents without being
+ * stored here - e.g. while xymond_history ran with --no-eventstore, or
+ * after a write error - and when trimhistory removes the old days.
+ * The event is stored before it is written to allevents, so if the
+ * allevents file has a later event than the store, the store is stale.
+ *
+ * "YYYYMMDD" holds the events for one day (UTC) as eventstorerec_t
+ * records, in the order they were received. Since the records have a
+ * fixed size, the start of a query period is found by bisecting the
+ * file of the first day.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+
+#include "libxymon.h"
+
+struct eventstore_t {
+	char *dir;
+	char **names;
+	unsigned int namecount;
+	time_t fromtime, totime;
+	unsigned int day, lastday;
+	FILE *fd;
+};
+
+/* Writer state, used by xymond_history */
+static char *wdir = NULL;
+static void *wnames = NULL;
+static unsigned int wnamecount = 0;
+static FILE *wdayfd = NULL;
+static unsigned int wday = 0;
+static int wsincelost = 0;
+
+
+static void dayfilename(char *buf, size_t bufsz, char *dir, unsigned int day)
+{
+	time_t t = (time_t)day * 86400;
+	struct tm *tm = gmtime(&t);
+
+	snprintf(buf, bufsz, "%s/%04d%02d%02d", dir, tm->tm_year+1900, tm->tm_mon+1, tm->tm_mday);
+}
+
+static char **loadnames(char *dir, unsigned int *count)
+{
+	char fn[PATH_MAX], l[MAX_LINE_LEN];
+	char **names = NULL;
+	unsigned int alloccount = 0;
+	FILE *fd;
+
+	*count = 0;
+	snprintf(fn, sizeof(fn), "%s/names", dir);
+	fd = fopen(fn, "r");
+	if (fd == NULL) return NULL;
+
+	while (fgets(l, sizeof(l), fd)) {
+		char *p = strchr(l, '\n');
+
+		/* An incomplete last line is being written right now */
+		if (p == NULL) break;
+		*p = '\0';
+
+		if (*count == alloccount) {
+			alloccount += 1024;
+			names = (char **)realloc(names, alloccount*sizeof(char *));
+		}
+		names[(*count)++] = strdup(l);
+	}
+	fclose(fd);
+
+	return names;
+}
+
+static void freenames(char **names, unsigned int count)
+{
+	unsigned int i;
+
+	if (!names) return;
+	for (i = 0; (i < count); i++) xfree(names[i]);
+	xfree(names);
+}
+
+static int isdayfile(char *name)
+{
+	return ((strlen(name) == 8) && (strspn(name, "0123456789") == 8));
+}
+
+static time_t storelast(char *dir)
+{
+	/* The time of the last event in the store */
+	DIR *d;
+	struct dirent *de;
+	char lastname[9], fn[PATH_MAX];
+	eventstorerec_t rec;
+	struct stat st;
+	FILE *fd;
+	time_t result = 0;
+
+	*lastname = '\0';
+	d = opendir(dir);
+	if (d == NULL) return 0;
+	while ((de = readdir(d)) != NULL) {
+		if (isdayfile(de->d_name) && (strcmp(de->d_name, lastname) > 0)) strcpy(lastname, de->d_name);
+	}
+	closedir(d);
+	if (*lastname == '\0') return 0;
+
+	if (snprintf(fn, sizeof(fn), "%s/%s", dir, lastname) >= sizeof(fn)) return 0;
+	fd = fopen(fn, "r");
+	if (fd == NULL) return 0;
+	if ((fstat(fileno(fd), &st) == 0) && (st.st_size >= sizeof(rec)) &&
+	    (fseeko(fd, (st.st_size / sizeof(rec) - 1) * sizeof(rec), SEEK_SET) == 0) &&
+	    (fread(&rec, sizeof(rec), 1, fd) == 1)) {
+		result = rec.eventtime;
+	}
+	fclose(fd);
+
+	return result;
+}
+
+static time_t alleventslast(char *histdir)
+{
+	/* The time of the last event in the allevents file: "HOST TEST EVENTTIME ..." */
+	char fn[PATH_MAX], buf[MAX_LINE_LEN+1];
+	char *eol, *bol;
+	struct stat st;
+	off_t pos;
+	size_t n;
+	unsigned int eventtime;
+	FILE *fd;
+	time_t result = 0;
+
+	if (snprintf(fn, sizeof(fn), "%s/allevents", histdir) >= sizeof(fn)) return 0;
+	fd = fopen(fn, "r");
+	if (fd == NULL) return 0;
+	if (fstat(fileno(fd), &st) == -1) { fclose(fd); return 0; }
+
+	pos = ((st.st_size > MAX_LINE_LEN) ? (st.st_size - MAX_LINE_LEN) : 0);
+	if (fseeko(fd, pos, SEEK_SET) == 0) {
+		n = fread(buf, 1, MAX_LINE_LEN, fd);
+		buf[n] = '\0';
+
+		/* The last complete line */
+		eol = strrchr(buf, '\n');
+		if (eol) {
+			*eol = '\0';
+			bol = strrchr(buf, '\n');
+			bol = (bol ? bol+1 : buf);
+			if (((bol > buf) || (pos == 0)) && (sscanf(bol, "%*s %*s %u", &eventtime) == 1)) result = eventtime;
+		}
+	}
+	fclose(fd);
+
+	return result;
+}
+
+static void writesince(char *dir, time_t since)
+{
+	char fn[PATH_MAX], tmpfn[PATH_MAX];
+	FILE *fd;
+	int ok;
+
+	snprintf(fn, sizeof(fn), "%s/since", dir);
+	if (snprintf(tmpfn, sizeof(tmpfn), "%s.tmp", fn) >= sizeof(tmpfn)) return;
+
+	fd = fopen(tmpfn, "w");
+	if (fd == NULL) {
+		errprintf("Cannot create %s: %s\n", tmpfn, strerror(errno));
+		return;
+	}
+	ok = (fprintf(fd, "%u\n", (unsigned int)since) > 0);
+	if (fclose(fd) != 0) ok = 0;
+	if (!ok || (rename(tmpfn, fn) == -1)) {
+		errprintf("Cannot update %s: %s\n", fn, strerror(errno));
+		unlink(tmpfn);
+	}
+}
+
+
+static int writer_init(char *histdir)
+{
+	char fn[PATH_MAX];
+	char **names;
+	unsigned int i;
+	struct stat st;
+
+	if (wdir) return 0;
+
+	if (snprintf(fn, sizeof(fn), "%s/%s", histdir, EVENTSTORE_DIR) >= sizeof(fn)) return -1;
+	if ((stat(fn, &st) == -1) && (mkdir(fn, 0755) == -1)) {
+		errprintf("Cannot create event store directory %s: %s\n", fn, strerror(errno));
+		return -1;
+	}
+	wdir = strdup(fn);
+
+	snprintf(fn, sizeof(fn), "%s/since", wdir);
+	if (stat(fn, &st) == -1) {
+		writesince(wdir, getcurrenttime(NULL));
+	}
+	else if (alleventslast(histdir) > storelast(wdir)) {
+		/* Events were logged while we were not storing them */
+		errprintf("Event store %s is missing events, using it only from now on\n", wdir);
+		writesince(wdir, getcurrenttime(NULL));
+	}
+
+	wnames = xtreeNew(strcmp);
+	names = loadnames(wdir, &wnamecount);
+	for (i = 0; (i < wnamecount); i++) {
+		unsigned int *id = (unsigned int *)malloc(sizeof(unsigned int));
+
+		*id = i;
+		xtreeAdd(wnames, names[i], id);
+	}
+	if (names) xfree(names);	/* The names themselves are kept in the tree */
+
+	return 0;
+}
+
+static int writer_nameid(char *name, unsigned int *id)
+{
+	xtreePos_t handle;
+	char fn[PATH_MAX];
+	unsigned int *newid;
+	FILE *fd;
+	int ok;
+
+	handle = xtreeFind(wnames, name);
+	if (handle != xtreeEnd(wnames)) {
+		*id = *((unsigned int *)xtreeData(wnames, handle));
+		return 0;
+	}
+
+	/* A new name, add it to the list */
+	snprintf(fn, sizeof(fn), "%s/names", wdir);
+	fd = fopen(fn, "a");
+	if (fd == NULL) {
+		errprintf("Cannot open event store names %s: %s\n", fn, strerror(errno));
+		return -1;
+	}
+	ok = (fprintf(fd, "%s\n", name) > 0);
+	if (fclose(fd) != 0) ok = 0;
+	if (!ok) {
+		errprintf("Cannot update event store names %s: %s\n", fn, strerror(errno));
+		return -1;
+	}
+
+	newid = (unsigned int *)malloc(sizeof(unsigned int));
+	*newid = wnamecount++;
+	xtreeAdd(wnames, strdup(name), newid);
+	*id = *newid;
+
+	return 0;
+}
+
+int eventstore_add(char *histdir, char *hostname, char *testname,
+		   time_t eventtime, time_t changetime, int newcolor, int oldcolor, int state)
+{
+	eventstorerec_t rec;
+	unsigned int day = (eventtime / 86400);
+
+	if (writer_init(histdir) != 0) return -1;
+
+	memset(&rec, 0, sizeof(rec));
+	if ((writer_nameid(hostname, &rec.hostid) != 0) || (writer_nameid(testname, &rec.testid) != 0)) return -1;
+	rec.eventtime = eventtime;
+	rec.changetime = changetime;
+	rec.duration = (eventtime - changetime);
+	rec.newcolor = newcolor;
+	rec.oldcolor = oldcolor;
+	rec.state = state;
+
+	if (wdayfd && (day != wday)) {
+		fclose(wdayfd);
+		wdayfd = NULL;
+	}
+
+	if (wdayfd == NULL) {
+		char fn[PATH_MAX];
+
+		dayfilename(fn, sizeof(fn), wdir, day);
+		wdayfd = fopen(fn, "a");
+		if (wdayfd == NULL) {
+			errprintf("Cannot open event store file %s: %s\n", fn, strerror(errno));
+			goto lost;
+		}
+		wday = day;
+	}
+
+	if ((fwrite(&rec, sizeof(rec), 1, wdayfd) != 1) || (fflush(wdayfd) != 0)) {
+		errprintf("Cannot write to the event store: %s\n", strerror(errno));
+		goto lost;
+	}
+
+	if (wsincelost) {
+		/* The store is complete again from this event */
+		writesince(wdir, eventtime);
+		wsincelost = 0;
+	}
+
+	return 0;
+
+lost:
+	/* This event will be in allevents only, so the store cannot be used for the time before now */
+	if (!wsincelost) {
+		char fn[PATH_MAX];
+
+		snprintf(fn, sizeof(fn), "%s/since", wdir);
+		unlink(fn);
+		wsincelost = 1;
+	}
+	return -1;
+}
+
+void eventstore_reopen(void)
+{
+	/* Close the current file, e.g. if it has been moved away */
+	if (wdayfd) fclose(wdayfd);
+	wdayfd = NULL;
+}
+
+
+eventstore_t *eventstore_open(char *histdir, time_t fromtime, time_t totime)
+{
+	/* Returns NULL if the store does not hold all events from fromtime */
+	eventstore_t *store;
+	char dir[PATH_MAX], fn[PATH_MAX];
+	unsigned int since = 0;
+	FILE *fd;
+
+	if (snprintf(dir, sizeof(dir), "%s/%s", histdir, EVENTSTORE_DIR) >= sizeof(dir)) return NULL;
+	if (snprintf(fn, sizeof(fn), "%s/since", dir) >= sizeof(fn)) return NULL;
+	fd = fopen(fn, "r");
+	if (fd == NULL) return NULL;
+	if (fscanf(fd, "%u", &since) != 1) since = 0;
+	fclose(fd);
+	if ((since == 0) || (fromtime < since)) return NULL;
+
+	/* xymond_history is not updating the store, e.g. with --no-eventstore */
+	if (alleventslast(histdir) > storelast(dir)) return NULL;
+
+	store = (eventstore_t *)calloc(1, sizeof(eventstore_t));
+	store->dir = strdup(dir);
+	store->names = loadnames(dir, &store->namecount);
+	store->fromtime = fromtime;
+	store->totime = totime;
+	store->day = (fromtime / 86400);
+	store->lastday = (totime / 86400);
+	store->fd = NULL;
+
+	return store;
+}
+
+static void seek_first(FILE *fd, time_t fromtime)
+{
+	eventstorerec_t rec;
+	struct stat st;
+	off_t lo, hi, mid;
+
+	if (fstat(fileno(fd), &st) == -1) return;
+
+	lo = 0; hi = (st.st_size / sizeof(rec));
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if ((fseeko(fd, mid*sizeof(rec), SEEK_SET) != 0) || (fread(&rec, sizeof(rec), 1, fd) != 1)) break;
+
+		if (rec.eventtime < fromtime) lo = mid+1; else hi = mid;
+	}
+
+	fseeko(fd, lo*sizeof(rec), SEEK_SET);
+}
+
+int eventstore_next(eventstore_t *store, eventstorerec_t *rec)
+{
+	/* Get the next event, or return 0 when there are no more */
+	while (1) {
+		if (store->fd == NULL) {
+			char fn[PATH_MAX];
+			int firstday = (store->day == (store->fromtime / 86400));
+
+			if (store->day > store->lastday) return 0;
+
+			dayfilename(fn, sizeof(fn), store->dir, store->day);
+			store->day++;
+			store->fd = fopen(fn, "r");
+			if (store->fd == NULL) continue;	/* No events that day */
+			if (firstday) seek_first(store->fd, store->fromtime);
+		}
+
+		if (fread(rec, sizeof(*rec), 1, store->fd) != 1) {
+			fclose(store->fd);
+			store->fd = NULL;
+			continue;
+		}
+
+		if (rec->eventtime < store->fromtime) continue;
+
+		if ((rec->hostid >= store->namecount) || (rec->testid >= store->namecount)) {
+			/* Names added since we loaded them */
+			freenames(store->names, store->namecount);
+			store->names = loadnames(store->dir, &store->namecount);
+			if ((rec->hostid >= store->namecount) || (rec->testid >= store->namecount)) continue;
+		}
+
+		return 1;
+	}
+}
+
+char *eventstore_name(eventstore_t *store, unsigned int id)
+{
+	return ((id < store->namecount) ? store->names[id] : NULL);
+}
+
+unsigned int eventstore_namecount(eventstore_t *store)
+{
+	return store->namecount;
+}
+
+void eventstore_trim(char *histdir, time_t cutoff)
+{
+	/* Remove the days before the one with the cutoff time, as trimhistory does with allevents */
+	char dir[PATH_MAX], fn[PATH_MAX], sincefn[PATH_MAX], cutname[9];
+	unsigned int since = 0;
+	time_t newsince = (cutoff / 86400) * 86400;
+	DIR *d;
+	struct dirent *de;
+	FILE *fd;
+
+	if (snprintf(dir, sizeof(dir), "%s/%s", histdir, EVENTSTORE_DIR) >= sizeof(dir)) return;
+	if (snprintf(sincefn, sizeof(sincefn), "%s/since", dir) >= sizeof(sincefn)) return;
+	d = opendir(dir);
+	if (d == NULL) return;
+
+	/* The day files sort by name */
+	strftime(cutname, sizeof(cutname), "%Y%m%d", gmtime(&newsince));
+	while ((de = readdir(d)) != NULL) {
+		if (!isdayfile(de->d_name) || (strcmp(de->d_name, cutname) >= 0)) continue;
+
+		if (snprintf(fn, sizeof(fn), "%s/%s", dir, de->d_name) >= sizeof(fn)) continue;
+		dbgprintf("Removing event store file %s\n", fn);
+		if (unlink(fn) == -1) errprintf("Cannot remove %s: %s\n", fn, strerror(errno));
+	}
+	closedir(d);
+
+	/* The store no longer has the events before the first day that is left */
+	fd = fopen(sincefn, "r");
+	if (fd == NULL) return;		/* Not in use, or missing events */
+	if (fscanf(fd, "%u", &since) != 1) since = 0;
+	fclose(fd);
+	if ((since > 0) && (since < newsince)) writesince(dir, newsince);
+}
+
+void eventstore_close(eventstore_t *store)
+{
+	if (store->fd) fclose(store->fd);
+	freenames(store->names, store->namecount);
+	xfree(store->dir);
+	xfree(store);
+}
+
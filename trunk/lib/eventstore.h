@@ -0,0 +1,46 @@
+/*----------------------------------------------------------------------------*/
+/* Xymon monitor library.                                                     */
+/*                                                                            */
+/* Copyright (C) 2002-2011 Henrik Storner <henrik@storner.dk>                 */
+/*                                                                            */
+/* This program is released under the GNU General Public License (GPL),       */
+/* version 2. See the file "COPYING" for details.                             */
+/*                                                                            */
+/*----------------------------------------------------------------------------*/
+
+#ifndef __EVENTSTORE_H__
+#define __EVENTSTORE_H__
+
+#include <time.h>
+
+/* The event store lives in this directory below $XYMONHISTDIR */
+#define EVENTSTORE_DIR "allevents.d"
+
+/* One status change, as written to the daily event files */
+typedef struct eventstorerec_t {
+	unsigned int eventtime;
+	unsigned int changetime;
+	unsigned int duration;
+	unsigned int hostid;
+	unsigned int testid;
+	signed char newcolor;
+	signed char oldcolor;
+	signed char state;	/* 2=escalated, 1=recovered, 0=no change, -1=unknown */
+	char pad;
+} eventstorerec_t;
+
+typedef struct eventstore_t eventstore_t;
+
+extern int eventstore_add(char *histdir, char *hostname, char *testname,
+			  time_t eventtime, time_t changetime, int newcolor, int oldcolor, int state);
+extern void eventstore_reopen(void);
+
+extern eventstore_t *eventstore_open(char *histdir, time_t fromtime, time_t totime);
+extern int eventstore_next(eventstore_t *store, eventstorerec_t *rec);
+extern char *eventstore_name(eventstore_t *store, unsigned int id);
+extern unsigned int eventstore_namecount(eventstore_t *store);
+extern void eventstore_close(eventstore_t *store);
+extern void eventstore_trim(char *histdir, time_t cutoff);
+
+#endif
+
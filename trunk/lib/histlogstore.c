@@ -0,0 +1,407 @@
+/*----------------------------------------------------------------------------*/
+/* Xymon monitor library.                                                     */
+/*                                                                            */
+/* This is a library module, part of libxymon.                                */
+/* It contains a compressed store of the historical status logs, written by   */
+/* xymond_history as an alternative to one file per status change.           */
+/*                                                                            */
+/* Copyright (C) 2002-2011 Henrik Storner <henrik@storner.dk>                 */
+/*                                                                            */
+/* This program is released under the GNU General Public License (GPL),       */
+/* version 2. See the file "COPYING" for details.                             */
+/*                                                                            */
+/*----------------------------------------------------------------------------*/
+
+static char rcsid[] = "$Id$";
+
+/*
+ * The store is kept in the $XYMONHISTLOGS/HOSTNAME/.packed/ directory,
+ * with two files for each day (local time):
+ *
+ * "YYYYMMDD.dat" holds the zlib-compressed status logs, appended one
+ * after the other. A log whose text is identical to one already stored
+ * that day is not stored again.
+ *
+ * "YYYYMMDD.idx" has one line for each status log:
+ *    TESTNAME TIMESTAMP OFFSET LENGTH MD5
+ * TIMESTAMP is the name the log would have as a plain file, OFFSET and
+ * LENGTH locate the compressed data in the .dat file, and MD5 is the
+ * hash of the uncompressed text used to find duplicates.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+
+#include "libxymon.h"
+
+typedef struct packhash_t {
+	off_t offset;
+	unsigned int length;
+} packhash_t;
+
+typedef struct packstate_t {
+	char day[9];
+	void *hashes;	/* Tree of packhash_t records, keyed by the MD5 of the text */
+} packstate_t;
+
+/* Writer state, used by xymond_history */
+static void *packs = NULL;	/* Tree of packstate_t records, keyed by host */
+
+
+static void packfilename(char *buf, size_t bufsz, char *histlogdir, char *hostdash, char *day, char *suffix)
+{
+	snprintf(buf, bufsz, "%s/%s/%s/%s.%s", histlogdir, hostdash, HISTLOGSTORE_DIR, day, suffix);
+}
+
+static int tstampday(char *tstampstr, char *day)
+{
+	/* Get the YYYYMMDD day from a "Fri_Nov_7_16:01:08_2002" timestamp */
+	static char *mnames[13] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec", NULL };
+	char mon[4];
+	int month, mday, year;
+
+	if (sscanf(tstampstr, "%*3s%*c%3s%*c%d%*c%*d:%*d:%*d%*c%d", mon, &mday, &year) != 3) return -1;
+	for (month = 0; (mnames[month] && strcmp(mnames[month], mon)); month++) ;
+	if (mnames[month] == NULL) return -1;
+
+	sprintf(day, "%04d%02d%02d", year, month+1, mday);
+	return 0;
+}
+
+static void freehashes(void *hashes)
+{
+	xtreePos_t handle;
+
+	if (!hashes) return;
+
+	while ((handle = xtreeFirst(hashes)) != xtreeEnd(hashes)) {
+		char *key = xtreeKey(hashes, handle);
+		packhash_t *rec = (packhash_t *)xtreeData(hashes, handle);
+
+		xtreeDelete(hashes, key);
+		xfree(key);
+		xfree(rec);
+	}
+	xtreeDestroy(hashes);
+}
+
+static void loadhashes(packstate_t *state, char *idxfn)
+{
+	/* Pick up the logs already stored today, e.g. after a restart */
+	FILE *fd;
+	char l[MAX_LINE_LEN];
+	char md5[33];
+	long long offset;
+	unsigned int length;
+
+	state->hashes = xtreeNew(strcmp);
+
+	fd = fopen(idxfn, "r");
+	if (fd == NULL) return;
+
+	while (fgets(l, sizeof(l), fd)) {
+		packhash_t *rec;
+
+		if (sscanf(l, "%*s %*s %lld %u %32s", &offset, &length, md5) != 3) continue;
+		if (xtreeFind(state->hashes, md5) != xtreeEnd(state->hashes)) continue;
+
+		rec = (packhash_t *)malloc(sizeof(packhash_t));
+		rec->offset = (off_t)offset;
+		rec->length = length;
+		xtreeAdd(state->hashes, strdup(md5), rec);
+	}
+
+	fclose(fd);
+}
+
+int histlogstore_save(char *histlogdir, char *hostdash, char *testname, time_t tstamp, char *data)
+{
+	char fn[PATH_MAX], day[9], tstampstr[30];
+	char *md5;
+	packstate_t *state;
+	packhash_t *rec;
+	xtreePos_t handle;
+	FILE *fd;
+	int ok;
+
+	strftime(day, sizeof(day), "%Y%m%d", localtime(&tstamp));
+	strncpy(tstampstr, histlogtime(tstamp), sizeof(tstampstr)); tstampstr[sizeof(tstampstr)-1] = '\0';
+
+	if (!packs) packs = xtreeNew(strcmp);
+	handle = xtreeFind(packs, hostdash);
+	if (handle == xtreeEnd(packs)) {
+		state = (packstate_t *)calloc(1, sizeof(packstate_t));
+		xtreeAdd(packs, strdup(hostdash), state);
+	}
+	else {
+		state = (packstate_t *)xtreeData(packs, handle);
+	}
+
+	if (strcmp(state->day, day) != 0) {
+		/* First log for this host today */
+		snprintf(fn, sizeof(fn), "%s/%s", histlogdir, hostdash);
+		if ((mkdir(fn, 0755) == -1) && (errno != EEXIST)) {
+			errprintf("Cannot create histlog directory %s: %s\n", fn, strerror(errno));
+			return -1;
+		}
+		snprintf(fn, sizeof(fn), "%s/%s/%s", histlogdir, hostdash, HISTLOGSTORE_DIR);
+		if ((mkdir(fn, 0755) == -1) && (errno != EEXIST)) {
+			errprintf("Cannot create histlog directory %s: %s\n", fn, strerror(errno));
+			return -1;
+		}
+
+		freehashes(state->hashes);
+		strcpy(state->day, day);
+		packfilename(fn, sizeof(fn), histlogdir, hostdash, day, "idx");
+		loadhashes(state, fn);
+	}
+
+	md5 = md5hash(data);
+	handle = xtreeFind(state->hashes, md5);
+	if (handle != xtreeEnd(state->hashes)) {
+		rec = (packhash_t *)xtreeData(state->hashes, handle);
+		dbgprintf("Histlog for %s:%s is a duplicate, not stored again\n", hostdash, testname);
+	}
+	else {
+		strbuffer_t *cbuf;
+		char *zdata;
+		int zlen;
+		off_t offset;
+
+		cbuf = compress_buffer(data, strlen(data));
+		if (cbuf == NULL) return -1;
+
+		/* Skip the "compress:zlib N" header line */
+		zdata = strchr(STRBUF(cbuf), '\n') + 1;
+		zlen = STRBUFLEN(cbuf) - (zdata - STRBUF(cbuf));
+
+		packfilename(fn, sizeof(fn), histlogdir, hostdash, day, "dat");
+		fd = fopen(fn, "a");
+		if (fd == NULL) {
+			errprintf("Cannot open histlog pack %s: %s\n", fn, strerror(errno));
+			freestrbuffer(cbuf);
+			return -1;
+		}
+		fseeko(fd, 0, SEEK_END);
+		offset = ftello(fd);
+		ok = (fwrite(zdata, 1, zlen, fd) == zlen);
+		if (fclose(fd) != 0) ok = 0;
+		freestrbuffer(cbuf);
+		if (!ok || (offset == -1)) {
+			errprintf("Cannot write to histlog pack %s: %s\n", fn, strerror(errno));
+			return -1;
+		}
+
+		rec = (packhash_t *)malloc(sizeof(packhash_t));
+		rec->offset = offset;
+		rec->length = zlen;
+		xtreeAdd(state->hashes, strdup(md5), rec);
+	}
+
+	/* The index is written last, so it only refers to data that has been stored */
+	packfilename(fn, sizeof(fn), histlogdir, hostdash, day, "idx");
+	fd = fopen(fn, "a");
+	if (fd == NULL) {
+		errprintf("Cannot open histlog pack index %s: %s\n", fn, strerror(errno));
+		return -1;
+	}
+	ok = (fprintf(fd, "%s %s %lld %u %s\n", testname, tstampstr, (long long)rec->offset, rec->length, md5) > 0);
+	if (fclose(fd) != 0) ok = 0;
+	if (!ok) {
+		errprintf("Cannot update histlog pack index %s: %s\n", fn, strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+void histlogstore_reset(void)
+{
+	/* Forget what we know about the packs, e.g. when a host is dropped or renamed */
+	xtreePos_t handle;
+
+	if (!packs) return;
+
+	while ((handle = xtreeFirst(packs)) != xtreeEnd(packs)) {
+		char *key = xtreeKey(packs, handle);
+		packstate_t *state = (packstate_t *)xtreeData(packs, handle);
+
+		xtreeDelete(packs, key);
+		xfree(key);
+		freehashes(state->hashes);
+		xfree(state);
+	}
+	xtreeDestroy(packs);
+	packs = NULL;
+}
+
+static int rewrite_indexes(char *histlogdir, char *hostdash, char *oldtestname, char *newtestname)
+{
+	/* Drop (newtestname == NULL) or rename the entries for a test in all of the index files */
+	char dirfn[PATH_MAX], fn[PATH_MAX], tmpfn[PATH_MAX], l[MAX_LINE_LEN];
+	DIR *dirfd;
+	struct dirent *de;
+	int result = 0;
+	size_t oldlen = strlen(oldtestname);
+
+	snprintf(dirfn, sizeof(dirfn), "%s/%s/%s", histlogdir, hostdash, HISTLOGSTORE_DIR);
+	dirfd = opendir(dirfn);
+	if (dirfd == NULL) return 0;
+
+	while ((de = readdir(dirfd)) != NULL) {
+		FILE *infd, *outfd;
+		char *p = strrchr(de->d_name, '.');
+		int ok = 1;
+
+		if ((*(de->d_name) == '.') || !p || (strcmp(p, ".idx") != 0)) continue;
+
+		if ((snprintf(fn, sizeof(fn), "%s/%s", dirfn, de->d_name) >= sizeof(fn)) ||
+		    (snprintf(tmpfn, sizeof(tmpfn), "%s/.%s.tmp", dirfn, de->d_name) >= sizeof(tmpfn))) {
+			errprintf("Filename too long in %s: %s\n", dirfn, de->d_name);
+			result = -1;
+			continue;
+		}
+		infd = fopen(fn, "r");
+		if (infd == NULL) continue;
+		outfd = fopen(tmpfn, "w");
+		if (outfd == NULL) {
+			errprintf("Cannot create %s: %s\n", tmpfn, strerror(errno));
+			fclose(infd);
+			result = -1;
+			continue;
+		}
+
+		while (ok && fgets(l, sizeof(l), infd)) {
+			if ((strncmp(l, oldtestname, oldlen) == 0) && (l[oldlen] == ' ')) {
+				if (newtestname) ok = (fprintf(outfd, "%s%s", newtestname, l+oldlen) >= 0);
+			}
+			else ok = (fputs(l, outfd) >= 0);
+		}
+
+		fclose(infd);
+		if (fclose(outfd) != 0) ok = 0;
+		if (!ok || (rename(tmpfn, fn) == -1)) {
+			errprintf("Cannot update histlog pack index %s: %s\n", fn, strerror(errno));
+			unlink(tmpfn);
+			result = -1;
+		}
+	}
+
+	closedir(dirfd);
+	return result;
+}
+
+int histlogstore_droptest(char *histlogdir, char *hostdash, char *testname)
+{
+	/* The data stays in the .dat files until the day is trimmed */
+	return rewrite_indexes(histlogdir, hostdash, testname, NULL);
+}
+
+int histlogstore_renametest(char *histlogdir, char *hostdash, char *oldtestname, char *newtestname)
+{
+	return rewrite_indexes(histlogdir, hostdash, oldtestname, newtestname);
+}
+
+
+strbuffer_t *histlogstore_load(char *histlogdir, char *hostdash, char *testname, char *tstampstr)
+{
+	/* Returns the status log text, or NULL if the log is not in the store */
+	char fn[PATH_MAX], day[9], l[MAX_LINE_LEN];
+	char ltest[MAX_LINE_LEN], ltstamp[MAX_LINE_LEN], want[30];
+	long long offset = -1, loffset;
+	unsigned int length = 0, llength;
+	strbuffer_t *result = NULL;
+	char *zdata, *p;
+	FILE *fd;
+
+	/* The timestamp may have had the underscores changed to blanks */
+	strncpy(want, tstampstr, sizeof(want)); want[sizeof(want)-1] = '\0';
+	for (p = want; (*p); p++) if (*p == ' ') *p = '_';
+	if (tstampday(want, day) != 0) return NULL;
+
+	packfilename(fn, sizeof(fn), histlogdir, hostdash, day, "idx");
+	fd = fopen(fn, "r");
+	if (fd == NULL) return NULL;
+
+	while (fgets(l, sizeof(l), fd)) {
+		if (sscanf(l, "%s %s %lld %u", ltest, ltstamp, &loffset, &llength) != 4) continue;
+
+		/* If there are several, the last one wins - like overwriting a file */
+		if ((strcmp(ltest, testname) == 0) && (strcmp(ltstamp, want) == 0)) {
+			offset = loffset;
+			length = llength;
+		}
+	}
+	fclose(fd);
+
+	if ((offset < 0) || (length == 0)) return NULL;
+
+	packfilename(fn, sizeof(fn), histlogdir, hostdash, day, "dat");
+	fd = fopen(fn, "r");
+	if (fd == NULL) return NULL;
+
+	zdata = (char *)malloc(length);
+	if ((fseeko(fd, (off_t)offset, SEEK_SET) == 0) && (fread(zdata, 1, length, fd) == length)) {
+		result = uncompress_buffer(zdata, length, NULL);
+	}
+	if (!result) errprintf("Corrupt histlog pack %s at offset %lld\n", fn, offset);
+
+	xfree(zdata);
+	fclose(fd);
+
+	return result;
+}
+
+
+int histlogstore_trim(char *hostdir, time_t cutoff)
+{
+	/* Remove the packs for days that ended before the cutoff. Returns the number of days left */
+	char dirfn[PATH_MAX], fn[PATH_MAX];
+	DIR *dirfd;
+	struct dirent *de;
+	int daysleft = 0;
+
+	snprintf(dirfn, sizeof(dirfn), "%s/%s", hostdir, HISTLOGSTORE_DIR);
+	dirfd = opendir(dirfn);
+	if (dirfd == NULL) return 0;
+
+	while ((de = readdir(dirfd)) != NULL) {
+		struct tm tm;
+		int year, month, mday;
+		char suffix[4];
+
+		if (*(de->d_name) == '.') continue;
+		if (sscanf(de->d_name, "%4d%2d%2d.%3s", &year, &month, &mday, suffix) != 4) continue;
+
+		/* The day is over at midnight, local time */
+		memset(&tm, 0, sizeof(tm));
+		tm.tm_year = year - 1900;
+		tm.tm_mon = month - 1;
+		tm.tm_mday = mday + 1;
+		tm.tm_isdst = -1;
+
+		if (mktime(&tm) <= cutoff) {
+			if (snprintf(fn, sizeof(fn), "%s/%s", dirfn, de->d_name) >= sizeof(fn)) {
+				errprintf("Filename too long in %s: %s\n", dirfn, de->d_name);
+			}
+			else if (unlink(fn) == -1) {
+				errprintf("Failed to unlink %s: %s\n", fn, strerror(errno));
+			}
+		}
+		else if (strcmp(suffix, "idx") == 0) daysleft++;
+	}
+
+	closedir(dirfd);
+
+	if (daysleft == 0) rmdir(dirfn);
+
+	return daysleft;
+}
+
@@ -0,0 +1,28 @@
+/*----------------------------------------------------------------------------*/
+/* Xymon monitor library.                                                     */
+/*                                                                            */
+/* Copyright (C) 2002-2011 Henrik Storner <henrik@storner.dk>                 */
+/*                                                                            */
+/* This program is released under the GNU General Public License (GPL),       */
+/* version 2. See the file "COPYING" for details.                             */
+/*                                                                            */
+/*----------------------------------------------------------------------------*/
+
+#ifndef __HISTLOGSTORE_H__
+#define __HISTLOGSTORE_H__
+
+#include <time.h>
+
+/* The packed histlogs live in this directory below $XYMONHISTLOGS/HOSTNAME/ */
+#define HISTLOGSTORE_DIR ".packed"
+
+extern int histlogstore_save(char *histlogdir, char *hostdash, char *testname, time_t tstamp, char *data);
+extern void histlogstore_reset(void);
+extern int histlogstore_droptest(char *histlogdir, char *hostdash, char *testname);
+extern int histlogstore_renametest(char *histlogdir, char *hostdash, char *oldtestname, char *newtestname);
+
+extern strbuffer_t *histlogstore_load(char *histlogdir, char *hostdash, char *testname, char *tstampstr);
+extern int histlogstore_trim(char *hostdir, time_t cutoff);
+
+#endif
+
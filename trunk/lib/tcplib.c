@@ -39,6 +39,10 @@ static char rcsid[] = "$Id$";
 #include "config.h"
 #include "tcplib.h"
 
+#ifdef HAVE_EPOLL
+#include <sys/epoll.h>
+#endif
+
 #ifdef HAVE_OPENSSL
 #include <openssl/err.h>
 #include <openssl/ssl.h>
@@ -56,6 +60,18 @@ static tcpconn_t *lsocks = NULL;
 /* Active connections list */
 static tcpconn_t *conns = NULL;
 
+/*
+ * epoll mode: The epoll handle, and the list of connections that have
+ * I/O readiness which has not been consumed yet. Sockets are registered
+ * edge-triggered, so a connection stays on the ready-list until a read
+ * or write tells us the socket has been drained.
+ */
+static int epollfd = -1;
+static tcpconn_t *readyconns = NULL;
+static time_t lastsweep = 0;
+#define EPOLL_MAXEVENTS 256
+#define EPOLL_MAXACCEPTS 64
+
 enum io_action_t { IO_READ, IO_WRITE };
 
 void (*userinfo)(time_t, const char *id, char *msg) = NULL;
@@ -373,6 +389,69 @@ char *conn_peer_certificate(tcpconn_t *conn, time_t *certstart, time_t *certend,
 }
 
 
+static void conn_epoll_add(tcpconn_t *conn, int islistener)
+{
+#ifdef HAVE_EPOLL
+	const char *funcid = "conn_epoll_add";
+	struct epoll_event ev;
+
+	if ((epollfd == -1) || (conn->sock <= 0)) return;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = (EPOLLIN | EPOLLET);
+	if (!islistener) ev.events |= (EPOLLOUT | EPOLLRDHUP);
+	ev.data.ptr = conn;
+	if (epoll_ctl(epollfd, EPOLL_CTL_ADD, conn->sock, &ev) == -1) {
+		conn_info(funcid, INFO_ERROR, "Cannot add socket %d to epoll set: %s\n", conn->sock, strerror(errno));
+	}
+#endif
+}
+
+static void conn_epoll_del(tcpconn_t *conn)
+{
+#ifdef HAVE_EPOLL
+	struct epoll_event ev;
+
+	if ((epollfd == -1) || (conn->sock <= 0)) return;
+
+	/* Linux before 2.6.9 requires a non-NULL event pointer for EPOLL_CTL_DEL */
+	epoll_ctl(epollfd, EPOLL_CTL_DEL, conn->sock, &ev);
+#endif
+}
+
+/* Put a connection on the ready-list, unless it is there already */
+static void conn_epoll_queue(tcpconn_t *conn)
+{
+	if (conn->evqueued) return;
+
+	conn->evqueued = 1;
+	conn->evnext = readyconns;
+	readyconns = conn;
+}
+
+/* After an SSL operation, see if the SSL library is waiting for the socket */
+static void conn_ssl_evcheck(tcpconn_t *conn)
+{
+	switch (conn->connstate) {
+	  case CONN_SSL_ACCEPT_READ:
+	  case CONN_SSL_CONNECT_READ:
+	  case CONN_SSL_STARTTLS_READ:
+	  case CONN_SSL_READ:
+		conn->evready &= ~CONN_EV_READ;
+		break;
+
+	  case CONN_SSL_ACCEPT_WRITE:
+	  case CONN_SSL_CONNECT_WRITE:
+	  case CONN_SSL_STARTTLS_WRITE:
+	  case CONN_SSL_WRITE:
+		conn->evready &= ~CONN_EV_WRITE;
+		break;
+
+	  default:
+		break;
+	}
+}
+
 static void conn_cleanup(tcpconn_t *conn)
 {
 #ifdef HAVE_OPENSSL
@@ -383,8 +462,9 @@ static void conn_cleanup(tcpconn_t *conn)
 	conn->ctx = NULL;
 #endif
 
-	if (conn->sock > 0) { close(conn->sock); conn->sock = -1; }
+	if (conn->sock > 0) { conn_epoll_del(conn); close(conn->sock); conn->sock = -1; }
 	if (conn->peer) { free(conn->peer); conn->peer = NULL; }
+	conn->evready = 0;
 	conn->elapsedus = conn_elapsedus(&conn->starttime, NULL);
 	conn->usercallback(conn, CONN_CB_CLOSED, conn->userdata);
 
@@ -489,6 +569,7 @@ int conn_listen(int portnumber, int backlog, int maxlifetime,
 		conn_info(funcid, INFO_INFO, "Listening on IPv4 %s\n", conn_print_address(ls));
 		ls->next = lsocks;
 		lsocks = ls;
+		conn_epoll_add(ls, 1);
 	}
 #endif
 
@@ -511,6 +592,7 @@ int conn_listen(int portnumber, int backlog, int maxlifetime,
 		conn_info(funcid, INFO_INFO, "Listening on IPv6 %s\n", conn_print_address(ls));
 		ls->next = lsocks;
 		lsocks = ls;
+		conn_epoll_add(ls, 1);
 	}
 #endif
 
@@ -550,6 +632,8 @@ static void try_ssl_accept(tcpconn_t *conn)
 			break;
 		}
 	}
+
+	conn_ssl_evcheck(conn);
 #endif
 }
 
@@ -594,6 +678,8 @@ static void try_ssl_connect(tcpconn_t *conn)
 			break;
 		}
 	}
+
+	conn_ssl_evcheck(conn);
 #endif
 }
 
@@ -637,6 +723,8 @@ static void try_ssl_starttls(tcpconn_t *conn)
 			break;
 		}
 	}
+
+	conn_ssl_evcheck(conn);
 #endif
 }
 
@@ -711,8 +799,14 @@ tcpconn_t *conn_accept(tcpconn_t *ls)
 	newconn->peer = (struct sockaddr *)malloc(sin_len);
 	newconn->sock = accept(ls->sock, newconn->peer, &sin_len);
 	if (newconn->sock == -1) {
+		int accepterr = errno;
+
+		/* Listen queue is empty, wait for the next epoll event */
+		if ((accepterr == EAGAIN) || (accepterr == EWOULDBLOCK)) ls->evready &= ~CONN_EV_READ;
+
 		conn_cleanup(newconn);
-		if ((errno != EAGAIN) && (errno != EINTR)) conn_info(funcid, INFO_WARN, "accept failed (%d: %s)\n", errno, strerror(errno));
+		if ((accepterr != EAGAIN) && (accepterr != EWOULDBLOCK) && (accepterr != EINTR)) 
+			conn_info(funcid, INFO_WARN, "accept failed (%d: %s)\n", accepterr, strerror(accepterr));
 		return NULL;
 	}
 
@@ -763,6 +857,7 @@ tcpconn_t *conn_accept(tcpconn_t *ls)
 		conn_getntimer(&newconn->starttime);
 		newconn->next = conns;
 		conns = newconn;
+		conn_epoll_add(newconn, 0);
 		conn_info(funcid, INFO_INFO, "Incoming connection from %s\n", conn_print_address(newconn));
 	}
 
@@ -818,8 +913,8 @@ static int try_ssl_io(tcpconn_t *conn, enum io_action_t action, void *buf, size_
 		else if (n < 0) {
 			/* SSL error. Catch the re-negotiate request; if another error close the connection */
 			switch (SSL_get_error(conn->ssl, n)) {
-			  case SSL_ERROR_WANT_READ: conn->connstate = CONN_SSL_READ; break;
-			  case SSL_ERROR_WANT_WRITE: conn->connstate = CONN_SSL_WRITE; break;
+			  case SSL_ERROR_WANT_READ: conn->connstate = CONN_SSL_READ; conn_ssl_evcheck(conn); break;
+			  case SSL_ERROR_WANT_WRITE: conn->connstate = CONN_SSL_WRITE; conn_ssl_evcheck(conn); break;
 			  default: 
 				{
 					char sslerrmsg[256];
@@ -860,12 +955,27 @@ int conn_read(tcpconn_t *conn, void *buf, size_t sz)
 	  case CONN_PLAINTEXT:
 		n = read(conn->sock, buf, sz);
 		if ((n == -1) && ((errno == EAGAIN) || (errno == EINTR))) {
+			if (errno == EAGAIN) conn->evready &= ~CONN_EV_READ;
 			n = 0;
 		}
 		else if (n < 0) {
 			conn_info(funcid, INFO_DEBUG, "read() returned no data: %s\n", strerror(errno));
 			conn->connstate = CONN_CLOSING;
 		}
+		else if ((n == 0) || ((n < sz) && !(conn->evready & CONN_EV_HUP))) {
+			/* 
+			 * Short read means the socket is drained; edge-triggered epoll will tell us when more arrives.
+			 * Unless the peer has closed, then we must read again to see the EOF.
+			 */
+			conn->evready &= ~CONN_EV_READ;
+		}
+		else if ((n == sz) && (epollfd != -1)) {
+			/* Filled the buffer. Peek to see if there is more, so the next read will not come up empty */
+			char c;
+
+			if ((recv(conn->sock, &c, 1, (MSG_PEEK | MSG_DONTWAIT)) == -1) && ((errno == EAGAIN) || (errno == EWOULDBLOCK)))
+				conn->evready &= ~CONN_EV_READ;
+		}
 		break;
 
 	  default:
@@ -896,6 +1006,7 @@ int conn_write(tcpconn_t *conn, void *buf, size_t count)
 	  case CONN_PLAINTEXT:
 		n = write(conn->sock, buf, count);
 		if ((n == -1) && ((errno == EAGAIN) || (errno == EINTR))) {
+			if (errno == EAGAIN) conn->evready &= ~CONN_EV_WRITE;
 			n = 0;
 			break; /* Do nothing */
 		}
@@ -903,6 +1014,10 @@ int conn_write(tcpconn_t *conn, void *buf, size_t count)
 			conn_info(funcid, INFO_DEBUG, "write failed: %s\n", strerror(errno));
 			conn->connstate = CONN_CLOSING;
 		}
+		else if (n < count) {
+			/* Socket buffer is full */
+			conn->evready &= ~CONN_EV_WRITE;
+		}
 		break;
 
 	  default:
@@ -927,6 +1042,22 @@ int conn_trimactive(void)
 	tcpconn_t *newhead = NULL, *current;
 	int result = 0;
 
+	/* Dead connections must be off the ready-list before they are freed */
+	while (readyconns) {
+		current = readyconns;
+		readyconns = readyconns->evnext;
+
+		if (current->connstate != CONN_DEAD) {
+			current->evnext = newhead;
+			newhead = current;
+		}
+		else {
+			current->evqueued = 0;
+		}
+	}
+	readyconns = newhead;
+	newhead = NULL;
+
 	while (conns) {
 		current = conns;
 		conns = conns->next;
@@ -962,17 +1093,74 @@ void add_fd(int sock, fd_set *fds, int *maxfd)
 
 
 /*
- * Setup the FD sets for select(). Simple enough when reading/writing data,
- * but the other states have special needs.
+ * Find out what I/O a connection is waiting for. Simple enough when
+ * reading/writing data, but the other states have special needs.
  *
  * readcheck() and writecheck() are callback-routines where application signals
- * that it wants to read/write data.
+ * that it wants to read/write data. If it wants neither, the connection is closed.
+ */
+static int conn_wantio(tcpconn_t *walk)
+{
+	int result = 0;
+
+	switch (walk->connstate) {
+	  case CONN_CLOSING:
+	  case CONN_DEAD:
+		break;
+
+	  case CONN_PLAINTEXT:
+	  case CONN_SSL_READY:
+		if (walk->usercallback(walk, CONN_CB_READCHECK, walk->userdata) == CONN_CBRESULT_OK) result |= CONN_EV_READ;
+		if (walk->usercallback(walk, CONN_CB_WRITECHECK, walk->userdata) == CONN_CBRESULT_OK) result |= CONN_EV_WRITE;
+		if (result == 0) {
+			/* Must be done with this socket */
+			walk->connstate = CONN_CLOSING;
+			conn_cleanup(walk);
+		}
+		break;
+
+	  case CONN_SSL_INIT:
+		/*
+		 * Starting an SSL handshake, we want to read or write data.
+		 * 
+		 * NOTE: This really should not happen, since all SSL I/O
+		 * operations explicitly call try_ssl_X(), which invokes the
+		 * SSL I/O operation and then changes state to CONN_SSL_X_READ/WRITE
+		 */
+		result = (CONN_EV_READ | CONN_EV_WRITE);
+		break;
+
+	  case CONN_SSL_ACCEPT_READ:
+	  case CONN_SSL_CONNECT_READ:
+	  case CONN_SSL_STARTTLS_READ:
+	  case CONN_SSL_READ:
+		/* We're doing SSL handshake and the library needs to read data */
+		result = CONN_EV_READ;
+		break;
+
+	  case CONN_SSL_ACCEPT_WRITE:
+	  case CONN_SSL_CONNECT_WRITE:
+	  case CONN_SSL_STARTTLS_WRITE:
+	  case CONN_SSL_WRITE:
+		/* We're doing SSL handshake and the library needs to write data */
+	  case CONN_SSL_CONNECTING:
+	  case CONN_PLAINTEXT_CONNECTING:
+		/* We're waiting for an outbound connection to complete = ready for writing */
+		result = CONN_EV_WRITE;
+		break;
+	}
+
+	return result;
+}
+
+/*
+ * Setup the FD sets for select().
  */
 int conn_fdset(fd_set *fdread, fd_set *fdwrite)
 {
 	const char *funcid = "conn_fdset";
 
-	int maxfd, wantread, wantwrite;
+	int maxfd, wantio;
 	tcpconn_t *walk;
 
 	clear_fdsets(fdread, fdwrite, &maxfd);
@@ -982,58 +1170,232 @@ int conn_fdset(fd_set *fdread, fd_set *fdwrite)
 	}
 
 	for (walk = conns; (walk); walk = walk->next) {
-		switch (walk->connstate) {
-		  case CONN_CLOSING:
-		  case CONN_DEAD:
-			break;
+		wantio = conn_wantio(walk);
+		if (wantio & CONN_EV_READ) add_fd(walk->sock, fdread, &maxfd);
+		if (wantio & CONN_EV_WRITE) add_fd(walk->sock, fdwrite, &maxfd);
+	}
+
+	return maxfd;
+}
+
+
+/*
+ * Enable the epoll() backend. Instead of building fd_sets with conn_fdset()
+ * and calling select(), the application calls conn_epoll_wait() and then
+ * conn_process_active() / conn_process_listeners() as usual (the fd_set 
+ * arguments are ignored). The cost of a wakeup then depends on the number
+ * of sockets with I/O pending, not the total number of connections, and
+ * there is no FD_SETSIZE limit.
+ *
+ * Returns 0 if epoll is active, -1 if it is not available.
+ */
+int conn_use_epoll(void)
+{
+	const char *funcid = "conn_use_epoll";
+
+#ifdef HAVE_EPOLL
+	tcpconn_t *walk;
+
+	if (epollfd != -1) return 0;
+
+	epollfd = epoll_create(1024);
+	if (epollfd == -1) {
+		conn_info(funcid, INFO_ERROR, "Cannot create epoll handle: %s\n", strerror(errno));
+		return -1;
+	}
+	fcntl(epollfd, F_SETFD, FD_CLOEXEC);
+
+	/* Pick up any sockets that were setup before epoll was enabled */
+	for (walk = lsocks; (walk); walk = walk->next) conn_epoll_add(walk, 1);
+	for (walk = conns; (walk); walk = walk->next) {
+		if (walk->connstate != CONN_DEAD) conn_epoll_add(walk, 0);
+	}
 
-		  case CONN_PLAINTEXT:
-		  case CONN_SSL_READY:
-			wantread = (walk->usercallback(walk, CONN_CB_READCHECK, walk->userdata) == CONN_CBRESULT_OK); if (wantread) add_fd(walk->sock, fdread, &maxfd);
-			wantwrite = (walk->usercallback(walk, CONN_CB_WRITECHECK, walk->userdata) == CONN_CBRESULT_OK); if (wantwrite) add_fd(walk->sock, fdwrite, &maxfd);
-			if (!wantread && !wantwrite) {
-				/* Must be done with this socket */
-				walk->connstate = CONN_CLOSING;
+	conn_info(funcid, INFO_INFO, "Using epoll for connection handling\n");
+	return 0;
+#else
+	conn_info(funcid, INFO_WARN, "epoll is not supported on this platform\n");
+	return -1;
+#endif
+}
+
+static int conn_is_listener(tcpconn_t *conn)
+{
+	tcpconn_t *walk;
+
+	for (walk = lsocks; (walk && (walk != conn)); walk = walk->next) ;
+
+	return (walk != NULL);
+}
+
+/*
+ * Wait for I/O events, at most "timeoutms" milliseconds. Returns the
+ * number of events, or -1 if epoll_wait() failed (check errno).
+ */
+int conn_epoll_wait(int timeoutms)
+{
+#ifdef HAVE_EPOLL
+	struct epoll_event events[EPOLL_MAXEVENTS];
+	tcpconn_t *walk;
+	int n, i;
+
+	if (epollfd == -1) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* Dont sleep if there is I/O left over from last round */
+	if (readyconns) timeoutms = 0;
+	for (walk = lsocks; (walk && timeoutms); walk = walk->next) {
+		if (walk->evready) timeoutms = 0;
+	}
+
+	n = epoll_wait(epollfd, events, EPOLL_MAXEVENTS, timeoutms);
+
+	for (i = 0; (i < n); i++) {
+		walk = (tcpconn_t *)events[i].data.ptr;
+
+		if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) walk->evready |= CONN_EV_READ;
+		if (events[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) walk->evready |= (CONN_EV_READ | CONN_EV_HUP);
+		if (events[i].events & (EPOLLOUT | EPOLLHUP | EPOLLERR)) walk->evready |= CONN_EV_WRITE;
+
+		/* Listeners are handled by conn_process_listeners() */
+		if (conn_is_listener(walk) || (walk->connstate == CONN_DEAD)) continue;
+		conn_epoll_queue(walk);
+	}
+
+	return n;
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+/* Does the connection have I/O readiness that the application wants to use ? */
+static int conn_epoll_pending(tcpconn_t *walk)
+{
+	int wantio;
+
+	if (walk->evready == 0) return 0;
+
+	wantio = conn_wantio(walk);
+	return ((wantio & walk->evready) != 0);
+}
+
+
+/*
+ * Handle I/O on one connection. canread/canwrite tell if the socket is
+ * ready for reading/writing.
+ */
+static void conn_process_one(tcpconn_t *walk, int canread, int canwrite)
+{
+	const char *funcid = "conn_process_one";
+	enum conn_cbresult_t cbres = CONN_CBRESULT_OK;
+	int connres;
+	socklen_t connressize;
+
+	if (walk->connstate == CONN_DEAD) return;
+	if (canread) {
+		cbres = walk->usercallback(walk, CONN_CB_READ, walk->userdata);
+		if (walk->connstate == CONN_DEAD) return;
+
+		if (cbres == CONN_CBRESULT_STARTTLS)
+			conn_starttls(walk);
+	}
+
+	if (walk->connstate == CONN_DEAD) return;
+	if (canwrite) {
+		switch (walk->connstate) {
+		  case CONN_PLAINTEXT_CONNECTING:
+		  case CONN_SSL_CONNECTING:
+			/* We have the connect() result now */
+			connressize = sizeof(connres);
+			getsockopt(walk->sock, SOL_SOCKET, SO_ERROR, &connres, &connressize);
+			if (connres != 0) {
+				walk->errcode = connres;
+				conn_info(funcid, INFO_DEBUG, "connect() to %s failed: status %d\n", 
+					  conn_print_address(walk), connres);
+				walk->usercallback(walk, CONN_CB_CONNECT_FAILED, walk->userdata);
 				conn_cleanup(walk);
 			}
-			break;
-
-		  case CONN_SSL_INIT:
-			/*
-			 * Starting an SSL handshake, we want to read or write data.
-			 * 
-			 * NOTE: This really should not happen, since all SSL I/O
-			 * operations explicitly call try_ssl_X(), which invokes the
-			 * SSL I/O operation and then changes state to CONN_SSL_X_READ/WRITE
-			 */
-			add_fd(walk->sock, fdread, &maxfd);
-			add_fd(walk->sock, fdwrite, &maxfd);
-			break;
+			else {
+				walk->usercallback(walk, CONN_CB_CONNECT_COMPLETE, walk->userdata);
+				if (walk->connstate == CONN_PLAINTEXT_CONNECTING) {
+					walk->connstate = CONN_PLAINTEXT;
+				}
+				else {
+					/* Connected, but havent done SSL handshake yet */
+					try_ssl_connect(walk);
+				}
 
-		  case CONN_SSL_ACCEPT_READ:
-		  case CONN_SSL_CONNECT_READ:
-		  case CONN_SSL_STARTTLS_READ:
-		  case CONN_SSL_READ:
-			/* We're doing SSL handshake and the library needs to read data */
-			add_fd(walk->sock, fdread, &maxfd);
+				if ((walk->connstate == CONN_PLAINTEXT) || (walk->connstate == CONN_SSL_READY)) {
+					if (walk->usercallback(walk, CONN_CB_WRITECHECK, walk->userdata) == CONN_CBRESULT_OK)
+						cbres = walk->usercallback(walk, CONN_CB_WRITE, walk->userdata);
+				}
+			}
 			break;
 
-		  case CONN_SSL_ACCEPT_WRITE:
-		  case CONN_SSL_CONNECT_WRITE:
-		  case CONN_SSL_STARTTLS_WRITE:
-		  case CONN_SSL_WRITE:
-			/* We're doing SSL handshake and the library needs to write data */
-		  case CONN_SSL_CONNECTING:
-		  case CONN_PLAINTEXT_CONNECTING:
-			/* We're waiting for an outbound connection to complete = ready for writing */
-			add_fd(walk->sock, fdwrite, &maxfd);
+		  default:
+			cbres = walk->usercallback(walk, CONN_CB_WRITE, walk->userdata);
 			break;
 		}
-	}
 
-	return maxfd;
+		if (walk->connstate == CONN_DEAD) return;
+
+		if (cbres == CONN_CBRESULT_STARTTLS)
+			conn_starttls(walk);
+	}
 }
 
+/*
+ * epoll version of conn_process_active(). Only the connections on the
+ * ready-list are handled. Once a second all connections are checked
+ * for timeouts, and for readiness that the application did not want
+ * to use when the event arrived.
+ */
+static void conn_epoll_process_active(void)
+{
+	tcpconn_t *worklist, *walk;
+	struct timespec tnow;
+	time_t now;
+
+	worklist = readyconns;
+	readyconns = NULL;
+
+	while (worklist) {
+		walk = worklist;
+		worklist = worklist->evnext;
+		walk->evqueued = 0;
+		walk->evnext = NULL;
+
+		if (walk->connstate == CONN_DEAD) continue;
+
+		/* Read first, then write - the read may have made the application want to write */
+		conn_process_one(walk, ((conn_wantio(walk) & walk->evready & CONN_EV_READ) != 0), 0);
+		conn_process_one(walk, 0, ((conn_wantio(walk) & walk->evready & CONN_EV_WRITE) != 0));
+
+		if ((walk->connstate != CONN_DEAD) && conn_epoll_pending(walk)) conn_epoll_queue(walk);
+	}
+
+	conn_getntimer(&tnow);
+	now = tnow.tv_sec;
+	if (now == lastsweep) return;
+	lastsweep = now;
+
+	for (walk = conns; (walk); walk = walk->next) {
+		int wantio;
+
+		if (walk->connstate == CONN_DEAD) continue;
+
+		/* This also closes connections that the application is done with, like conn_fdset() does */
+		wantio = conn_wantio(walk);
+		if (!walk->evqueued && (wantio & walk->evready)) conn_epoll_queue(walk);
+
+		if (walk->maxlifetime && (walk->connstate != CONN_DEAD) && (conn_elapsedus(&walk->starttime, &tnow) > walk->maxlifetime)) {
+			walk->usercallback(walk, CONN_CB_TIMEOUT, walk->userdata);
+		}
+	}
+}
 
 /*
  * Do a cycle of all the active connections after select() has found out
@@ -1050,78 +1412,35 @@ int conn_fdset(fd_set *fdread, fd_set *fdwrite)
  * The only funny thing about this is that an outbound connection that is established
  * is handled here; since we do async I/O, the connect() call is also asynchronous and
  * a new connection shows up here as being ready for writing.
+ *
+ * In epoll mode the fd_set's are not used.
  */
 void conn_process_active(fd_set *fdread, fd_set *fdwrite)
 {
 	const char *funcid = "conn_process_active";
 	tcpconn_t *walk;
-	int connres;
-	socklen_t connressize;
 	struct timespec tnow;
 	
 	conn_info(funcid, INFO_DEBUG, "Processing all active connections\n");
 
+	if (epollfd != -1) {
+		conn_epoll_process_active();
+		return;
+	}
+
 	conn_getntimer(&tnow);
 
 	for (walk = conns; (walk); walk = walk->next) {
-		enum conn_cbresult_t cbres = CONN_CBRESULT_OK;
-
 		if (walk->connstate == CONN_DEAD) continue;
-		if (FD_ISSET(walk->sock, fdread)) {
-			cbres = walk->usercallback(walk, CONN_CB_READ, walk->userdata);
-			if (walk->connstate == CONN_DEAD) continue;
-
-			if (cbres == CONN_CBRESULT_STARTTLS)
-				conn_starttls(walk);
-		}
 
+		conn_process_one(walk, FD_ISSET(walk->sock, fdread), 0);
+		if (walk->connstate == CONN_DEAD) continue;
+		conn_process_one(walk, 0, FD_ISSET(walk->sock, fdwrite));
 		if (walk->connstate == CONN_DEAD) continue;
-		if (FD_ISSET(walk->sock, fdwrite)) {
-			switch (walk->connstate) {
-			  case CONN_PLAINTEXT_CONNECTING:
-			  case CONN_SSL_CONNECTING:
-				/* We have the connect() result now */
-				connressize = sizeof(connres);
-				getsockopt(walk->sock, SOL_SOCKET, SO_ERROR, &connres, &connressize);
-				if (connres != 0) {
-					walk->errcode = connres;
-					conn_info(funcid, INFO_DEBUG, "connect() to %s failed: status %d\n", 
-						  conn_print_address(walk), connres);
-					walk->usercallback(walk, CONN_CB_CONNECT_FAILED, walk->userdata);
-					conn_cleanup(walk);
-				}
-				else {
-					walk->usercallback(walk, CONN_CB_CONNECT_COMPLETE, walk->userdata);
-					if (walk->connstate == CONN_PLAINTEXT_CONNECTING) {
-						walk->connstate = CONN_PLAINTEXT;
-					}
-					else {
-						/* Connected, but havent done SSL handshake yet */
-						try_ssl_connect(walk);
-					}
-
-					if ((walk->connstate == CONN_PLAINTEXT) || (walk->connstate == CONN_SSL_READY)) {
-						if (walk->usercallback(walk, CONN_CB_WRITECHECK, walk->userdata) == CONN_CBRESULT_OK)
-							cbres = walk->usercallback(walk, CONN_CB_WRITE, walk->userdata);
-					}
-				}
-				break;
-
-			  default:
-				cbres = walk->usercallback(walk, CONN_CB_WRITE, walk->userdata);
-				break;
-			}
-
-			if (walk->connstate == CONN_DEAD) continue;
-
-			if (cbres == CONN_CBRESULT_STARTTLS)
-				conn_starttls(walk);
-		}
 
 		if (walk->maxlifetime && (conn_elapsedus(&walk->starttime, &tnow) > walk->maxlifetime)) {
 			walk->usercallback(walk, CONN_CB_TIMEOUT, walk->userdata);
 		}
-		continue;
 	}
 }
 
@@ -1135,7 +1454,13 @@ void conn_process_listeners(fd_set *fdread)
 
 	conn_info(funcid, INFO_DEBUG, "Processing all listen-sockets\n");
 	for (walk = lsocks; (walk); walk = walk->next) {
-		if (FD_ISSET(walk->sock, fdread)) conn_accept(walk);
+		if (epollfd != -1) {
+			/* Edge-triggered: Accept until the listen queue is empty, but dont starve the active connections */
+			int count = 0;
+
+			while ((walk->evready & CONN_EV_READ) && (count++ < EPOLL_MAXACCEPTS)) conn_accept(walk);
+		}
+		else if (FD_ISSET(walk->sock, fdread)) conn_accept(walk);
 	}
 }
 
@@ -1512,6 +1837,7 @@ tcpconn_t *conn_prepare_connection(char *ip, int portnumber, enum conn_socktype_
 		conn_getntimer(&newconn->starttime);
 		newconn->next = conns;
 		conns = newconn;
+		conn_epoll_add(newconn, 0);
 	}
 
 	return newconn;
@@ -1569,6 +1895,10 @@ void conn_deinit(void)
 		conn_close_connection(walk, NULL);
 	}
 
+#ifdef HAVE_EPOLL
+	if (epollfd != -1) { close(epollfd); epollfd = -1; }
+#endif
+
 #ifdef HAVE_OPENSSL
 	if (serverctx) SSL_CTX_free(serverctx);
 	EVP_cleanup();
@@ -36,6 +36,10 @@ enum conn_callback_t {
 };
 enum conn_cbresult_t { CONN_CBRESULT_OK, CONN_CBRESULT_FAILED, CONN_CBRESULT_STARTTLS, CONN_CBRESULT_LAST };
 
+#define CONN_EV_READ  1
+#define CONN_EV_WRITE 2
+#define CONN_EV_HUP   4
+
 extern char *conn_callback_names[];
 extern char *conn_callback_result_names[];
 
@@ -62,6 +66,9 @@ typedef struct tcpconn_t {
 	void *userdata;
 	enum conn_cbresult_t (*usercallback)(struct tcpconn_t *, enum conn_callback_t, void *);
 	struct tcpconn_t *next;
+	unsigned int evready;		/* epoll mode: CONN_EV_* readiness not yet consumed */
+	int evqueued;			/* epoll mode: Connection is on the ready-list */
+	struct tcpconn_t *evnext;	/* epoll mode: Next connection on the ready-list */
 #ifdef HAVE_OPENSSL
 	SSL_CTX *ctx;
 	SSL *ssl;
@@ -96,6 +103,8 @@ extern tcpconn_t *conn_prepare_connection(char *ip, int portnumber, enum conn_so
 					  char *localaddr, enum sslhandling_t withssl, char *sslname, char *certfn, char *keyfn, long maxlifetime,
 					  enum conn_cbresult_t (*usercallback)(tcpconn_t *, enum conn_callback_t, void *), void *userdata);
 
+extern int conn_use_epoll(void);
+extern int conn_epoll_wait(int timeoutms);
 extern int conn_fdset(fd_set *fdread, fd_set *fdwrite);
 extern void conn_process_listeners(fd_set *fdread);
 extern void conn_process_active(fd_set *fdread, fd_set *fdwrite);
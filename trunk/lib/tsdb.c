@@ -0,0 +1,1083 @@
+/*----------------------------------------------------------------------------*/
+/* Xymon monitor library.                                                     */
+/*                                                                            */
+/* This is a library module, part of libxymon.                                */
+/* It contains a simple time-series store, used by xymond_rrd as an           */
+/* alternative to keeping the graph data in RRD files.                        */
+/*                                                                            */
+/* Copyright (C) 2002-2011 Henrik Storner <henrik@storner.dk>                 */
+/*                                                                            */
+/* This program is released under the GNU General Public License (GPL),       */
+/* version 2. See the file "COPYING" for details.                             */
+/*                                                                            */
+/*----------------------------------------------------------------------------*/
+
+static char rcsid[] = "$Id$";
+
+/*
+ * All of the series for a host are kept in two files in the host RRD
+ * directory:
+ *
+ * tsdb.def holds one line per series: The series name (which is the same
+ * as the RRD filename would have been), the step and the RRD-style DS
+ * definitions. The line number is the series ID.
+ *
+ * Several processes may use the same host directory, e.g. the xymond_rrd
+ * for status and for data messages. So new lines are only added to tsdb.def
+ * while holding a lock on it, after reading the lines other processes have
+ * added. The same lock is held while appending to or compacting tsdb.dat,
+ * and compacting keeps the chunks of any series we do not know.
+ *
+ * tsdb.dat is append-only, and holds the data as a sequence of chunks.
+ * Each chunk has the readings for a single series, so an RRD cache flush
+ * of N updates becomes one append of a small chunk. The chunk header is
+ *
+ *     "XT" version(1) columns(1) seriesid(4) resolution(4) points(2) length(4)
+ *
+ * (integers are little-endian) followed by the payload: The timestamps as
+ * delta-of-delta varints, and then the values one column at a time, each
+ * value XOR'ed with the previous one in the column and stored with only
+ * the non-zero bytes. Unknown values are stored as NaN.
+ *
+ * The raw readings are stored as-is (resolution 0). Once a day the file is
+ * compacted: Readings older than 48 hours are consolidated to 30 minutes,
+ * 2 hours and 1 day resolution - the same as the default RRA's in
+ * rrddefinitions.cfg - and data older than 576 days is dropped.
+ * Rates for COUNTER, DERIVE and ABSOLUTE data are computed when the data
+ * is fetched, so the consolidation keeps the last counter value of each
+ * interval (the sum for ABSOLUTE) and averages the GAUGE values.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+
+#include "libxymon.h"
+
+#define TSDB_VERSION 1
+#define TSDB_HDRSZ 18
+#define TSDB_MAXPOINTS 65535
+
+/* Avoids needing -lm for isnan() in everything using libxymon */
+#define TSDB_ISNAN(x) ((x) != (x))
+
+typedef struct tsdbhost_t {
+	char *hostdir;
+	int defcount;		/* Lines read from tsdb.def, i.e. the next series ID */
+	off_t defsize;		/* How much of tsdb.def we have read */
+	tsdbseries_t *serieshead, *seriestail;
+	void *seriestree;
+	time_t nextcompact;
+} tsdbhost_t;
+
+static void *tsdbhosts = NULL;
+
+static struct {
+	int maxage;
+	int resolution;
+} tsdbtiers[] = {
+	{  48*60*60,  0     },
+	{  12*86400,  1800  },
+	{  48*86400,  7200  },
+	{ 576*86400,  86400 },
+	{ 0, 0 }
+};
+
+/* The readings for one series, while fetching or compacting */
+typedef struct tsdbpoints_t {
+	int count, size, ncols;
+	time_t *t;
+	int *res;
+	double *v;		/* count*ncols values */
+} tsdbpoints_t;
+
+
+static double tsdb_nan(void)
+{
+	static int haveval = 0;
+	static double nanval;
+
+	if (!haveval) { nanval = strtod("NAN", NULL); haveval = 1; }
+	return nanval;
+}
+
+static void put_u16(unsigned char *p, unsigned int v)
+{
+	p[0] = (v & 0xFF); p[1] = ((v >> 8) & 0xFF);
+}
+
+static void put_u32(unsigned char *p, unsigned int v)
+{
+	p[0] = (v & 0xFF); p[1] = ((v >> 8) & 0xFF); p[2] = ((v >> 16) & 0xFF); p[3] = ((v >> 24) & 0xFF);
+}
+
+static unsigned int get_u16(unsigned char *p)
+{
+	return (p[0] | (p[1] << 8));
+}
+
+static unsigned int get_u32(unsigned char *p)
+{
+	return (p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24));
+}
+
+static int put_varint(unsigned char *p, unsigned long long v)
+{
+	int n = 0;
+
+	while (v >= 0x80) {
+		p[n++] = (v & 0x7F) | 0x80;
+		v >>= 7;
+	}
+	p[n++] = v;
+
+	return n;
+}
+
+static int get_varint(unsigned char *p, unsigned char *end, unsigned long long *v)
+{
+	int n = 0, shift = 0;
+
+	*v = 0;
+	while ((p+n) < end) {
+		*v |= ((unsigned long long)(p[n] & 0x7F) << shift);
+		if ((p[n++] & 0x80) == 0) return n;
+		shift += 7;
+		if (shift > 63) break;
+	}
+
+	return 0;
+}
+
+static unsigned long long zigzag(long long v)
+{
+	return ((unsigned long long)v << 1) ^ (unsigned long long)(v >> 63);
+}
+
+static long long unzigzag(unsigned long long v)
+{
+	return (long long)(v >> 1) ^ -(long long)(v & 1);
+}
+
+static unsigned long long double2bits(double d)
+{
+	unsigned long long bits;
+
+	memcpy(&bits, &d, sizeof(bits));
+	return bits;
+}
+
+static double bits2double(unsigned long long bits)
+{
+	double d;
+
+	memcpy(&d, &bits, sizeof(d));
+	return d;
+}
+
+
+static int encode_chunk(unsigned char **buf, int *bufsz, int id, int res, int ncols, int npoints, time_t *t, double *v)
+{
+	/* Encode a chunk into buf, returns the length of the chunk */
+	unsigned char *p;
+	int i, col, need;
+	long long delta, prevdelta = 0;
+
+	need = TSDB_HDRSZ + npoints*10 + ncols*npoints*9;
+	if (need > *bufsz) {
+		*bufsz = need;
+		*buf = (unsigned char *)realloc(*buf, *bufsz);
+	}
+
+	p = *buf + TSDB_HDRSZ;
+	for (i = 0; (i < npoints); i++) {
+		if (i == 0) {
+			p += put_varint(p, (unsigned long long)t[0]);
+		}
+		else {
+			delta = (long long)(t[i] - t[i-1]);
+			p += put_varint(p, zigzag(delta - prevdelta));
+			prevdelta = delta;
+		}
+	}
+
+	for (col = 0; (col < ncols); col++) {
+		unsigned long long prev = 0, x;
+
+		for (i = 0; (i < npoints); i++) {
+			int lead, trail, n;
+			unsigned long long cur = double2bits(v[i*ncols + col]);
+
+			x = cur ^ prev;
+			prev = cur;
+			if (x == 0) {
+				*(p++) = 0;
+				continue;
+			}
+
+			for (lead = 0; ((lead < 7) && (((x >> (56 - 8*lead)) & 0xFF) == 0)); lead++) ;
+			for (trail = 0; ((trail < 7) && (((x >> (8*trail)) & 0xFF) == 0)); trail++) ;
+			*(p++) = 0x40 | (lead << 3) | trail;
+			for (n = 7 - lead; (n >= trail); n--) *(p++) = ((x >> (8*n)) & 0xFF);
+		}
+	}
+
+	(*buf)[0] = 'X'; (*buf)[1] = 'T'; (*buf)[2] = TSDB_VERSION; (*buf)[3] = ncols;
+	put_u32(*buf+4, id);
+	put_u32(*buf+8, res);
+	put_u16(*buf+12, npoints);
+	put_u32(*buf+14, (p - *buf) - TSDB_HDRSZ);
+
+	return (p - *buf);
+}
+
+static int decode_chunk(unsigned char *p, unsigned char *end, int ncols, int npoints, time_t *t, double *v)
+{
+	int i, col, n;
+	unsigned long long u;
+	long long delta = 0;
+
+	for (i = 0; (i < npoints); i++) {
+		n = get_varint(p, end, &u); if (n == 0) return -1;
+		p += n;
+		if (i == 0) {
+			t[0] = (time_t)u;
+		}
+		else {
+			delta += unzigzag(u);
+			t[i] = t[i-1] + delta;
+		}
+	}
+
+	for (col = 0; (col < ncols); col++) {
+		unsigned long long prev = 0, x;
+
+		for (i = 0; (i < npoints); i++) {
+			int lead, trail, hdr;
+
+			if (p >= end) return -1;
+			hdr = *(p++);
+			x = 0;
+			if (hdr != 0) {
+				lead = ((hdr >> 3) & 0x07);
+				trail = (hdr & 0x07);
+				if ((p + (8 - lead - trail)) > end) return -1;
+				for (n = 7 - lead; (n >= trail); n--) x |= ((unsigned long long)*(p++) << (8*n));
+			}
+			prev ^= x;
+			v[i*ncols + col] = bits2double(prev);
+		}
+	}
+
+	return 0;
+}
+
+static unsigned char *read_datfile(char *hostdir, size_t *len)
+{
+	char fn[PATH_MAX];
+	struct stat st;
+	unsigned char *buf;
+	int fd;
+	ssize_t n;
+	size_t got = 0;
+
+	*len = 0;
+	snprintf(fn, sizeof(fn), "%s/%s", hostdir, TSDB_DATFILE);
+	fd = open(fn, O_RDONLY);
+	if (fd == -1) return NULL;
+	if (fstat(fd, &st) == -1) { close(fd); return NULL; }
+
+	buf = (unsigned char *)malloc(st.st_size + 1);
+	while ((got < st.st_size) && ((n = read(fd, buf+got, st.st_size - got)) > 0)) got += n;
+	close(fd);
+
+	*len = got;
+	return buf;
+}
+
+static unsigned char *next_chunk(unsigned char *p, unsigned char *end, unsigned int *id, int *res, int *ncols, int *npoints,
+				 unsigned char **payloadend, int *corrupt)
+{
+	/*
+	 * Returns the chunk payload, or NULL at the end of the data. A partially written chunk is ignored.
+	 * If the data is corrupt, NULL is returned and "corrupt" is set.
+	 */
+	unsigned int len;
+
+	*corrupt = 0;
+	if ((p + TSDB_HDRSZ) > end) return NULL;
+	if ((p[0] != 'X') || (p[1] != 'T') || (p[2] != TSDB_VERSION)) {
+		errprintf("tsdb: Corrupt data file, bad chunk header\n");
+		*corrupt = 1;
+		return NULL;
+	}
+
+	*ncols = p[3];
+	*id = get_u32(p+4);
+	*res = get_u32(p+8);
+	*npoints = get_u16(p+12);
+	len = get_u32(p+14);
+	if ((p + TSDB_HDRSZ + len) > end) {
+		dbgprintf("tsdb: Ignoring incomplete chunk at end of data file\n");
+		return NULL;
+	}
+
+	*payloadend = p + TSDB_HDRSZ + len;
+	return p + TSDB_HDRSZ;
+}
+
+static void points_add(tsdbpoints_t *pts, time_t t, int res, double *vals, int ncols)
+{
+	int col;
+
+	/* Data must be in time order */
+	if ((pts->count > 0) && (t <= pts->t[pts->count-1])) return;
+
+	if (pts->count == pts->size) {
+		pts->size += 256;
+		pts->t = (time_t *)realloc(pts->t, pts->size * sizeof(time_t));
+		pts->res = (int *)realloc(pts->res, pts->size * sizeof(int));
+		pts->v = (double *)realloc(pts->v, pts->size * pts->ncols * sizeof(double));
+	}
+
+	pts->t[pts->count] = t;
+	pts->res[pts->count] = res;
+	for (col = 0; (col < pts->ncols); col++) {
+		pts->v[pts->count*pts->ncols + col] = ((col < ncols) ? vals[col] : tsdb_nan());
+	}
+	pts->count++;
+}
+
+static void points_free(tsdbpoints_t *pts)
+{
+	if (pts->t) xfree(pts->t);
+	if (pts->res) xfree(pts->res);
+	if (pts->v) xfree(pts->v);
+	memset(pts, 0, sizeof(tsdbpoints_t));
+}
+
+static int load_points(unsigned char *data, size_t datalen, tsdbpoints_t *pts, int nseries)
+{
+	/* Decode all chunks in the data file into pts[id], for series ID's below nseries. Returns -1 if the file is corrupt */
+	unsigned char *p = data, *end = data + datalen, *payload, *payloadend;
+	unsigned int id;
+	int res, ncols, npoints, i, corrupt;
+	time_t *t = NULL;
+	double *v = NULL;
+	int tsize = 0, vsize = 0;
+
+	while ((payload = next_chunk(p, end, &id, &res, &ncols, &npoints, &payloadend, &corrupt)) != NULL) {
+		p = payloadend;
+		if ((id >= (unsigned int)nseries) || (pts[id].ncols == 0)) continue;
+
+		if (npoints > tsize) { tsize = npoints; t = (time_t *)realloc(t, tsize * sizeof(time_t)); }
+		if ((npoints * ncols) > vsize) { vsize = npoints * ncols; v = (double *)realloc(v, vsize * sizeof(double)); }
+		if (decode_chunk(payload, payloadend, ncols, npoints, t, v) != 0) {
+			errprintf("tsdb: Corrupt data chunk for series %u\n", id);
+			continue;
+		}
+
+		for (i = 0; (i < npoints); i++) points_add(&pts[id], t[i], res, v + i*ncols, ncols);
+	}
+
+	if (t) xfree(t);
+	if (v) xfree(v);
+
+	return (corrupt ? -1 : 0);
+}
+
+
+static int parse_ds(char *def, tsdbds_t *ds)
+{
+	/* DS:name:TYPE:heartbeat:min:max */
+	char *buf, *tok[6], *p;
+	int i;
+
+	/* Note: Called while parse_defline() is using strtok() */
+	buf = strdup(def);
+	for (i = 0, p = buf; (p && (i < 6)); i++) {
+		tok[i] = p;
+		p = strchr(p, ':');
+		if (p) *(p++) = '\0';
+	}
+	if ((i < 6) || (strcmp(tok[0], "DS") != 0)) {
+		xfree(buf);
+		return -1;
+	}
+
+	if (strcmp(tok[2], "GAUGE") == 0) ds->type = TSDB_GAUGE;
+	else if (strcmp(tok[2], "COUNTER") == 0) ds->type = TSDB_COUNTER;
+	else if (strcmp(tok[2], "DERIVE") == 0) ds->type = TSDB_DERIVE;
+	else if (strcmp(tok[2], "ABSOLUTE") == 0) ds->type = TSDB_ABSOLUTE;
+	else {
+		xfree(buf);
+		return -1;
+	}
+
+	ds->name = strdup(tok[1]);
+	ds->heartbeat = atoi(tok[3]);
+	ds->minval = ((strcmp(tok[4], "U") == 0) ? tsdb_nan() : atof(tok[4]));
+	ds->maxval = ((strcmp(tok[5], "U") == 0) ? tsdb_nan() : atof(tok[5]));
+	xfree(buf);
+
+	return 0;
+}
+
+static tsdbseries_t *parse_defline(char *line, int id)
+{
+	/* "name step DS:... DS:..." */
+	tsdbseries_t *newitem;
+	char *buf, *tok;
+	int dssize = 0;
+
+	buf = strdup(line);
+	tok = strtok(buf, " \t\r\n");
+	if (!tok) { xfree(buf); return NULL; }
+
+	newitem = (tsdbseries_t *)calloc(1, sizeof(tsdbseries_t));
+	newitem->name = strdup(tok);
+	newitem->id = id;
+	tok = strtok(NULL, " \t\r\n");
+	newitem->step = (tok ? atoi(tok) : 0);
+	if (newitem->step <= 0) newitem->step = 300;
+
+	while ((tok = strtok(NULL, " \t\r\n")) != NULL) {
+		if (newitem->dscount == dssize) {
+			dssize += 4;
+			newitem->ds = (tsdbds_t *)realloc(newitem->ds, dssize * sizeof(tsdbds_t));
+		}
+		if (parse_ds(tok, &newitem->ds[newitem->dscount]) == 0) newitem->dscount++;
+	}
+	xfree(buf);
+
+	return newitem;
+}
+
+static void add_series(tsdbhost_t *host, tsdbseries_t *newitem)
+{
+	if (host->seriestail) host->seriestail->next = newitem; else host->serieshead = newitem;
+	host->seriestail = newitem;
+	xtreeAdd(host->seriestree, newitem->name, newitem);
+}
+
+static void free_series(tsdbseries_t *series)
+{
+	int i;
+
+	for (i = 0; (i < series->dscount); i++) xfree(series->ds[i].name);
+	if (series->ds) xfree(series->ds);
+	xfree(series->name);
+	xfree(series);
+}
+
+static void read_deflines(tsdbhost_t *host, int fd)
+{
+	/* Pick up the lines added to tsdb.def since we last looked */
+	struct stat st;
+	char *buf, *bol, *eol;
+	ssize_t n;
+	tsdbseries_t *newitem;
+	xtreePos_t handle;
+
+	if ((fstat(fd, &st) == -1) || (st.st_size <= host->defsize)) return;
+
+	buf = (char *)malloc(st.st_size - host->defsize + 1);
+	n = pread(fd, buf, st.st_size - host->defsize, host->defsize);
+	if (n <= 0) {
+		xfree(buf);
+		return;
+	}
+	buf[n] = '\0';
+
+	/* A line without the newline is still being written */
+	for (bol = buf; ((eol = strchr(bol, '\n')) != NULL); bol = eol+1) {
+		*eol = '\0';
+		host->defsize += (eol - bol) + 1;
+		newitem = parse_defline(bol, host->defcount++);
+		if (!newitem) continue;
+
+		handle = xtreeFind(host->seriestree, newitem->name);
+		if (handle == xtreeEnd(host->seriestree)) {
+			add_series(host, newitem);
+		}
+		else {
+			/* Known from tsdb_define() without storing it, now we know the ID */
+			((tsdbseries_t *)xtreeData(host->seriestree, handle))->id = newitem->id;
+			free_series(newitem);
+		}
+	}
+
+	xfree(buf);
+}
+
+static int tsdb_lock(char *hostdir)
+{
+	/* tsdb.def is never replaced, so the lock on it covers tsdb.dat also. Returns the open tsdb.def */
+	char fn[PATH_MAX];
+	struct flock lck;
+	int fd;
+
+	snprintf(fn, sizeof(fn), "%s/%s", hostdir, TSDB_DEFFILE);
+	fd = open(fn, O_RDWR|O_APPEND|O_CREAT, 0644);
+	if (fd == -1) {
+		errprintf("tsdb: Cannot open %s: %s\n", fn, strerror(errno));
+		return -1;
+	}
+
+	memset(&lck, 0, sizeof(lck));
+	lck.l_type = F_WRLCK;
+	lck.l_whence = SEEK_SET;
+	while (fcntl(fd, F_SETLKW, &lck) == -1) {
+		if (errno != EINTR) {
+			errprintf("tsdb: Cannot lock %s: %s\n", fn, strerror(errno));
+			close(fd);
+			return -1;
+		}
+	}
+
+	return fd;
+}
+
+static void tsdb_unlock(int fd)
+{
+	/* Closing the file releases the lock */
+	close(fd);
+}
+
+static tsdbhost_t *tsdb_host(char *hostdir)
+{
+	xtreePos_t handle;
+	tsdbhost_t *host;
+	char fn[PATH_MAX];
+	int fd;
+	unsigned int h;
+	char *p;
+
+	if (tsdbhosts == NULL) tsdbhosts = xtreeNew(strcmp);
+
+	handle = xtreeFind(tsdbhosts, hostdir);
+	if (handle != xtreeEnd(tsdbhosts)) return (tsdbhost_t *)xtreeData(tsdbhosts, handle);
+
+	host = (tsdbhost_t *)calloc(1, sizeof(tsdbhost_t));
+	host->hostdir = strdup(hostdir);
+	host->seriestree = xtreeNew(strcmp);
+
+	/* Spread the compacting of the hosts over the day */
+	for (h = 0, p = hostdir; (*p); p++) h = h*31 + (unsigned char)*p;
+	host->nextcompact = getcurrenttime(NULL) + (h % 86400);
+
+	snprintf(fn, sizeof(fn), "%s/%s", hostdir, TSDB_DEFFILE);
+	fd = open(fn, O_RDONLY);
+	if (fd != -1) {
+		read_deflines(host, fd);
+		close(fd);
+	}
+
+	xtreeAdd(tsdbhosts, host->hostdir, host);
+
+	return host;
+}
+
+int tsdb_hasstore(char *hostdir)
+{
+	char fn[PATH_MAX];
+	struct stat st;
+
+	snprintf(fn, sizeof(fn), "%s/%s", hostdir, TSDB_DEFFILE);
+	return (stat(fn, &st) == 0);
+}
+
+tsdbseries_t *tsdb_serieslist(char *hostdir)
+{
+	return tsdb_host(hostdir)->serieshead;
+}
+
+tsdbseries_t *tsdb_findseries(char *hostdir, char *name)
+{
+	tsdbhost_t *host = tsdb_host(hostdir);
+	xtreePos_t handle;
+
+	handle = xtreeFind(host->seriestree, name);
+	if (handle == xtreeEnd(host->seriestree)) return NULL;
+
+	return (tsdbseries_t *)xtreeData(host->seriestree, handle);
+}
+
+int tsdb_define(char *hostdir, char *name, int argc, char **argv, int store)
+{
+	/*
+	 * Define a new series from rrdcreate-style parameters: argv[0] is the
+	 * command and argv[1] the filename, the options and DS/RRA definitions
+	 * follow. The RRA definitions are not used. If "store" is not set, the
+	 * series is only added to our in-memory list, because another process
+	 * stores it.
+	 */
+	tsdbhost_t *host = tsdb_host(hostdir);
+	tsdbseries_t *newitem;
+	strbuffer_t *defline;
+	char stepstr[20];
+	int i, step = 0, result = 0;
+
+	if (xtreeFind(host->seriestree, name) != xtreeEnd(host->seriestree)) return 0;
+
+	for (i = 2; (i < argc); i++) {
+		if (((strcmp(argv[i], "-s") == 0) || (strcmp(argv[i], "--step") == 0)) && (i+1 < argc)) {
+			step = atoi(argv[++i]);
+		}
+		else if (((strcmp(argv[i], "-b") == 0) || (strcmp(argv[i], "--start") == 0)) && (i+1 < argc)) {
+			i++;
+		}
+	}
+	sprintf(stepstr, "%d", (step > 0) ? step : 300);
+
+	defline = newstrbuffer(0);
+	addtobuffer_many(defline, name, " ", stepstr, NULL);
+	for (i = 2; (i < argc); i++) {
+		if (strncmp(argv[i], "DS:", 3) == 0) addtobuffer_many(defline, " ", argv[i], NULL);
+	}
+	addtobuffer(defline, "\n");
+
+	newitem = parse_defline(STRBUF(defline), host->defcount);
+	if (!newitem || (newitem->dscount == 0) || (newitem->dscount > 255)) {
+		errprintf("tsdb: No usable DS definitions for %s/%s\n", hostdir, name);
+		if (newitem) free_series(newitem);
+		freestrbuffer(defline);
+		return -1;
+	}
+
+	if (store) {
+		int fd = tsdb_lock(hostdir);
+
+		if (fd != -1) {
+			/* Another process may have added series, or even this one */
+			read_deflines(host, fd);
+			if (xtreeFind(host->seriestree, name) != xtreeEnd(host->seriestree)) {
+				tsdb_unlock(fd);
+				free_series(newitem);
+				freestrbuffer(defline);
+				return 0;
+			}
+
+			newitem->id = host->defcount;
+			if (write(fd, STRBUF(defline), STRBUFLEN(defline)) == STRBUFLEN(defline)) {
+				host->defcount++;
+				host->defsize += STRBUFLEN(defline);
+			}
+			else {
+				errprintf("tsdb: Cannot add %s to %s/%s: %s\n", name, hostdir, TSDB_DEFFILE, strerror(errno));
+				/* Don't leave a partial line that would merge with the next one */
+				if (ftruncate(fd, host->defsize) == -1) {
+					errprintf("tsdb: Cannot truncate %s/%s: %s\n", hostdir, TSDB_DEFFILE, strerror(errno));
+				}
+				result = -1;
+			}
+			tsdb_unlock(fd);
+		}
+		else {
+			result = -1;
+		}
+	}
+	freestrbuffer(defline);
+
+	/* Without the definition in tsdb.def, the data could not be read back */
+	if (result == 0) add_series(host, newitem); else free_series(newitem);
+
+	return result;
+}
+
+int tsdb_append(char *hostdir, char *name, char *template, int count, char **values)
+{
+	/*
+	 * Append readings to a series. "template" is the rrdupdate template with
+	 * the DS names, and the values are rrdupdate-style "TIME:VAL1:VAL2..."
+	 */
+	static unsigned char *buf = NULL;
+	static int bufsz = 0;
+	tsdbseries_t *series;
+	int *colmap, tplcount, i, col, npoints, len, fd, result = 0;
+	char *tplcopy, *tok, *vcopy;
+	time_t *t;
+	double *v;
+	char fn[PATH_MAX];
+	time_t now;
+
+	series = tsdb_findseries(hostdir, name);
+	if (!series) {
+		errprintf("tsdb: Update for undefined series %s/%s\n", hostdir, name);
+		return -1;
+	}
+
+	/* Map the template names to DS columns */
+	tplcopy = strdup(template);
+	colmap = (int *)malloc((strlen(template) + 1) * sizeof(int));
+	for (tplcount = 0, tok = strtok(tplcopy, ":"); (tok); tok = strtok(NULL, ":"), tplcount++) {
+		colmap[tplcount] = -1;
+		for (col = 0; (col < series->dscount); col++) {
+			if (strcmp(tok, series->ds[col].name) == 0) { colmap[tplcount] = col; break; }
+		}
+	}
+	xfree(tplcopy);
+
+	t = (time_t *)malloc(count * sizeof(time_t));
+	v = (double *)malloc(count * series->dscount * sizeof(double));
+	for (i = 0, npoints = 0; (i < count); i++) {
+		double *pv = v + npoints*series->dscount;
+
+		for (col = 0; (col < series->dscount); col++) pv[col] = tsdb_nan();
+
+		vcopy = strdup(values[i]);
+		tok = strtok(vcopy, ":");
+		if (tok && (atol(tok) > 0)) {
+			t[npoints] = atol(tok);
+			for (col = 0; ((tok = strtok(NULL, ":")) != NULL) && (col < tplcount); col++) {
+				if ((colmap[col] >= 0) && (strcmp(tok, "U") != 0)) pv[colmap[col]] = atof(tok);
+			}
+			if ((npoints == 0) || (t[npoints] > t[npoints-1])) npoints++;
+		}
+		xfree(vcopy);
+	}
+	xfree(colmap);
+
+	if (npoints > 0) {
+		int lockfd;
+
+		len = encode_chunk(&buf, &bufsz, series->id, 0, series->dscount, npoints, t, v);
+
+		/* Keep a compaction in another process from losing our chunk */
+		lockfd = tsdb_lock(hostdir);
+		snprintf(fn, sizeof(fn), "%s/%s", hostdir, TSDB_DATFILE);
+		fd = ((lockfd != -1) ? open(fn, O_WRONLY|O_APPEND|O_CREAT, 0644) : -1);
+		if ((fd == -1) || (write(fd, buf, len) != len)) {
+			errprintf("tsdb: Cannot update %s: %s\n", fn, strerror(errno));
+			result = -1;
+		}
+		if (fd != -1) close(fd);
+		if (lockfd != -1) tsdb_unlock(lockfd);
+	}
+
+	xfree(t);
+	xfree(v);
+
+	now = getcurrenttime(NULL);
+	if (now >= tsdb_host(hostdir)->nextcompact) tsdb_compact(hostdir, now);
+
+	return result;
+}
+
+
+static void consolidate(tsdbseries_t *series, tsdbpoints_t *in, time_t now, tsdbpoints_t *out)
+{
+	/* Reduce the resolution of old data, see the tsdbtiers table */
+	int i, first, col, tier;
+	double *vals = (double *)malloc(series->dscount * sizeof(double));
+
+	out->ncols = series->dscount;
+
+	i = 0;
+	while (i < in->count) {
+		time_t age = now - in->t[i];
+		time_t bucket;
+		int res;
+
+		for (tier = 0; (tsdbtiers[tier].maxage && (age > tsdbtiers[tier].maxage)); tier++) ;
+		if (tsdbtiers[tier].maxage == 0) { i++; continue; }	/* Too old */
+
+		res = tsdbtiers[tier].resolution;
+		if ((res == 0) || (in->res[i] >= res)) {
+			points_add(out, in->t[i], in->res[i], in->v + i*in->ncols, in->ncols);
+			i++;
+			continue;
+		}
+
+		/* Collect the readings in this interval */
+		bucket = (in->t[i] / res);
+		first = i;
+		while ((i < in->count) && ((in->t[i] / res) == bucket)) i++;
+
+		for (col = 0; (col < series->dscount); col++) {
+			double sum = 0.0, val;
+			int j, n = 0;
+
+			switch (series->ds[col].type) {
+			  case TSDB_GAUGE:
+			  case TSDB_ABSOLUTE:
+				for (j = first; (j < i); j++) {
+					val = in->v[j*in->ncols + col];
+					if (!TSDB_ISNAN(val)) { sum += val; n++; }
+				}
+				if (n == 0) vals[col] = tsdb_nan();
+				else if (series->ds[col].type == TSDB_GAUGE) vals[col] = sum / n;
+				else vals[col] = sum;
+				break;
+
+			  case TSDB_COUNTER:
+			  case TSDB_DERIVE:
+				vals[col] = in->v[(i-1)*in->ncols + col];
+				break;
+			}
+		}
+
+		points_add(out, in->t[i-1], res, vals, series->dscount);
+	}
+
+	xfree(vals);
+}
+
+int tsdb_compact(char *hostdir, time_t now)
+{
+	tsdbhost_t *host = tsdb_host(hostdir);
+	tsdbseries_t *swalk;
+	tsdbpoints_t *pts, cpts;
+	unsigned char *data, *buf = NULL;
+	unsigned char *p, *payloadend;
+	size_t datalen;
+	int bufsz = 0, len, fd, lockfd, i, ok = 1;
+	unsigned int id;
+	int res, ncols, npoints, corrupt;
+	char fn[PATH_MAX], tmpfn[PATH_MAX];
+	size_t newsize = 0;
+
+	host->nextcompact = now + 86400;
+
+	/* Appends must wait until the new file is in place, and we need all of the series */
+	lockfd = tsdb_lock(hostdir);
+	if (lockfd == -1) return -1;
+	read_deflines(host, lockfd);
+
+	data = read_datfile(hostdir, &datalen);
+	if (!data) {
+		tsdb_unlock(lockfd);
+		return 0;
+	}
+
+	pts = (tsdbpoints_t *)calloc(host->defcount + 1, sizeof(tsdbpoints_t));
+	for (swalk = host->serieshead; (swalk); swalk = swalk->next) pts[swalk->id].ncols = swalk->dscount;
+	if (load_points(data, datalen, pts, host->defcount + 1) != 0) {
+		/* The new file would only have the data before the damage, so leave it as it is */
+		errprintf("tsdb: Not compacting %s/%s, it is corrupt\n", hostdir, TSDB_DATFILE);
+		for (i = 0; (i <= host->defcount); i++) points_free(&pts[i]);
+		xfree(pts);
+		xfree(data);
+		tsdb_unlock(lockfd);
+		return -1;
+	}
+
+	snprintf(fn, sizeof(fn), "%s/%s", hostdir, TSDB_DATFILE);
+	snprintf(tmpfn, sizeof(tmpfn), "%s/%s.tmp", hostdir, TSDB_DATFILE);
+	fd = open(tmpfn, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	if (fd == -1) {
+		errprintf("tsdb: Cannot create %s: %s\n", tmpfn, strerror(errno));
+		ok = 0;
+	}
+
+	for (swalk = host->serieshead; (ok && swalk); swalk = swalk->next) {
+		int first;
+
+		memset(&cpts, 0, sizeof(cpts));
+		consolidate(swalk, &pts[swalk->id], now, &cpts);
+
+		/* Write one chunk for each run of readings with the same resolution */
+		for (first = 0; (ok && (first < cpts.count)); first = i) {
+			for (i = first; ((i < cpts.count) && (i - first < TSDB_MAXPOINTS) && (cpts.res[i] == cpts.res[first])); i++) ;
+			len = encode_chunk(&buf, &bufsz, swalk->id, cpts.res[first], cpts.ncols, i - first,
+					   cpts.t + first, cpts.v + first*cpts.ncols);
+			if (write(fd, buf, len) != len) {
+				errprintf("tsdb: Cannot write %s: %s\n", tmpfn, strerror(errno));
+				ok = 0;
+			}
+			newsize += len;
+		}
+
+		points_free(&cpts);
+	}
+
+	/* Copy the chunks for series we have no usable definition for as-is */
+	p = data;
+	while (ok && (next_chunk(p, data + datalen, &id, &res, &ncols, &npoints, &payloadend, &corrupt) != NULL)) {
+		if ((id > (unsigned int)host->defcount) || (pts[id].ncols == 0)) {
+			if (write(fd, p, payloadend - p) != (payloadend - p)) {
+				errprintf("tsdb: Cannot write %s: %s\n", tmpfn, strerror(errno));
+				ok = 0;
+			}
+			newsize += (payloadend - p);
+		}
+		p = payloadend;
+	}
+
+	for (i = 0; (i <= host->defcount); i++) points_free(&pts[i]);
+	xfree(pts);
+	xfree(data);
+	if (buf) xfree(buf);
+
+	if (fd != -1) close(fd);
+	if (ok && (rename(tmpfn, fn) == -1)) {
+		errprintf("tsdb: Cannot rename %s to %s: %s\n", tmpfn, fn, strerror(errno));
+		ok = 0;
+	}
+	tsdb_unlock(lockfd);
+	if (!ok) {
+		unlink(tmpfn);
+		return -1;
+	}
+
+	dbgprintf("tsdb: Compacted %s from %lu to %lu bytes\n", fn, (unsigned long)datalen, (unsigned long)newsize);
+	return 0;
+}
+
+int tsdb_fetch(char *hostdir, char *name, char *cf, time_t *start, time_t *end, int *step,
+	       int *dscount, char ***dsnames, double **data)
+{
+	/*
+	 * Fetch consolidated data like rrd_fetch(). The start/end/step are
+	 * adjusted to the step of the series, and row N of the result holds
+	 * the data for the interval (start + N*step, start + (N+1)*step].
+	 * The returned data is rows*dscount values, unknown values are NaN.
+	 * Returns the number of rows, or -1 on error.
+	 */
+	tsdbhost_t *host = tsdb_host(hostdir);
+	tsdbseries_t *series;
+	tsdbpoints_t *pts;
+	unsigned char *raw;
+	size_t rawlen;
+	int rows, row, col, i;
+	enum { CF_AVERAGE, CF_MIN, CF_MAX, CF_LAST } cfunc;
+	double *known;
+
+	series = tsdb_findseries(hostdir, name);
+	if (!series) return -1;
+
+	if (strcmp(cf, "MIN") == 0) cfunc = CF_MIN;
+	else if (strcmp(cf, "MAX") == 0) cfunc = CF_MAX;
+	else if (strcmp(cf, "LAST") == 0) cfunc = CF_LAST;
+	else cfunc = CF_AVERAGE;
+
+	if (*step < series->step) *step = series->step;
+	else *step = ((*step + series->step - 1) / series->step) * series->step;
+	*start = (*start / *step) * *step;
+	*end = ((*end + *step - 1) / *step) * *step;
+	if (*end <= *start) *end = *start + *step;
+	rows = (*end - *start) / *step;
+
+	*dscount = series->dscount;
+	*dsnames = (char **)malloc(series->dscount * sizeof(char *));
+	for (col = 0; (col < series->dscount); col++) (*dsnames)[col] = strdup(series->ds[col].name);
+	*data = (double *)malloc(rows * series->dscount * sizeof(double));
+	known = (double *)calloc(rows * series->dscount, sizeof(double));
+	for (i = 0; (i < rows * series->dscount); i++) (*data)[i] = ((cfunc == CF_AVERAGE) ? 0.0 : tsdb_nan());
+
+	pts = (tsdbpoints_t *)calloc(host->defcount + 1, sizeof(tsdbpoints_t));
+	pts[series->id].ncols = series->dscount;
+	raw = read_datfile(hostdir, &rawlen);
+	if (raw) {
+		load_points(raw, rawlen, pts, host->defcount + 1);
+		xfree(raw);
+	}
+
+	for (col = 0; (col < series->dscount); col++) {
+		tsdbds_t *ds = &series->ds[col];
+		tsdbpoints_t *p = &pts[series->id];
+
+		for (i = 1; (i < p->count); i++) {
+			time_t t0 = p->t[i-1], t1 = p->t[i];
+			double v0 = p->v[(i-1)*p->ncols + col], v1 = p->v[i*p->ncols + col];
+			double rate;
+			int heartbeat, firstrow, lastrow;
+
+			if ((t1 <= *start) || (t0 >= *end)) continue;
+
+			/* Consolidated data naturally has larger gaps than the heartbeat */
+			heartbeat = ds->heartbeat;
+			if (heartbeat < 2*p->res[i]) heartbeat = 2*p->res[i];
+			if ((t1 - t0) > heartbeat) continue;
+
+			switch (ds->type) {
+			  case TSDB_GAUGE:
+				rate = v1;
+				break;
+			  case TSDB_COUNTER:
+				rate = v1 - v0;
+				if (rate < 0) rate += ((v0 < 4294967296.0) ? 4294967296.0 : 18446744073709551616.0);
+				rate /= (t1 - t0);
+				break;
+			  case TSDB_DERIVE:
+				rate = (v1 - v0) / (t1 - t0);
+				break;
+			  case TSDB_ABSOLUTE:
+			  default:
+				rate = v1 / (t1 - t0);
+				break;
+			}
+			if (TSDB_ISNAN(rate)) continue;
+			if (!TSDB_ISNAN(ds->minval) && (rate < ds->minval)) continue;
+			if (!TSDB_ISNAN(ds->maxval) && (rate > ds->maxval)) continue;
+
+			/* Spread the value over the rows covered by this interval */
+			firstrow = (t0 > *start) ? ((t0 - *start) / *step) : 0;
+			lastrow = (t1 < *end) ? ((t1 - 1 - *start) / *step) : (rows - 1);
+			for (row = firstrow; (row <= lastrow); row++) {
+				time_t rstart = *start + row * *step, rend = rstart + *step;
+				double overlap = (((t1 < rend) ? t1 : rend) - ((t0 > rstart) ? t0 : rstart));
+				double *d = &(*data)[row*series->dscount + col];
+
+				if (overlap <= 0) continue;
+				switch (cfunc) {
+				  case CF_AVERAGE: *d += rate*overlap; break;
+				  case CF_MIN: if (TSDB_ISNAN(*d) || (rate < *d)) *d = rate; break;
+				  case CF_MAX: if (TSDB_ISNAN(*d) || (rate > *d)) *d = rate; break;
+				  case CF_LAST: *d = rate; break;
+				}
+				known[row*series->dscount + col] += overlap;
+			}
+		}
+	}
+
+	/* Like RRD's default xff of 0.5: At least half of the interval must be known */
+	for (i = 0; (i < rows * series->dscount); i++) {
+		if (known[i] < (*step / 2.0)) (*data)[i] = tsdb_nan();
+		else if (cfunc == CF_AVERAGE) (*data)[i] /= known[i];
+	}
+
+	points_free(&pts[series->id]);
+	xfree(pts);
+	xfree(known);
+
+	return rows;
+}
+
+void tsdb_forget(char *hostdir)
+{
+	/* Drop our cached series list for a host, e.g. when it is deleted or renamed. NULL drops all hosts. */
+	tsdbhost_t *host;
+	tsdbseries_t *swalk;
+	xtreePos_t handle;
+
+	if (tsdbhosts == NULL) return;
+	if (hostdir == NULL) {
+		while ((handle = xtreeFirst(tsdbhosts)) != xtreeEnd(tsdbhosts)) {
+			tsdb_forget(((tsdbhost_t *)xtreeData(tsdbhosts, handle))->hostdir);
+		}
+		return;
+	}
+
+	handle = xtreeFind(tsdbhosts, hostdir);
+	if (handle == xtreeEnd(tsdbhosts)) return;
+
+	host = (tsdbhost_t *)xtreeData(tsdbhosts, handle);
+	xtreeDelete(tsdbhosts, hostdir);
+
+	xtreeDestroy(host->seriestree);
+	while (host->serieshead) {
+		swalk = host->serieshead;
+		host->serieshead = swalk->next;
+		free_series(swalk);
+	}
+	xfree(host->hostdir);
+	xfree(host);
+}
+
@@ -0,0 +1,49 @@
+/*----------------------------------------------------------------------------*/
+/* Xymon monitor library.                                                     */
+/*                                                                            */
+/* Copyright (C) 2002-2011 Henrik Storner <henrik@storner.dk>                 */
+/*                                                                            */
+/* This program is released under the GNU General Public License (GPL),       */
+/* version 2. See the file "COPYING" for details.                             */
+/*                                                                            */
+/*----------------------------------------------------------------------------*/
+
+#ifndef __TSDB_H__
+#define __TSDB_H__
+
+#include <time.h>
+
+/* The files holding the time-series data for a host, in the host RRD directory */
+#define TSDB_DEFFILE "tsdb.def"
+#define TSDB_DATFILE "tsdb.dat"
+
+typedef enum { TSDB_GAUGE, TSDB_COUNTER, TSDB_DERIVE, TSDB_ABSOLUTE } tsdb_dstype_t;
+
+typedef struct tsdbds_t {
+	char *name;
+	tsdb_dstype_t type;
+	int heartbeat;
+	double minval, maxval;	/* NaN if there is no limit */
+} tsdbds_t;
+
+typedef struct tsdbseries_t {
+	char *name;		/* Same as the RRD filename, e.g. "la.rrd" */
+	int id;
+	int step;
+	int dscount;
+	tsdbds_t *ds;
+	struct tsdbseries_t *next;
+} tsdbseries_t;
+
+extern int tsdb_hasstore(char *hostdir);
+extern tsdbseries_t *tsdb_serieslist(char *hostdir);
+extern tsdbseries_t *tsdb_findseries(char *hostdir, char *name);
+extern int tsdb_define(char *hostdir, char *name, int argc, char **argv, int store);
+extern int tsdb_append(char *hostdir, char *name, char *template, int count, char **values);
+extern int tsdb_fetch(char *hostdir, char *name, char *cf, time_t *start, time_t *end, int *step,
+		      int *dscount, char ***dsnames, double **data);
+extern int tsdb_compact(char *hostdir, time_t now);
+extern void tsdb_forget(char *hostdir);
+
+#endif
+
@@ -62,3 +62,14 @@ unsigned int shbufsz(enum msgchannels_t chnid)
 	return result;
 }
 
+unsigned int shringsz(enum msgchannels_t chnid)
+{
+	/* Size (in kB) of the message ring for a channel: Room for CHANNELRING max-size messages */
+	unsigned int slots = 8;
+	char *v = getenv("CHANNELRING");
+
+	if (v && (atoi(v) >= 2)) slots = atoi(v);
+
+	return slots * shbufsz(chnid);
+}
+
@@ -6,14 +6,16 @@
 /* semaphores.                                                                */
 /*                                                                            */
 /* The concept is to use a shared memory segment for each "channel" that      */
-/* xymond supports. This memory segment is used to pass a single xymond       */
-/* message between the xymond master daemon, and the xymond_channel workers.  */
-/* Two semaphores are used to synchronize between the master daemon and the   */
-/* workers, i.e. the workers wait for a semaphore to go up indicating that a  */
-/* new message has arrived, and the master daemon then waits for the other    */
-/* semaphore to go 0 indicating that the workers have read the message. A     */
-/* third semaphore is used as a simple counter to tell how many workers have  */
-/* attached to a channel.                                                     */
+/* xymond supports. This memory segment holds a ring buffer of messages       */
+/* passed from the xymond master daemon to the xymond_channel workers. The    */
+/* master daemon appends messages to the ring without waiting for anyone;     */
+/* each worker has its own read cursor in the shared memory header. A worker  */
+/* that cannot keep up falls behind, and when the master daemon wraps around  */
+/* and overwrites messages the worker has not yet read, the worker skips      */
+/* ahead and counts the messages it lost. Each worker has a semaphore that it */
+/* sleeps on when the ring is empty; the master daemon only touches it if the */
+/* worker is actually waiting. A separate semaphore is used as a simple       */
+/* counter to tell how many workers have attached to a channel.               */
 /*                                                                            */
 /* Copyright (C) 2004-2011 Henrik Storner <henrik@hswn.dk>                    */
 /*                                                                            */
@@ -34,7 +36,9 @@ static char rcsid[] = "$Id$";
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <stddef.h>
 #include <errno.h>
+#include <signal.h>
 
 #include "libxymon.h"
 
@@ -55,15 +59,102 @@ char *channelnames[C_LAST+1] = {
 	NULL
 };
 
+/* A message in the ring. Records are 8-byte aligned, and never wrap around the end of the ring */
+typedef struct ringrec_t {
+	volatile unsigned int seq;	/* Message sequence number, 0 if the record is invalid */
+	volatile unsigned int len;	/* Length of the message, or RING_WRAPMARK */
+	char data[8];
+} ringrec_t;
+
+#define RING_WRAPMARK 0xFFFFFFFF
+#define RING_RECHDRSZ ((unsigned int)offsetof(ringrec_t, data))
+#define RING_RECSZ(LEN) ((RING_RECHDRSZ + (LEN) + 1 + 7) & ~7U)
+#define RING_HDRSZ ((sizeof(xymond_chanhdr_t) + 63) & ~63UL)
+
+static unsigned int nextseq(unsigned int seq)
+{
+	seq++;
+	return (seq == 0) ? 1 : seq;
+}
+
+static int getshm(key_t key, unsigned int shmsz, int role)
+{
+	int shmid;
+
+	if (role != CHAN_MASTER) return shmget(key, 0, 0);
+
+	shmid = shmget(key, shmsz, IPC_CREAT | 0600);
+	if ((shmid == -1) && (errno == EINVAL)) {
+		/* Left over from an older version, with a different size. Remove it and try again */
+		shmid = shmget(key, 0, 0);
+		if (shmid != -1) shmctl(shmid, IPC_RMID, NULL);
+		shmid = shmget(key, shmsz, IPC_CREAT | 0600);
+	}
+
+	return shmid;
+}
+
+static int getsem(key_t key, int role)
+{
+	int semid;
+
+	if (role != CHAN_MASTER) return semget(key, 0, 0);
+
+	semid = semget(key, 1+CHANNEL_MAXREADERS, IPC_CREAT | 0600);
+	if ((semid == -1) && (errno == EINVAL)) {
+		/* Semaphore set from an older version, with fewer semaphores */
+		semid = semget(key, 0, 0);
+		if (semid != -1) semctl(semid, 0, IPC_RMID);
+		semid = semget(key, 1+CHANNEL_MAXREADERS, IPC_CREAT | 0600);
+	}
+
+	return semid;
+}
+
+static int register_reader(xymond_channel_t *chn)
+{
+	xymond_chanhdr_t *hdr = chn->hdr;
+	pid_t mypid = getpid();
+	int i;
+
+	for (i = 0; (i < CHANNEL_MAXREADERS); i++) {
+		pid_t oldpid = hdr->reader[i].pid;
+
+		/* Take over free slots, and slots left behind by readers that have died */
+		if ((oldpid != 0) && ((kill(oldpid, 0) == 0) || (errno != ESRCH))) continue;
+		if (!__sync_bool_compare_and_swap(&hdr->reader[i].pid, oldpid, mypid)) continue;
+
+		semctl(chn->semid, READERSEM(i), SETVAL, 0);
+		hdr->reader[i].waiting = 0;
+		hdr->reader[i].lost = 0;
+
+		/* Start with the next message posted */
+		do {
+			unsigned int gen = hdr->gen;
+
+			__sync_synchronize();
+			chn->readpos = hdr->writepos;
+			chn->readseq = hdr->nextseq;
+			__sync_synchronize();
+			if ((gen == hdr->gen) && ((gen & 1) == 0)) break;
+		} while (1);
+		hdr->reader[i].seq = chn->readseq;
+
+		return i;
+	}
+
+	return -1;
+}
+
 xymond_channel_t *setup_channel(enum msgchannels_t chnid, int role)
 {
 	key_t key;
 	struct stat st;
 	struct sembuf s;
 	xymond_channel_t *newch;
-	unsigned int bufsz;
-	int flags = ((role == CHAN_MASTER) ? (IPC_CREAT | 0600) : 0);
+	unsigned int bufsz, ringsz;
 	char *xymonhome = xgetenv("XYMONHOME");
+	void *shmaddr;
 
 	if ( (xymonhome == NULL) || (stat(xymonhome, &st) == -1) ) {
 		errprintf("XYMONHOME not defined, or points to invalid directory - cannot continue.\n");
@@ -71,6 +162,7 @@ xymond_channel_t *setup_channel(enum msgchannels_t chnid, int role)
 	}
 
 	bufsz = 1024*shbufsz(chnid);
+	ringsz = 1024*shringsz(chnid);
 	dbgprintf("Setting up %s channel (id=%d)\n", channelnames[chnid], chnid);
 
 	dbgprintf("calling ftok('%s',%d)\n", xymonhome, chnid);
@@ -81,30 +173,33 @@ xymond_channel_t *setup_channel(enum msgchannels_t chnid, int role)
 	}
 	dbgprintf("ftok() returns: 0x%X\n", key);
 
-	newch = (xymond_channel_t *)malloc(sizeof(xymond_channel_t));
+	newch = (xymond_channel_t *)calloc(1, sizeof(xymond_channel_t));
 	newch->seq = 0;
 	newch->channelid = chnid;
 	newch->msgcount = 0;
-	newch->shmid = shmget(key, bufsz, flags);
+	newch->readerid = -1;
+	newch->shmid = getshm(key, RING_HDRSZ + ringsz, role);
 	if (newch->shmid == -1) {
-		errprintf("Could not get shm of size %d: %s\n", bufsz, strerror(errno));
+		errprintf("Could not get shm of size %d: %s\n", RING_HDRSZ + ringsz, strerror(errno));
 		xfree(newch);
 		return NULL;
 	}
 	dbgprintf("shmget() returns: 0x%X\n", newch->shmid);
 
-	newch->channelbuf = (char *) shmat(newch->shmid, NULL, 0);
-	if (newch->channelbuf == (char *)-1) {
+	shmaddr = shmat(newch->shmid, NULL, 0);
+	if (shmaddr == (void *)-1) {
 		errprintf("Could not attach shm %s\n", strerror(errno));
 		if (role == CHAN_MASTER) shmctl(newch->shmid, IPC_RMID, NULL);
 		xfree(newch);
 		return NULL;
 	}
+	newch->hdr = (xymond_chanhdr_t *)shmaddr;
+	newch->ring = (char *)shmaddr + RING_HDRSZ;
 
-	newch->semid = semget(key, 3, flags);
+	newch->semid = getsem(key, role);
 	if (newch->semid == -1) {
 		errprintf("Could not get sem: %s\n", strerror(errno));
-		shmdt(newch->channelbuf);
+		shmdt(shmaddr);
 		if (role == CHAN_MASTER) shmctl(newch->shmid, IPC_RMID, NULL);
 		xfree(newch);
 		return NULL;
@@ -118,7 +213,17 @@ xymond_channel_t *setup_channel(enum msgchannels_t chnid, int role)
 		s.sem_num = CLIENTCOUNT; s.sem_op = +1; s.sem_flg = SEM_UNDO;
 		if (semop(newch->semid, &s, 1) == -1) {
 			errprintf("Could not register presence: %s\n", strerror(errno));
-			shmdt(newch->channelbuf);
+			shmdt(shmaddr);
+			xfree(newch);
+			return NULL;
+		}
+
+		newch->readerid = register_reader(newch);
+		if (newch->readerid == -1) {
+			errprintf("Too many readers on the %s channel (max %d)\n", channelnames[chnid], CHANNEL_MAXREADERS);
+			s.sem_num = CLIENTCOUNT; s.sem_op = -1; s.sem_flg = SEM_UNDO;
+			semop(newch->semid, &s, 1);
+			shmdt(shmaddr);
 			xfree(newch);
 			return NULL;
 		}
@@ -129,17 +234,26 @@ xymond_channel_t *setup_channel(enum msgchannels_t chnid, int role)
 		n = semctl(newch->semid, CLIENTCOUNT, GETVAL);
 		if (n > 0) {
 			errprintf("FATAL: xymond sees clientcount %d, should be 0\nCheck for hanging xymond_channel processes or stale semaphores\n", n);
-			shmdt(newch->channelbuf);
+			shmdt(shmaddr);
 			shmctl(newch->shmid, IPC_RMID, NULL);
 			semctl(newch->semid, 0, IPC_RMID);
 			xfree(newch);
 			return NULL;
 		}
-	}
 
+		/* Start with an empty ring */
+		memset(shmaddr, 0, RING_HDRSZ + ringsz);
+		newch->hdr->ringsize = ringsz;
+		newch->hdr->bufsz = bufsz;
+		newch->hdr->nextseq = 1;
+
+		newch->channelbuf = (char *)malloc(bufsz);
+		*(newch->channelbuf) = '\0';
 #ifdef MEMORY_DEBUG
-	add_to_memlist(newch->channelbuf, bufsz);
+		add_to_memlist(newch->channelbuf, bufsz);
 #endif
+	}
+
 	return newch;
 }
 
@@ -147,13 +261,214 @@ void close_channel(xymond_channel_t *chn, int role)
 {
 	if (chn == NULL) return;
 
-	/* No need to de-register, this happens automatically because we registered with SEM_UNDO */
+	/* No need to de-register the count, this happens automatically because we registered with SEM_UNDO */
+	if ((role == CHAN_CLIENT) && (chn->readerid >= 0)) chn->hdr->reader[chn->readerid].pid = 0;
 
 	if (role == CHAN_MASTER) semctl(chn->semid, 0, IPC_RMID);
 
-	MEMUNDEFINE(chn->channelbuf);
-	shmdt(chn->channelbuf);
-	if (role == CHAN_MASTER) shmctl(chn->shmid, IPC_RMID, NULL);
+	shmdt((void *)chn->hdr);
+	if (role == CHAN_MASTER) {
+		shmctl(chn->shmid, IPC_RMID, NULL);
+		MEMUNDEFINE(chn->channelbuf);
+		xfree(chn->channelbuf);
+	}
+}
+
+int channel_readers(xymond_channel_t *chn)
+{
+	int i, n = 0;
+
+	for (i = 0; (i < CHANNEL_MAXREADERS); i++) if (chn->hdr->reader[i].pid) n++;
+
+	return n;
+}
+
+static void ring_reclaim(xymond_channel_t *chn, unsigned int startpos, unsigned int endpos)
+{
+	/* Invalidate the oldest messages, if they are in the area we are about to overwrite */
+	while (chn->livecount && (chn->tailpos >= startpos) && (chn->tailpos < endpos)) {
+		ringrec_t *rec = (ringrec_t *)(chn->ring + chn->tailpos);
+		unsigned int nextpos = (rec->len == RING_WRAPMARK) ? 0 : (chn->tailpos + RING_RECSZ(rec->len));
+
+		rec->seq = 0;
+		__sync_synchronize();	/* Readers must see it is gone before we write over it */
+		chn->tailpos = nextpos;
+		chn->livecount--;
+	}
+}
+
+void channel_post(xymond_channel_t *chn)
+{
+	/* Append the message in chn->channelbuf to the ring, and wake up any readers waiting for it */
+	xymond_chanhdr_t *hdr = chn->hdr;
+	unsigned int len, need, pos, seq;
+	ringrec_t *rec;
+	int i;
+
+	len = strlen(chn->channelbuf);
+	need = RING_RECSZ(len);
+	pos = hdr->writepos;
+	seq = hdr->nextseq;
+
+	if ((pos + need + RING_RECHDRSZ) > hdr->ringsize) {
+		/*
+		 * No room before the end of the ring. Leave a marker telling readers to continue at the start.
+		 * The messages from here to the end of the ring are the oldest ones, so they all go now.
+		 */
+		ring_reclaim(chn, pos, hdr->ringsize);
+		rec = (ringrec_t *)(chn->ring + pos);
+		rec->len = RING_WRAPMARK;
+		__sync_synchronize();
+		rec->seq = seq;
+		chn->livecount++;
+		pos = 0;
+	}
+
+	ring_reclaim(chn, pos, pos + need);
+	rec = (ringrec_t *)(chn->ring + pos);
+	memcpy(rec->data, chn->channelbuf, len+1);
+	rec->len = len;
+	__sync_synchronize();	/* The message must be complete before it becomes valid */
+	rec->seq = seq;
+	chn->livecount++;
+
+	hdr->gen++;
+	__sync_synchronize();
+	hdr->writepos = pos + need;
+	hdr->nextseq = nextseq(seq);
+	__sync_synchronize();
+	hdr->gen++;
+
+	for (i = 0; (i < CHANNEL_MAXREADERS); i++) {
+		if (hdr->reader[i].pid && hdr->reader[i].waiting && __sync_bool_compare_and_swap(&hdr->reader[i].waiting, 1, 0)) {
+			struct sembuf s;
+
+			s.sem_num = READERSEM(i); s.sem_op = +1; s.sem_flg = 0;
+			semop(chn->semid, &s, 1);
+		}
+	}
+}
+
+static void ring_writerpos(xymond_chanhdr_t *hdr, unsigned int *pos, unsigned int *seq)
+{
+	unsigned int gen;
+
+	do {
+		gen = hdr->gen;
+		__sync_synchronize();
+		*pos = hdr->writepos;
+		*seq = hdr->nextseq;
+		__sync_synchronize();
+	} while ((gen != hdr->gen) || (gen & 1));
+}
+
+int channel_readmsg(xymond_channel_t *chn, char **msgbuf, int headroom, int wait)
+{
+	/*
+	 * Pick up the next message from the ring. The message is copied to a
+	 * new buffer with "headroom" bytes free in front of it.
+	 * Returns the message size; 0 if there is no message (or we were 
+	 * interrupted while waiting for one), -1 on errors.
+	 */
+	xymond_chanhdr_t *hdr = chn->hdr;
+	xymond_chanreader_t *me = &hdr->reader[chn->readerid];
+	unsigned int wpos, wseq;
+
+	*msgbuf = NULL;
+
+	while (1) {
+		ringrec_t *rec = (ringrec_t *)(chn->ring + chn->readpos);
+		unsigned int seq, len;
+
+		seq = rec->seq;
+		__sync_synchronize();
+
+		if (seq == chn->readseq) {
+			len = rec->len;
+
+			if (len == RING_WRAPMARK) {
+				chn->readpos = 0;
+				continue;
+			}
+
+			if (len < hdr->bufsz) {
+				char *buf = (char *)malloc(headroom + len + 1);
+
+				memcpy(buf + headroom, rec->data, len);
+				*(buf + headroom + len) = '\0';
+				__sync_synchronize();
+
+				if (rec->seq == seq) {
+					chn->readpos += RING_RECSZ(len);
+					chn->readseq = nextseq(chn->readseq);
+					me->seq = chn->readseq;
+					*msgbuf = buf;
+					return len;
+				}
+
+				/* Overwritten while we copied it */
+				xfree(buf);
+			}
+		}
+		else {
+			ring_writerpos(hdr, &wpos, &wseq);
+			if (wseq == chn->readseq) {
+				/* Nothing new */
+				struct sembuf s;
+
+				if (!wait) return 0;
+
+				me->waiting = 1;
+				__sync_synchronize();
+
+				/* Check again, something may have been posted before we said we were waiting */
+				ring_writerpos(hdr, &wpos, &wseq);
+				if (wseq != chn->readseq) {
+					me->waiting = 0;
+					continue;
+				}
+
+				s.sem_num = READERSEM(chn->readerid); s.sem_op = -1; s.sem_flg = 0;
+				if (semop(chn->semid, &s, 1) == -1) {
+					if (errno == EINTR) return 0;
+					errprintf("Semaphore wait failed: %s\n", strerror(errno));
+					return -1;
+				}
+				continue;
+			}
+
+			/* Our message may have been posted after we looked at it */
+			__sync_synchronize();
+			if (rec->seq == chn->readseq) continue;
+		}
+
+		/* The writer has lapped us. Skip ahead to the current message */
+		ring_writerpos(hdr, &wpos, &wseq);
+		chn->lostcount += (wseq - chn->readseq);
+		me->lost += (wseq - chn->readseq);
+		chn->readpos = wpos;
+		chn->readseq = wseq;
+		me->seq = chn->readseq;
+	}
+}
+
+void channel_readerstats(xymond_channel_t *chn, int *readers, unsigned int *maxlag, unsigned long *lost)
+{
+	xymond_chanhdr_t *hdr = chn->hdr;
+	int i;
+
+	*readers = 0; *maxlag = 0; *lost = 0;
+	for (i = 0; (i < CHANNEL_MAXREADERS); i++) {
+		unsigned int lag;
+
+		if (hdr->reader[i].pid == 0) continue;
+		if ((kill(hdr->reader[i].pid, 0) == -1) && (errno == ESRCH)) continue;	/* Crashed, slot not re-used yet */
+
+		(*readers)++;
+		lag = (hdr->nextseq - hdr->reader[i].seq);
+		if (lag > *maxlag) *maxlag = lag;
+		*lost += hdr->reader[i].lost;
+	}
 }
 
 int setup_msg_queue(char *ident, int role)
@@ -197,3 +512,115 @@ void close_feedback_queue(int queueid, int role)
 {
 	return close_msg_queue(queueid, role);
 }
+
+#ifdef STANDALONE
+
+/*
+ * Ring test: The master posts messages of varying size through a small
+ * ring, so it wraps many times, while a slow reader checks that every
+ * message it gets is intact. Usage: xymond_ipc [MESSAGECOUNT]
+ */
+
+#include <sys/wait.h>
+
+static void fillmsg(char *buf, unsigned int n)
+{
+	unsigned int len = 64 + ((n * 7919) % 6000), i;
+
+	sprintf(buf, "%u %u ", n, len);
+	for (i = strlen(buf); (i < len); i++) buf[i] = 'a' + ((n + i) % 26);
+	buf[len] = '\0';
+}
+
+static int checkmsg(char *buf, int buflen)
+{
+	unsigned int n, len, i;
+	char *p;
+
+	if (sscanf(buf, "%u %u ", &n, &len) != 2) return 0;
+	if (len != buflen) return 0;
+
+	p = strchr(buf, ' '); p = strchr(p+1, ' ');
+	for (i = (p - buf) + 1; (i < len); i++) if (buf[i] != ('a' + ((n + i) % 26))) return 0;
+
+	return 1;
+}
+
+int main(int argc, char *argv[])
+{
+	char tmpdir[] = "/tmp/xymond_ipc.XXXXXX";
+	xymond_channel_t *master, *reader;
+	unsigned int count = ((argc > 1) ? atoi(argv[1]) : 20000), n, maxlive = 0;
+	pid_t childpid;
+	sigset_t sigs;
+	int sig, status, failed = 0;
+
+	if (mkdtemp(tmpdir) == NULL) { perror("mkdtemp"); return 1; }
+	setenv("XYMONHOME", tmpdir, 1);
+	setenv("CHANNELRING", "2", 1);
+
+	master = setup_channel(C_ENADIS, CHAN_MASTER);
+	if (!master) return 1;
+	printf("Ring size %u bytes, posting %u messages\n", master->hdr->ringsize, count);
+	fflush(stdout);
+
+	/* The reader tells us when it has attached */
+	sigemptyset(&sigs); sigaddset(&sigs, SIGUSR1);
+	sigprocmask(SIG_BLOCK, &sigs, NULL);
+
+	childpid = fork();
+	if (childpid == 0) {
+		unsigned long got = 0, torn = 0;
+		char *buf;
+		int len;
+
+		reader = setup_channel(C_ENADIS, CHAN_CLIENT);
+		if (!reader) exit(1);
+		kill(getppid(), SIGUSR1);
+
+		while ((len = channel_readmsg(reader, &buf, 0, 1)) > 0) {
+			if (strcmp(buf, "done") == 0) { xfree(buf); break; }
+
+			got++;
+			if (!checkmsg(buf, len)) torn++;
+			xfree(buf);
+			usleep(((got % 100) == 0) ? 2000 : 20);	/* A slow reader */
+		}
+
+		printf("Reader: %lu messages, %lu lost, %lu torn\n", got, reader->lostcount, torn);
+		close_channel(reader, CHAN_CLIENT);
+		exit(torn ? 1 : 0);
+	}
+	sigwait(&sigs, &sig);
+
+	for (n = 1; (n <= count); n++) {
+		fillmsg(master->channelbuf, n);
+		channel_post(master);
+		if (master->livecount > maxlive) maxlive = master->livecount;
+		if ((n % 50) == 0) usleep(100);
+	}
+
+	printf("Master: at most %u messages live, tail at %u\n", maxlive, master->tailpos);
+	if (maxlive > (master->hdr->ringsize / RING_RECSZ(64))) {
+		printf("FAILED: More live messages than the ring can hold\n");
+		failed = 1;
+	}
+
+	/* A lapped reader skips ahead, and may skip the end-marker too */
+	do {
+		strcpy(master->channelbuf, "done");
+		channel_post(master);
+		usleep(10000);
+	} while (waitpid(childpid, &status, WNOHANG) == 0);
+	if (!WIFEXITED(status) || (WEXITSTATUS(status) != 0)) {
+		printf("FAILED: Reader got damaged messages\n");
+		failed = 1;
+	}
+
+	close_channel(master, CHAN_MASTER);
+	rmdir(tmpdir);
+
+	if (!failed) printf("OK\n");
+	return failed;
+}
+#endif
@@ -11,23 +11,63 @@
 #ifndef __XYMOND_IPC_H__
 #define __XYMOND_IPC_H__
 
+#include <sys/types.h>
+
 #include "xymond_buffer.h"
 
 /* Semaphore numbers */
-#define BOARDBUSY   0
-#define GOCLIENT    1
-#define CLIENTCOUNT 2
+#define CLIENTCOUNT 0
+#define READERSEM(N) (1+(N))
 
 #define CHAN_MASTER 0
 #define CHAN_CLIENT 1
 
+/*
+ * Layout of the shared memory segment for a channel: A header, followed
+ * by a ring buffer holding the messages. The ring is written only by
+ * xymond; each reader has its own cursor, so a slow reader falls behind
+ * (and eventually loses messages) without holding up xymond.
+ */
+#define CHANNEL_MAXREADERS 32
+
+/*
+ * When xymond_channel runs with "--batch", each message passed on to the
+ * worker module is preceded by a fixed-size frame header holding the
+ * length of the message (including the "\n@@\n" end-marker) in hex.
+ * The worker can then pick out the message without scanning for the marker.
+ */
+#define CHANNEL_FRAMEHDR "@@>%08x\n"
+#define CHANNEL_FRAMEHDRSZ 12
+
+typedef struct xymond_chanreader_t {
+	volatile pid_t pid;		/* 0 if the slot is free */
+	volatile int waiting;		/* Reader is (about to go) asleep on its semaphore */
+	volatile unsigned int seq;	/* Next message the reader will pick up */
+	volatile unsigned int lost;	/* Messages lost because the reader was too slow */
+} xymond_chanreader_t;
+
+typedef struct xymond_chanhdr_t {
+	unsigned int ringsize;		/* Bytes in the ring */
+	unsigned int bufsz;		/* Max size of a single message */
+	volatile unsigned int gen;	/* Odd while writepos/nextseq are being updated */
+	volatile unsigned int writepos;	/* Where the next message goes */
+	volatile unsigned int nextseq;	/* Sequence number of the next message */
+	xymond_chanreader_t reader[CHANNEL_MAXREADERS];
+} xymond_chanhdr_t;
+
 typedef struct xymond_channel_t {
 	enum msgchannels_t channelid;
 	int shmid;
 	int semid;
-	char *channelbuf;
+	char *channelbuf;		/* Master: Where posttochannel() builds the message */
 	unsigned int seq;
 	unsigned long msgcount;
+	xymond_chanhdr_t *hdr;
+	char *ring;
+	unsigned int tailpos, livecount;	/* Master: Oldest message still in the ring */
+	int readerid;				/* Client: Our slot in hdr->reader[] */
+	unsigned int readpos, readseq;		/* Client: Our cursor */
+	unsigned long lostcount;
 	struct xymond_channel_t *next;
 } xymond_channel_t;
 
@@ -35,6 +75,10 @@ extern char *channelnames[];
 
 extern xymond_channel_t *setup_channel(enum msgchannels_t chnname, int role);
 extern void close_channel(xymond_channel_t *chn, int role);
+extern int channel_readers(xymond_channel_t *chn);
+extern void channel_post(xymond_channel_t *chn);
+extern int channel_readmsg(xymond_channel_t *chn, char **msgbuf, int headroom, int wait);
+extern void channel_readerstats(xymond_channel_t *chn, int *readers, unsigned int *maxlag, unsigned long *lost);
 
 extern int setup_msg_queue(char *ident, int role);
 extern void close_msg_queue(int queueid, int role);
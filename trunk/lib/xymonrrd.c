@@ -13,12 +13,17 @@
 
 static char rcsid[] = "$Id$";
 
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 #include <ctype.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 #include <stdio.h>
 #include <time.h>
+#include <fcntl.h>
+#include <limits.h>
 
 #include "libxymon.h"
 #include "version.h"
@@ -363,3 +368,299 @@ rrdtpldata_t *setup_template(char *params[])
 }
 
 
+
+
+/*
+ * Reading the RRD files directly. This follows the on-disk format from
+ * rrd_format.h in RRDtool, which is the native memory layout of these
+ * structures, so files created on another architecture are rejected
+ * through the float cookie check. Many RRD files share the same layout
+ * (e.g. all of the disk files), so the parsed layouts are cached and
+ * shared by all files with identical headers.
+ */
+#define RRD_FLOAT_COOKIE 8.642135E130
+
+typedef union { unsigned long u_cnt; double u_val; } rrdunival_t;
+typedef struct { char cookie[4]; char version[5]; double float_cookie;
+		 unsigned long ds_cnt, rra_cnt, pdp_step; rrdunival_t par[10]; } rrdstathead_t;
+typedef struct { char ds_nam[20]; char dst[20]; rrdunival_t par[10]; } rrddsdef_t;
+typedef struct { char cf_nam[20]; unsigned long row_cnt, pdp_cnt; rrdunival_t par[10]; } rrdradef_t;
+typedef struct { time_t last_up; long last_up_usec; } rrdlivehead_t;
+typedef struct { char last_ds[30]; rrdunival_t scratch[10]; } rrdpdpprep_t;
+typedef struct { rrdunival_t scratch[10]; } rrdcdpprep_t;
+
+typedef struct rrdlayout_t {
+	char *key;
+	unsigned long dscount, rracount, pdpstep;
+	char **dsnames;
+	char **rracf;
+	unsigned long *rowcount, *pdpcount;
+	size_t liveofs, rraptrofs, *rraofs, filesize;
+} rrdlayout_t;
+
+static void *rrdlayouts = NULL;
+
+static rrdlayout_t *rrd_layout(unsigned char *map, size_t mapsize)
+{
+	rrdstathead_t *sh = (rrdstathead_t *)map;
+	rrddsdef_t *ds;
+	rrdradef_t *ra;
+	rrdlayout_t *layout;
+	strbuffer_t *key;
+	xtreePos_t handle;
+	char buf[100];
+	unsigned long i;
+	size_t ofs;
+
+	if ((mapsize < sizeof(rrdstathead_t)) || (memcmp(sh->cookie, "RRD", 4) != 0) || (sh->float_cookie != RRD_FLOAT_COOKIE)) return NULL;
+	if ((sh->ds_cnt == 0) || (sh->rra_cnt == 0) || (sh->ds_cnt > 10000) || (sh->rra_cnt > 10000)) return NULL;
+	if (mapsize < (sizeof(rrdstathead_t) + sh->ds_cnt*sizeof(rrddsdef_t) + sh->rra_cnt*sizeof(rrdradef_t))) return NULL;
+
+	ds = (rrddsdef_t *)(map + sizeof(rrdstathead_t));
+	ra = (rrdradef_t *)(map + sizeof(rrdstathead_t) + sh->ds_cnt*sizeof(rrddsdef_t));
+
+	key = newstrbuffer(0);
+	sprintf(buf, "%.4s|%lu|", sh->version, sh->pdp_step);
+	addtobuffer(key, buf);
+	for (i = 0; (i < sh->ds_cnt); i++) {
+		sprintf(buf, "%.19s:%.19s,", ds[i].ds_nam, ds[i].dst);
+		addtobuffer(key, buf);
+	}
+	for (i = 0; (i < sh->rra_cnt); i++) {
+		sprintf(buf, "|%.19s:%lu:%lu", ra[i].cf_nam, ra[i].row_cnt, ra[i].pdp_cnt);
+		addtobuffer(key, buf);
+	}
+
+	if (rrdlayouts == NULL) rrdlayouts = xtreeNew(strcmp);
+	handle = xtreeFind(rrdlayouts, STRBUF(key));
+	if (handle != xtreeEnd(rrdlayouts)) {
+		freestrbuffer(key);
+		layout = (rrdlayout_t *)xtreeData(rrdlayouts, handle);
+		return ((mapsize >= layout->filesize) ? layout : NULL);
+	}
+
+	layout = (rrdlayout_t *)calloc(1, sizeof(rrdlayout_t));
+	layout->key = grabstrbuffer(key);
+	layout->dscount = sh->ds_cnt;
+	layout->rracount = sh->rra_cnt;
+	layout->pdpstep = sh->pdp_step;
+	layout->dsnames = (char **)malloc(sh->ds_cnt * sizeof(char *));
+	for (i = 0; (i < sh->ds_cnt); i++) {
+		layout->dsnames[i] = (char *)malloc(20);
+		strncpy(layout->dsnames[i], ds[i].ds_nam, 19); layout->dsnames[i][19] = '\0';
+	}
+	layout->rracf = (char **)malloc(sh->rra_cnt * sizeof(char *));
+	layout->rowcount = (unsigned long *)malloc(sh->rra_cnt * sizeof(unsigned long));
+	layout->pdpcount = (unsigned long *)malloc(sh->rra_cnt * sizeof(unsigned long));
+	layout->rraofs = (size_t *)malloc(sh->rra_cnt * sizeof(size_t));
+	for (i = 0; (i < sh->rra_cnt); i++) {
+		layout->rracf[i] = (char *)malloc(20);
+		strncpy(layout->rracf[i], ra[i].cf_nam, 19); layout->rracf[i][19] = '\0';
+		layout->rowcount[i] = ra[i].row_cnt;
+		layout->pdpcount[i] = ra[i].pdp_cnt;
+	}
+
+	ofs = sizeof(rrdstathead_t) + sh->ds_cnt*sizeof(rrddsdef_t) + sh->rra_cnt*sizeof(rrdradef_t);
+	layout->liveofs = ofs;
+	/* Version 0001 and 0002 files only have the timestamp in the live header */
+	ofs += ((atoi(sh->version) >= 3) ? sizeof(rrdlivehead_t) : sizeof(time_t));
+	ofs += sh->ds_cnt*sizeof(rrdpdpprep_t) + sh->rra_cnt*sh->ds_cnt*sizeof(rrdcdpprep_t);
+	layout->rraptrofs = ofs;
+	ofs += sh->rra_cnt*sizeof(unsigned long);
+	for (i = 0; (i < sh->rra_cnt); i++) {
+		layout->rraofs[i] = ofs;
+		ofs += layout->rowcount[i] * layout->dscount * sizeof(double);
+	}
+	layout->filesize = ofs;
+
+	xtreeAdd(rrdlayouts, layout->key, layout);
+
+	return ((mapsize >= layout->filesize) ? layout : NULL);
+}
+
+static unsigned char *rrd_map(char *filename, size_t *mapsize)
+{
+	struct stat st;
+	unsigned char *map;
+	int fd;
+
+	fd = open(filename, O_RDONLY);
+	if (fd == -1) return NULL;
+	if ((fstat(fd, &st) == -1) || (st.st_size == 0)) { close(fd); return NULL; }
+
+	map = (unsigned char *)mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) return NULL;
+
+	*mapsize = st.st_size;
+	return map;
+}
+
+static int rrd_fetchone(char *filename, xymonrrdfetch_t *item, char *cf, time_t start, time_t end, int step)
+{
+	/* Works like rrd_fetch(), including the choice of RRA */
+	unsigned char *map;
+	size_t mapsize;
+	rrdlayout_t *layout;
+	time_t lastup, calstart, calend, rraend, t;
+	unsigned long rrastep, currow, i;
+	long stepdiff, bestfulldiff = 0, bestpartdiff = 0, match, bestmatch = 0;
+	int bestfull = -1, bestpart = -1, chosen, row;
+	double nanval = strtod("NAN", NULL);
+
+	map = rrd_map(filename, &mapsize);
+	if (!map) return -1;
+
+	layout = rrd_layout(map, mapsize);
+	if (!layout) {
+		errprintf("%s is not an RRD file, or from another architecture\n", filename);
+		munmap(map, mapsize);
+		return -1;
+	}
+
+	memcpy(&lastup, map + layout->liveofs, sizeof(time_t));
+	if (step <= 0) step = 1;
+
+	for (i = 0; (i < layout->rracount); i++) {
+		if (strcmp(layout->rracf[i], cf) != 0) continue;
+
+		rrastep = layout->pdpcount[i] * layout->pdpstep;
+		calend = lastup - (lastup % rrastep);
+		calstart = calend - (rrastep * layout->rowcount[i]);
+		stepdiff = labs((long)step - (long)rrastep);
+
+		if (calstart <= start) {
+			if ((bestfull == -1) || (stepdiff < bestfulldiff)) {
+				bestfull = i;
+				bestfulldiff = stepdiff;
+			}
+		}
+		else {
+			match = (end - start) - (calstart - start);
+			if ((bestpart == -1) || (bestmatch < match) || ((bestmatch == match) && (stepdiff < bestpartdiff))) {
+				bestpart = i;
+				bestmatch = match;
+				bestpartdiff = stepdiff;
+			}
+		}
+	}
+	chosen = ((bestfull != -1) ? bestfull : bestpart);
+	if (chosen == -1) {
+		munmap(map, mapsize);
+		return -1;
+	}
+
+	rrastep = layout->pdpcount[chosen] * layout->pdpstep;
+	start -= (start % rrastep);
+	if (end % rrastep) end += (rrastep - (end % rrastep));
+	if (end <= start) end = start + rrastep;
+
+	item->start = start;
+	item->end = end;
+	item->step = rrastep;
+	item->rows = (end - start) / rrastep;
+	item->dscount = layout->dscount;
+	item->dsnames = (char **)malloc(layout->dscount * sizeof(char *));
+	for (i = 0; (i < layout->dscount); i++) item->dsnames[i] = strdup(layout->dsnames[i]);
+	item->data = (double *)malloc(item->rows * layout->dscount * sizeof(double));
+
+	/* The newest row (cur_row) is for the step ending at the last update */
+	memcpy(&currow, map + layout->rraptrofs + chosen*sizeof(unsigned long), sizeof(unsigned long));
+	rraend = lastup - (lastup % rrastep);
+	for (row = 0; (row < item->rows); row++) {
+		double *dest = item->data + row*layout->dscount;
+		unsigned long back, idx;
+
+		t = start + (row+1)*rrastep;
+		back = (rraend - t) / rrastep;
+		if ((t > rraend) || (back >= layout->rowcount[chosen])) {
+			for (i = 0; (i < layout->dscount); i++) dest[i] = nanval;
+			continue;
+		}
+
+		idx = (currow + layout->rowcount[chosen] - back) % layout->rowcount[chosen];
+		memcpy(dest, map + layout->rraofs[chosen] + idx*layout->dscount*sizeof(double), layout->dscount*sizeof(double));
+	}
+
+	munmap(map, mapsize);
+	return 0;
+}
+
+int xymonrrd_fetch(char *hostdir, xymonrrdfetch_t *items, int count, char *cf, time_t start, time_t end, int step)
+{
+	/*
+	 * Fetch the data for a time period from a set of RRD files for a host,
+	 * like rrd_fetch() does for one file. Datasets stored by the "tsdb"
+	 * backend of xymond_rrd are fetched from there. Row N of an item holds
+	 * the data for the interval (start + N*step, start + (N+1)*step], where
+	 * start and step are adjusted per item to the chosen RRA.
+	 * Returns the number of items where data was found.
+	 */
+	char fn[PATH_MAX];
+	int i, found = 0, havetsdb = -1;
+
+	for (i = 0; (i < count); i++) {
+		xymonrrdfetch_t *item = &items[i];
+
+		item->rows = -1;
+		item->dscount = 0;
+		item->dsnames = NULL;
+		item->data = NULL;
+
+		snprintf(fn, sizeof(fn), "%s/%s", hostdir, item->rrdfn);
+		if (rrd_fetchone(fn, item, cf, start, end, step) == 0) {
+			found++;
+			continue;
+		}
+
+		if (havetsdb == -1) havetsdb = tsdb_hasstore(hostdir);
+		if (havetsdb && tsdb_findseries(hostdir, item->rrdfn)) {
+			item->start = start;
+			item->end = end;
+			item->step = step;
+			item->rows = tsdb_fetch(hostdir, item->rrdfn, cf, &item->start, &item->end, &item->step,
+						&item->dscount, &item->dsnames, &item->data);
+			if (item->rows >= 0) found++;
+		}
+	}
+
+	return found;
+}
+
+void xymonrrd_fetchfree(xymonrrdfetch_t *items, int count)
+{
+	int i, j;
+
+	for (i = 0; (i < count); i++) {
+		for (j = 0; (j < items[i].dscount); j++) xfree(items[i].dsnames[j]);
+		if (items[i].dsnames) xfree(items[i].dsnames);
+		if (items[i].data) xfree(items[i].data);
+		items[i].dsnames = NULL;
+		items[i].data = NULL;
+		items[i].dscount = 0;
+	}
+}
+
+time_t xymonrrd_lastupdate(char *filename)
+{
+	/*
+	 * The time of the last update of an RRD file. Unlike the file timestamp,
+	 * this is also right with RRDtool versions that use mmap'ed I/O.
+	 */
+	unsigned char *map;
+	size_t mapsize;
+	rrdlayout_t *layout;
+	time_t lastup = 0;
+	struct stat st;
+
+	map = rrd_map(filename, &mapsize);
+	if (map) {
+		layout = rrd_layout(map, mapsize);
+		if (layout) memcpy(&lastup, map + layout->liveofs, sizeof(time_t));
+		munmap(map, mapsize);
+	}
+
+	if ((lastup == 0) && (stat(filename, &st) == 0)) lastup = st.st_mtime;
+
+	return lastup;
+}
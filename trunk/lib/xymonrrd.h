@@ -43,6 +43,17 @@ typedef struct rrdtplnames_t {
 	int idx;
 } rrdtplnames_t;
 
+/* This is for reading data from a batch of RRD files, see xymonrrd_fetch() */
+typedef struct xymonrrdfetch_t {
+	char *rrdfn;		/* The file to read, relative to the host directory */
+	int rows;		/* Number of rows, -1 if no data could be read */
+	time_t start, end;
+	int step;
+	int dscount;
+	char **dsnames;
+	double *data;		/* rows*dscount values, NaN if unknown */
+} xymonrrdfetch_t;
+
 
 extern xymonrrd_t *xymonrrds;
 extern xymongraph_t *xymongraphs;
@@ -54,6 +65,9 @@ extern char *xymon_graph_data(char *hostname, char *dispname, char *service, int
 		hg_stale_rrds_t nostale, hg_link_t wantmeta, int locatorbased,
 		time_t starttime, time_t endtime);
 extern rrdtpldata_t *setup_template(char *params[]);
+extern int xymonrrd_fetch(char *hostdir, xymonrrdfetch_t *items, int count, char *cf, time_t start, time_t end, int step);
+extern void xymonrrd_fetchfree(xymonrrdfetch_t *items, int count);
+extern time_t xymonrrd_lastupdate(char *filename);
 
 #endif
 
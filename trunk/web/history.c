@@ -718,32 +718,34 @@ int main(int argc, char *argv[])
 
 	/*
 	 * Collect data for the color-bars and summaries. Multiple scans over the history file,
-	 * but doing it all in one go would be hideously complex.
+	 * but doing it all in one go would be hideously complex. The daily rollups are no help
+	 * here: The color-bars need every status in the period, and the summaries come for free
+	 * with that.
 	 */
 	if (barsums & BARSUM_1D) {
-		parse_historyfile(fd, &repinfo1d, NULL, NULL, start1d, req_endtime, 1, reportwarnlevel, reportgreenlevel, reportwarnstops, NULL);
+		parse_historyfile(fd, histlogfn, &repinfo1d, NULL, NULL, start1d, req_endtime, 1, reportwarnlevel, reportgreenlevel, reportwarnstops, NULL);
 		log1d = save_replogs();
 	}
 
 	if (barsums & BARSUM_1W) {
-		parse_historyfile(fd, &repinfo1w, NULL, NULL, start1w, req_endtime, 1, reportwarnlevel, reportgreenlevel, reportwarnstops, NULL);
+		parse_historyfile(fd, histlogfn, &repinfo1w, NULL, NULL, start1w, req_endtime, 1, reportwarnlevel, reportgreenlevel, reportwarnstops, NULL);
 		log1w = save_replogs();
 	}
 
 	if (barsums & BARSUM_4W) {
-		parse_historyfile(fd, &repinfo4w, NULL, NULL, start4w, req_endtime, 1, reportwarnlevel, reportgreenlevel, reportwarnstops, NULL);
+		parse_historyfile(fd, histlogfn, &repinfo4w, NULL, NULL, start4w, req_endtime, 1, reportwarnlevel, reportgreenlevel, reportwarnstops, NULL);
 		log4w = save_replogs();
 	}
 
 	if (barsums & BARSUM_1Y) {
-		parse_historyfile(fd, &repinfo1y, NULL, NULL, start1y, req_endtime, 1, reportwarnlevel, reportgreenlevel, reportwarnstops, NULL);
+		parse_historyfile(fd, histlogfn, &repinfo1y, NULL, NULL, start1y, req_endtime, 1, reportwarnlevel, reportgreenlevel, reportwarnstops, NULL);
 		log1y = save_replogs();
 	}
 
 	if (entrycount == 0) {
 		/* All entries - just rewind the history file and do all of them */
 		rewind(fd);
-		parse_historyfile(fd, &dummyrep, NULL, NULL, 0, getcurrenttime(NULL), 1, reportwarnlevel, reportgreenlevel, reportwarnstops, NULL);
+		parse_historyfile(fd, histlogfn, &dummyrep, NULL, NULL, 0, getcurrenttime(NULL), 1, reportwarnlevel, reportgreenlevel, reportwarnstops, NULL);
 		fclose(fd);
 	}
 	else {
@@ -752,7 +754,7 @@ int main(int argc, char *argv[])
 		sprintf(tailcmd, "tail -%d %s", entrycount, histlogfn);
 		fd = popen(tailcmd, "r");
 		if (fd == NULL) errormsg("Cannot run tail on the histfile");
-		parse_historyfile(fd, &dummyrep, NULL, NULL, 0, getcurrenttime(NULL), 1, reportwarnlevel, reportgreenlevel, reportwarnstops, NULL);
+		parse_historyfile(fd, NULL, &dummyrep, NULL, NULL, 0, getcurrenttime(NULL), 1, reportwarnlevel, reportgreenlevel, reportwarnstops, NULL);
 		pclose(fd);
 	}
 
@@ -20,7 +20,6 @@ static char rcsid[] = "$Id$";
 #include <math.h>
 #include <dirent.h>
 
-#include <rrd.h>
 #include <pcre.h>
 
 #include "libxymon.h"
@@ -87,40 +86,46 @@ static void parse_query(void)
 }
 
 
-int oneset(char *hostname, char *rrdname, char *starttime, char *endtime, char *colname, double subfrom, char *dsdescr)
+typedef struct perfset_t {
+	char *colname;
+	double subfrom;
+	char *dsdescr;
+} perfset_t;
+
+static time_t rrdtime(char *tday, char *thm)
+{
+	/* Convert the YYYYMMDD and HH:MM:SS strings to a timestamp */
+	struct tm tm;
+	int year, month, day, hour = 0, min = 0, sec = 0;
+
+	memset(&tm, 0, sizeof(tm));
+	if (sscanf(tday, "%4d%2d%2d", &year, &month, &day) != 3) return 0;
+	if (thm) sscanf(thm, "%d:%d:%d", &hour, &min, &sec);
+
+	tm.tm_year = year - 1900; tm.tm_mon = month - 1; tm.tm_mday = day;
+	tm.tm_hour = hour; tm.tm_min = min; tm.tm_sec = sec;
+	tm.tm_isdst = -1;
+
+	return mktime(&tm);
+}
+
+int oneset(char *hostname, xymonrrdfetch_t *item, char *colname, double subfrom, char *dsdescr)
 {
 	static int firsttime = 1;
-	time_t start, end, t;
-	unsigned long step;
-	unsigned long dscount;
-	char **dsnames;
-	rrd_value_t *data;
+	char *rrdname = item->rrdfn;
+	time_t t;
 	int columnindex;
 	char tstamp[30];
 	int dataindex, rowcount, havemin, havemax, missingdata;
 	double sum, min = 0.0, max = 0.0, val;
 
-	char *rrdargs[10];
-	int result;
-
-	rrdargs[0] = "rrdfetch";
-	rrdargs[1] = rrdname;
-	rrdargs[2] = "AVERAGE";
-	rrdargs[3] = "-s"; rrdargs[4] = starttimedate; rrdargs[5] = starttimehm;
-	rrdargs[6] = "-e"; rrdargs[7] = endtimedate; rrdargs[8] = endtimehm;
-	rrdargs[9] = NULL;
-
-	optind = opterr = 0; rrd_clear_error();
-	result = rrd_fetch(9, rrdargs,
-			   &start, &end, &step, &dscount, &dsnames, &data);
-
-	if (result != 0) {
-		errprintf("RRD error: %s\n", rrd_get_error());
+	if (item->rows < 0) {
+		errprintf("RRD error: Cannot read %s\n", rrdname);
 		return 1;
 	}
 
-	for (columnindex=0; ((columnindex < dscount) && strcmp(dsnames[columnindex], colname)); columnindex++) ;
-	if (columnindex == dscount) {
+	for (columnindex=0; ((columnindex < item->dscount) && strcmp(item->dsnames[columnindex], colname)); columnindex++) ;
+	if (columnindex == item->dscount) {
 		errprintf("RRD error: Cannot find column %s\n", colname);
 		return 1;
 	}
@@ -151,13 +156,13 @@ int oneset(char *hostname, char *rrdname, char *starttime, char *endtime, char *
 		break;
 	}
 
-	for (t=start+step, dataindex=columnindex, missingdata=0; (t <= end); t += step, dataindex += dscount) {
-		if (isnan(data[dataindex]) || isnan(-data[dataindex])) {
+	for (t=item->start+item->step, dataindex=columnindex, missingdata=0; ((t <= item->end) && (dataindex < item->rows*item->dscount)); t += item->step, dataindex += item->dscount) {
+		if (isnan(item->data[dataindex]) || isnan(-item->data[dataindex])) {
 			missingdata++;
 			continue;
 		}
 
-		val = (subfrom != 0) ?  subfrom - data[dataindex] : data[dataindex];
+		val = (subfrom != 0) ?  subfrom - item->data[dataindex] : item->data[dataindex];
 
 		strftime(tstamp, sizeof(tstamp), "%Y%m%d%H%M%S", localtime(&t));
 
@@ -204,76 +209,152 @@ int oneset(char *hostname, char *rrdname, char *starttime, char *endtime, char *
 }
 
 
+static int addset(xymonrrdfetch_t **items, perfset_t **sets, int *count, int *size,
+		  char *rrdname, char *colname, double subfrom, char *dsdescr)
+{
+	if (*count == *size) {
+		*size += 20;
+		*items = (xymonrrdfetch_t *)realloc(*items, (*size)*sizeof(xymonrrdfetch_t));
+		*sets = (perfset_t *)realloc(*sets, (*size)*sizeof(perfset_t));
+	}
+
+	memset(&(*items)[*count], 0, sizeof(xymonrrdfetch_t));
+	(*items)[*count].rrdfn = strdup(rrdname);
+	(*sets)[*count].colname = colname;
+	(*sets)[*count].subfrom = subfrom;
+	(*sets)[*count].dsdescr = (dsdescr ? strdup(dsdescr) : NULL);
+	(*count)++;
+
+	return 0;
+}
+
+static int haveset(char *hostdir, int havetsdb, char *rrdname)
+{
+	struct stat st;
+	char fn[PATH_MAX];
+
+	snprintf(fn, sizeof(fn), "%s/%s", hostdir, rrdname);
+	if ((stat(fn, &st) == 0) && S_ISREG(st.st_mode)) return 1;
+
+	return (havetsdb && tsdb_findseries(hostdir, rrdname));
+}
+
+static void adddiskset(xymonrrdfetch_t **items, perfset_t **sets, int *count, int *size, char *hostname, char *rrdname)
+{
+	if (strcmp(rrdname, "disk,root.rrd") == 0) {
+		addset(items, sets, count, size, rrdname, "pct", 0, "/");
+	}
+	else {
+		char *fsnam = strdup(rrdname+4);
+		char *p;
+
+		while ((p = strchr(fsnam, ',')) != NULL) *p = '/';
+		p = fsnam + strlen(fsnam) - 4; *p = '\0';
+		dbgprintf("Processing set %s for host %s from %s\n", rrdname, hostname, fsnam);
+		addset(items, sets, count, size, rrdname, "pct", 0, fsnam);
+		xfree(fsnam);
+	}
+}
+
 int onehost(char *hostname, char *starttime, char *endtime)
 {
+	char hostdir[PATH_MAX];
 	struct stat st;
 	DIR *d;
 	struct dirent *de;
+	xymonrrdfetch_t *items = NULL;
+	perfset_t *sets = NULL;
+	int count = 0, size = 0, havetsdb, i;
+	time_t start, end;
 
-	if ((chdir(xgetenv("XYMONRRDS")) == -1) || (chdir(hostname) == -1)) {
+	snprintf(hostdir, sizeof(hostdir), "%s/%s", xgetenv("XYMONRRDS"), hostname);
+	if ((stat(hostdir, &st) == -1) || !S_ISDIR(st.st_mode)) {
 		errprintf("Cannot cd to %s/%s\n", xgetenv("XYMONRRDS"), hostname);
 		return 1;
 	}
+	havetsdb = tsdb_hasstore(hostdir);
 
 	if (customrrd && customds) {
-		if (stat(customrrd, &st) != 0) return 1;
-
-		oneset(hostname, customrrd, starttime, endtime, customds, 0, customds);
-		return 0;
-	}
+		if (!haveset(hostdir, havetsdb, customrrd)) return 1;
 
-	/* 
-	 * CPU busy data - use vmstat.rrd if it is there, 
-	 * if not then assume it's a Windows box and report the la.rrd data.
-	 */
-	if (stat("vmstat.rrd", &st) == 0) {
-		oneset(hostname, "vmstat.rrd", starttime, endtime, "cpu_idl", 100, "pctbusy");
+		addset(&items, &sets, &count, &size, customrrd, customds, 0, customds);
 	}
 	else {
-		/* No vmstat data, so use the la.rrd file */
-		oneset(hostname, "la.rrd", starttime, endtime, "la", 0, "pctbusy");
-	}
+		tsdbseries_t *swalk;
+
+		/* 
+		 * CPU busy data - use vmstat.rrd if it is there, 
+		 * if not then assume it's a Windows box and report the la.rrd data.
+		 */
+		if (haveset(hostdir, havetsdb, "vmstat.rrd")) {
+			addset(&items, &sets, &count, &size, "vmstat.rrd", "cpu_idl", 100, "pctbusy");
+		}
+		else {
+			/* No vmstat data, so use the la.rrd file */
+			addset(&items, &sets, &count, &size, "la.rrd", "la", 0, "pctbusy");
+		}
 
-	/*
-	 * Report all memory data - it depends on the OS of the host which one
-	 * really is interesting (memory.actual.rrd for Linux, memory.real.rrd for
-	 * most of the other systems).
-	 */
-	if (stat("memory.actual.rrd", &st) == 0) {
-		oneset(hostname, "memory.actual.rrd", starttime, endtime, "realmempct", 0, "Virtual");
-	}
-	if (stat("memory.real.rrd", &st) == 0) {
-		oneset(hostname, "memory.real.rrd", starttime, endtime, "realmempct", 0, "RAM");
-	}
-	if (stat("memory.swap.rrd", &st) == 0) {
-		oneset(hostname, "memory.swap.rrd", starttime, endtime, "realmempct", 0, "Swap");
-	}
+		/*
+		 * Report all memory data - it depends on the OS of the host which one
+		 * really is interesting (memory.actual.rrd for Linux, memory.real.rrd for
+		 * most of the other systems).
+		 */
+		if (haveset(hostdir, havetsdb, "memory.actual.rrd")) {
+			addset(&items, &sets, &count, &size, "memory.actual.rrd", "realmempct", 0, "Virtual");
+		}
+		if (haveset(hostdir, havetsdb, "memory.real.rrd")) {
+			addset(&items, &sets, &count, &size, "memory.real.rrd", "realmempct", 0, "RAM");
+		}
+		if (haveset(hostdir, havetsdb, "memory.swap.rrd")) {
+			addset(&items, &sets, &count, &size, "memory.swap.rrd", "realmempct", 0, "Swap");
+		}
+
+		/*
+		 * Report data for all filesystems.
+		 */
+		d = opendir(hostdir);
+		while (d && ((de = readdir(d)) != NULL)) {
+			char fn[PATH_MAX];
 
-	/*
-	 * Report data for all filesystems.
-	 */
-	d = opendir(".");
-	while ((de = readdir(d)) != NULL) {
-		if (strncmp(de->d_name, "disk,", 5) != 0) continue;
+			if (strncmp(de->d_name, "disk,", 5) != 0) continue;
 
-		stat(de->d_name, &st);
-		if (!S_ISREG(st.st_mode)) continue;
+			if (snprintf(fn, sizeof(fn), "%s/%s", hostdir, de->d_name) >= sizeof(fn)) continue;
+			if ((stat(fn, &st) != 0) || !S_ISREG(st.st_mode)) continue;
 
-		if (strcmp(de->d_name, "disk,root.rrd") == 0) {
-			oneset(hostname, de->d_name, starttime, endtime, "pct", 0, "/");
+			adddiskset(&items, &sets, &count, &size, hostname, de->d_name);
 		}
-		else {
-			char *fsnam = strdup(de->d_name+4);
-			char *p;
-
-			while ((p = strchr(fsnam, ',')) != NULL) *p = '/';
-			p = fsnam + strlen(fsnam) - 4; *p = '\0';
-			dbgprintf("Processing set %s for host %s from %s\n", de->d_name, hostname, fsnam);
-			oneset(hostname, de->d_name, starttime, endtime, "pct", 0, fsnam);
-			xfree(fsnam);
+		if (d) closedir(d);
+
+		for (swalk = (havetsdb ? tsdb_serieslist(hostdir) : NULL); (swalk); swalk = swalk->next) {
+			char fn[PATH_MAX];
+
+			if (strncmp(swalk->name, "disk,", 5) != 0) continue;
+
+			/* An RRD file takes precedence, and is already done */
+			if (snprintf(fn, sizeof(fn), "%s/%s", hostdir, swalk->name) >= sizeof(fn)) continue;
+			if (stat(fn, &st) == 0) continue;
+
+			adddiskset(&items, &sets, &count, &size, hostname, swalk->name);
 		}
 	}
-	closedir(d);
+
+	/* Fetch all of the datasets in one go */
+	start = rrdtime(starttimedate, starttimehm);
+	end = rrdtime(endtimedate, endtimehm);
+	xymonrrd_fetch(hostdir, items, count, "AVERAGE", start, end, 1);
+
+	for (i = 0; (i < count); i++) {
+		oneset(hostname, &items[i], sets[i].colname, sets[i].subfrom, sets[i].dsdescr);
+	}
+
+	xymonrrd_fetchfree(items, count);
+	for (i = 0; (i < count); i++) {
+		xfree(items[i].rrdfn);
+		if (sets[i].dsdescr) xfree(sets[i].dsdescr);
+	}
+	if (items) xfree(items);
+	if (sets) xfree(sets);
+
 	return 0;
 }
 
@@ -136,7 +136,7 @@ int main(int argc, char *argv[])
 		errormsg("Cannot open history file");
 	}
 
-	color = parse_historyfile(fd, &repinfo, hostname, service, st, end, 0, reportwarnlevel, reportgreenlevel, reportwarnstops, reporttime);
+	color = parse_historyfile(fd, histlogfn, &repinfo, hostname, service, st, end, 0, reportwarnlevel, reportgreenlevel, reportwarnstops, reporttime);
 	fclose(fd);
 
 	textrepfn = (char *)malloc(1024 + strlen(hostname) + strlen(service));
@@ -26,6 +26,8 @@ static char rcsid[] = "$Id$";
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <fcntl.h>
+#include <utime.h>
+#include <math.h>
 
 #include <pcre.h>
 #include <rrd.h>
@@ -189,6 +191,238 @@ void request_cacheflush(char *hostname)
 }
 
 
+/*
+ * xymond_rrd can store the graph data with its "tsdb" backend instead of in
+ * RRD files. rrd_graph() only handles RRD files, so for hosts with a tsdb store
+ * we fetch the data for the graph period and write it to temporary RRD files.
+ */
+char *tsdbgraphdir = NULL;
+
+void tsdb_cleanup_graphdir(void)
+{
+	DIR *dir, *subdir;
+	struct dirent *d, *sd;
+	struct stat st;
+	char fn[PATH_MAX], subfn[PATH_MAX];
+
+	if (!tsdbgraphdir) return;
+
+	dir = opendir(tsdbgraphdir);
+	while (dir && ((d = readdir(dir)) != NULL)) {
+		if ((strcmp(d->d_name, ".") == 0) || (strcmp(d->d_name, "..") == 0)) continue;
+
+		snprintf(fn, sizeof(fn), "%s/%s", tsdbgraphdir, d->d_name);
+		/* Must not follow the symlinks to the real host directories */
+		if ((lstat(fn, &st) == 0) && S_ISDIR(st.st_mode)) {
+			subdir = opendir(fn);
+			while (subdir && ((sd = readdir(subdir)) != NULL)) {
+				if (*(sd->d_name) == '.') continue;
+				if (snprintf(subfn, sizeof(subfn), "%s/%s", fn, sd->d_name) >= sizeof(subfn)) continue;
+				unlink(subfn);
+			}
+			if (subdir) closedir(subdir);
+			rmdir(fn);
+		}
+		else {
+			unlink(fn);
+		}
+	}
+	if (dir) closedir(dir);
+
+	rmdir(tsdbgraphdir);
+	xfree(tsdbgraphdir);
+	tsdbgraphdir = NULL;
+}
+
+void tsdb_make_rrd(char *hostdir, char *seriesname, char *rrdfn, time_t start, time_t end)
+{
+	time_t fstart = start, fend = end, lastupdate = 0;
+	int step = (end - start) / 600;
+	int rows, dscount, row, col, pcount, i;
+	char **dsnames = NULL;
+	double *data = NULL;
+	char **params;
+	char startstr[20], stepstr[20], rrastr[3][50];
+	char *cfs[3] = { "AVERAGE", "MIN", "MAX" };
+	strbuffer_t *updbuf;
+	char *updparams[3+64+1];
+	char *updvals[64];
+	int updcount = 0;
+
+	rows = tsdb_fetch(hostdir, seriesname, "AVERAGE", &fstart, &fend, &step, &dscount, &dsnames, &data);
+	if (rows <= 0) return;
+
+	/* The data is already consolidated to the step we use, so MIN and MAX are the same as AVERAGE */
+	params = (char **)calloc(6 + dscount + 3 + 1, sizeof(char *));
+	sprintf(startstr, "%u", (unsigned int)fstart);
+	sprintf(stepstr, "%d", step);
+	params[0] = "rrdcreate"; params[1] = rrdfn;
+	params[2] = "-b"; params[3] = startstr;
+	params[4] = "-s"; params[5] = stepstr;
+	pcount = 6;
+	for (col = 0; (col < dscount); col++) {
+		params[pcount] = (char *)malloc(strlen(dsnames[col]) + 40);
+		sprintf(params[pcount], "DS:%s:GAUGE:%d:U:U", dsnames[col], 2*step);
+		pcount++;
+	}
+	for (i = 0; (i < 3); i++) {
+		sprintf(rrastr[i], "RRA:%s:0.5:1:%d", cfs[i], rows + 1);
+		params[pcount++] = rrastr[i];
+	}
+
+	optind = opterr = 0; rrd_clear_error();
+	if (rrd_create(pcount, params) != 0) {
+		errprintf("Cannot create temporary RRD %s: %s\n", rrdfn, rrd_get_error());
+		rows = 0;
+	}
+
+	/* Rows with no data are left out. The gap is then unknown in the RRD file too. */
+	updbuf = newstrbuffer(0);
+	updparams[0] = "rrdupdate"; updparams[1] = rrdfn;
+	for (row = 0; (row <= rows); row++) {
+		int anydata = 0;
+
+		if ((updcount == 64) || ((row == rows) && (updcount > 0))) {
+			updparams[2+updcount] = NULL;
+			optind = opterr = 0; rrd_clear_error();
+			if (rrd_update(2+updcount, updparams) != 0) {
+				errprintf("Cannot update temporary RRD %s: %s\n", rrdfn, rrd_get_error());
+			}
+			for (i = 0; (i < updcount); i++) xfree(updvals[i]);
+			updcount = 0;
+		}
+		if (row == rows) break;
+
+		clearstrbuffer(updbuf);
+		sprintf(startstr, "%u", (unsigned int)(fstart + (row+1)*step));
+		addtobuffer(updbuf, startstr);
+		for (col = 0; (col < dscount); col++) {
+			double val = data[row*dscount + col];
+			char valstr[50];
+
+			if (isnan(val)) {
+				addtobuffer(updbuf, ":U");
+			}
+			else {
+				sprintf(valstr, ":%.12g", val);
+				addtobuffer(updbuf, valstr);
+				anydata = 1;
+			}
+		}
+		if (!anydata) continue;
+
+		lastupdate = fstart + (row+1)*step;
+		updvals[updcount] = strdup(STRBUF(updbuf));
+		updparams[2+updcount] = updvals[updcount];
+		updcount++;
+	}
+	freestrbuffer(updbuf);
+
+	if (lastupdate) {
+		/* So the "nostale" check sees when the data was last updated */
+		struct utimbuf ut;
+
+		ut.actime = ut.modtime = lastupdate;
+		utime(rrdfn, &ut);
+	}
+
+	for (col = 0; (col < dscount); col++) {
+		xfree(params[6+col]);
+		xfree(dsnames[col]);
+	}
+	xfree(params);
+	xfree(dsnames);
+	xfree(data);
+}
+
+void tsdb_setup_graphdir(char *fnpat, char *fixedname, time_t start, time_t end)
+{
+	/*
+	 * Called with the RRD directory as the current directory. If there is tsdb data,
+	 * setup a temporary directory with RRD files for it, and make that the current
+	 * directory. fnpat is a pattern for the series we need, fixedname the series
+	 * name for a single-file graph or for a multi-host graph.
+	 */
+	pcre *pat = NULL;
+	const char *errmsg;
+	int errofs, ovector[30];
+	char fn[PATH_MAX], cwd[PATH_MAX];
+	tsdbseries_t *swalk;
+	DIR *dir;
+	struct dirent *d;
+	int i;
+
+	if (hostlist) {
+		for (i = 0; ((i < hostlistsize) && !tsdb_hasstore(hostlist[i])); i++) ;
+		if (i == hostlistsize) return;
+	}
+	else if (!tsdb_hasstore(".")) return;
+
+	if (!getcwd(cwd, sizeof(cwd))) return;
+	snprintf(fn, sizeof(fn), "%s/showgraph.tsdb.%d", xgetenv("XYMONTMP"), (int)getpid());
+	if (mkdir(fn, S_IRWXU) == -1) {
+		errprintf("Cannot create temporary graph directory %s: %s\n", fn, strerror(errno));
+		return;
+	}
+	tsdbgraphdir = strdup(fn);
+	atexit(tsdb_cleanup_graphdir);
+
+	if (fnpat) pat = pcre_compile(fnpat, PCRE_CASELESS, &errmsg, &errofs, NULL);
+
+	if (hostlist) {
+		for (i = 0; (i < hostlistsize); i++) {
+			char realfn[PATH_MAX];
+
+			if (snprintf(fn, sizeof(fn), "%s/%s", tsdbgraphdir, hostlist[i]) >= sizeof(fn)) continue;
+			if (tsdb_hasstore(hostlist[i])) {
+				char rrdfn[PATH_MAX];
+
+				mkdir(fn, S_IRWXU);
+				if (snprintf(rrdfn, sizeof(rrdfn), "%s/%s", fn, fixedname) >= sizeof(rrdfn)) continue;
+				if (tsdb_findseries(hostlist[i], fixedname)) {
+					tsdb_make_rrd(hostlist[i], fixedname, rrdfn, start, end);
+				}
+				else if (snprintf(realfn, sizeof(realfn), "%s/%s/%s", cwd, hostlist[i], fixedname) < sizeof(realfn)) {
+					/* Data from before the host was switched to tsdb */
+					symlink(realfn, rrdfn);
+				}
+			}
+			else {
+				/* This host has plain RRD files */
+				if (snprintf(realfn, sizeof(realfn), "%s/%s", cwd, hostlist[i]) < sizeof(realfn)) symlink(realfn, fn);
+			}
+		}
+	}
+	else {
+		for (swalk = tsdb_serieslist("."); (swalk); swalk = swalk->next) {
+			if (pat) {
+				if (pcre_exec(pat, NULL, swalk->name, strlen(swalk->name), 0, 0, ovector, (sizeof(ovector)/sizeof(int))) < 0) continue;
+			}
+			else if (strcmp(swalk->name, fixedname) != 0) continue;
+
+			if (snprintf(fn, sizeof(fn), "%s/%s", tsdbgraphdir, swalk->name) >= sizeof(fn)) continue;
+			tsdb_make_rrd(".", swalk->name, fn, start, end);
+		}
+
+		/* The host may also have plain RRD files, e.g. from before it was switched to tsdb. The tsdb data wins. */
+		dir = opendir(".");
+		while (dir && ((d = readdir(dir)) != NULL)) {
+			char realfn[PATH_MAX];
+			int len = strlen(d->d_name);
+
+			if ((len < 4) || (strcmp(d->d_name + len - 4, ".rrd") != 0)) continue;
+			if (snprintf(fn, sizeof(fn), "%s/%s", tsdbgraphdir, d->d_name) >= sizeof(fn)) continue;
+			if (snprintf(realfn, sizeof(realfn), "%s/%s", cwd, d->d_name) >= sizeof(realfn)) continue;
+			symlink(realfn, fn);
+		}
+		if (dir) closedir(dir);
+	}
+
+	if (pat) pcre_free(pat);
+	if (chdir(tsdbgraphdir)) errormsg("Cannot access temporary graph directory");
+}
+
+
 void parse_query(void)
 {
 	cgidata_t *cgidata = NULL, *cwalk;
@@ -891,6 +1125,24 @@ void generate_graph(char *gdeffn, char *rrddir, char *graphfn)
 	}
 	else if (hostname) request_cacheflush(hostname);
 
+	/* Data stored by the xymond_rrd tsdb backend must be converted to RRD files */
+	{
+		time_t tsend = (graphend ? graphend : now);
+		time_t tsstart = (graphstart ? graphstart : (tsend - (persecs ? persecs : 48*60*60)));
+		char *fixedname = NULL;
+
+		if (hostlist) {
+			fixedname = strdup(gdef->fnpat);
+		}
+		else if (gdef->fnpat == NULL) {
+			fixedname = (char *)malloc(strlen(gdef->name) + strlen(".rrd") + 1);
+			sprintf(fixedname, "%s.rrd", gdef->name);
+		}
+
+		tsdb_setup_graphdir((fixedname ? NULL : gdef->fnpat), fixedname, tsstart, tsend);
+		if (fixedname) xfree(fixedname);
+	}
+
 	/* What RRD files do we have matching this request? */
 	if (hostlist || (gdef->fnpat == NULL)) {
 		/*
@@ -932,7 +1184,6 @@ void generate_graph(char *gdeffn, char *rrddir, char *graphfn)
 		const char *errmsg;
 		int errofs, result;
 		int ovector[30];
-		struct stat st;
 		time_t now = getcurrenttime(NULL);
 
 		/* Scan the directory to see what RRD files are there that match */
@@ -993,7 +1244,7 @@ void generate_graph(char *gdeffn, char *rrddir, char *graphfn)
 			 * Has it been updated recently (within the past 24 hours) ? 
 			 * We dont want old graphs to mess up multi-displays.
 			 */
-			if (ignorestalerrds && (stat(d->d_name, &st) == 0) && ((now - st.st_mtime) > 86400)) {
+			if (ignorestalerrds && ((now - xymonrrd_lastupdate(d->d_name)) > 86400)) {
 				continue;
 			}
 
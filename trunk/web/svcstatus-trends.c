@@ -111,6 +111,17 @@ static char *stack_readdir(void)
 }
 
 
+static char *tsdb_readseries(tsdbseries_t **walk)
+{
+	char *result;
+
+	if (*walk == NULL) return NULL;
+
+	result = (*walk)->name;
+	*walk = (*walk)->next;
+	return result;
+}
+
 static char *rrdlink_text(void *host, graph_t *rrd, hg_link_t wantmeta, time_t starttime, time_t endtime)
 {
 	static char *rrdlink = NULL;
@@ -234,6 +245,9 @@ char *generate_trends(char *hostname, time_t starttime, time_t endtime)
 	graph_t *rwalk;
 	char *allrrdlinks = NULL, *allrrdlinksend;
 	unsigned int allrrdlinksize = 0;
+	tsdbseries_t *tsdbwalk;
+	int fromtsdb = 0;
+	struct stat st;
 
 	myhost = hostinfo(hostname);
 	if (!myhost) return NULL;
@@ -245,9 +259,14 @@ char *generate_trends(char *hostname, time_t starttime, time_t endtime)
 	}
 	stack_opendir(".");
 
-	while ((fn = stack_readdir())) {
+	/* The series stored by the xymond_rrd tsdb backend are named like the RRD files */
+	tsdbwalk = (tsdb_hasstore(".") ? tsdb_serieslist(".") : NULL);
+
+	while ((fn = stack_readdir()) || (fromtsdb = ((fn = tsdb_readseries(&tsdbwalk)) != NULL))) {
 		/* Check if the filename ends in ".rrd", and we know how to handle this RRD */
 		if ((strlen(fn) <= 4) || (strcmp(fn+strlen(fn)-4, ".rrd") != 0)) continue;
+		/* A series that is also kept as an RRD file has already been counted */
+		if (fromtsdb && (stat(fn, &st) == 0)) continue;
 		graph = find_xymon_graph(fn); if (!graph) continue;
 
 		dbgprintf("Got RRD %s\n", fn);
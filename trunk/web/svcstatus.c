@@ -527,24 +527,33 @@ int do_request(void)
 		p = hostnamedash; while ((p = strchr(p, '.')) != NULL) *p = '_';
 		p = hostnamedash; while ((p = strchr(p, ',')) != NULL) *p = '_';
 		sprintf(logfn, "%s/%s/%s/%s", xgetenv("XYMONHISTLOGS"), hostnamedash, service, tstamp);
-		xfree(hostnamedash);
 		p = tstamp; while ((p = strchr(p, '_')) != NULL) *p = ' ';
 		sethostenv_histlog(tstamp);
 
-		if ((stat(logfn, &st) == -1) || (st.st_size < 10) || (!S_ISREG(st.st_mode))) {
-			errormsg(404, "Historical status log not available\n");
-			return 1;
+		if ((stat(logfn, &st) == 0) && (st.st_size >= 10) && S_ISREG(st.st_mode)) {
+			xfree(hostnamedash);
+
+			fd = fopen(logfn, "r");
+			if (!fd) {
+				errormsg(404, "Unable to access historical logfile\n");
+				return 1;
+			}
+			log = (char *)malloc(st.st_size+1);
+			n = fread(log, 1, st.st_size, fd);
+			if (n >= 0) *(log+n) = '\0'; else *log = '\0';
+			fclose(fd);
 		}
+		else {
+			/* Not a plain file, but it may be in the packed histlogs */
+			strbuffer_t *packedlog = histlogstore_load(xgetenv("XYMONHISTLOGS"), hostnamedash, service, tstamp);
 
-		fd = fopen(logfn, "r");
-		if (!fd) {
-			errormsg(404, "Unable to access historical logfile\n");
-			return 1;
+			xfree(hostnamedash);
+			if (!packedlog || (STRBUFLEN(packedlog) < 10)) {
+				errormsg(404, "Historical status log not available\n");
+				return 1;
+			}
+			log = grabstrbuffer(packedlog);
 		}
-		log = (char *)malloc(st.st_size+1);
-		n = fread(log, 1, st.st_size, fd);
-		if (n >= 0) *(log+n) = '\0'; else *log = '\0';
-		fclose(fd);
 
 		p = strchr(log, '\n'); 
 		if (!p) {
@@ -1941,15 +1941,26 @@ void dump_client_config(void)
 	}
 }
 
-static c_rule_t *getrule(char *hostname, char *pagename, char *classname, void *hinfo, ruletype_t ruletype)
+/*
+ * The position in the list of rules is kept by the caller in a ruleiter_t,
+ * so several lookups can be in progress at the same time. Pass a hostname
+ * or pagename to start at the first rule for the host, or NULL for both to
+ * continue after the previous match.
+ */
+typedef struct ruleiter_t {
+	ruleset_t *rwalk;
+} ruleiter_t;
+
+static c_rule_t *getrule(ruleiter_t *iter, char *hostname, char *pagename, char *classname, void *hinfo, ruletype_t ruletype)
 {
-	static ruleset_t *rwalk = NULL;
+	ruleset_t *rwalk;
 	char *holidayset;
 
 	if (hostname || pagename) {
 		rwalk = ruleset(hostname, pagename, classname); 
 	}
 	else {
+		rwalk = iter->rwalk;
 		if (rwalk) rwalk = rwalk->next;
 	}
 
@@ -1960,9 +1971,11 @@ static c_rule_t *getrule(char *hostname, char *pagename, char *classname, void *
 		if (rwalk->rule->timespec && !timematch(holidayset, rwalk->rule->timespec)) continue;
 
 		/* If we get here, then we have something that matches */
+		iter->rwalk = rwalk;
 		return rwalk->rule;
 	}
 
+	iter->rwalk = NULL;
 	return NULL;
 }
 
@@ -1971,6 +1984,7 @@ int get_cpu_thresholds(void *hinfo, char *classname,
 		       int *recentlimit, int *ancientlimit, int *uptimecolor,
 		       int *maxclockdiff, int *clockdiffcolor)
 {
+	ruleiter_t iter = { NULL };
 	int result = 0;
 	char *hostname, *pagename;
 	c_rule_t *rule;
@@ -1982,7 +1996,7 @@ int get_cpu_thresholds(void *hinfo, char *classname,
 	*loadred = 10.0;
 	*uptimecolor = *clockdiffcolor = COL_YELLOW;
 
-	rule = getrule(hostname, pagename, classname, hinfo, C_LOAD);
+	rule = getrule(&iter, hostname, pagename, classname, hinfo, C_LOAD);
 	if (rule) {
 		*loadyellow = rule->rule.load.warnlevel;
 		*loadred    = rule->rule.load.paniclevel;
@@ -1992,7 +2006,7 @@ int get_cpu_thresholds(void *hinfo, char *classname,
 	*recentlimit = 3600;
 	*ancientlimit = -1;
 
-	rule = getrule(hostname, pagename, classname, hinfo, C_UPTIME);
+	rule = getrule(&iter, hostname, pagename, classname, hinfo, C_UPTIME);
 	if (rule) {
 		*recentlimit  = rule->rule.uptime.recentlimit;
 		*ancientlimit = rule->rule.uptime.ancientlimit;
@@ -2001,7 +2015,7 @@ int get_cpu_thresholds(void *hinfo, char *classname,
 	}
 
 	*maxclockdiff = -1;
-	rule = getrule(hostname, pagename, classname, hinfo, C_CLOCK);
+	rule = getrule(&iter, hostname, pagename, classname, hinfo, C_CLOCK);
 	if (rule) {
 		*maxclockdiff = rule->rule.clock.maxdiff;
 		*clockdiffcolor = rule->rule.clock.color;
@@ -2016,6 +2030,7 @@ int get_disk_thresholds(void *hinfo, char *classname,
 			int *abswarn, int *abspanic,
 			int *ignored, char **group)
 {
+	ruleiter_t iter = { NULL };
 	char *hostname, *pagename;
 	c_rule_t *rule;
 
@@ -2029,9 +2044,9 @@ int get_disk_thresholds(void *hinfo, char *classname,
 	*ignored = 0;
 	*group = NULL;
 
-	rule = getrule(hostname, pagename, classname, hinfo, C_DISK);
+	rule = getrule(&iter, hostname, pagename, classname, hinfo, C_DISK);
 	while (rule && (!rule->rule.disk.fsexp || !namematch(fsname, rule->rule.disk.fsexp->pattern, rule->rule.disk.fsexp->exp))) {
-		rule = getrule(NULL, NULL, NULL, hinfo, C_DISK);
+		rule = getrule(&iter, NULL, NULL, NULL, hinfo, C_DISK);
 	}
 
 	if (rule) {
@@ -2053,6 +2068,7 @@ int get_inode_thresholds(void *hinfo, char *classname,
 		int *abswarn, int *abspanic,
 		int *ignored, char **group)
 {
+	ruleiter_t iter = { NULL };
 	char *hostname, *pagename;
 	c_rule_t *rule;
 
@@ -2066,9 +2082,9 @@ int get_inode_thresholds(void *hinfo, char *classname,
 	*ignored = 0;
 	*group = NULL;
 
-	rule = getrule(hostname, pagename, classname, hinfo, C_INODE);
+	rule = getrule(&iter, hostname, pagename, classname, hinfo, C_INODE);
 	while (rule && (!rule->rule.inode.fsexp || !namematch(fsname, rule->rule.inode.fsexp->pattern, rule->rule.inode.fsexp->exp))) {
-		rule = getrule(NULL, NULL, NULL, hinfo, C_INODE);
+		rule = getrule(&iter, NULL, NULL, NULL, hinfo, C_INODE);
 	}
 
 	if (rule) {
@@ -2087,6 +2103,7 @@ int get_inode_thresholds(void *hinfo, char *classname,
 void get_cics_thresholds(void *hinfo, char *classname, char *appid,
                         int *dsayel, int *dsared, int *edsayel, int *edsared)
 {
+        ruleiter_t iter = { NULL };
         char *hostname, *pagename;
         c_rule_t *rule;
 
@@ -2099,7 +2116,7 @@ void get_cics_thresholds(void *hinfo, char *classname, char *appid,
         *edsared = 95;
 
 /* Get thresholds for CICS DSA */
-        rule = getrule(hostname, pagename, classname, hinfo, C_CICS);
+        rule = getrule(&iter, hostname, pagename, classname, hinfo, C_CICS);
 
 /* This is sort of cheating, because the while statement that follows should catch it
    but it doesn't.  So if there is a way to solve the problem I welcome some tips...   */
@@ -2108,7 +2125,7 @@ void get_cics_thresholds(void *hinfo, char *classname, char *appid,
 		}
 
         while (rule && (!rule->rule.cics.applid || !namematch(appid, rule->rule.cics.applid->pattern, rule->rule.cics.applid->exp))) {
-                rule = getrule(NULL, NULL, NULL, hinfo, C_CICS);
+                rule = getrule(&iter, NULL, NULL, NULL, hinfo, C_CICS);
         }
 
         if (rule) {
@@ -2123,6 +2140,7 @@ void get_cics_thresholds(void *hinfo, char *classname, char *appid,
 void get_zvsevsize_thresholds(void *hinfo, char *classname,
                         int *usedyel, int *usedred)
 {
+        ruleiter_t iter = { NULL };
         char *hostname, *pagename;
         c_rule_t *rule;
 
@@ -2133,7 +2151,7 @@ void get_zvsevsize_thresholds(void *hinfo, char *classname,
         *usedred = 95;
 
 /* Get thresholds for z/VSE System Memory */
-        rule = getrule(hostname, pagename, classname, hinfo, C_MEM_VSIZE);
+        rule = getrule(&iter, hostname, pagename, classname, hinfo, C_MEM_VSIZE);
 
         if (rule) {
                 *usedyel = rule->rule.zvse_vsize.warnlevel;
@@ -2144,6 +2162,7 @@ void get_zvsevsize_thresholds(void *hinfo, char *classname,
 void get_zvsegetvis_thresholds(void *hinfo, char *classname, char *pid,
                         int *gv24yel, int *gv24red, int *gvanyyel, int *gvanyred)
 {
+        ruleiter_t iter = { NULL };
         char *hostname, *pagename;
         c_rule_t *rule;
 
@@ -2156,7 +2175,7 @@ void get_zvsegetvis_thresholds(void *hinfo, char *classname, char *pid,
         *gvanyred = 95;
 
 /* Get thresholds for z/VSE Partition Getvis */
-        rule = getrule(hostname, pagename, classname, hinfo, C_MEM_GETVIS);
+        rule = getrule(&iter, hostname, pagename, classname, hinfo, C_MEM_GETVIS);
 
 /* This is sort of cheating, because the while statement that follows should catch it
    but it doesn't.  So if there is a way to solve the problem I welcome some tips...   */
@@ -2165,7 +2184,7 @@ void get_zvsegetvis_thresholds(void *hinfo, char *classname, char *pid,
 	}
 
         while (rule && (!rule->rule.zvse_getvis.partid || !namematch(pid, rule->rule.zvse_getvis.partid->pattern, rule->rule.zvse_getvis.partid->exp))) {
-                rule = getrule(NULL, NULL, NULL, hinfo, C_MEM_GETVIS);
+                rule = getrule(&iter, NULL, NULL, NULL, hinfo, C_MEM_GETVIS);
        	}
 
         if (rule) {
@@ -2179,6 +2198,7 @@ void get_zvsegetvis_thresholds(void *hinfo, char *classname, char *pid,
 void get_memory_thresholds(void *hinfo, char *classname,
 			   int *physyellow, int *physred, int *swapyellow, int *swapred, int *actyellow, int *actred)
 {
+	ruleiter_t iter = { NULL };
 	char *hostname, *pagename;
 	c_rule_t *rule;
 	int gotphys = 0, gotswap = 0, gotact = 0;
@@ -2193,7 +2213,7 @@ void get_memory_thresholds(void *hinfo, char *classname,
 	*actyellow = 90;
 	*actred = 97;
 
-	rule = getrule(hostname, pagename, classname, hinfo, C_MEM);
+	rule = getrule(&iter, hostname, pagename, classname, hinfo, C_MEM);
 	while (rule) {
 		switch (rule->rule.mem.memtype) {
 		  case C_MEM_PHYS:
@@ -2218,7 +2238,7 @@ void get_memory_thresholds(void *hinfo, char *classname,
 			}
 			break;
 		}
-		rule = getrule(NULL, NULL, NULL, hinfo, C_MEM);
+		rule = getrule(&iter, NULL, NULL, NULL, hinfo, C_MEM);
 	}
 }
 
@@ -2226,6 +2246,7 @@ void get_zos_memory_thresholds(void *hinfo, char *classname,
                                int *csayellow, int *csared, int *ecsayellow, int *ecsared,
 			       int *sqayellow, int *sqared, int *esqayellow, int *esqared)
 {
+        ruleiter_t iter = { NULL };
         char *hostname, *pagename;
         c_rule_t *rule;
         int gotcsa = 0, gotecsa = 0, gotsqa = 0, gotesqa = 0;
@@ -2242,7 +2263,7 @@ void get_zos_memory_thresholds(void *hinfo, char *classname,
         *esqayellow = 90;
         *esqared = 95;
 
-        rule = getrule(hostname, pagename, classname, hinfo, C_MEM);
+        rule = getrule(&iter, hostname, pagename, classname, hinfo, C_MEM);
         while (rule) {
                 switch (rule->rule.zos_mem.zos_memtype) {
                   case C_MEM_CSA:
@@ -2274,7 +2295,7 @@ void get_zos_memory_thresholds(void *hinfo, char *classname,
                         }
                         break;
                 }
-                rule = getrule(NULL, NULL, NULL, hinfo, C_MEM);
+                rule = getrule(&iter, NULL, NULL, NULL, hinfo, C_MEM);
         }
 
 }
@@ -2283,6 +2304,7 @@ void get_zos_memory_thresholds(void *hinfo, char *classname,
 void get_asid_thresholds(void *hinfo, char *classname,
                                int *maxyellow, int *maxred)
 {
+        ruleiter_t iter = { NULL };
         int gotmaxuser = 0, gotnparts = 0;
         char *hostname, *pagename;
         c_rule_t *rule;
@@ -2293,7 +2315,7 @@ void get_asid_thresholds(void *hinfo, char *classname,
         *maxyellow = 101;
         *maxred = 101;
 
-        rule = getrule(hostname, pagename, classname, hinfo, C_ASID);
+        rule = getrule(&iter, hostname, pagename, classname, hinfo, C_ASID);
         while (rule) {
                 switch (rule->rule.asid.asidtype) {
 			case C_ASID_MAXUSER: 
@@ -2311,13 +2333,14 @@ void get_asid_thresholds(void *hinfo, char *classname,
                                 }
                                 break;
 		}
-                rule = getrule(NULL, NULL, NULL, hinfo, C_ASID);
+                rule = getrule(&iter, NULL, NULL, NULL, hinfo, C_ASID);
         }
 
 }
 
 int get_paging_thresholds(void *hinfo, char *classname, int *pagingyellow, int *pagingred)
 {
+	ruleiter_t iter = { NULL };
 	int result = 0;
 	char *hostname, *pagename;
 	c_rule_t *rule;
@@ -2328,7 +2351,7 @@ int get_paging_thresholds(void *hinfo, char *classname, int *pagingyellow, int *
 	*pagingyellow = 5;
 	*pagingred = 10;
 
-	rule = getrule(hostname, pagename, classname, hinfo, C_PAGING);
+	rule = getrule(&iter, hostname, pagename, classname, hinfo, C_PAGING);
 	if (rule) {
 		*pagingyellow = rule->rule.paging.warnlevel;
 		*pagingred    = rule->rule.paging.paniclevel;
@@ -2342,6 +2365,7 @@ int get_mibval_thresholds(void *hinfo, char *classname,
 			  char *mibname, char *keyname, char *valname,
 			  long *minval, long *maxval, void **matchexp, int *color, char **group)
 {
+	ruleiter_t iter = { NULL };
 	static void * mibnametree;
 	static int have_mibnametree = 0;
 	char *hostname, *pagename, *mibkeyval_id;
@@ -2358,7 +2382,7 @@ int get_mibval_thresholds(void *hinfo, char *classname,
 	pagename = xmh_item(hinfo, XMH_PAGEPATH);
 
 	/* Any potential rules at all ? */
-	rule = getrule(hostname, pagename, classname, hinfo, C_MIBVAL);
+	rule = getrule(&iter, hostname, pagename, classname, hinfo, C_MIBVAL);
 	if (!rule) return -1;
 
 	*minval = LONG_MIN;
@@ -2439,7 +2463,7 @@ int get_mibval_thresholds(void *hinfo, char *classname,
 			found = (rule->rule.mibval.mibvalexp && namematch(mibval_id, rule->rule.mibval.mibvalexp->pattern, rule->rule.mibval.mibvalexp->exp));
 			if (found && keyname && rule->rule.mibval.keyexp)
 				found = namematch(keyname, rule->rule.mibval.keyexp->pattern, rule->rule.mibval.keyexp->exp);
-			if (!found) rule = getrule(NULL, NULL, NULL, hinfo, C_MIBVAL);
+			if (!found) rule = getrule(&iter, NULL, NULL, NULL, hinfo, C_MIBVAL);
 		}
 
 		xtreeAdd(valdeftree, mibkeyval_id, rule);
@@ -2561,6 +2585,7 @@ int check_mibvals(void *hinfo, char *classname,
 int scan_log(void *hinfo, char *classname, 
 	     char *logname, char *logdata, char *section, strbuffer_t *summarybuf)
 {
+	ruleiter_t iter = { NULL };
 	int result = COL_GREEN;
 	char *hostname, *pagename;
 	c_rule_t *rule;
@@ -2573,7 +2598,7 @@ int scan_log(void *hinfo, char *classname,
 	
 	nofile = (strncmp(logdata, "Cannot open logfile ", 20) == 0);
 
-	for (rule = getrule(hostname, pagename, classname, hinfo, C_LOG); (rule); rule = getrule(NULL, NULL, NULL, hinfo, C_LOG)) {
+	for (rule = getrule(&iter, hostname, pagename, classname, hinfo, C_LOG); (rule); rule = getrule(&iter, NULL, NULL, NULL, hinfo, C_LOG)) {
 		int anylines = 0;
 
 		/* First, check if the filename matches */
@@ -2637,6 +2662,7 @@ int check_file(void *hinfo, char *classname,
 	       strbuffer_t *summarybuf, off_t *filesize, 
 	       char **id, int *trackit, int *anyrules)
 {
+	ruleiter_t iter = { NULL };
 	int result = COL_GREEN;
 	char *hostname, *pagename;
 	c_rule_t *rwalk;
@@ -2736,7 +2762,7 @@ int check_file(void *hinfo, char *classname,
 	atimedif = clock - atime;
 	mtimedif = clock - mtime;
 
-	for (rwalk = getrule(hostname, pagename, classname, hinfo, C_FILE); (rwalk); rwalk = getrule(NULL, NULL, NULL, hinfo, C_FILE)) {
+	for (rwalk = getrule(&iter, hostname, pagename, classname, hinfo, C_FILE); (rwalk); rwalk = getrule(&iter, NULL, NULL, NULL, hinfo, C_FILE)) {
 		int rulecolor = COL_GREEN;
 
 		/* First, check if the filename matches */
@@ -2959,6 +2985,7 @@ int check_dir(void *hinfo, char *classname,
 	      strbuffer_t *summarybuf, unsigned long *dirsize, 
 	      char **id, int *trackit)
 {
+	ruleiter_t iter = { NULL };
 	int result = COL_GREEN;
 	char *hostname, *pagename;
 	c_rule_t *rwalk;
@@ -3001,7 +3028,7 @@ int check_dir(void *hinfo, char *classname,
 		return COL_YELLOW;
 	}
 
-	for (rwalk = getrule(hostname, pagename, classname, hinfo, C_DIR); (rwalk); rwalk = getrule(NULL, NULL, NULL, hinfo, C_DIR)) {
+	for (rwalk = getrule(&iter, hostname, pagename, classname, hinfo, C_DIR); (rwalk); rwalk = getrule(&iter, NULL, NULL, NULL, hinfo, C_DIR)) {
 		int rulecolor = COL_GREEN;
 
 		/* First, check if the filename matches */
@@ -3037,6 +3064,7 @@ int check_dir(void *hinfo, char *classname,
 
 strbuffer_t *check_rrdds_thresholds(char *hostname, char *classname, char *pagepaths, char *rrdkey, void * valnames, char *vals)
 {
+	ruleiter_t iter = { NULL };
 	static strbuffer_t *resbuf = NULL;
 	char msgline[1024];
 	c_rule_t *rule;
@@ -3051,7 +3079,7 @@ strbuffer_t *check_rrdds_thresholds(char *hostname, char *classname, char *pagep
 	clearstrbuffer(resbuf);
 
 	hinfo = hostinfo(hostname);
-	rule = getrule(hostname, pagepaths, classname, hinfo, C_RRDDS);
+	rule = getrule(&iter, hostname, pagepaths, classname, hinfo, C_RRDDS);
 	while (rule) {
 		int rulematch = 0;
 
@@ -3165,7 +3193,7 @@ strbuffer_t *check_rrdds_thresholds(char *hostname, char *classname, char *pagep
 		}
 
 nextrule:
-		rule = getrule(NULL, NULL, NULL, hinfo, C_RRDDS);
+		rule = getrule(&iter, NULL, NULL, NULL, hinfo, C_RRDDS);
 	}
 
 	if (valscopy) xfree(valscopy);
@@ -3177,6 +3205,7 @@ nextrule:
 
 void get_mqqueue_thresholds(void *hinfo, char *classname, char *qmgrname, char *qname, int *warnlen, int *critlen, int *warnage, int *critage, char **trackit)
 {
+	ruleiter_t iter = { NULL };
 	char *hostname, *pagepaths;
 	c_rule_t *rule;
 
@@ -3186,7 +3215,7 @@ void get_mqqueue_thresholds(void *hinfo, char *classname, char *qmgrname, char *
 	*warnlen = *critlen = *warnage = *critage = -1;
 	*trackit = NULL;
 
-	rule = getrule(hostname, pagepaths, classname, hinfo, C_MQ_QUEUE);
+	rule = getrule(&iter, hostname, pagepaths, classname, hinfo, C_MQ_QUEUE);
 	while (rule) {
 		if (rule->rule.mqqueue.qname && rule->rule.mqqueue.qmgrname &&
 		    namematch(qname, rule->rule.mqqueue.qname->pattern, rule->rule.mqqueue.qname->exp) &&
@@ -3199,19 +3228,20 @@ void get_mqqueue_thresholds(void *hinfo, char *classname, char *qmgrname, char *
 			return;
 		}
 
-		rule = getrule(NULL, NULL, NULL, hinfo, C_MQ_QUEUE);
+		rule = getrule(&iter, NULL, NULL, NULL, hinfo, C_MQ_QUEUE);
 	}
 }
 
 int get_mqchannel_params(void *hinfo, char *classname, char *qmgrname, char *chnname, char *chnstatus, int *color)
 {
+	ruleiter_t iter = { NULL };
 	char *hostname, *pagepaths;
 	c_rule_t *rule;
 
 	hostname = xmh_item(hinfo, XMH_HOSTNAME);
 	pagepaths = xmh_item(hinfo, XMH_ALLPAGEPATHS);
 
-	rule = getrule(hostname, pagepaths, classname, hinfo, C_MQ_CHANNEL);
+	rule = getrule(&iter, hostname, pagepaths, classname, hinfo, C_MQ_CHANNEL);
 	while (rule) {
 		if (rule->rule.mqchannel.chnname && rule->rule.mqchannel.qmgrname && 
 		    namematch(chnname, rule->rule.mqchannel.chnname->pattern, rule->rule.mqchannel.chnname->exp) &&
@@ -3229,7 +3259,7 @@ int get_mqchannel_params(void *hinfo, char *classname, char *qmgrname, char *chn
 			return 1;
 		}
 
-		rule = getrule(NULL, NULL, NULL, hinfo, C_MQ_CHANNEL);
+		rule = getrule(&iter, NULL, NULL, NULL, hinfo, C_MQ_CHANNEL);
 	}
 
 	return 0;
@@ -3244,6 +3274,7 @@ typedef struct mon_proc_t {
 static int clear_counts(void *hinfo, char *classname, ruletype_t ruletype, 
 			mon_proc_t **head, mon_proc_t **tail, mon_proc_t **walk)
 {
+	ruleiter_t iter = { NULL };
 	char *hostname, *pagename;
 	c_rule_t *rule;
 	int count = 0;
@@ -3258,7 +3289,7 @@ static int clear_counts(void *hinfo, char *classname, ruletype_t ruletype,
 	hostname = xmh_item(hinfo, XMH_HOSTNAME);
 	pagename = xmh_item(hinfo, XMH_ALLPAGEPATHS);
 
-	rule = getrule(hostname, pagename, classname, hinfo, ruletype);
+	rule = getrule(&iter, hostname, pagename, classname, hinfo, ruletype);
 	while (rule) {
 		mon_proc_t *newitem = (mon_proc_t *)calloc(1, sizeof(mon_proc_t));
 
@@ -3277,7 +3308,7 @@ static int clear_counts(void *hinfo, char *classname, ruletype_t ruletype,
 		  default: break;
 		}
 
-		rule = getrule(NULL, NULL, NULL, hinfo, ruletype);
+		rule = getrule(&iter, NULL, NULL, NULL, hinfo, ruletype);
 	}
 
 	*walk = *head;
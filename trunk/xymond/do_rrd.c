@@ -21,6 +21,11 @@ static char rcsid[] = "$Id$";
 #include <ctype.h>
 #include <errno.h>
 #include <utime.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <sys/wait.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
 
 #include <rrd.h>
 #include <pcre.h>
@@ -39,6 +44,8 @@ extern int seq;	/* from xymond_rrd.c */
 
 char *rrddir = NULL;
 int use_rrd_cache = 1;         /* Use the cache by default */
+int rrdcache_maxage = 1800;    /* Max. time an update is held in the cache */
+unsigned long rrdcache_maxmem = 0; /* Max. memory for cached updates, 0 = unlimited */
 int no_rrd = 0;                /* Write to rrd by default */
 
 static int  processorfd = 0;
@@ -68,8 +75,27 @@ typedef struct updcacheitem_t {
 	char *vals[CACHESZ];
 	int updseq[CACHESZ];
 	time_t updtime[CACHESZ];
+	int flushslot;
+	struct updcacheitem_t *prevdirty, *nextdirty;
 } updcacheitem_t;
 
+/*
+ * Write-behind scheduling of the cached updates. Every RRD file has a fixed
+ * flush slot within the cache period (one slot per second), and files with
+ * cached updates are kept on the list for their slot. Each second we flush
+ * the files in the slots that have come up, so the disk I/O is spread evenly
+ * over the period instead of all files filling up and being flushed together.
+ */
+static updcacheitem_t **flushslots = NULL;
+static int flushslotcount = 0;
+static time_t lastflushtime = 0;
+static int memflushslot = 0;
+
+/* Statistics for the xymond_rrd status report */
+static unsigned long cachedfiles = 0, cachedvalues = 0, cachedbytes = 0;
+static unsigned long stat_flushes = 0, stat_flushvalues = 0, stat_fullflushes = 0, stat_memflushes = 0;
+static double stat_flushms = 0.0, stat_flushmaxms = 0.0;
+
 static void * flushtree;
 static int have_flushtree = 0;
 typedef struct flushtree_t {
@@ -77,6 +103,32 @@ typedef struct flushtree_t {
 	time_t flushtime;
 } flushtree_t;
 
+/*
+ * RRD writer processes. When enabled, the actual rrd_create() and rrd_update()
+ * calls are handed off to a set of child processes, so that a slow disk does
+ * not hold up the processing of incoming messages. All files for a host go to
+ * the same writer, so updates for each file are still done in order.
+ */
+#define RRDWR_CREATE     1
+#define RRDWR_UPDATE     2
+#define RRDWR_DROPHOST   3
+#define RRDWR_RENAMEHOST 4
+#define RRDWR_SYNC       5
+
+typedef struct rrdwriter_t {
+	pid_t pid;
+	int cmdfd;		/* Where we send requests to the writer */
+	int replyfd;		/* Where the writer acknowledges a sync request */
+} rrdwriter_t;
+static rrdwriter_t *rrdwriters = NULL;
+static int rrdwritercount = 0;
+
+typedef struct rrdwrhdr_t {
+	int op;
+	int argc;
+	int datalen;
+} rrdwrhdr_t;
+
 
 void setup_exthandler(char *handlerpath, char *ids)
 {
@@ -213,48 +265,892 @@ static void setupinterval(int intvl)
 	rrdinterval = (intvl ? intvl : DEFAULT_RRD_INTERVAL);
 }
 
+static int rrd_create_file(int pcount, char **params)
+{
+	/* params[1] is the RRD filename */
+	int result;
+
+	/*
+	 * Ugly! RRDtool uses getopt() for parameter parsing, so
+	 * we MUST reset this before every call.
+	 */
+	optind = opterr = 0; rrd_clear_error();
+	result = rrd_create(pcount, params);
+	if (result != 0) errprintf("RRD error creating %s: %s\n", params[1], rrd_get_error());
+
+	return result;
+}
+
+static int rrd_update_file(int pcount, char **params, char *sender)
+{
+	/* params[1] is the RRD filename */
+	int result;
+
+	optind = opterr = 0; rrd_clear_error();
+	result = rrd_update(pcount, params);
+
+#if defined(LINUX) && defined(RRDTOOL12)
+	/*
+	 * RRDtool 1.2+ uses mmap'ed I/O, but the Linux kernel does not update timestamps when
+	 * doing file I/O on mmap'ed files. This breaks our check for stale/nostale RRD's.
+	 * So do an explicit timestamp update on the file here.
+	 */
+	utimes(params[1], NULL);
+#endif
+
+	if (result != 0) {
+		char *msg = rrd_get_error();
+
+		if (strstr(msg, "(minimum one second step)") != NULL) {
+			dbgprintf("RRD error updating %s from %s: %s\n",
+				  params[1], (sender ? sender : "unknown"), msg);
+		}
+		else {
+			errprintf("RRD error updating %s from %s: %s\n",
+				  params[1], (sender ? sender : "unknown"), msg);
+		}
+	}
+
+	return result;
+}
+
+static int rrd_file_exists(char *filename)
+{
+	struct stat st;
+
+	return (stat(filename, &st) == 0);
+}
+
+/*
+ * Cache of the dataset names in the RRD files. Getting these means reading
+ * the file through librrd, so they are kept in memory and saved to an index
+ * file when xymond_rrd stops. After a restart the index is mmap'ed, and an
+ * entry is used as long as the RRD file has the same inode and size. The
+ * file timestamp changes with every update, so it cannot be used for this.
+ */
+char *dscachefn = NULL;
+
+#define DSINDEX_MAGIC "XYDSIX01"
+#define DSCACHE_MAXAGE (30*86400)	/* Entries not used for this long are dropped */
+
+/*
+ * Index file layout: The header, "count" record offsets sorted by the
+ * filename, and the records. Each record is a dsindexrec_t followed by the
+ * filename and the dataset names, all NUL-terminated.
+ */
+typedef struct dsindexhdr_t {
+	char magic[8];
+	unsigned int count;
+} dsindexhdr_t;
+
+typedef struct dsindexrec_t {
+	unsigned long long inode, size;
+	unsigned int lastused;
+	unsigned int dscount;
+	unsigned int keylen, nameslen;
+} dsindexrec_t;
+
+typedef struct dscacheitem_t {
+	char *key;
+	dsindexrec_t rec;
+	char *names;
+	int dropped;		/* Host was dropped, ignore the index entry */
+} dscacheitem_t;
+
+static void *dscache;
+static int have_dscache = 0, dscache_dirty = 0;
+static unsigned char *dsindexmap = NULL;
+static size_t dsindexsize = 0;
+static unsigned int dsindexcount = 0;
+static unsigned long stat_dscachehits = 0, stat_dscachereads = 0;
+
+static unsigned char *dsindex_map(char *fn, size_t *mapsize, unsigned int *count)
+{
+	struct stat st;
+	unsigned char *map;
+	dsindexhdr_t hdr;
+	int fd;
+
+	fd = open(fn, O_RDONLY);
+	if (fd == -1) return NULL;
+	if ((fstat(fd, &st) == -1) || (st.st_size < sizeof(hdr))) { close(fd); return NULL; }
+
+	map = (unsigned char *)mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) return NULL;
+
+	memcpy(&hdr, map, sizeof(hdr));
+	if ((memcmp(hdr.magic, DSINDEX_MAGIC, sizeof(hdr.magic)) != 0) ||
+	    (st.st_size < sizeof(hdr) + (size_t)hdr.count*sizeof(unsigned int))) {
+		errprintf("Ignoring invalid dataset cache file %s\n", fn);
+		munmap(map, st.st_size);
+		return NULL;
+	}
+
+	*mapsize = st.st_size;
+	*count = hdr.count;
+	return map;
+}
+
+static int dsindex_rec(unsigned char *map, size_t mapsize, unsigned int idx, dsindexrec_t *rec, char **key, char **names)
+{
+	unsigned int ofs;
+
+	memcpy(&ofs, map + sizeof(dsindexhdr_t) + idx*sizeof(unsigned int), sizeof(ofs));
+	if ((ofs + sizeof(dsindexrec_t)) > mapsize) return -1;
+	memcpy(rec, map + ofs, sizeof(dsindexrec_t));
+	if ((ofs + sizeof(dsindexrec_t) + rec->keylen + rec->nameslen) > mapsize) return -1;
+
+	*key = (char *)(map + ofs + sizeof(dsindexrec_t));
+	*names = *key + rec->keylen;
+	return 0;
+}
+
+static unsigned int dsindex_lowerbound(char *key)
+{
+	/* Index of the first record with a filename >= key */
+	unsigned int lo = 0, hi = dsindexcount, mid;
+	dsindexrec_t rec;
+	char *reckey, *recnames;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if ((dsindex_rec(dsindexmap, dsindexsize, mid, &rec, &reckey, &recnames) == 0) && (strcmp(reckey, key) < 0))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+static dscacheitem_t *dscache_add(char *key, dsindexrec_t *rec, char *names)
+{
+	xtreePos_t handle;
+	dscacheitem_t *item;
+
+	handle = xtreeFind(dscache, key);
+	if (handle == xtreeEnd(dscache)) {
+		item = (dscacheitem_t *)calloc(1, sizeof(dscacheitem_t));
+		item->key = strdup(key);
+		xtreeAdd(dscache, item->key, item);
+	}
+	else {
+		item = (dscacheitem_t *)xtreeData(dscache, handle);
+		if (item->names) xfree(item->names);
+	}
+
+	memcpy(&item->rec, rec, sizeof(dsindexrec_t));
+	item->names = (char *)malloc(rec->nameslen);
+	memcpy(item->names, names, rec->nameslen);
+	item->dropped = 0;
+	dscache_dirty = 1;
+
+	return item;
+}
+
+static dscacheitem_t *dscache_find(char *filename)
+{
+	xtreePos_t handle;
+	dscacheitem_t *item = NULL;
+
+	if (!have_dscache) {
+		dscache = xtreeNew(strcmp);
+		have_dscache = 1;
+		if (dscachefn) dsindexmap = dsindex_map(dscachefn, &dsindexsize, &dsindexcount);
+	}
+
+	handle = xtreeFind(dscache, filename);
+	if (handle != xtreeEnd(dscache)) {
+		item = (dscacheitem_t *)xtreeData(dscache, handle);
+	}
+	else if (dsindexmap) {
+		unsigned int idx = dsindex_lowerbound(filename);
+		dsindexrec_t rec;
+		char *key, *names;
+
+		/* Entries from the index are copied to the in-memory cache when they are used */
+		if ((idx < dsindexcount) && (dsindex_rec(dsindexmap, dsindexsize, idx, &rec, &key, &names) == 0) &&
+		    (strcmp(key, filename) == 0)) {
+			item = dscache_add(key, &rec, names);
+		}
+	}
+
+	return ((item && !item->dropped) ? item : NULL);
+}
+
+static void dscache_drophost(char *hostdir)
+{
+	/* Forget the cached datasets for all files in a host directory */
+	char *prefix;
+	int prefixlen;
+	xtreePos_t handle;
+	unsigned int idx;
+
+	if (!have_dscache) return;
+
+	prefix = (char *)malloc(strlen(hostdir) + 2);
+	sprintf(prefix, "%s/", hostdir);
+	prefixlen = strlen(prefix);
+
+	for (handle = xtreeFirst(dscache); (handle != xtreeEnd(dscache)); handle = xtreeNext(dscache, handle)) {
+		dscacheitem_t *item = (dscacheitem_t *)xtreeData(dscache, handle);
+		if (strncmp(item->key, prefix, prefixlen) == 0) item->dropped = 1;
+	}
+
+	/* The index is sorted, so the files for the host are all together */
+	for (idx = (dsindexmap ? dsindex_lowerbound(prefix) : dsindexcount); (idx < dsindexcount); idx++) {
+		dsindexrec_t rec;
+		char *key, *names;
+
+		if (dsindex_rec(dsindexmap, dsindexsize, idx, &rec, &key, &names) != 0) break;
+		if (strncmp(key, prefix, prefixlen) != 0) break;
+		dscache_add(key, &rec, names)->dropped = 1;
+	}
+
+	xfree(prefix);
+}
+
+static int dscache_compare(const void *v1, const void *v2)
+{
+	return strcmp(((dscacheitem_t *)v1)->key, ((dscacheitem_t *)v2)->key);
+}
+
+void rrddscachesave(void)
+{
+	/*
+	 * Write the index file. Another xymond_rrd may have saved the index
+	 * since we loaded it, so merge our cache with what is on disk now.
+	 */
+	unsigned char *curmap;
+	size_t cursize = 0;
+	unsigned int curcount = 0, i, n = 0, ofs;
+	dscacheitem_t *items;
+	xtreePos_t handle;
+	time_t now = getcurrenttime(NULL);
+	char tmpfn[PATH_MAX];
+	dsindexhdr_t hdr;
+	FILE *fd;
+
+	if (!dscachefn || !dscache_dirty) return;
+
+	curmap = dsindex_map(dscachefn, &cursize, &curcount);
+
+	items = (dscacheitem_t *)malloc((curcount + 1) * sizeof(dscacheitem_t));
+	for (handle = xtreeFirst(dscache); (handle != xtreeEnd(dscache)); handle = xtreeNext(dscache, handle)) {
+		dscacheitem_t *item = (dscacheitem_t *)xtreeData(dscache, handle);
+
+		if (item->dropped || ((item->rec.lastused + DSCACHE_MAXAGE) < now)) continue;
+		items = (dscacheitem_t *)realloc(items, (curcount + n + 1) * sizeof(dscacheitem_t));
+		memcpy(&items[n++], item, sizeof(dscacheitem_t));
+	}
+	for (i = 0; (i < curcount); i++) {
+		dscacheitem_t *item = &items[n];
+
+		if (dsindex_rec(curmap, cursize, i, &item->rec, &item->key, &item->names) != 0) break;
+		if ((item->rec.lastused + DSCACHE_MAXAGE) < now) continue;
+		if (xtreeFind(dscache, item->key) != xtreeEnd(dscache)) continue;
+		n++;
+	}
+	qsort(items, n, sizeof(dscacheitem_t), dscache_compare);
+
+	snprintf(tmpfn, sizeof(tmpfn), "%s.%d", dscachefn, (int)getpid());
+	fd = fopen(tmpfn, "w");
+	if (fd == NULL) {
+		errprintf("Cannot save dataset cache to %s: %s\n", tmpfn, strerror(errno));
+	}
+	else {
+		memset(&hdr, 0, sizeof(hdr));
+		memcpy(hdr.magic, DSINDEX_MAGIC, sizeof(hdr.magic));
+		hdr.count = n;
+		fwrite(&hdr, sizeof(hdr), 1, fd);
+		ofs = sizeof(hdr) + n*sizeof(unsigned int);
+		for (i = 0; (i < n); i++) {
+			fwrite(&ofs, sizeof(ofs), 1, fd);
+			ofs += sizeof(dsindexrec_t) + items[i].rec.keylen + items[i].rec.nameslen;
+		}
+		for (i = 0; (i < n); i++) {
+			fwrite(&items[i].rec, sizeof(dsindexrec_t), 1, fd);
+			fwrite(items[i].key, items[i].rec.keylen, 1, fd);
+			fwrite(items[i].names, items[i].rec.nameslen, 1, fd);
+		}
+
+		if ((fclose(fd) == 0) && (rename(tmpfn, dscachefn) == 0)) {
+			dbgprintf("Saved %u dataset cache entries to %s\n", n, dscachefn);
+			dscache_dirty = 0;
+		}
+		else {
+			errprintf("Cannot save dataset cache to %s: %s\n", dscachefn, strerror(errno));
+			unlink(tmpfn);
+		}
+	}
+
+	xfree(items);
+	if (curmap) munmap(curmap, cursize);
+}
+
+static int rrd_file_datasets(char *filename, char ***dsnames)
+{
+	int result;
+	char *fetch_params[] = { "rrdfetch", filename, "AVERAGE", "-s", "-30m", NULL };
+	time_t starttime, endtime;
+	unsigned long steptime, dscount, i;
+	rrd_value_t *rrddata;
+	struct stat st;
+	dscacheitem_t *item;
+	dsindexrec_t rec;
+	strbuffer_t *names;
+	char *p;
+
+	if (stat(filename, &st) == -1) return 0;
+
+	item = dscache_find(filename);
+	if (item && (item->rec.inode == (unsigned long long)st.st_ino) && (item->rec.size == (unsigned long long)st.st_size)) {
+		stat_dscachehits++;
+		if (item->rec.lastused < (getcurrenttime(NULL) - 86400)) {
+			item->rec.lastused = getcurrenttime(NULL);
+			dscache_dirty = 1;
+		}
+
+		*dsnames = (char **)malloc(item->rec.dscount * sizeof(char *));
+		for (i = 0, p = item->names; (i < item->rec.dscount); i++, p += strlen(p)+1) (*dsnames)[i] = strdup(p);
+
+		return item->rec.dscount;
+	}
+
+	optind = opterr = 0; rrd_clear_error();
+	result = rrd_fetch(5, fetch_params, &starttime, &endtime, &steptime, &dscount, dsnames, &rrddata);
+	if (result == -1) {
+		errprintf("Error while retrieving RRD dataset names from %s: %s\n",
+			  filename, rrd_get_error());
+		return 0;
+	}
+
+	free(rrddata);	/* No use for the actual data */
+	stat_dscachereads++;
+
+	names = newstrbuffer(0);
+	for (i = 0; (i < dscount); i++) addtobufferraw(names, (*dsnames)[i], strlen((*dsnames)[i])+1);
+	memset(&rec, 0, sizeof(rec));
+	rec.inode = st.st_ino;
+	rec.size = st.st_size;
+	rec.lastused = getcurrenttime(NULL);
+	rec.dscount = dscount;
+	rec.keylen = strlen(filename) + 1;
+	rec.nameslen = STRBUFLEN(names);
+	dscache_add(filename, &rec, STRBUF(names));
+	freestrbuffer(names);
+
+	return dscount;
+}
+
+/*
+ * The "tsdb" backend keeps all of the datasets for a host in the host
+ * directory, in one append-only file (see lib/tsdb.c). The filenames
+ * are the same as for the RRD files, the basename is the series name.
+ */
+static char *tsdb_splitname(char *filename, char *hostdir)
+{
+	char *p = strrchr(filename, '/');
+
+	if (!p) {
+		strcpy(hostdir, ".");
+		return filename;
+	}
+
+	*p = '\0';
+	snprintf(hostdir, PATH_MAX, "%s", filename);
+	*p = '/';
+	return p+1;
+}
+
+static int tsdb_file_exists(char *filename)
+{
+	char hostdir[PATH_MAX];
+	char *name = tsdb_splitname(filename, hostdir);
+
+	return (tsdb_findseries(hostdir, name) != NULL);
+}
+
+static int tsdb_create_file(int pcount, char **params)
+{
+	char hostdir[PATH_MAX];
+	char *name = tsdb_splitname(params[1], hostdir);
+
+	return tsdb_define(hostdir, name, pcount, params, 1);
+}
+
+static void tsdb_created_file(int pcount, char **params)
+{
+	/* An RRD writer stores the definition, we just need to know about it */
+	char hostdir[PATH_MAX];
+	char *name = tsdb_splitname(params[1], hostdir);
+
+	tsdb_define(hostdir, name, pcount, params, 0);
+}
+
+static int tsdb_update_file(int pcount, char **params, char *sender)
+{
+	/* params are "rrdupdate" FILENAME "-t" TEMPLATE VALUES... */
+	char hostdir[PATH_MAX];
+	char *name = tsdb_splitname(params[1], hostdir);
+	int result;
+
+	if (pcount < 5) return 0;
+	result = tsdb_append(hostdir, name, params[3], pcount - 4, params + 4);
+	if (result != 0) errprintf("tsdb error updating %s from %s\n", params[1], (sender ? sender : "unknown"));
+
+	return result;
+}
+
+static int tsdb_file_datasets(char *filename, char ***dsnames)
+{
+	char hostdir[PATH_MAX];
+	char *name = tsdb_splitname(filename, hostdir);
+	tsdbseries_t *series;
+	int i;
+
+	series = tsdb_findseries(hostdir, name);
+	if (!series) return 0;
+
+	*dsnames = (char **)malloc(series->dscount * sizeof(char *));
+	for (i = 0; (i < series->dscount); i++) (*dsnames)[i] = strdup(series->ds[i].name);
+
+	return series->dscount;
+}
+
+/*
+ * Storage backends. They all get rrdcreate/rrdupdate-style parameters with
+ * the full filename in params[1], so the rest of the code (and the RRD writers)
+ * need not care where the data goes.
+ */
+typedef struct rrdbackend_t {
+	char *name;
+	int (*exists)(char *filename);
+	int (*create)(int pcount, char **params);
+	void (*created)(int pcount, char **params);	/* Create was queued for an RRD writer */
+	int (*update)(int pcount, char **params, char *sender);
+	int (*datasets)(char *filename, char ***dsnames);
+	void (*drophost)(char *hostdir);		/* Host directory is being removed or renamed */
+} rrdbackend_t;
+
+static rrdbackend_t rrdbackends[] = {
+	{ "rrd", rrd_file_exists, rrd_create_file, NULL, rrd_update_file, rrd_file_datasets, NULL },
+	{ "tsdb", tsdb_file_exists, tsdb_create_file, tsdb_created_file, tsdb_update_file, tsdb_file_datasets, tsdb_forget },
+	{ NULL, NULL, NULL, NULL, NULL, NULL, NULL }
+};
+static rrdbackend_t *rrdbackend = &rrdbackends[0];
+
+int rrdbackend_select(char *name)
+{
+	int i;
+
+	for (i = 0; (rrdbackends[i].name && strcmp(rrdbackends[i].name, name)); i++) ;
+	if (rrdbackends[i].name == NULL) return -1;
+
+	rrdbackend = &rrdbackends[i];
+	return 0;
+}
+
+static int rrdwriter_io(int fd, void *buf, size_t len, int writing)
+{
+	char *p = (char *)buf;
+	ssize_t n;
+
+	while (len > 0) {
+		n = (writing ? write(fd, p, len) : read(fd, p, len));
+		if (n > 0) {
+			p += n;
+			len -= n;
+		}
+		else if ((n == -1) && (errno == EINTR)) {
+			continue;
+		}
+		else {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static void rrdwriter_main(int cmdfd, int replyfd)
+{
+	rrdwrhdr_t hdr;
+	char *data = NULL;
+	char **params = NULL;
+	int datasz = 0, paramsz = 0;
+
+	while (rrdwriter_io(cmdfd, &hdr, sizeof(hdr), 0) == 0) {
+		struct stat st;
+		char *p;
+		int i;
+
+		if (hdr.datalen > datasz) {
+			datasz = hdr.datalen;
+			data = (char *)realloc(data, datasz);
+		}
+		if ((hdr.argc + 1) > paramsz) {
+			paramsz = hdr.argc + 1;
+			params = (char **)realloc(params, paramsz * sizeof(char *));
+		}
+		if ((hdr.datalen > 0) && (rrdwriter_io(cmdfd, data, hdr.datalen, 0) != 0)) break;
+
+		for (i = 0, p = data; (i < hdr.argc); i++) {
+			params[i] = p;
+			p += strlen(p) + 1;
+		}
+		params[hdr.argc] = NULL;
+
+		switch (hdr.op) {
+		  case RRDWR_CREATE:
+			/* Create the host directory if needed */
+			p = strrchr(params[1], '/');
+			if (p) {
+				*p = '\0';
+				if ((stat(params[1], &st) == -1) && (mkdir(params[1], S_IRWXU|S_IRGRP|S_IXGRP|S_IROTH|S_IXOTH) == -1)) {
+					errprintf("Cannot create rrd directory %s : %s\n", params[1], strerror(errno));
+				}
+				*p = '/';
+			}
+
+			/* The same file may have been queued for creation more than once */
+			if (!rrdbackend->exists(params[1])) {
+				dbgprintf("Creating rrd %s\n", params[1]);
+				rrdbackend->create(hdr.argc, params);
+			}
+			break;
+
+		  case RRDWR_UPDATE:
+			/* params[0] is the sender IP, the rrdupdate parameters follow */
+			rrdbackend->update(hdr.argc - 1, params + 1, params[0]);
+			break;
+
+		  case RRDWR_DROPHOST:
+			if (rrdbackend->drophost) rrdbackend->drophost(params[0]);
+			dropdirectory(params[0], 0);
+			break;
+
+		  case RRDWR_RENAMEHOST:
+			if (rrdbackend->drophost) {
+				rrdbackend->drophost(params[0]);
+				rrdbackend->drophost(params[1]);
+			}
+			rename(params[0], params[1]);
+			break;
+
+		  case RRDWR_SYNC:
+			rrdwriter_io(replyfd, "", 1, 1);
+			break;
+		}
+
+	}
+
+	exit(0);
+}
+
+static int rrdwriter_fork(int idx)
+{
+	int cmdpipe[2], replypipe[2];
+	pid_t childpid;
+	int i;
+
+	if (pipe(cmdpipe) == -1) {
+		errprintf("Could not get a pipe: %s\n", strerror(errno));
+		return -1;
+	}
+	if (pipe(replypipe) == -1) {
+		errprintf("Could not get a pipe: %s\n", strerror(errno));
+		close(cmdpipe[0]); close(cmdpipe[1]);
+		return -1;
+	}
+#ifdef F_SETPIPE_SZ
+	/* Let the writer fall further behind before we block */
+	fcntl(cmdpipe[1], F_SETPIPE_SZ, 1024*1024);
+#endif
+
+	fflush(stdout); fflush(stderr);
+	childpid = fork();
+	if (childpid == -1) {
+		errprintf("Could not fork RRD writer: %s\n", strerror(errno));
+		close(cmdpipe[0]); close(cmdpipe[1]);
+		close(replypipe[0]); close(replypipe[1]);
+		return -1;
+	}
+	else if (childpid == 0) {
+		/* Close the descriptors belonging to the parent and to the other writers */
+		close(cmdpipe[1]); close(replypipe[0]);
+		close(STDIN_FILENO);
+		if (processorfd) close(processorfd);
+		processorfd = 0; processorstream = NULL;
+		for (i = 0; (i < rrdwritercount); i++) {
+			if ((i == idx) || (rrdwriters[i].pid <= 0)) continue;
+			close(rrdwriters[i].cmdfd);
+			close(rrdwriters[i].replyfd);
+		}
+
+		/* A restarted writer must not trust what the parent knows about the tsdb files */
+		if (rrdbackend->drophost) rrdbackend->drophost(NULL);
+
+		rrdwriter_main(cmdpipe[0], replypipe[1]);
+	}
+
+	close(cmdpipe[0]); close(replypipe[1]);
+	rrdwriters[idx].pid = childpid;
+	rrdwriters[idx].cmdfd = cmdpipe[1];
+	rrdwriters[idx].replyfd = replypipe[0];
+
+	return 0;
+}
+
+static void rrdwriter_close(int idx)
+{
+	if (rrdwriters[idx].pid <= 0) return;
+
+	close(rrdwriters[idx].cmdfd);
+	close(rrdwriters[idx].replyfd);
+	waitpid(rrdwriters[idx].pid, NULL, 0);
+	rrdwriters[idx].pid = 0;
+}
+
+static unsigned int rrdkeyhash(char *key, char endchar)
+{
+	/* Case-insensitive hash of "key", up to "endchar" or the end of the string */
+	unsigned int hashval = 0;
+	char *p;
+
+	for (p = key; (*p && (*p != endchar)); p++) hashval = (hashval * 31) + tolower((int)*p);
+
+	return hashval;
+}
+
+static int rrdwriter_shard(char *key)
+{
+	/* key is "/hostname/filename" - all files for a host go to the same writer */
+	char *p = key;
+
+	if (*p == '/') p++;
+
+	return (rrdkeyhash(p, '/') % rrdwritercount);
+}
+
+static void rrdwriter_send(int idx, int op, int argc, char **argv)
+{
+	static char *buf = NULL;
+	static int bufsz = 0;
+	rrdwrhdr_t hdr;
+	int i, len, attempt;
+
+	hdr.op = op;
+	hdr.argc = argc;
+	hdr.datalen = 0;
+	for (i = 0; (i < argc); i++) hdr.datalen += strlen(argv[i]) + 1;
+
+	if ((sizeof(hdr) + hdr.datalen) > bufsz) {
+		bufsz = sizeof(hdr) + hdr.datalen + 4096;
+		buf = (char *)realloc(buf, bufsz);
+	}
+	memcpy(buf, &hdr, sizeof(hdr));
+	for (i = 0, len = sizeof(hdr); (i < argc); i++) {
+		strcpy(buf + len, argv[i]);
+		len += strlen(argv[i]) + 1;
+	}
+
+	for (attempt = 0; (attempt < 2); attempt++) {
+		if ((rrdwriters[idx].pid > 0) && (rrdwriter_io(rrdwriters[idx].cmdfd, buf, len, 1) == 0)) return;
+
+		/* The writer has died. Start a new one and try again */
+		errprintf("RRD writer %d failed, restarting it\n", idx);
+		rrdwriter_close(idx);
+		if (rrdwriter_fork(idx) != 0) break;
+	}
+
+	errprintf("Could not pass request to RRD writer %d, data lost\n", idx);
+}
+
+static void rrdwriter_sync(int idx)
+{
+	/* Wait until the writer has handled everything we have sent to it */
+	char c;
+
+	rrdwriter_send(idx, RRDWR_SYNC, 0, NULL);
+	if ((rrdwriters[idx].pid > 0) && (rrdwriter_io(rrdwriters[idx].replyfd, &c, 1, 0) != 0)) {
+		errprintf("No response from RRD writer %d\n", idx);
+	}
+}
+
+void rrdwriter_start(int count)
+{
+	int i;
+
+	if (count <= 0) return;
+
+	rrdwriters = (rrdwriter_t *)calloc(count, sizeof(rrdwriter_t));
+	rrdwritercount = count;
+	for (i = 0; (i < count); i++) {
+		if (rrdwriter_fork(i) != 0) {
+			errprintf("Could not start RRD writers, updating RRD files directly\n");
+			rrdwriter_stop();
+			return;
+		}
+	}
+
+	errprintf("Started %d RRD writers\n", count);
+}
+
+void rrdwriter_stop(void)
+{
+	int i;
+
+	/* Closing the request pipe makes the writer finish its queue and exit */
+	for (i = 0; (i < rrdwritercount); i++) {
+		if (rrdwriters[i].pid > 0) close(rrdwriters[i].cmdfd);
+	}
+	for (i = 0; (i < rrdwritercount); i++) {
+		if (rrdwriters[i].pid > 0) {
+			close(rrdwriters[i].replyfd);
+			waitpid(rrdwriters[i].pid, NULL, 0);
+		}
+	}
+
+	if (rrdwriters) xfree(rrdwriters);
+	rrdwritercount = 0;
+}
+
+void rrddrophost(char *hostname)
+{
+	char hostdir[PATH_MAX];
+
+	MEMDEFINE(hostdir);
+
+	snprintf(hostdir, sizeof(hostdir), "%s/%s", rrddir, basename(hostname));
+	if (rrdbackend->drophost) rrdbackend->drophost(hostdir);
+	dscache_drophost(hostdir);
+	if (rrdwritercount) {
+		char *params[1];
+		int idx = rrdwriter_shard(hostdir + strlen(rrddir));
+
+		/*
+		 * The writer completes any pending updates for the host before
+		 * removing the files. Wait for it, so that new updates for the
+		 * host see that the RRD files must be created again.
+		 */
+		params[0] = hostdir;
+		rrdwriter_send(idx, RRDWR_DROPHOST, 1, params);
+		rrdwriter_sync(idx);
+	}
+	else {
+		/*
+		 * A host may have lots of RRD files, so delete them in the background.
+		 * The tsdb backend has just two files per host, and deleting those after
+		 * new updates have come in would lose the series definitions.
+		 */
+		dropdirectory(hostdir, (rrdbackend->drophost == NULL));
+	}
+
+	MEMUNDEFINE(hostdir);
+}
+
+void rrdrenamehost(char *oldhostname, char *newhostname)
+{
+	char oldhostdir[PATH_MAX];
+	char newhostdir[PATH_MAX];
+
+	MEMDEFINE(oldhostdir);
+	MEMDEFINE(newhostdir);
+
+	snprintf(oldhostdir, sizeof(oldhostdir), "%s/%s", rrddir, oldhostname);
+	snprintf(newhostdir, sizeof(newhostdir), "%s/%s", rrddir, newhostname);
+	if (rrdbackend->drophost) {
+		rrdbackend->drophost(oldhostdir);
+		rrdbackend->drophost(newhostdir);
+	}
+	dscache_drophost(oldhostdir);
+	dscache_drophost(newhostdir);
+	if (rrdwritercount) {
+		char *params[2];
+		int idx = rrdwriter_shard(oldhostdir + strlen(rrddir));
+
+		/*
+		 * The new hostname may belong to another writer, so wait for the
+		 * rename to complete before any updates for the new name are queued.
+		 */
+		params[0] = oldhostdir;
+		params[1] = newhostdir;
+		rrdwriter_send(idx, RRDWR_RENAMEHOST, 2, params);
+		rrdwriter_sync(idx);
+	}
+	else {
+		rename(oldhostdir, newhostdir);
+	}
+
+	MEMUNDEFINE(newhostdir);
+	MEMUNDEFINE(oldhostdir);
+}
+
 static int flush_cached_updates(updcacheitem_t *cacheitem, char *newdata)
 {
-	/* Flush any updates we've cached */
-	char *updparams[5+CACHESZ+1] = { "rrdupdate", filedir, "-t", NULL, NULL, NULL, };
+	/* Flush any updates we've cached. updparams[0] is for the rrd writer, rrdupdate gets the rest. */
+	char *updparams[6+CACHESZ+1] = { NULL, "rrdupdate", filedir, "-t", NULL, NULL, NULL, };
 	int i, pcount, result;
+	struct timespec tstart, tend, tdiff;
+	double flushms;
 
-	dbgprintf("Flushing '%s' with %d updates pending, template '%s'\n", 
+	dbgprintf("Flushing '%s' with %d updates pending, template '%s'\n",
 		  cacheitem->key, (newdata ? 1 : 0) + cacheitem->valcount, cacheitem->tpl->template);
 
 	/* ISO C90: parameters cannot be used as initializers */
-	updparams[3] = cacheitem->tpl->template;
+	updparams[0] = (senderip ? senderip : "unknown");
+	updparams[4] = cacheitem->tpl->template;
 
 	/* Setup the parameter list with all of the cached and new readings */
-	for (i=0; (i < cacheitem->valcount); i++) updparams[4+i] = cacheitem->vals[i];
+	for (i=0; (i < cacheitem->valcount); i++) updparams[5+i] = cacheitem->vals[i];
 
 	if (newdata) {
-		updparams[4+cacheitem->valcount] = newdata;
-		updparams[4+cacheitem->valcount+1] = NULL;
+		updparams[5+cacheitem->valcount] = newdata;
+		updparams[5+cacheitem->valcount+1] = NULL;
 	}
 	else {
 		/* No new data - happens when flushing the cache */
-		updparams[4+cacheitem->valcount] = NULL;
+		updparams[5+cacheitem->valcount] = NULL;
 	}
 
-	for (pcount = 0; (updparams[pcount]); pcount++);
-	optind = opterr = 0; rrd_clear_error();
-	result = rrd_update(pcount, updparams);
+	for (pcount = 0; (updparams[pcount+1]); pcount++);
+	getntimer(&tstart);
+	if (rrdwritercount) {
+		rrdwriter_send(rrdwriter_shard(cacheitem->key), RRDWR_UPDATE, pcount+1, updparams);
+		result = 0;
+	}
+	else {
+		result = rrdbackend->update(pcount, updparams+1, senderip);
+	}
 
-#if defined(LINUX) && defined(RRDTOOL12)
-	/*
-	 * RRDtool 1.2+ uses mmap'ed I/O, but the Linux kernel does not update timestamps when
-	 * doing file I/O on mmap'ed files. This breaks our check for stale/nostale RRD's.
-	 * So do an explicit timestamp update on the file here.
-	 */
-	utimes(filedir, NULL);
-#endif
+	getntimer(&tend);
+	tvdiff(&tstart, &tend, &tdiff);
+	flushms = tdiff.tv_sec*1000.0 + tdiff.tv_nsec/1000000.0;
+	stat_flushes++;
+	stat_flushvalues += pcount - 4;	/* Not "rrdupdate", the filename, "-t" and the template */
+	stat_flushms += flushms;
+	if (flushms > stat_flushmaxms) stat_flushmaxms = flushms;
 
 	/* Clear the cached data */
 	for (i=0; (i < cacheitem->valcount); i++) {
 		cacheitem->updseq[i] = 0;
 		cacheitem->updtime[i] = 0;
-		if (cacheitem->vals[i]) xfree(cacheitem->vals[i]);
+		if (cacheitem->vals[i]) {
+			cachedbytes -= strlen(cacheitem->vals[i]) + 1;
+			xfree(cacheitem->vals[i]);
+		}
+	}
+	if (cacheitem->valcount > 0) {
+		/* Take it off the list for the flush slot */
+		if (cacheitem->prevdirty) cacheitem->prevdirty->nextdirty = cacheitem->nextdirty;
+		else flushslots[cacheitem->flushslot] = cacheitem->nextdirty;
+		if (cacheitem->nextdirty) cacheitem->nextdirty->prevdirty = cacheitem->prevdirty;
+		cacheitem->prevdirty = cacheitem->nextdirty = NULL;
+
+		cachedfiles--;
+		cachedvalues -= cacheitem->valcount;
 	}
 	cacheitem->valcount = 0;
 
@@ -263,7 +1159,6 @@ static int flush_cached_updates(updcacheitem_t *cacheitem, char *newdata)
 
 static int create_and_update_rrd(char *hostname, char *testname, char *classname, char *pagepaths, char *creparams[], void *template)
 {
-	static int callcounter = 0;
 	struct stat st;
 	int pcount, result;
 	char *updcachekey;
@@ -285,8 +1180,9 @@ static int create_and_update_rrd(char *hostname, char *testname, char *classname
 	MEMDEFINE(rrdvalues);
 	MEMDEFINE(filedir);
 
+	/* The RRD writers create the host directory along with the RRD file */
 	sprintf(filedir, "%s/%s", rrddir, hostname);
-	if (stat(filedir, &st) == -1) {
+	if (!rrdwritercount && (stat(filedir, &st) == -1)) {
 		if (mkdir(filedir, S_IRWXU|S_IRGRP|S_IXGRP|S_IROTH|S_IXOTH) == -1) {
 			errprintf("Cannot create rrd directory %s : %s\n", filedir, strerror(errno));
 			MEMUNDEFINE(filedir);
@@ -306,6 +1202,9 @@ static int create_and_update_rrd(char *hostname, char *testname, char *classname
 	if (updcache_keyofs == -1) {
 		updcache = xtreeNew(strcasecmp);
 		updcache_keyofs = strlen(rrddir);
+		flushslotcount = ((rrdcache_maxage > 0) ? rrdcache_maxage : 1);
+		flushslots = (updcacheitem_t **)calloc(flushslotcount, sizeof(updcacheitem_t *));
+		lastflushtime = gettimer();
 	}
 	updcachekey = filedir + updcache_keyofs;
 	handle = xtreeFind(updcache, updcachekey);
@@ -321,6 +1220,7 @@ static int create_and_update_rrd(char *hostname, char *testname, char *classname
 		cacheitem = (updcacheitem_t *)calloc(1, sizeof(updcacheitem_t));
 		cacheitem->key = strdup(updcachekey);
 		cacheitem->tpl = template;
+		cacheitem->flushslot = (rrdkeyhash(cacheitem->key, '\0') % flushslotcount);
 		xtreeAdd(updcache, cacheitem->key, cacheitem);
 	}
 	else {
@@ -329,7 +1229,7 @@ static int create_and_update_rrd(char *hostname, char *testname, char *classname
 	}
 
 	/* If the RRD file doesn't exist, create it immediately */
-	if (stat(filedir, &st) == -1) {
+	if (!rrdbackend->exists(filedir)) {
 		char **rrdcreate_params, **rrddefinitions;
 		int rrddefcount, i;
 		char *rrakey = NULL;
@@ -373,17 +1273,19 @@ static int create_and_update_rrd(char *hostname, char *testname, char *classname
 			}
 		}
 
-		/*
-		 * Ugly! RRDtool uses getopt() for parameter parsing, so
-		 * we MUST reset this before every call.
-		 */
-		optind = opterr = 0; rrd_clear_error();
-		result = rrd_create(4+pcount, rrdcreate_params);
+		for (pcount = 0; (rrdcreate_params[pcount]); pcount++) ;
+		if (rrdwritercount) {
+			rrdwriter_send(rrdwriter_shard(updcachekey), RRDWR_CREATE, pcount, rrdcreate_params);
+			if (rrdbackend->created) rrdbackend->created(pcount, rrdcreate_params);
+			result = 0;
+		}
+		else {
+			result = rrdbackend->create(pcount, rrdcreate_params);
+		}
 		xfree(rrdcreate_params);
 		if (rrakey) xfree(rrakey);
 
 		if (result != 0) {
-			errprintf("RRD error creating %s: %s\n", filedir, rrd_get_error());
 			MEMUNDEFINE(filedir);
 			MEMUNDEFINE(rrdvalues);
 			return 1;
@@ -463,43 +1365,39 @@ static int create_and_update_rrd(char *hostname, char *testname, char *classname
 	/* Are we actually handling the writing of RRD files? */
 	if (no_rrd) return 0;
 
-	/* 
-	 * We cannot just cache data every time because then after CACHESZ updates
-	 * of each RRD, we will flush all of the data at once (all of the caches 
-	 * fill at the same speed); this would result in huge load-spikes every 
-	 * rrdinterval*CACHESZ seconds.
-	 *
-	 * So to smooth the load, we force the update through for every CACHESZ 
-	 * updates, regardless of how much is in the cache. This gives us a steady 
-	 * (although slightly higher) load.
+	/*
+	 * Cache the update until the flush slot for this file comes up, see
+	 * rrdcacheflushdue(). If the cache for the file is full, write it
+	 * out now.
 	 */
-	if (use_rrd_cache && (++callcounter < CACHESZ)) {
-		if (cacheitem && (cacheitem->valcount < CACHESZ)) {
+	if (use_rrd_cache) {
+		if (cacheitem->valcount < CACHESZ) {
+			if (cacheitem->valcount == 0) {
+				/* Put it on the list for the flush slot */
+				cacheitem->prevdirty = NULL;
+				cacheitem->nextdirty = flushslots[cacheitem->flushslot];
+				if (cacheitem->nextdirty) cacheitem->nextdirty->prevdirty = cacheitem;
+				flushslots[cacheitem->flushslot] = cacheitem;
+				cachedfiles++;
+			}
+
 			cacheitem->updseq[cacheitem->valcount] = seq;
 			cacheitem->updtime[cacheitem->valcount] = updtime;
 			cacheitem->vals[cacheitem->valcount] = strdup(rrdvalues);
 			cacheitem->valcount += 1;
+			cachedvalues++;
+			cachedbytes += strlen(rrdvalues) + 1;
 			MEMUNDEFINE(filedir);
 			MEMUNDEFINE(rrdvalues);
 			return 0;
 		}
+
+		stat_fullflushes++;
 	}
-	else callcounter = 0;
 
 	/* At this point, we will commit the update to disk */
 	result = flush_cached_updates(cacheitem, rrdvalues);
 	if (result != 0) {
-		char *msg = rrd_get_error();
-
-		if (strstr(msg, "(minimum one second step)") != NULL) {
-			dbgprintf("RRD error updating %s from %s: %s\n", 
-				  filedir, (senderip ? senderip : "unknown"), msg);
-		}
-		else {
-			errprintf("RRD error updating %s from %s: %s\n", 
-				  filedir, (senderip ? senderip : "unknown"), msg);
-		}
-
 		MEMUNDEFINE(filedir);
 		MEMUNDEFINE(rrdvalues);
 		return 2;
@@ -583,32 +1481,124 @@ void rrdcacheflushhost(char *hostname)
 			break;
 		}
 	}
+
+	/* Make sure the data is on disk before we return */
+	if (rrdwritercount) rrdwriter_sync(rrdwriter_shard(hostname));
 }
 
-static int rrddatasets(char *hostname, char ***dsnames)
+static void flush_slot(int slot, unsigned long maxbytes)
 {
-	struct stat st;
+	/* Flush the files on the list for a slot, or just enough to get below maxbytes cached */
+	while (flushslots[slot] && (!maxbytes || (cachedbytes > maxbytes))) {
+		updcacheitem_t *cacheitem = flushslots[slot];
 
-	int result;
-	char *fetch_params[] = { "rrdfetch", filedir, "AVERAGE", "-s", "-30m", NULL };
-	time_t starttime, endtime;
-	unsigned long steptime, dscount;
-	rrd_value_t *rrddata;
+		sprintf(filedir, "%s%s", rrddir, cacheitem->key);
+		flush_cached_updates(cacheitem, NULL);
+		if (maxbytes) stat_memflushes++;
+	}
+}
 
-	snprintf(filedir, sizeof(filedir)-1, "%s/%s/%s", rrddir, hostname, rrdfn);
-	filedir[sizeof(filedir)-1] = '\0';
-	if (stat(filedir, &st) == -1) return 0;
+void rrdcacheflushdue(void)
+{
+	time_t now;
+	int n;
 
-	optind = opterr = 0; rrd_clear_error();
-	result = rrd_fetch(5, fetch_params, &starttime, &endtime, &steptime, &dscount, dsnames, &rrddata);
-	if (result == -1) {
-		errprintf("Error while retrieving RRD dataset names from %s: %s\n",
-			  filedir, rrd_get_error());
-		return 0;
+	if (updcache_keyofs == -1) return; /* No cache */
+
+	now = gettimer();
+
+	/* Flush the files in the slots that have come up since we were last here */
+	for (n = 0; ((lastflushtime < now) && (n < flushslotcount)); n++) {
+		lastflushtime++;
+		flush_slot(lastflushtime % flushslotcount, 0);
 	}
+	lastflushtime = now;
 
-	free(rrddata);	/* No use for the actual data */
-	return dscount;
+	/*
+	 * If we use too much memory, flush files until we are 10% below the limit.
+	 * Go round-robin through the slots, so a file is not flushed again until
+	 * all of the other files have been flushed.
+	 */
+	if (rrdcache_maxmem && (cachedbytes > rrdcache_maxmem)) {
+		unsigned long lowmark = (rrdcache_maxmem / 10) * 9;
+
+		for (n = 0; ((n < flushslotcount) && (cachedbytes > lowmark)); ) {
+			flush_slot(memflushslot, lowmark);
+			if (flushslots[memflushslot] == NULL) {
+				memflushslot = ((memflushslot + 1) % flushslotcount);
+				n++;
+			}
+		}
+	}
+}
+
+char *rrdcachestats(void)
+{
+	static strbuffer_t *statsbuf = NULL;
+	char msgline[1024];
+	int i;
+
+	if (statsbuf == NULL) statsbuf = newstrbuffer(0); else clearstrbuffer(statsbuf);
+
+	addtobuffer(statsbuf, "Update cache:\n");
+	sprintf(msgline, "- Files with cached data   : %10lu\n", cachedfiles);
+	addtobuffer(statsbuf, msgline);
+	sprintf(msgline, "- Cached updates           : %10lu\n", cachedvalues);
+	addtobuffer(statsbuf, msgline);
+	if (rrdcache_maxmem)
+		sprintf(msgline, "- Cached bytes             : %10lu (limit %lu)\n", cachedbytes, rrdcache_maxmem);
+	else
+		sprintf(msgline, "- Cached bytes             : %10lu\n", cachedbytes);
+	addtobuffer(statsbuf, msgline);
+	sprintf(msgline, "- Max. cache time (seconds): %10d\n", (use_rrd_cache ? rrdcache_maxage : 0));
+	addtobuffer(statsbuf, msgline);
+
+	addtobuffer(statsbuf, "\nFlushes since last report:\n");
+	sprintf(msgline, "- Files flushed            : %10lu\n", stat_flushes);
+	addtobuffer(statsbuf, msgline);
+	sprintf(msgline, "- Updates written          : %10lu\n", stat_flushvalues);
+	addtobuffer(statsbuf, msgline);
+	sprintf(msgline, "- Flushed due to full cache: %10lu\n", stat_fullflushes);
+	addtobuffer(statsbuf, msgline);
+	sprintf(msgline, "- Flushed due to mem. limit: %10lu\n", stat_memflushes);
+	addtobuffer(statsbuf, msgline);
+	sprintf(msgline, "- Avg. flush time (ms)     : %10.2f\n", (stat_flushes ? (stat_flushms / stat_flushes) : 0.0));
+	addtobuffer(statsbuf, msgline);
+	sprintf(msgline, "- Max. flush time (ms)     : %10.2f\n", stat_flushmaxms);
+	addtobuffer(statsbuf, msgline);
+	sprintf(msgline, "- Dataset names cached     : %10lu\n", stat_dscachehits);
+	addtobuffer(statsbuf, msgline);
+	sprintf(msgline, "- Dataset names from files : %10lu\n", stat_dscachereads);
+	addtobuffer(statsbuf, msgline);
+
+	if (rrdwritercount) {
+		/* With writers, the flush time is how long it takes to queue the update */
+		addtobuffer(statsbuf, "\nRRD writers:\n");
+		for (i = 0; (i < rrdwritercount); i++) {
+			int backlog = 0;
+
+#ifdef FIONREAD
+			if ((rrdwriters[i].pid <= 0) || (ioctl(rrdwriters[i].cmdfd, FIONREAD, &backlog) == -1)) backlog = -1;
+#endif
+			sprintf(msgline, "- Writer %-2d queued bytes  : %10d\n", i, backlog);
+			addtobuffer(statsbuf, msgline);
+		}
+	}
+
+	stat_flushes = stat_flushvalues = stat_fullflushes = stat_memflushes = 0;
+	stat_dscachehits = stat_dscachereads = 0;
+	stat_flushms = stat_flushmaxms = 0.0;
+
+	return STRBUF(statsbuf);
+}
+
+static int rrddatasets(char *hostname, char ***dsnames)
+{
+	snprintf(filedir, sizeof(filedir)-1, "%s/%s/%s", rrddir, hostname, rrdfn);
+	filedir[sizeof(filedir)-1] = '\0';
+	if (!rrdbackend->exists(filedir)) return 0;
+
+	return rrdbackend->datasets(filedir, dsnames);
 }
 
 /* Include all of the sub-modules. */
@@ -675,100 +1665,241 @@ static int rrddatasets(char *hostname, char ***dsnames)
 #include "rrd/do_devmon.c"
 
 
-void update_rrd(char *hostname, char *testname, char *msg, time_t tstamp, char *sender, xymonrrd_t *ldef, char *classname, char *pagepaths)
+static int do_proccounts_rrd(char *hostname, char *testname, char *classname, char *pagepaths, char *msg, time_t tstamp)
 {
-	int res = 0;
-	char *id;
+	return do_counts_rrd("processes", hostname, testname, classname, pagepaths, msg, tstamp);
+}
 
-	MEMDEFINE(rrdvalues);
+static int do_portcounts_rrd(char *hostname, char *testname, char *classname, char *pagepaths, char *msg, time_t tstamp)
+{
+	return do_counts_rrd("ports", hostname, testname, classname, pagepaths, msg, tstamp);
+}
 
-	if (ldef) id = ldef->xymonrrdname; else id = testname;
-	senderip = sender;
+static int do_linecounts_rrd(char *hostname, char *testname, char *classname, char *pagepaths, char *msg, time_t tstamp)
+{
+	return do_derives_rrd("lines", hostname, testname, classname, pagepaths, msg, tstamp);
+}
+
+
+/*
+ * The RRD handlers, looked up by the RRD id of the test. The built-in handlers
+ * are listed here; the ids handled by the external script are added by
+ * rrdhandler_init(), and SNMP MIB ids are added the first time we see them.
+ */
+typedef int (*rrdhandler_fn_t)(char *hostname, char *testname, char *classname, char *pagepaths, char *msg, time_t tstamp);
 
-	if      (strcmp(id, "bbgen") == 0)       res = do_xymongen_rrd(hostname, testname, classname, pagepaths, msg, tstamp);
-	else if (strcmp(id, "xymongen") == 0)    res = do_xymongen_rrd(hostname, testname, classname, pagepaths, msg, tstamp);
-	else if (strcmp(id, "bbtest") == 0)      res = do_xymonnet_rrd(hostname, testname, classname, pagepaths, msg, tstamp);
-	else if (strcmp(id, "xymonnet") == 0)    res = do_xymonnet_rrd(hostname, testname, classname, pagepaths, msg, tstamp);
-	else if (strcmp(id, "bbproxy") == 0)     res = do_xymonproxy_rrd(hostname, testname, classname, pagepaths, msg, tstamp);
-	else if (strcmp(id, "xymonproxy") == 0)  res = do_xymonproxy_rrd(hostname, testname, classname, pagepaths, msg, tstamp);
-	else if (strcmp(id, "hobbitd") == 0)     res = do_xymond_rrd(hostname, testname, classname, pagepaths, msg, tstamp);
-	else if (strcmp(id, "xymond") == 0)      res = do_xymond_rrd(hostname, testname, classname, pagepaths, msg, tstamp);
-	else if (strcmp(id, "citrix") == 0)      res = do_citrix_rrd(hostname, testname, classname, pagepaths, msg, tstamp);
-	else if (strcmp(id, "ntpstat") == 0)     res = do_ntpstat_rrd(hostname, testname, classname, pagepaths, msg, tstamp);
-
-	else if (strcmp(id, "la") == 0)          res = do_la_rrd(hostname, testname, classname, pagepaths, msg, tstamp);
-	else if (strcmp(id, "disk") == 0)        res = do_disk_rrd(hostname, testname, classname, pagepaths, msg, tstamp);
-	else if (strcmp(id, "memory") == 0)      res = do_memory_rrd(hostname, testname, classname, pagepaths, msg, tstamp);
-	else if (strcmp(id, "netstat") == 0)     res = do_netstat_rrd(hostname, testname, classname, pagepaths, msg, tstamp);
-	else if (strcmp(id, "vmstat") == 0)      res = do_vmstat_rrd(hostname, testname, classname, pagepaths, msg, tstamp);
-	else if (strcmp(id, "iostat") == 0)      res = do_iostat_rrd(hostname, testname, classname, pagepaths, msg, tstamp);
-	else if (strcmp(id, "ifstat") == 0)      res = do_ifstat_rrd(hostname, testname, classname, pagepaths, msg, tstamp);
+static struct {
+	char *id;
+	rrdhandler_fn_t handler;
+	int aftersnmpmib;		/* An SNMP MIB definition with the same name takes precedence */
+} builtin_rrdhandlers[] = {
+	{ "bbgen",       do_xymongen_rrd, 0 },
+	{ "xymongen",    do_xymongen_rrd, 0 },
+	{ "bbtest",      do_xymonnet_rrd, 0 },
+	{ "xymonnet",    do_xymonnet_rrd, 0 },
+	{ "bbproxy",     do_xymonproxy_rrd, 0 },
+	{ "xymonproxy",  do_xymonproxy_rrd, 0 },
+	{ "hobbitd",     do_xymond_rrd, 0 },
+	{ "xymond",      do_xymond_rrd, 0 },
+	{ "citrix",      do_citrix_rrd, 0 },
+	{ "ntpstat",     do_ntpstat_rrd, 0 },
+
+	{ "la",          do_la_rrd, 0 },
+	{ "disk",        do_disk_rrd, 0 },
+	{ "memory",      do_memory_rrd, 0 },
+	{ "netstat",     do_netstat_rrd, 0 },
+	{ "vmstat",      do_vmstat_rrd, 0 },
+	{ "iostat",      do_iostat_rrd, 0 },
+	{ "ifstat",      do_ifstat_rrd, 0 },
 
 	/* These two come from the filerstats2bb.pl script. The reports are in disk-format */
-	else if (strcmp(id, "inode") == 0)       res = do_disk_rrd(hostname, testname, classname, pagepaths, msg, tstamp);
-	else if (strcmp(id, "qtree") == 0)       res = do_disk_rrd(hostname, testname, classname, pagepaths, msg, tstamp);
+	{ "inode",       do_disk_rrd, 0 },
+	{ "qtree",       do_disk_rrd, 0 },
 
-	else if (strcmp(id, "apache") == 0)      res = do_apache_rrd(hostname, testname, classname, pagepaths, msg, tstamp);
-	else if (strcmp(id, "sendmail") == 0)    res = do_sendmail_rrd(hostname, testname, classname, pagepaths, msg, tstamp);
-	else if (strcmp(id, "mailq") == 0)       res = do_mailq_rrd(hostname, testname, classname, pagepaths, msg, tstamp);
-	else if (strcmp(id, "iishealth") == 0)   res = do_iishealth_rrd(hostname, testname, classname, pagepaths, msg, tstamp);
-	else if (strcmp(id, "temperature") == 0) res = do_temperature_rrd(hostname, testname, classname, pagepaths, msg, tstamp);
+	{ "apache",      do_apache_rrd, 0 },
+	{ "sendmail",    do_sendmail_rrd, 0 },
+	{ "mailq",       do_mailq_rrd, 0 },
+	{ "iishealth",   do_iishealth_rrd, 0 },
+	{ "temperature", do_temperature_rrd, 0 },
 
-	else if (strcmp(id, "ncv") == 0)         res = do_ncv_rrd(hostname, testname, classname, pagepaths, msg, tstamp);
-	else if (strcmp(id, "tcp") == 0)         res = do_net_rrd(hostname, testname, classname, pagepaths, msg, tstamp);
+	{ "ncv",         do_ncv_rrd, 0 },
+	{ "tcp",         do_net_rrd, 0 },
 
-	else if (strcmp(id, "filesizes") == 0)   res = do_filesizes_rrd(hostname, testname, classname, pagepaths, msg, tstamp);
-	else if (strcmp(id, "proccounts") == 0)  res = do_counts_rrd("processes", hostname, testname, classname, pagepaths, msg, tstamp);
-	else if (strcmp(id, "portcounts") == 0)  res = do_counts_rrd("ports", hostname, testname, classname, pagepaths, msg, tstamp);
-	else if (strcmp(id, "linecounts") == 0)  res = do_derives_rrd("lines", hostname, testname, classname, pagepaths, msg, tstamp);
-	else if (strcmp(id, "trends") == 0)      res = do_trends_rrd(hostname, testname, classname, pagepaths, msg, tstamp);
+	{ "filesizes",   do_filesizes_rrd, 0 },
+	{ "proccounts",  do_proccounts_rrd, 0 },
+	{ "portcounts",  do_portcounts_rrd, 0 },
+	{ "linecounts",  do_linecounts_rrd, 0 },
+	{ "trends",      do_trends_rrd, 0 },
 
-	else if (strcmp(id, "ifmib") == 0)       res = do_ifmib_rrd(hostname, testname, classname, pagepaths, msg, tstamp);
-	else if (is_snmpmib_rrd(id))             res = do_snmpmib_rrd(hostname, testname, classname, pagepaths, msg, tstamp);
+	{ "ifmib",       do_ifmib_rrd, 0 },
 
 	/* z/OS, z/VSE, z/VM from Rich Smrcina */
-	else if (strcmp(id, "paging") == 0)      res = do_paging_rrd(hostname, testname, classname, pagepaths, msg, tstamp);
-	else if (strcmp(id, "mdc") == 0)         res = do_mdc_rrd(hostname, testname, classname, pagepaths, msg, tstamp);
-	else if (strcmp(id, "cics") == 0)        res = do_cics_rrd(hostname, testname, classname, pagepaths, msg, tstamp);
-	else if (strcmp(id, "getvis") == 0)      res = do_getvis_rrd(hostname, testname, classname, pagepaths, msg, tstamp);
-	else if (strcmp(id, "maxuser") == 0)     res = do_asid_rrd(hostname, testname, classname, pagepaths, msg, tstamp);
-	else if (strcmp(id, "nparts") == 0)      res = do_asid_rrd(hostname, testname, classname, pagepaths, msg, tstamp);
+	{ "paging",      do_paging_rrd, 1 },
+	{ "mdc",         do_mdc_rrd, 1 },
+	{ "cics",        do_cics_rrd, 1 },
+	{ "getvis",      do_getvis_rrd, 1 },
+	{ "maxuser",     do_asid_rrd, 1 },
+	{ "nparts",      do_asid_rrd, 1 },
 
 	/* 
 	 * These are from the hobbit-perl-client
 	 * NetApp check for netapp.pl, dbcheck.pl and beastat.pl scripts
 	 */
-	else if (strcmp(id, "xtstats") == 0)     res = do_netapp_extrastats_rrd(hostname, testname, classname, pagepaths, msg, tstamp);
-	else if (strcmp(id, "quotas") == 0)      res = do_disk_rrd(hostname, testname, classname, pagepaths, msg, tstamp);
-	else if (strcmp(id, "snapshot") == 0)    res = do_disk_rrd(hostname, testname, classname, pagepaths, msg, tstamp);
-	else if (strcmp(id, "TblSpace") == 0)    res = do_disk_rrd(hostname, testname, classname, pagepaths, msg, tstamp);
-	else if (strcmp(id, "stats") == 0)       res = do_netapp_stats_rrd(hostname, testname, classname, pagepaths, msg, tstamp);
-	else if (strcmp(id, "ops") == 0)         res = do_netapp_ops_rrd(hostname, testname, classname, pagepaths, msg, tstamp);
-	else if (strcmp(id, "cifs") == 0)        res = do_netapp_cifs_rrd(hostname, testname, classname, pagepaths, msg, tstamp);
-	else if (strcmp(id, "snaplist") == 0)    res = do_netapp_snaplist_rrd(hostname, testname, classname, pagepaths, msg, tstamp);
-	else if (strcmp(id, "snapmirr") == 0)    res = do_netapp_snapmirror_rrd(hostname, testname, classname, pagepaths, msg, tstamp);
-	else if (strcmp(id, "HitCache") == 0)    res = do_dbcheck_hitcache_rrd(hostname, testname, classname, pagepaths, msg, tstamp);
-	else if (strcmp(id, "Session") == 0)     res = do_dbcheck_session_rrd(hostname, testname, classname, pagepaths, msg, tstamp);
-	else if (strcmp(id, "RollBack") == 0)    res = do_dbcheck_rb_rrd(hostname, testname, classname, pagepaths, msg, tstamp);
-	else if (strcmp(id, "InvObj") == 0)      res = do_dbcheck_invobj_rrd(hostname, testname, classname, pagepaths, msg, tstamp);
-	else if (strcmp(id, "MemReq") == 0)      res = do_dbcheck_memreq_rrd(hostname, testname, classname, pagepaths, msg, tstamp);
-	else if (strcmp(id, "JVM") == 0)         res = do_beastat_jvm_rrd(hostname, testname, classname, pagepaths, msg, tstamp);
-	else if (strcmp(id, "JMS") == 0)         res = do_beastat_jms_rrd(hostname, testname, classname, pagepaths, msg, tstamp);
-	else if (strcmp(id, "JTA") == 0)         res = do_beastat_jta_rrd(hostname, testname, classname, pagepaths, msg, tstamp);
-	else if (strcmp(id, "ExecQueue") == 0)   res = do_beastat_exec_rrd(hostname, testname, classname, pagepaths, msg, tstamp);
-	else if (strcmp(id, "JDBCConn") == 0)    res = do_beastat_jdbc_rrd(hostname, testname, classname, pagepaths, msg, tstamp);
+	{ "xtstats",     do_netapp_extrastats_rrd, 1 },
+	{ "quotas",      do_disk_rrd, 1 },
+	{ "snapshot",    do_disk_rrd, 1 },
+	{ "TblSpace",    do_disk_rrd, 1 },
+	{ "stats",       do_netapp_stats_rrd, 1 },
+	{ "ops",         do_netapp_ops_rrd, 1 },
+	{ "cifs",        do_netapp_cifs_rrd, 1 },
+	{ "snaplist",    do_netapp_snaplist_rrd, 1 },
+	{ "snapmirr",    do_netapp_snapmirror_rrd, 1 },
+	{ "HitCache",    do_dbcheck_hitcache_rrd, 1 },
+	{ "Session",     do_dbcheck_session_rrd, 1 },
+	{ "RollBack",    do_dbcheck_rb_rrd, 1 },
+	{ "InvObj",      do_dbcheck_invobj_rrd, 1 },
+	{ "MemReq",      do_dbcheck_memreq_rrd, 1 },
+	{ "JVM",         do_beastat_jvm_rrd, 1 },
+	{ "JMS",         do_beastat_jms_rrd, 1 },
+	{ "JTA",         do_beastat_jta_rrd, 1 },
+	{ "ExecQueue",   do_beastat_exec_rrd, 1 },
+	{ "JDBCConn",    do_beastat_jdbc_rrd, 1 },
 
 	/*
 	 * This is from the devmon SNMP collector
 	 */
-	else if (strcmp(id, "devmon") == 0)      res = do_devmon_rrd(hostname, testname, classname, pagepaths, msg, tstamp);
+	{ "devmon",      do_devmon_rrd, 1 },
 
-	else if (extids && exthandler) {
-		int i;
+	{ NULL, NULL, 0 }
+};
+
+#define RRDHANDLER_HASHSIZE 256
+
+typedef struct rrdhandler_t {
+	char *id;
+	rrdhandler_fn_t handler;
+	int (*check)(char *id);			/* If set, must return true before the handler is used */
+	int aftersnmpmib;			/* An SNMP MIB with the same name takes precedence */
+	unsigned long msgcount;			/* Messages handled since the last status report */
+	struct rrdhandler_t *hashnext;		/* Next in the hash bucket */
+	struct rrdhandler_t *next;		/* Next in the order they were registered */
+} rrdhandler_t;
+static rrdhandler_t *rrdhandlerhash[RRDHANDLER_HASHSIZE];
+static rrdhandler_t *rrdhandlerhead = NULL, *rrdhandlertail = NULL;
+static int have_rrdhandlers = 0;
+static unsigned long unhandledcount = 0;
+
+static unsigned int rrdhandler_hash(char *id)
+{
+	return (rrdkeyhash(id, '\0') % RRDHANDLER_HASHSIZE);
+}
+
+static rrdhandler_t *rrdhandler_find(char *id)
+{
+	rrdhandler_t *walk;
+
+	for (walk = rrdhandlerhash[rrdhandler_hash(id)]; (walk && strcmp(walk->id, id)); walk = walk->hashnext) ;
+
+	return walk;
+}
+
+static rrdhandler_t *rrdhandler_register(char *id, rrdhandler_fn_t handler, int (*check)(char *id))
+{
+	rrdhandler_t *newitem;
+	unsigned int bucket;
+
+	/* If an id is registered twice, the first one wins */
+	newitem = rrdhandler_find(id);
+	if (newitem) return newitem;
+
+	newitem = (rrdhandler_t *)calloc(1, sizeof(rrdhandler_t));
+	newitem->id = strdup(id);
+	newitem->handler = handler;
+	newitem->check = check;
+
+	bucket = rrdhandler_hash(id);
+	newitem->hashnext = rrdhandlerhash[bucket];
+	rrdhandlerhash[bucket] = newitem;
+
+	if (rrdhandlertail) rrdhandlertail->next = newitem; else rrdhandlerhead = newitem;
+	rrdhandlertail = newitem;
+
+	return newitem;
+}
+
+static void rrdhandler_init(void)
+{
+	int i;
+	rrdhandler_t *handler;
+
+	memset(rrdhandlerhash, 0, sizeof(rrdhandlerhash));
+	for (i = 0; (builtin_rrdhandlers[i].id); i++) {
+		handler = rrdhandler_register(builtin_rrdhandlers[i].id, builtin_rrdhandlers[i].handler, NULL);
+		handler->aftersnmpmib = builtin_rrdhandlers[i].aftersnmpmib;
+	}
 
-		for (i=0; (extids[i] && strcmp(extids[i], id)); i++) ;
+	if (extids && exthandler) {
+		for (i = 0; (extids[i]); i++) {
+			handler = rrdhandler_register(extids[i], do_external_rrd, NULL);
+			if (handler->handler == do_external_rrd) handler->aftersnmpmib = 1;
+		}
+	}
+
+	have_rrdhandlers = 1;
+}
+
+char *rrdhandlerstats(void)
+{
+	static strbuffer_t *statsbuf = NULL;
+	char msgline[1024];
+	rrdhandler_t *walk;
+
+	if (statsbuf == NULL) statsbuf = newstrbuffer(0); else clearstrbuffer(statsbuf);
+
+	addtobuffer(statsbuf, "RRD handlers, messages since last report:\n");
+	for (walk = rrdhandlerhead; (walk); walk = walk->next) {
+		if (walk->msgcount == 0) continue;
 
-		if (extids[i]) res = do_external_rrd(hostname, testname, classname, pagepaths, msg, tstamp);
+		sprintf(msgline, "- %-24.24s : %10lu\n", walk->id, walk->msgcount);
+		addtobuffer(statsbuf, msgline);
+		walk->msgcount = 0;
+	}
+	sprintf(msgline, "- %-24s : %10lu\n", "No RRD handler", unhandledcount);
+	addtobuffer(statsbuf, msgline);
+	unhandledcount = 0;
+
+	return STRBUF(statsbuf);
+}
+
+void update_rrd(char *hostname, char *testname, char *msg, time_t tstamp, char *sender, xymonrrd_t *ldef, char *classname, char *pagepaths)
+{
+	int res = 0;
+	char *id;
+	rrdhandler_t *handler;
+
+	MEMDEFINE(rrdvalues);
+
+	if (!have_rrdhandlers) rrdhandler_init();
+
+	if (ldef) id = ldef->xymonrrdname; else id = testname;
+	senderip = sender;
+
+	handler = rrdhandler_find(id);
+	if (!handler && is_snmpmib_rrd(id)) {
+		/* The MIB definitions may be reloaded, so check the MIB every time */
+		handler = rrdhandler_register(id, do_snmpmib_rrd, is_snmpmib_rrd);
+	}
+
+	if (handler && handler->aftersnmpmib && is_snmpmib_rrd(id)) {
+		res = do_snmpmib_rrd(hostname, testname, classname, pagepaths, msg, tstamp);
+		handler->msgcount++;
+	}
+	else if (handler && (!handler->check || handler->check(id))) {
+		res = handler->handler(hostname, testname, classname, pagepaths, msg, tstamp);
+		handler->msgcount++;
+	}
+	else {
+		unhandledcount++;
 	}
 
 	if (!res) {
@@ -779,4 +1910,3 @@ void update_rrd(char *hostname, char *testname, char *msg, time_t tstamp, char *
 
 	MEMUNDEFINE(rrdvalues);
 }
-
@@ -18,11 +18,23 @@
 extern char *rrddir;
 extern char *trackmax;
 extern int use_rrd_cache;
+extern int rrdcache_maxage;
+extern unsigned long rrdcache_maxmem;
 extern int no_rrd;
+extern char *dscachefn;
 extern void setup_exthandler(char *handlerpath, char *ids);
 extern void update_rrd(char *hostname, char *testname, char *restofmsg, time_t tstamp, char *sender, xymonrrd_t *ldef, char *classname, char *pagepaths);
 extern void rrdcacheflushall(void);
 extern void rrdcacheflushhost(char *hostname);
+extern void rrdcacheflushdue(void);
+extern char *rrdcachestats(void);
+extern void rrddscachesave(void);
+extern char *rrdhandlerstats(void);
+extern void rrddrophost(char *hostname);
+extern void rrdrenamehost(char *oldhostname, char *newhostname);
+extern int rrdbackend_select(char *name);
+extern void rrdwriter_start(int count);
+extern void rrdwriter_stop(void);
 extern void setup_extprocessor(char *cmd);
 extern void shutdown_extprocessor(void);
 
@@ -23,6 +23,7 @@ static char rcsid[] = "$Id$";
 #include <utime.h>
 #include <limits.h>
 #include <signal.h>
+#include <sys/wait.h>
 
 #include "libxymon.h"
 
@@ -30,6 +31,7 @@ enum ftype_t { F_HOSTHISTORY, F_SERVICEHISTORY, F_ALLEVENTS, F_DROPIT, F_PURGELO
 typedef struct filelist_t {
 	char *fname;
 	enum ftype_t ftype;
+	char *unit;		/* Files with the same unit (host) are processed together */
 	struct filelist_t *next;
 } filelist_t;
 filelist_t *flhead = NULL;
@@ -38,6 +40,18 @@ char *outdir = NULL;
 int progressinfo = 0;
 int totalitems = 0;
 
+/*
+ * The work is split by host between a number of worker processes
+ * (--workers). With --time-limit, no new hosts are started once the
+ * time is up; with --checkpoint, the hosts that have been done are
+ * recorded so the next run can continue where this one stopped.
+ */
+int workers = 1;
+int timelimit = 0;
+time_t starttime = 0;
+char *checkpointfn = NULL;
+void *checkpointdone = NULL;
+
 void showprogress(int itemno)
 {
 	errprintf("Processing item %d/%d ... \n", itemno, totalitems);
@@ -86,7 +100,7 @@ int validstatus(char *hname, char *tname)
 	return result;
 }
 
-void add_to_filelist(char *fn, enum ftype_t ftype)
+void add_to_filelist(char *fn, enum ftype_t ftype, char *unit)
 {
 	/* This keeps track of what files we must process - and how */
 	filelist_t *newitem;
@@ -94,6 +108,7 @@ void add_to_filelist(char *fn, enum ftype_t ftype)
 	newitem = (filelist_t *)malloc(sizeof(filelist_t));
 	newitem->fname = strdup(fn);
 	newitem->ftype = ftype;
+	newitem->unit = strdup(unit);
 	newitem->next = flhead;
 	flhead = newitem;
 
@@ -101,139 +116,207 @@ void add_to_filelist(char *fn, enum ftype_t ftype)
 }
 
 
+static int line_timestamp(char *l, enum ftype_t ftype, int sorted, time_t *tstamp)
+{
+	/*
+	 * Find the timestamp in a line, depending on the file type. Returns -1 if there is none.
+	 * Trimming the allevents file goes by the time of the previous change, but the lines are
+	 * in the order of the event time: "sorted" selects that one.
+	 */
+	int col, i;
+	char *p;
+
+	switch (ftype) {
+	  case F_HOSTHISTORY:    col = 1; break;
+	  case F_SERVICEHISTORY: col = 6; break;
+	  case F_ALLEVENTS:      col = (sorted ? 2 : 3); break;
+	  default:               return -1;
+	}
+
+	/* Same as splitting the line with strtok(), so repeated blanks count as one */
+	p = l;
+	for (i = 0; (i <= col); i++) {
+		p += strspn(p, " ");
+		if (*p == '\0') return -1;
+		if (i < col) p += strcspn(p, " ");
+	}
+
+	*tstamp = atoi(p);
+	return 0;
+}
+
+static off_t seek_cutoff(FILE *fd, enum ftype_t ftype, time_t cutoff)
+{
+	/*
+	 * The lines are in time order, so we can bisect the file to find
+	 * a line from before the cutoff time that is close to it. Only the
+	 * last part of the way is then read line by line.
+	 */
+	char l[4096];
+	struct stat st;
+	off_t lo = 0, hi, mid, linestart;
+	time_t tstamp;
+
+	if (fstat(fileno(fd), &st) == -1) return 0;
+	hi = st.st_size;
+
+	while ((hi - lo) > 65536) {
+		mid = lo + (hi - lo) / 2;
+		if (fseeko(fd, mid, SEEK_SET) != 0) break;
+
+		/* Skip the rest of the line we landed in */
+		do {
+			if (fgets(l, sizeof(l), fd) == NULL) { hi = mid; break; }
+		} while (strchr(l, '\n') == NULL);
+		if (hi == mid) continue;
+
+		linestart = ftello(fd);
+		if ((linestart >= hi) || (fgets(l, sizeof(l), fd) == NULL)) { hi = mid; continue; }
+
+		if ((line_timestamp(l, ftype, 1, &tstamp) == 0) && (tstamp < cutoff))
+			lo = linestart;
+		else
+			hi = mid;
+	}
+
+	fseeko(fd, lo, SEEK_SET);
+	return lo;
+}
+
 void trim_history(FILE *infd, FILE *outfd, enum ftype_t ftype, time_t cutoff)
 {
 	/* Does the grunt work of going through a file and copying the wanted records */
-	char l[4096], prevl[4096], l2[4096];
-	char *cols[10];
-	int i;
+	char l[4096], prevl[4096];
 	int copying = 0;
+	time_t tstamp;
 
 	*prevl = '\0';
 
-	while (fgets(l, sizeof(l), infd)) {
+	while (!copying && fgets(l, sizeof(l), infd)) {
+		switch (ftype) {
+		  case F_HOSTHISTORY:
+		  case F_SERVICEHISTORY:
+		  case F_ALLEVENTS:
+			copying = ((line_timestamp(l, ftype, 0, &tstamp) != 0) || (tstamp >= cutoff));
+			break;
+
+		  case F_DROPIT:
+		  case F_PURGELOGS:
+			/* Cannot happen */
+			errprintf("Impossible - F_DROPIT/F_PURGELOGS in trim_history\n");
+			return;
+		}
+
+		/* If we switched to copy-mode, start by outputting the previous and the current lines */
 		if (copying) {
+			if (*prevl) fprintf(outfd, "%s", prevl);
 			fprintf(outfd, "%s", l);
 		}
 		else {
-			/* Split up the input line into columns, and find the timestamp depending on the file type */
-			memset(cols, 0, sizeof(cols));
-			strcpy(l2, l); i = 0; cols[i++] = strtok(l2, " "); 
-			while ((i < 10) && ((cols[i++] = strtok(NULL, " ")) != NULL)) ;
-
-			switch (ftype) {
-			  case F_HOSTHISTORY:
-				copying = (!cols[1] || (atoi(cols[1]) >= cutoff));
-				break;
-
-			  case F_SERVICEHISTORY:
-				copying = (!cols[6] || (atoi(cols[6]) >= cutoff));
-				break;
-
-			  case F_ALLEVENTS:
-				copying = (!cols[3] || (atoi(cols[3]) >= cutoff));
-				break;
-
-			  case F_DROPIT:
-			  case F_PURGELOGS:
-				/* Cannot happen */
-				errprintf("Impossible - F_DROPIT/F_PURGELOGS in trim_history\n");
-				return;
-			}
-
-			/* If we switched to copy-mode, start by outputting the previous and the current lines */
-			if (copying) {
-				if (*prevl) fprintf(outfd, "%s", prevl);
-				fprintf(outfd, "%s", l);
-			}
-			else {
-				strcpy(prevl, l);
-			}
+			strcpy(prevl, l);
 		}
 	}
 
-	if (!copying) {
+	if (copying) {
+		/* The rest of the file is copied as-is */
+		char buf[65536];
+		size_t n;
+
+		while ((n = fread(buf, 1, sizeof(buf), infd)) > 0) fwrite(buf, 1, n, outfd);
+	}
+	else {
 		/* No entries after the cutoff time - keep the last line */
 		if (*prevl) fprintf(outfd, "%s", prevl);
 	}
 }
 
-void trim_files(time_t cutoff)
+void trim_file(filelist_t *fwalk, time_t cutoff)
 {
-	filelist_t *fwalk;
 	FILE *infd, *outfd;
 	char outfn[PATH_MAX];
+	char l[4096];
 	struct stat st;
 	struct utimbuf tstamp;
-	int itemno = 0;
+	time_t firsttime;
+
+	if (fwalk->ftype == F_DROPIT) {
+		/* It's an orphan, and we want to delete it */
+		unlink(fwalk->fname); 
+		unlink(historyindex_filename(fwalk->fname));
+		unlink(historyrollup_filename(fwalk->fname));
+		return;
+	}
 
-	/* We have a list of files to trim, so process them */
-	for (fwalk = flhead; (fwalk); fwalk = fwalk->next) {
-		dbgprintf("Processing %s\n", fwalk->fname);
-		itemno++; if (progressinfo && ((itemno % progressinfo) == 0)) showprogress(itemno); 
+	if (stat(fwalk->fname, &st) == -1) {
+		errprintf("Cannot stat input file %s: %s\n", fwalk->fname, strerror(errno));
+		return;
+	}
+	tstamp.actime = time(NULL);
+	tstamp.modtime = st.st_mtime;
 
-		if (fwalk->ftype == F_DROPIT) {
-			/* It's an orphan, and we want to delete it */
-			unlink(fwalk->fname); 
-			continue;
-		}
+	infd = fopen(fwalk->fname, "r");
+	if (infd == NULL) {
+		errprintf("Cannot open input file %s: %s\n", fwalk->fname, strerror(errno));
+		return;
+	}
 
-		if (stat(fwalk->fname, &st) == -1) {
-			errprintf("Cannot stat input file %s: %s\n", fwalk->fname, strerror(errno));
-			continue;
-		}
-		tstamp.actime = time(NULL);
-		tstamp.modtime = st.st_mtime;
+	/* If the first entry is after the cutoff, there is nothing to trim */
+	if (!outdir && ((fgets(l, sizeof(l), infd) == NULL) || 
+			(line_timestamp(l, fwalk->ftype, 0, &firsttime) != 0) || (firsttime >= cutoff))) {
+		dbgprintf("%s has no entries before the cutoff\n", fwalk->fname);
+		fclose(infd);
+		return;
+	}
 
-		infd = fopen(fwalk->fname, "r");
-		if (infd == NULL) {
-			errprintf("Cannot open input file %s: %s\n", fwalk->fname, strerror(errno));
-			continue;
-		}
+	if (outdir) {
+		sprintf(outfn, "%s/%s", outdir, fwalk->fname);
+	}
+	else {
+		sprintf(outfn, "%s.tmp", fwalk->fname);
+	}
+	outfd = fopen(outfn, "w");
+	if (outfd == NULL) {
+		errprintf("Cannot create output file %s: %s\n", outfn, strerror(errno));
+		fclose(infd);
+		return;
+	}
 
-		if (outdir) {
-			sprintf(outfn, "%s/%s", outdir, fwalk->fname);
-		}
-		else {
-			sprintf(outfn, "%s.tmp", fwalk->fname);
-		}
-		outfd = fopen(outfn, "w");
-		if (outfd == NULL) {
-			errprintf("Cannot create output file %s: %s\n", outfn, strerror(errno));
-			fclose(infd);
-			continue;
+	seek_cutoff(infd, fwalk->ftype, cutoff);
+	trim_history(infd, outfd, fwalk->ftype, cutoff);
+	if (fwalk->ftype == F_ALLEVENTS) {
+		char pidfn[PATH_MAX];
+		FILE *fd;
+		long pid = -1;
+
+		sprintf(pidfn, "%s/xymond_history.pid", xgetenv("XYMONSERVERLOGS"));
+		fd = fopen(pidfn, "r");
+		if (fd) {
+			char l[100];
+			pid = (fgets(l, sizeof(l), fd) ? atol(l) : 0);
+			fclose(fd);
 		}
 
-		trim_history(infd, outfd, fwalk->ftype, cutoff);
-		if (fwalk->ftype == F_ALLEVENTS) {
-			char pidfn[PATH_MAX];
-			FILE *fd;
-			long pid = -1;
-
-			sprintf(pidfn, "%s/xymond_history.pid", xgetenv("XYMONSERVERLOGS"));
-			fd = fopen(pidfn, "r");
-			if (fd) {
-				char l[100];
-				pid = (fgets(l, sizeof(l), fd) ? atol(l) : 0);
-				fclose(fd);
-			}
+		if (pid > 0) kill(pid, SIGHUP);
+	}
 
-			if (pid > 0) kill(pid, SIGHUP);
-		}
+	fclose(infd);
+	fclose(outfd);
+	utime(outfn, &tstamp);	/* So the access time is consistent with the last update */
 
-		fclose(infd);
-		fclose(outfd);
-		utime(outfn, &tstamp);	/* So the access time is consistent with the last update */
+	/* Final check to make sure the file didn't change while we were processing it */
+	if ((stat(fwalk->fname, &st) == 0) && (st.st_mtime == tstamp.modtime)) {
+		if (!outdir) rename(outfn, fwalk->fname);
 
-		/* Final check to make sure the file didn't change while we were processing it */
-		if ((stat(fwalk->fname, &st) == 0) && (st.st_mtime == tstamp.modtime)) {
-			if (!outdir) rename(outfn, fwalk->fname);
-		}
-		else {
-			errprintf("File %s changed while processing it - not trimmed\n", fwalk->fname);
-			unlink(outfn);
+		/* The lines have moved, so the history index and rollups must be rebuilt */
+		if (fwalk->ftype == F_SERVICEHISTORY) {
+			historyindex_build(outdir ? outfn : fwalk->fname);
+			historyrollup_build(outdir ? outfn : fwalk->fname);
 		}
 	}
+	else {
+		errprintf("File %s changed while processing it - not trimmed\n", fwalk->fname);
+		unlink(outfn);
+	}
 }
 
 time_t logtime(char *fn)
@@ -290,70 +373,242 @@ time_t logtime(char *fn)
 	return result;
 }
 
-void trim_logs(time_t cutoff)
+void trim_logdir(filelist_t *fwalk, time_t cutoff)
 {
-	filelist_t *fwalk;
 	DIR *ldir = NULL, *sdir = NULL;
 	struct dirent *sent, *lent;
 	time_t ltime;
 	char fn1[PATH_MAX], fn2[PATH_MAX];
-	int itemno = 0;
 
-	/* We have a list of directories to trim, so process them */
-	for (fwalk = flhead; (fwalk); fwalk = fwalk->next) {
-		dbgprintf("Processing %s\n", fwalk->fname);
-		itemno++; if (progressinfo && ((itemno % progressinfo) == 0)) showprogress(itemno); 
+	switch (fwalk->ftype) {
+	  case F_DROPIT:
+		/* It's an orphan, and we want to delete it */
+		dropdirectory(fwalk->fname, 0);
+		break;
 
-		switch (fwalk->ftype) {
-		  case F_DROPIT:
-			/* It's an orphan, and we want to delete it */
-			dropdirectory(fwalk->fname, 0);
+	  case F_PURGELOGS:
+		sdir = opendir(fwalk->fname);
+		if (sdir == NULL) {
+			errprintf("Cannot process directory %s: %s\n", fwalk->fname, strerror(errno));
 			break;
+		}
 
-		  case F_PURGELOGS:
-			sdir = opendir(fwalk->fname);
-			if (sdir == NULL) {
-				errprintf("Cannot process directory %s: %s\n", fwalk->fname, strerror(errno));
-				break;
+		while ((sent = readdir(sdir)) != NULL) {
+			int allgone = 1;
+			if (*(sent->d_name) == '.') continue;
+
+			sprintf(fn1, "%s/%s", fwalk->fname, sent->d_name);
+			ldir = opendir(fn1);
+			if (ldir == NULL) {
+				errprintf("Cannot process directory %s: %s\n", fn1, strerror(errno));
+				continue;
 			}
 
-			while ((sent = readdir(sdir)) != NULL) {
-				int allgone = 1;
-				if (*(sent->d_name) == '.') continue;
+			while ((lent = readdir(ldir)) != NULL) {
+				if (*(lent->d_name) == '.') continue;
 
-				sprintf(fn1, "%s/%s", fwalk->fname, sent->d_name);
-				ldir = opendir(fn1);
-				if (ldir == NULL) {
-					errprintf("Cannot process directory %s: %s\n", fn1, strerror(errno));
-					continue;
+				ltime = logtime(lent->d_name);
+				if ((ltime > 0) && (ltime < cutoff)) {
+					sprintf(fn2, "%s/%s", fn1, lent->d_name);
+					if (unlink(fn2) == -1) {
+						errprintf("Failed to unlink %s: %s\n", fn2, strerror(errno));
+					}
 				}
+				else allgone = 0;
+			}
 
-				while ((lent = readdir(ldir)) != NULL) {
-					if (*(lent->d_name) == '.') continue;
+			closedir(ldir);
 
-					ltime = logtime(lent->d_name);
-					if ((ltime > 0) && (ltime < cutoff)) {
-						sprintf(fn2, "%s/%s", fn1, lent->d_name);
-						if (unlink(fn2) == -1) {
-							errprintf("Failed to unlink %s: %s\n", fn2, strerror(errno));
-						}
-					}
-					else allgone = 0;
-				}
+			/* Is it empty ? Then remove it */
+			if (allgone) rmdir(fn1);
+		}
+
+		closedir(sdir);
+
+		/* The packed histlogs are trimmed by the day */
+		histlogstore_trim(fwalk->fname, cutoff);
+		break;
 
-				closedir(ldir);
+	  default:
+		break;
+	}
+}
+
+
+static int filelist_compare(const void *v1, const void *v2)
+{
+	filelist_t **f1 = (filelist_t **)v1;
+	filelist_t **f2 = (filelist_t **)v2;
+	int res;
+
+	res = strcmp((*f1)->unit, (*f2)->unit);
+	if (res == 0) res = strcmp((*f1)->fname, (*f2)->fname);
+
+	return res;
+}
+
+static void load_checkpoint(void)
+{
+	FILE *fd;
+	char l[PATH_MAX+10];
+
+	checkpointdone = xtreeNew(strcmp);
+
+	fd = fopen(checkpointfn, "r");
+	if (fd == NULL) return;
+
+	while (fgets(l, sizeof(l), fd)) {
+		char *p = strchr(l, '\n');
+
+		/* An incomplete line means a worker was interrupted while writing it */
+		if (p == NULL) continue;
+		*p = '\0';
+		if (xtreeFind(checkpointdone, l) == xtreeEnd(checkpointdone)) {
+			char *key = strdup(l);
+			xtreeAdd(checkpointdone, key, key);
+		}
+	}
+	fclose(fd);
+
+}
+
+static int process_units(filelist_t **items, int count, char *phase, int worker,
+			 void (*trimfunc)(filelist_t *, time_t), time_t cutoff)
+{
+	/* Process the units for one worker. Returns 0 if all were done, 1 if we ran out of time */
+	int i, unitno = -1, itemno = 0;
+	char *unit = NULL;
+	char ckey[PATH_MAX+10];
+
+	for (i = 0; (i < count); ) {
+		int first = i, last;
+
+		/* Find all of the files for the next unit */
+		for (last = first; ((last < count) && (strcmp(items[last]->unit, items[first]->unit) == 0)); last++) ;
+		unit = items[first]->unit;
+		unitno++;
+		i = last;
+
+		if ((unitno % workers) != worker) continue;
+
+		snprintf(ckey, sizeof(ckey), "%s %s", phase, unit);
+		if (checkpointdone && (xtreeFind(checkpointdone, ckey) != xtreeEnd(checkpointdone))) {
+			dbgprintf("Skipping %s, done in an earlier run\n", ckey);
+			continue;
+		}
 
-				/* Is it empty ? Then remove it */
-				if (allgone) rmdir(fn1);
+		if (timelimit && ((gettimer() - starttime) >= timelimit)) {
+			if (progressinfo) errprintf("Time limit reached, stopping\n");
+			return 1;
+		}
+
+		for (; (first < last); first++) {
+			dbgprintf("Processing %s\n", items[first]->fname);
+			itemno++; if (progressinfo && ((itemno % progressinfo) == 0)) showprogress(itemno); 
+			trimfunc(items[first], cutoff);
+		}
+
+		if (checkpointfn) {
+			FILE *fd = fopen(checkpointfn, "a");
+
+			if (fd) {
+				fprintf(fd, "%s\n", ckey);
+				fclose(fd);
 			}
+			else {
+				errprintf("Cannot update checkpoint file %s: %s\n", checkpointfn, strerror(errno));
+			}
+		}
+	}
 
-			closedir(sdir);
-			break;
+	return 0;
+}
 
-		  default:
-			break;
+int process_filelist(char *phase, void (*trimfunc)(filelist_t *, time_t), time_t cutoff)
+{
+	/* Returns 0 if all of the files were processed */
+	filelist_t **items, *fwalk;
+	int count = 0, w, incomplete = 0;
+	pid_t *pids;
+
+	/* Sort the files so all of the files for a host are processed together */
+	items = (filelist_t **)malloc((totalitems+1) * sizeof(filelist_t *));
+	for (fwalk = flhead; (fwalk); fwalk = fwalk->next) items[count++] = fwalk;
+	qsort(items, count, sizeof(filelist_t *), filelist_compare);
+
+	if (workers <= 1) {
+		incomplete = process_units(items, count, phase, 0, trimfunc, cutoff);
+		xfree(items);
+		return incomplete;
+	}
+
+	pids = (pid_t *)calloc(workers, sizeof(pid_t));
+	for (w = 0; (w < workers); w++) {
+		pids[w] = fork();
+		if (pids[w] == 0) {
+			exit(process_units(items, count, phase, w, trimfunc, cutoff));
+		}
+		else if (pids[w] == -1) {
+			errprintf("Cannot fork worker: %s\n", strerror(errno));
+			incomplete = 1;
 		}
 	}
+
+	for (w = 0; (w < workers); w++) {
+		int status;
+
+		if (pids[w] <= 0) continue;
+		if ((waitpid(pids[w], &status, 0) != pids[w]) || !WIFEXITED(status) || (WEXITSTATUS(status) != 0)) {
+			incomplete = 1;
+		}
+	}
+
+	xfree(pids);
+	xfree(items);
+
+	return incomplete;
+}
+
+int trim_statuslogs(time_t cutoff)
+{
+	DIR *histdir = NULL;
+	struct dirent *hent;
+	struct stat st;
+
+	flhead = NULL;  /* Dirty - we should clean it up properly - but I dont care */
+	totalitems = 0;
+	if (chdir(xgetenv("XYMONHISTLOGS")) == -1) {
+		errprintf("Cannot cd to historical statuslogs directory: %s\n", strerror(errno));
+		return 1;
+	}
+
+	histdir = opendir(".");
+	if (!histdir) {
+		errprintf("Cannot read historical statuslogs directory: %s\n", strerror(errno));
+		return 1;
+	}
+
+	while ((hent = readdir(histdir)) != NULL) {
+		if (stat(hent->d_name, &st) == -1) {
+			errprintf("Odd entry %s - cannot stat: %s\n", hent->d_name, strerror(errno));
+			continue;
+		}
+
+		if ((*(hent->d_name) == '.') || !S_ISDIR(st.st_mode)) continue;
+
+		if (knownloghost(hent->d_name)) {
+			add_to_filelist(hent->d_name, F_PURGELOGS, hent->d_name);
+		}
+		else {
+			add_to_filelist(hent->d_name, F_DROPIT, hent->d_name);
+		}
+	}
+
+	closedir(histdir);
+
+	if (progressinfo) errprintf("Starting trim of %d status-log collections\n", totalitems);
+
+	return process_filelist("logs", trim_logdir, cutoff);
 }
 
 int main(int argc, char *argv[])
@@ -366,9 +621,11 @@ int main(int argc, char *argv[])
 	int dropsvcs = 0;
 	int dropfiles = 0;
 	int droplogs = 0;
+	int incomplete = 0;
 	char *envarea = NULL;
 
 	libxymon_init(argv[0]);
+	starttime = gettimer();
 	for (argi = 1; (argi < argc); argi++) {
 		if (argnmatch(argv[argi], "--cutoff=")) {
 			char *p = strchr(argv[argi], '=');
@@ -394,6 +651,23 @@ int main(int argc, char *argv[])
 			char *p = strchr(argv[argi], '=');
 			progressinfo = atoi(p+1);
 		}
+		else if (argnmatch(argv[argi], "--workers=")) {
+			char *p = strchr(argv[argi], '=');
+			workers = atoi(p+1);
+			if (workers < 1) workers = 1;
+		}
+		else if (argnmatch(argv[argi], "--time-limit=")) {
+			char *p = strchr(argv[argi], '=');
+			timelimit = atoi(p+1);
+		}
+		else if (strcmp(argv[argi], "--checkpoint") == 0) {
+			checkpointfn = (char *)malloc(strlen(xgetenv("XYMONTMP")) + strlen("/trimhistory.checkpoint") + 1);
+			sprintf(checkpointfn, "%s/trimhistory.checkpoint", xgetenv("XYMONTMP"));
+		}
+		else if (argnmatch(argv[argi], "--checkpoint=")) {
+			char *p = strchr(argv[argi], '=');
+			checkpointfn = strdup(p+1);
+		}
 		else if (standardoption(argv[argi])) {
 			if (showhelp) {
 				printf("Usage:\n\n\t%s --cutoff=TIME\n\nTIME is in seconds since epoch\n", argv[0]);
@@ -407,6 +681,23 @@ int main(int argc, char *argv[])
 		return 1;
 	}
 
+	if (checkpointfn && (*checkpointfn != '/')) {
+		/* We chdir into the history directories, so a relative filename must be resolved now */
+		char cwd[PATH_MAX];
+		char *absfn;
+
+		if (getcwd(cwd, sizeof(cwd)) == NULL) {
+			errprintf("Cannot get the current directory: %s\n", strerror(errno));
+			return 1;
+		}
+		absfn = (char *)malloc(strlen(cwd) + strlen(checkpointfn) + 2);
+		sprintf(absfn, "%s/%s", cwd, checkpointfn);
+		xfree(checkpointfn);
+		checkpointfn = absfn;
+	}
+
+	if (checkpointfn) load_checkpoint();
+
 	if (chdir(xgetenv("XYMONHISTDIR")) == -1) {
 		errprintf("Cannot cd to history directory: %s\n", strerror(errno));
 		return 1;
@@ -435,42 +726,43 @@ int main(int argc, char *argv[])
 
 		if (strcmp(hent->d_name, "allevents") == 0) {
 			/* Special all-hosts-services event log */
-			add_to_filelist(hent->d_name, F_ALLEVENTS);
+			add_to_filelist(hent->d_name, F_ALLEVENTS, hent->d_name);
 			continue;
 		}
 
 		hostname = knownhost(hent->d_name, &hostip, ghosthandling);
 		if (hostname) {
 			/* Host history file. */
-			add_to_filelist(hent->d_name, F_HOSTHISTORY);
+			add_to_filelist(hent->d_name, F_HOSTHISTORY, commafy(hent->d_name));
 		}
 		else {
-			char *delim, *p, *hname, *tname;
+			char *delim, *p, *hname, *tname, *unit;
 
 			delim = strrchr(hent->d_name, '.');
 			if (!delim) {
 				/* It's a host history file (no dot in filename), but the host does not exist */
 				errprintf("Orphaned host-history file %s - no host\n", hent->d_name);
-				if (dropfiles) add_to_filelist(hent->d_name, F_DROPIT);
+				if (dropfiles) add_to_filelist(hent->d_name, F_DROPIT, hent->d_name);
 				continue;
 			}
 
-			*delim = '\0'; hname = strdup(hent->d_name); tname = delim+1; *delim = '.';
+			*delim = '\0'; unit = strdup(hent->d_name); hname = strdup(hent->d_name); tname = delim+1; *delim = '.';
 			p = strchr(hname, ','); while (p) { *p = '.'; p = strchr(p, ','); }
 			hostname = knownhost(hname, &hostip, ghosthandling);
 			if (!hostname) {
 				errprintf("Orphaned service-history file %s - no host\n", hent->d_name);
-				if (dropfiles) add_to_filelist(hent->d_name, F_DROPIT);
+				if (dropfiles) add_to_filelist(hent->d_name, F_DROPIT, unit);
 			}
 			else if (dropsvcs && !validstatus(hostname, tname)) {
 				errprintf("Orphaned service-history file %s - no service\n", hent->d_name);
-				if (dropfiles) add_to_filelist(hent->d_name, F_DROPIT);
+				if (dropfiles) add_to_filelist(hent->d_name, F_DROPIT, unit);
 			}
 			else {
 				/* Service history file */
-				add_to_filelist(hent->d_name, F_SERVICEHISTORY);
+				add_to_filelist(hent->d_name, F_SERVICEHISTORY, unit);
 			}
 			xfree(hname);
+			xfree(unit);
 		}
 	}
 
@@ -478,45 +770,19 @@ int main(int argc, char *argv[])
 
 	/* Then process the files */
 	if (progressinfo) errprintf("Starting trim of %d history-logs\n", totalitems);
-	trim_files(cutoff);
-
-
-	/* Process statuslogs also ? */
-	if (!droplogs) return 0;
-
-	flhead = NULL;  /* Dirty - we should clean it up properly - but I dont care */
-	totalitems = 0;
-	if (chdir(xgetenv("XYMONHISTLOGS")) == -1) {
-		errprintf("Cannot cd to historical statuslogs directory: %s\n", strerror(errno));
-		return 1;
-	}
+	incomplete = process_filelist("hist", trim_file, cutoff);
 
-	histdir = opendir(".");
-	if (!histdir) {
-		errprintf("Cannot read historical statuslogs directory: %s\n", strerror(errno));
-		return 1;
-	}
-
-	while ((hent = readdir(histdir)) != NULL) {
-		if (stat(hent->d_name, &st) == -1) {
-			errprintf("Odd entry %s - cannot stat: %s\n", hent->d_name, strerror(errno));
-			continue;
-		}
+	/* The event store days go along with the allevents file */
+	if (!outdir) eventstore_trim(".", cutoff);
 
-		if ((*(hent->d_name) == '.') || !S_ISDIR(st.st_mode)) continue;
 
-		if (knownloghost(hent->d_name)) {
-			add_to_filelist(hent->d_name, F_PURGELOGS);
-		}
-		else {
-			add_to_filelist(hent->d_name, F_DROPIT);
-		}
+	/* Process statuslogs also ? */
+	if (droplogs && !incomplete) {
+		incomplete = trim_statuslogs(cutoff);
 	}
 
-	closedir(histdir);
-
-	if (progressinfo) errprintf("Starting trim of %d status-log collections\n", totalitems);
-	trim_logs(cutoff);
+	/* All done, so the next run starts from the beginning */
+	if (checkpointfn && !incomplete) unlink(checkpointfn);
 
 	return 0;
 }
@@ -55,6 +55,8 @@ static char rcsid[] = "$Id$";
 
 #include "libxymon.h"
 
+#include "xymond_ingest.h"
+
 #define DISABLED_UNTIL_OK -1
 
 /*
@@ -131,6 +133,8 @@ typedef struct xymond_log_t {
 	struct modifier_t *modifiers;
 	ackinfo_t *acklist;	/* Holds list of acks */
 	unsigned long statuschangecount;
+	unsigned long chkgen;	/* Checkpoint generation when this status last changed */
+	unsigned long boardseq;	/* Change sequence number, for xymondboardsince */
 	struct xymond_log_t *next;
 } xymond_log_t;
 
@@ -150,6 +154,8 @@ typedef struct xymond_hostlist_t {
 	xymond_log_t *pinglog; /* Points to entry in logs list, but we need it often */
 	clientmsg_list_t *clientmsgs;
 	time_t clientmsgtstamp;
+	unsigned int hostidx;	/* Unique number for this host, used in the board filter cache */
+	unsigned long boardseq;	/* Change sequence number when the host appeared */
 } xymond_hostlist_t;
 
 typedef struct filecache_t {
@@ -184,6 +190,8 @@ typedef struct conn_t {
 	int msgsz;
 	size_t buflen, bufsz;				/* Active and maximum length of buffer */
 	enum { NOTALK, RECEIVING, STARTTLSWAIT, RESPONDING } doingwhat;	/* Communications state (NOTALK, READING, RESPONDING) */
+	int canstream;					/* Network connection, can take a response in pieces */
+	struct boardcursor_t *board;			/* xymondboard response being generated */
 } conn_t;
 
 enum droprencmd_t { CMD_DROPHOST, CMD_DROPTEST, CMD_RENAMEHOST, CMD_RENAMETEST, CMD_DROPSTATE };
@@ -231,6 +239,7 @@ void *rbmultisrc;
 enum ghosthandling_t ghosthandling = GH_LOG;
 
 char *checkpointfn = NULL;
+enum { CHK_TEXT, CHK_BINARY } checkpointformat = CHK_BINARY;
 FILE *dbgfd = NULL;
 char *dbghost = NULL;
 time_t boottimer = 0;
@@ -266,6 +275,7 @@ xymond_statistics_t xymond_stats[] = {
 	{ "hobbitdlog", },
 	{ "xymondxlog", },
 	{ "hobbitdxlog", },
+	{ "xymondboardsince", },
 	{ "xymondboard", },
 	{ "hobbitdboard", },
 	{ "xymondxboard", },
@@ -346,6 +356,75 @@ typedef struct hostfilter_rec_t {
 	xtreePos_t handle;
 } hostfilter_rec_t;
 
+/*
+ * Board queries tend to be the same few filters over and over again, so
+ * the parsed filters are kept in a cache keyed by the request text. Each
+ * cached filter also remembers which hosts it has matched, so the host
+ * regex'es are only run once per host - until the hosts.cfg file is
+ * reloaded. Filters that look at the test status ("down=", "notdown=")
+ * cannot remember host matches, since the result changes with the status.
+ */
+#define BOARDPLAN_MAX 100
+typedef struct boardplan_t {
+	char *key;			/* The request, without the command */
+	hostfilter_rec_t *logfilter;
+	boardfield_t *logfields;
+	int acklevel, havehostfilter;
+	int dynamichostfilter;		/* Host match depends on status, must check every time */
+	unsigned long hostcfggen;	/* Value of hostcfggen when the host bitmaps were valid */
+	unsigned char *hostknown, *hostmatch;	/* Bitmaps indexed by hostidx */
+	unsigned int bitmapbytes;
+	int refcount;			/* Board responses using this right now */
+	unsigned long lastused;
+} boardplan_t;
+static void *rbboardplans;
+static int boardplancount = 0;
+static unsigned long boardplanclock = 0;
+static unsigned long hostcfggen = 0;	/* Changes when host definitions may have changed */
+static unsigned int nexthostidx = 0;
+
+/*
+ * A xymondboard or xymondxboard response. This is generated a few hosts
+ * at a time while the client reads it, so a large board does not have to
+ * be built in memory and other messages are handled in between.
+ * We cannot hold on to a tree position across updates of the host tree,
+ * so we remember the last host sent and find our place again if the tree
+ * has changed.
+ */
+#define BOARDCHUNKSZ (64*1024)
+typedef struct boardcursor_t {
+	int xmlformat;
+	boardplan_t *plan;
+	int delta;			/* xymondboardsince - only what changed after sinceseq */
+	unsigned long sinceseq, startseq;
+	time_t *dummytimes;
+	char *lasthost;			/* Last host sent, NULL before we start */
+	xtreePos_t nexthandle;		/* Next host to send. Only valid while treegen == hosttreegen */
+	unsigned long treegen;
+	int done;
+} boardcursor_t;
+static unsigned long hosttreegen = 0;	/* Changes whenever hosts are added to or removed from rbhosts */
+
+/*
+ * For "xymondboardsince": Every change to a status log gets a new sequence
+ * number, and statuses that disappear (drop, rename) are kept in a list
+ * for a while. A client can then ask for what has changed since the
+ * sequence number it got last time. If it is too far behind - or xymond
+ * has been restarted, or hosts.cfg reloaded - it gets the full board.
+ */
+#define BOARDDEL_MAX 10000
+typedef struct boarddel_t {
+	unsigned long seq;
+	char *hostname, *testname;	/* testname is NULL when the whole host is gone */
+	struct boarddel_t *next;
+} boarddel_t;
+static boarddel_t *boarddelhead = NULL, *boarddeltail = NULL;
+static int boarddelcount = 0;
+static unsigned long boardseq = 0;
+static unsigned long boarddelbase = 0;		/* Deletions up to this have been forgotten */
+static unsigned long boardresyncseq = 0;	/* Everyone before this must get the full board */
+static time_t boardepoch = 0;			/* Identifies this run of xymond in the cursor */
+
 
 /* Statistics counters */
 unsigned long msgs_total = 0;
@@ -363,6 +442,195 @@ typedef struct scheduletask_t {
 scheduletask_t *schedulehead = NULL;
 int nextschedid = 1;
 
+/*
+ * Incremental checkpoints. Every change to a status stamps it with the
+ * current checkpoint generation. A full checkpoint is identified by its
+ * generation and timestamp; the journal written between full checkpoints
+ * holds the statuses changed since then, plus the drop/rename commands
+ * that have been done since.
+ */
+unsigned long chkgen = 1;		/* Current generation */
+unsigned long chkbasegen = 0;		/* Generation of the last full checkpoint */
+time_t chkbasetime = 0;			/* ... and when it was taken */
+typedef struct chkop_t {
+	unsigned long gen;
+	enum droprencmd_t cmd;
+	char *hostname, *n1, *n2;
+	struct chkop_t *next;
+} chkop_t;
+chkop_t *chkophead = NULL, *chkoptail = NULL;
+
+/*
+ * Memory pools for the records we keep about each status.
+ *
+ * The fixed-size records (hosts, logs, acks, modifiers) are allocated from
+ * slabs: Each size class takes memory from the system in large chunks and
+ * keeps the freed records on a free-list for re-use. The status message
+ * buffers come from a pool of power-of-2 sized buffers, so a log which
+ * needs a larger buffer returns its old one for another log to use,
+ * instead of growing it with realloc(). Both keep xymond from fragmenting
+ * the heap over a long uptime.
+ */
+#define SLAB_GRAIN 16
+#define SLAB_CLASSES 32			/* Objects up to 512 bytes, larger ones use malloc */
+#define SLAB_CHUNKSZ (64*1024)
+
+typedef struct slabclass_t {
+	void *freelist;
+	unsigned long inuse, freecount, chunks;
+} slabclass_t;
+static slabclass_t slabs[SLAB_CLASSES];
+
+#define MSGPOOL_MINSHIFT 8		/* Smallest buffer is 256 bytes */
+#define MSGPOOL_CLASSES 12		/* Largest pooled buffer is 512 KB */
+#define MSGPOOL_MAXFREE (8*1024*1024)	/* Max. bytes kept in free buffers */
+
+typedef struct msgpoolclass_t {
+	void *freelist;
+	unsigned long inuse, freecount, gets, reused;
+} msgpoolclass_t;
+static msgpoolclass_t msgpool[MSGPOOL_CLASSES];
+static unsigned long msgpool_freebytes = 0;
+static unsigned long msgpool_biginuse = 0;
+
+void *slab_alloc(size_t sz)
+{
+	/* Returns a zero-filled object, like calloc() */
+	int idx = (sz + SLAB_GRAIN - 1) / SLAB_GRAIN - 1;
+	slabclass_t *sc;
+	void *result;
+
+	if ((idx < 0) || (idx >= SLAB_CLASSES)) return calloc(1, sz);
+
+	sc = &slabs[idx];
+	if (sc->freelist == NULL) {
+		size_t objsz = (idx+1) * SLAB_GRAIN;
+		char *chunk = (char *)malloc(SLAB_CHUNKSZ);
+		int i, n = SLAB_CHUNKSZ / objsz;
+
+		/* The chunks are never returned to the system, only re-used */
+		for (i = n-1; (i >= 0); i--) {
+			*(void **)(chunk + i*objsz) = sc->freelist;
+			sc->freelist = chunk + i*objsz;
+		}
+		sc->freecount += n;
+		sc->chunks++;
+	}
+
+	result = sc->freelist;
+	sc->freelist = *(void **)result;
+	sc->freecount--;
+	sc->inuse++;
+	memset(result, 0, (idx+1) * SLAB_GRAIN);
+
+	return result;
+}
+
+void slab_free(void *p, size_t sz)
+{
+	/* sz must be the same size that was passed to slab_alloc() */
+	int idx = (sz + SLAB_GRAIN - 1) / SLAB_GRAIN - 1;
+	slabclass_t *sc;
+
+	if ((idx < 0) || (idx >= SLAB_CLASSES)) { xfree(p); return; }
+
+	sc = &slabs[idx];
+	*(void **)p = sc->freelist;
+	sc->freelist = p;
+	sc->freecount++;
+	sc->inuse--;
+}
+
+unsigned char *msgbuf_get(int minsz, int *bufsz)
+{
+	/* Get a buffer of at least minsz bytes. The real size is returned in bufsz. */
+	int idx;
+	msgpoolclass_t *mc;
+	unsigned char *result;
+
+	for (idx = 0; ((idx < MSGPOOL_CLASSES) && ((1 << (idx + MSGPOOL_MINSHIFT)) < minsz)); idx++) ;
+	if (idx == MSGPOOL_CLASSES) {
+		/* Too large to pool */
+		msgpool_biginuse++;
+		*bufsz = minsz;
+		return (unsigned char *)malloc(minsz);
+	}
+
+	mc = &msgpool[idx];
+	*bufsz = (1 << (idx + MSGPOOL_MINSHIFT));
+	mc->gets++;
+	mc->inuse++;
+	if (mc->freelist) {
+		result = mc->freelist;
+		mc->freelist = *(void **)result;
+		mc->freecount--;
+		mc->reused++;
+		msgpool_freebytes -= *bufsz;
+	}
+	else {
+		result = (unsigned char *)malloc(*bufsz);
+	}
+
+	return result;
+}
+
+void msgbuf_put(unsigned char *buf, int bufsz)
+{
+	/*
+	 * Return a buffer to the pool. bufsz is the size of the buffer as
+	 * allocated; buffers which did not come from msgbuf_get() are also
+	 * accepted here, and are just freed unless their size happens to
+	 * match one of the pool sizes.
+	 */
+	int idx;
+	msgpoolclass_t *mc;
+
+	for (idx = 0; ((idx < MSGPOOL_CLASSES) && ((1 << (idx + MSGPOOL_MINSHIFT)) != bufsz)); idx++) ;
+	if (idx == MSGPOOL_CLASSES) {
+		if ((bufsz > (1 << (MSGPOOL_CLASSES - 1 + MSGPOOL_MINSHIFT))) && msgpool_biginuse) msgpool_biginuse--;
+		xfree(buf);
+		return;
+	}
+
+	mc = &msgpool[idx];
+	if (mc->inuse) mc->inuse--;
+	if ((msgpool_freebytes + bufsz) > MSGPOOL_MAXFREE) {
+		xfree(buf);
+		return;
+	}
+
+	*(void **)buf = mc->freelist;
+	mc->freelist = buf;
+	mc->freecount++;
+	msgpool_freebytes += bufsz;
+}
+
+void add_poolstats(strbuffer_t *statsbuf)
+{
+	int i;
+	char msgline[1024];
+
+	addtobuffer(statsbuf, "\nMemory pools:\n");
+	for (i = 0; (i < SLAB_CLASSES); i++) {
+		if (slabs[i].chunks == 0) continue;
+
+		sprintf(msgline, "- slab %6d bytes   : %10lu used %10lu free (%lu KB)\n",
+			(i+1)*SLAB_GRAIN, slabs[i].inuse, slabs[i].freecount, (slabs[i].chunks * SLAB_CHUNKSZ) / 1024);
+		addtobuffer(statsbuf, msgline);
+	}
+	for (i = 0; (i < MSGPOOL_CLASSES); i++) {
+		if (msgpool[i].gets == 0) continue;
+
+		sprintf(msgline, "- msgbuf %6d bytes : %10lu used %10lu free (%lu of %lu requests re-used a buffer)\n",
+			(1 << (i + MSGPOOL_MINSHIFT)), msgpool[i].inuse, msgpool[i].freecount, msgpool[i].reused, msgpool[i].gets);
+		addtobuffer(statsbuf, msgline);
+	}
+	if (msgpool_biginuse) {
+		sprintf(msgline, "- msgbuf unpooled      : %10lu used\n", msgpool_biginuse);
+		addtobuffer(statsbuf, msgline);
+	}
+}
+
 void update_statistics(char *cmd, int viabfq)
 {
 	int i;
@@ -394,12 +662,30 @@ void update_statistics(char *cmd, int viabfq)
 	dbgprintf("<- update_statistics\n");
 }
 
+static void add_channelstats(strbuffer_t *statsbuf, char *chnname, xymond_channel_t *chn)
+{
+	char msgline[200];
+	int readers;
+	unsigned int maxlag;
+	unsigned long lost;
+
+	channel_readerstats(chn, &readers, &maxlag, &lost);
+	sprintf(msgline, "%s channel messages: %10ld (%d readers", chnname, chn->msgcount, readers);
+	addtobuffer(statsbuf, msgline);
+	if (maxlag || lost) {
+		/* Readers that are behind, or have lost messages because they were too slow */
+		sprintf(msgline, ", lagging %u, lost %lu", maxlag, lost);
+		addtobuffer(statsbuf, msgline);
+	}
+	addtobuffer(statsbuf, ")\n");
+}
+
 char *generate_stats(void)
 {
 	static strbuffer_t *statsbuf = NULL;
 	time_t now = getcurrenttime(NULL);
 	time_t nowtimer = gettimer();
-	int i, clients;
+	int i;
 	char bootuptxt[40];
 	char uptimetxt[40];
 	xtreePos_t ghandle;
@@ -454,35 +740,19 @@ char *generate_stats(void)
 		addtobuffer(statsbuf, msgline);
 	}
 	msgs_total_last = msgs_total;
+	addtobuffer(statsbuf, ingest_stats());
 
 	addtobuffer(statsbuf, "\n");
-	clients = semctl(statuschn->semid, CLIENTCOUNT, GETVAL);
-	sprintf(msgline, "status channel messages: %10ld (%d readers)\n", statuschn->msgcount, clients);
-	addtobuffer(statsbuf, msgline);
-	clients = semctl(stachgchn->semid, CLIENTCOUNT, GETVAL);
-	sprintf(msgline, "stachg channel messages: %10ld (%d readers)\n", stachgchn->msgcount, clients);
-	addtobuffer(statsbuf, msgline);
-	clients = semctl(pagechn->semid, CLIENTCOUNT, GETVAL);
-	sprintf(msgline, "page   channel messages: %10ld (%d readers)\n", pagechn->msgcount, clients);
-	addtobuffer(statsbuf, msgline);
-	clients = semctl(datachn->semid, CLIENTCOUNT, GETVAL);
-	sprintf(msgline, "data   channel messages: %10ld (%d readers)\n", datachn->msgcount, clients);
-	addtobuffer(statsbuf, msgline);
-	clients = semctl(noteschn->semid, CLIENTCOUNT, GETVAL);
-	sprintf(msgline, "notes  channel messages: %10ld (%d readers)\n", noteschn->msgcount, clients);
-	addtobuffer(statsbuf, msgline);
-	clients = semctl(enadischn->semid, CLIENTCOUNT, GETVAL);
-	sprintf(msgline, "enadis channel messages: %10ld (%d readers)\n", enadischn->msgcount, clients);
-	addtobuffer(statsbuf, msgline);
-	clients = semctl(clientchn->semid, CLIENTCOUNT, GETVAL);
-	sprintf(msgline, "client channel messages: %10ld (%d readers)\n", clientchn->msgcount, clients);
-	addtobuffer(statsbuf, msgline);
-	clients = semctl(clichgchn->semid, CLIENTCOUNT, GETVAL);
-	sprintf(msgline, "clichg channel messages: %10ld (%d readers)\n", clichgchn->msgcount, clients);
-	addtobuffer(statsbuf, msgline);
-	clients = semctl(userchn->semid, CLIENTCOUNT, GETVAL);
-	sprintf(msgline, "user   channel messages: %10ld (%d readers)\n", userchn->msgcount, clients);
-	addtobuffer(statsbuf, msgline);
+	add_channelstats(statsbuf, "status", statuschn);
+	add_channelstats(statsbuf, "stachg", stachgchn);
+	add_channelstats(statsbuf, "page  ", pagechn);
+	add_channelstats(statsbuf, "data  ", datachn);
+	add_channelstats(statsbuf, "notes ", noteschn);
+	add_channelstats(statsbuf, "enadis", enadischn);
+	add_channelstats(statsbuf, "client", clientchn);
+	add_channelstats(statsbuf, "clichg", clichgchn);
+	add_channelstats(statsbuf, "user  ", userchn);
+	add_poolstats(statsbuf);
 
 	ghandle = xtreeFirst(rbghosts);
 	if (ghandle != xtreeEnd(rbghosts)) addtobuffer(statsbuf, "\n\nGhost reports:\n");
@@ -550,16 +820,181 @@ xymond_hostlist_t *create_hostlist_t(char *hostname, char *ip)
 {
 	xymond_hostlist_t *hitem;
 
-	hitem = (xymond_hostlist_t *) calloc(1, sizeof(xymond_hostlist_t));
+	hitem = (xymond_hostlist_t *) slab_alloc(sizeof(xymond_hostlist_t));
 	hitem->hostname = strdup(hostname);
 	hitem->ip = strdup(ip);
+	hitem->hostidx = nexthostidx++;
+	hitem->boardseq = ++boardseq;
 	if (strcmp(hostname, "summary") == 0) hitem->hosttype = H_SUMMARY;
 	else hitem->hosttype = H_NORMAL;
 	xtreeAdd(rbhosts, hitem->hostname, hitem);
+	hosttreegen++;
 
 	return hitem;
 }
 
+/*
+ * Index of the status logs, keyed by host and test. This is an open-addressing
+ * hash table with linear probing. For each host+test it points to the first
+ * log in the host's list of logs with that test, so a lookup gives the same
+ * result as a walk through the list. The list itself is kept for ordered
+ * iteration.
+ */
+typedef struct loghashent_t {
+	xymond_hostlist_t *host;	/* NULL for an empty or deleted slot */
+	testinfo_t *test;
+	xymond_log_t *log;
+} loghashent_t;
+
+static loghashent_t *loghash = NULL;
+static unsigned long loghashsz = 0;	/* Number of slots, always a power of 2 */
+static unsigned long loghashused = 0;	/* Slots that are not empty, including deleted slots */
+static testinfo_t loghashdeleted;	/* Marks a deleted slot */
+
+static unsigned long loghash_slot(xymond_hostlist_t *host, testinfo_t *test)
+{
+	unsigned long h = ((unsigned long)host >> 4) * 2654435761UL;
+
+	h ^= ((unsigned long)test >> 4) + 0x9e3779b9UL + (h << 6) + (h >> 2);
+	return (h & (loghashsz - 1));
+}
+
+static loghashent_t *loghash_lookup(xymond_hostlist_t *host, testinfo_t *test, int forinsert)
+{
+	/*
+	 * Find the slot for host+test. If it is not there, return NULL - or
+	 * when inserting, the first free slot in the probe sequence.
+	 */
+	unsigned long i;
+	loghashent_t *freeslot = NULL;
+
+	if (loghashsz == 0) return NULL;
+
+	for (i = loghash_slot(host, test); (1); i = ((i+1) & (loghashsz - 1))) {
+		loghashent_t *ent = &loghash[i];
+
+		if (ent->host == NULL) {
+			if (ent->test == &loghashdeleted) {
+				if (!freeslot) freeslot = ent;
+				continue;
+			}
+
+			/* Empty slot ends the probe sequence */
+			return (forinsert ? (freeslot ? freeslot : ent) : NULL);
+		}
+
+		if ((ent->host == host) && (ent->test == test)) return ent;
+	}
+}
+
+static void loghash_resize(unsigned long newsz)
+{
+	loghashent_t *oldtbl = loghash;
+	unsigned long i, oldsz = loghashsz;
+
+	loghash = (loghashent_t *)calloc(newsz, sizeof(loghashent_t));
+	loghashsz = newsz;
+	loghashused = 0;
+
+	for (i = 0; (i < oldsz); i++) {
+		if (oldtbl[i].host) {
+			loghashent_t *ent = loghash_lookup(oldtbl[i].host, oldtbl[i].test, 1);
+			*ent = oldtbl[i];
+			loghashused++;
+		}
+	}
+
+	if (oldtbl) xfree(oldtbl);
+}
+
+xymond_log_t *loghash_find(xymond_hostlist_t *host, testinfo_t *test)
+{
+	loghashent_t *ent = loghash_lookup(host, test, 0);
+
+	return (ent ? ent->log : NULL);
+}
+
+void loghash_update(xymond_hostlist_t *host, testinfo_t *test)
+{
+	/*
+	 * Make the index entry for host+test point to the first log with this
+	 * test in the list of logs for the host, or remove it if there is none.
+	 * Must be called whenever logs are added, removed or change their test.
+	 */
+	xymond_log_t *lwalk;
+	loghashent_t *ent;
+
+	for (lwalk = host->logs; (lwalk && (lwalk->test != test)); lwalk = lwalk->next) ;
+
+	if (lwalk == NULL) {
+		ent = loghash_lookup(host, test, 0);
+		if (ent) {
+			ent->host = NULL;
+			ent->test = &loghashdeleted;
+			ent->log = NULL;
+		}
+		return;
+	}
+
+	/* Keep the table at most half full, counting deleted slots */
+	if (2*(loghashused+1) > loghashsz) {
+		unsigned long newsz = (loghashsz ? loghashsz : 1024);
+		unsigned long i, live;
+
+		for (i = 0, live = 0; (i < loghashsz); i++) if (loghash[i].host) live++;
+		while (4*(live+1) > newsz) newsz *= 2;
+		loghash_resize(newsz);
+	}
+
+	ent = loghash_lookup(host, test, 1);
+	if (ent->host == NULL) {
+		if (ent->test != &loghashdeleted) loghashused++;
+		ent->host = host;
+		ent->test = test;
+	}
+	ent->log = lwalk;
+}
+
+void log_changed(xymond_log_t *log)
+{
+	/* Note that the status has changed, for the checkpoint journal and for xymondboardsince */
+	log->chkgen = chkgen;
+	log->boardseq = ++boardseq;
+}
+
+void log_refreshed(xymond_log_t *log)
+{
+	/*
+	 * A status update that did not change the color, ack or disable state.
+	 * Only xymondboardsince needs to know; the checkpoint journal skips it,
+	 * so the new message and timestamps are saved with the next full checkpoint.
+	 */
+	log->boardseq = ++boardseq;
+}
+
+void board_deleted(char *hostname, char *testname)
+{
+	boarddel_t *newrec = (boarddel_t *)calloc(1, sizeof(boarddel_t));
+
+	newrec->seq = ++boardseq;
+	newrec->hostname = strdup(hostname);
+	newrec->testname = (testname ? strdup(testname) : NULL);
+	if (boarddeltail) boarddeltail->next = newrec; else boarddelhead = newrec;
+	boarddeltail = newrec;
+	boarddelcount++;
+
+	while (boarddelcount > BOARDDEL_MAX) {
+		boarddel_t *zombie = boarddelhead;
+
+		boarddelhead = boarddelhead->next;
+		boarddelbase = zombie->seq;
+		boarddelcount--;
+		xfree(zombie->hostname);
+		if (zombie->testname) xfree(zombie->testname);
+		xfree(zombie);
+	}
+}
+
 testinfo_t *create_testinfo(char *name)
 {
 	testinfo_t *newrec;
@@ -575,12 +1010,9 @@ testinfo_t *create_testinfo(char *name)
 void posttochannel(xymond_channel_t *channel, char *channelmarker, 
 		   char *msg, char *sender, char *hostname, xymond_log_t *log, char *readymsg)
 {
-	struct sembuf s;
-	int clients;
 	int n;
 	struct timeval tstamp;
 	struct timezone tz;
-	int semerr = 0;
 	unsigned int bufsz = 1024*shbufsz(channel->channelid);
 	void *hi;
 	char *pagepath, *classname, *osname;
@@ -589,49 +1021,12 @@ void posttochannel(xymond_channel_t *channel, char *channelmarker,
 	dbgprintf("-> posttochannel\n");
 
 	/* First see how many users are on this channel */
-	clients = semctl(channel->semid, CLIENTCOUNT, GETVAL);
-	if (clients == 0) {
+	if (channel_readers(channel) == 0) {
 		dbgprintf("Dropping message - no readers\n");
 		return;
 	}
-
-	/* 
-	 * Wait for BOARDBUSY to go low.
-	 * We need a loop here, because if we catch a signal
-	 * while waiting on the semaphore, then we need to
-	 * re-start the semaphore wait. Otherwise we may
-	 * end up with semaphores that are out of sync
-	 * (GOCLIENT goes up while a worker waits for it 
-	 *  to go to 0).
-	 */
-	gotalarm = 0; alarm(5);
-	do {
-		s.sem_num = BOARDBUSY; s.sem_op = 0; s.sem_flg = 0;
-		n = semop(channel->semid, &s, 1);
-		if (n == -1) {
-			semerr = errno;
-			if (semerr != EINTR) errprintf("semop failed, %s\n", strerror(errno));
-		}
-	} while ((n == -1) && (semerr == EINTR) && running && !gotalarm);
-	alarm(0);
 	if (!running) return;
 
-	/* Check if the alarm fired */
-	if (gotalarm) {
-		errprintf("BOARDBUSY locked at %d, GETNCNT is %d, GETPID is %d, %d clients\n",
-			  semctl(channel->semid, BOARDBUSY, GETVAL),
-			  semctl(channel->semid, BOARDBUSY, GETNCNT),
-			  semctl(channel->semid, BOARDBUSY, GETPID),
-			  semctl(channel->semid, CLIENTCOUNT, GETVAL));
-		return;
-	}
-
-	/* Check if we failed to grab the semaphore */
-	if (n == -1) {
-		errprintf("Dropping message due to semaphore error\n");
-		return;
-	}
-
 	/* All clear, post the message */
 	if (channel->seq == 999999) channel->seq = 0;
 	channel->seq++;
@@ -879,27 +1274,9 @@ void posttochannel(xymond_channel_t *channel, char *channelmarker,
 	/* Terminate the message */
 	strncat(channel->channelbuf, "\n@@\n", (bufsz-1));
 
-	/* Let the readers know it is there.  */
-	clients = semctl(channel->semid, CLIENTCOUNT, GETVAL); /* Get it again, maybe changed since last check */
-	dbgprintf("Posting message %u to %d readers\n", channel->seq, clients);
-	/* Up BOARDBUSY */
-	s.sem_num = BOARDBUSY; 
-	s.sem_op = (clients - semctl(channel->semid, BOARDBUSY, GETVAL)); 
-	if (s.sem_op <= 0) {
-		errprintf("How did this happen? clients=%d, s.sem_op=%d\n", clients, s.sem_op);
-		s.sem_op = clients;
-	}
-	s.sem_flg = 0;
-	n = semop(channel->semid, &s, 1);
-
-	/* Make sure GOCLIENT is 0 */
-	n = semctl(channel->semid, GOCLIENT, GETVAL);
-	if (n > 0) {
-		errprintf("Oops ... GOCLIENT is high (%d)\n", n);
-	}
-
-	s.sem_num = GOCLIENT; s.sem_op = clients; s.sem_flg = 0; 		/* Up GOCLIENT */
-	n = semop(channel->semid, &s, 1);
+	/* Put it in the ring, and let the readers know it is there. No waiting for them to pick it up */
+	dbgprintf("Posting message %u to %d readers\n", channel->seq, channel_readers(channel));
+	channel_post(channel);
 
 	dbgprintf("<- posttochannel\n");
 
@@ -1025,7 +1402,6 @@ xymond_log_t *find_log(hostfilter_rec_t *filter, xymond_hostlist_t **host)
 	hostfilter_rec_t *fwalk;
 	xymond_hostlist_t *hrec = NULL;
 	testinfo_t *trec = NULL;
-	xymond_log_t *lwalk;
 
 	*host = NULL;
 	if (!filter) return NULL;
@@ -1047,8 +1423,7 @@ xymond_log_t *find_log(hostfilter_rec_t *filter, xymond_hostlist_t **host)
 
 	if (!hrec || !trec) return NULL;
 
-	for (lwalk = hrec->logs; (lwalk && (lwalk->test != trec)); lwalk = lwalk->next);
-	return lwalk;
+	return loghash_find(hrec, trec);
 }
 
 char *check_downtime(char *hostname, char *testname)
@@ -1224,17 +1599,23 @@ void get_hts(char *msg, char *sender, char *origin,
 	}
 
 	if (hwalk && twalk && owalk) {
-		for (lwalk = hwalk->logs; (lwalk && ((lwalk->test != twalk) || (lwalk->origin != owalk))); lwalk = lwalk->next);
+		lwalk = loghash_find(hwalk, twalk);
+		if (lwalk && (lwalk->origin != owalk)) {
+			/* Same test from another origin - look for the one we want */
+			for (lwalk = hwalk->logs; (lwalk && ((lwalk->test != twalk) || (lwalk->origin != owalk))); lwalk = lwalk->next);
+		}
 		if (createlog && (lwalk == NULL)) {
-			lwalk = (xymond_log_t *)calloc(1, sizeof(xymond_log_t));
-			lwalk->lastchange = (time_t *)calloc((flapcount > 0) ? flapcount : 1, sizeof(time_t));
+			lwalk = (xymond_log_t *)slab_alloc(sizeof(xymond_log_t));
+			lwalk->lastchange = (time_t *)slab_alloc(((flapcount > 0) ? flapcount : 1) * sizeof(time_t));
 			lwalk->lastchange[0] = getcurrenttime(NULL);
 			lwalk->color = lwalk->oldcolor = NO_COLOR;
 			lwalk->host = hwalk;
 			lwalk->test = twalk;
 			lwalk->origin = owalk;
+			log_changed(lwalk);
 			lwalk->next = hwalk->logs;
 			hwalk->logs = lwalk;
+			loghash_update(hwalk, twalk);
 			if (strcmp(testname, xgetenv("PINGCOLUMN")) == 0) hwalk->pinglog = lwalk;
 		}
 	}
@@ -1273,6 +1654,7 @@ void clear_cookie(xymond_log_t *log)
 	xtreeDelete(rbcookies, log->cookie);
 	xfree(log->cookie);
 	log->cookie = NULL; log->cookieexpires = 0;
+	log_changed(log);
 }
 
 
@@ -1342,6 +1724,8 @@ void handle_status(unsigned char *msg, char *sender, char *hostname, char *testn
 	enum alertstate_t oldalertstatus, newalertstatus;
 	int delayval = 0;
 	void *hinfo = hostinfo(hostname);
+	int prevcolor = log->color;
+	time_t prevacktime = log->acktime, prevenabletime = log->enabletime;
 
 	dbgprintf("->handle_status\n");
 
@@ -1351,6 +1735,8 @@ void handle_status(unsigned char *msg, char *sender, char *hostname, char *testn
 		return;
 	}
 
+	log_refreshed(log);
+
 	msglen = strlen(msg);
 	if (msglen == 0) {
 		errprintf("Bogus status message for %s.%s contains no data: Sent from %s\n", 
@@ -1374,7 +1760,7 @@ void handle_status(unsigned char *msg, char *sender, char *hostname, char *testn
 		 * Original status message - check if there is an active modifier for the color.
 		 * We dont do this for status changes triggered by a "modify" command.
 		 */
-		modifier_t *mwalk;
+		modifier_t *mwalk, *mprev = NULL;
 		int mcolor = -1;
 
 		mwalk = log->modifiers;
@@ -1390,11 +1776,13 @@ void handle_status(unsigned char *msg, char *sender, char *hostname, char *testn
 
 				/* Remove this modifier from the list. Make sure log->modifiers is updated */
 				if (mwalk == log->modifiers) log->modifiers = mwalk->next;
+				else mprev->next = mwalk->next;
 				mwalk = mwalk->next;
-				xfree(zombie);
+				slab_free(zombie, sizeof(modifier_t));
 			}
 			else {
 				if (mwalk->color > mcolor) mcolor = mwalk->color;
+				mprev = mwalk;
 				mwalk = mwalk->next;
 			}
 		}
@@ -1595,6 +1983,7 @@ void handle_status(unsigned char *msg, char *sender, char *hostname, char *testn
 
 	log->oldcolor = log->color;
 	log->color = newcolor;
+	if ((newcolor != prevcolor) || (log->acktime != prevacktime) || (log->enabletime != prevenabletime)) log_changed(log);
 	oldalertstatus = decide_alertstate(log->oldcolor);
 	newalertstatus = decide_alertstate(newcolor);
 	if (log->grouplist) xfree(log->grouplist);
@@ -1624,22 +2013,12 @@ void handle_status(unsigned char *msg, char *sender, char *hostname, char *testn
 		 * - log->msgsz is the buffer size INCLUDING the final \0.
 		 * - msglen is the message length WITHOUT the final \0.
 		 */
-		if ((log->message == NULL) || (log->msgsz == 0)) {
-			/* No buffer - get one */
-			log->message = (unsigned char *)malloc(msglen+1);
-			memcpy(log->message, msg, msglen+1);
-			log->msgsz = msglen+1;
-		}
-		else if (log->msgsz > msglen) {
-			/* Message - including \0 - fits into the existing buffer. */
-			memcpy(log->message, msg, msglen+1);
-		}
-		else {
-			/* Message does not fit into existing buffer. Grow it. */
-			log->message = (unsigned char *)realloc(log->message, msglen+1);
-			memcpy(log->message, msg, msglen+1);
-			log->msgsz = msglen+1;
+		if ((log->message == NULL) || (log->msgsz <= msglen)) {
+			/* No buffer, or message does not fit into the existing buffer - swap it for a larger one */
+			if (log->message) msgbuf_put(log->message, log->msgsz);
+			log->message = msgbuf_get(msglen+1, &log->msgsz);
 		}
+		memcpy(log->message, msg, msglen+1);
 
 		/* Get at the test flags. They are immediately after the color */
 		p = msg_data(msg, 0);
@@ -1656,7 +2035,7 @@ void handle_status(unsigned char *msg, char *sender, char *hostname, char *testn
 				else if (strlen(log->testflags) >= strlen(flagstart))
 					strcpy(log->testflags, flagstart);
 				else {
-					log->testflags = realloc(log->testflags, strlen(flagstart));
+					log->testflags = realloc(log->testflags, strlen(flagstart)+1);
 					strcpy(log->testflags, flagstart);
 				}
 				*flagend = ']';
@@ -1781,7 +2160,7 @@ void handle_modify(char *msg, xymond_log_t *log, int color)
 		if ((color >= 0) && (color < COL_COUNT)) {
 			if (!mwalk) {
 				/* New modifier record */
-				mwalk = (modifier_t *)calloc(1, sizeof(modifier_t));
+				mwalk = (modifier_t *)slab_alloc(sizeof(modifier_t));
 				mwalk->source = strdup(sourcename);
 				mwalk->next = log->modifiers;
 				log->modifiers = mwalk;
@@ -1969,6 +2348,7 @@ void handle_enadis(int enabled, conn_t *msg, char *sender)
 		if (alltests) {
 			for (log = hwalk->logs; (log); log = log->next) {
 				log->enabletime = 0;
+				log_changed(log);
 				if (log->dismsg) {
 					xfree(log->dismsg);
 					log->dismsg = NULL;
@@ -1977,9 +2357,10 @@ void handle_enadis(int enabled, conn_t *msg, char *sender)
 			}
 		}
 		else {
-			for (log = hwalk->logs; (log && (log->test != twalk)); log = log->next) ;
+			log = loghash_find(hwalk, twalk);
 			if (log) {
 				log->enabletime = 0;
+				log_changed(log);
 				if (log->dismsg) {
 					xfree(log->dismsg);
 					log->dismsg = NULL;
@@ -2005,7 +2386,7 @@ void handle_enadis(int enabled, conn_t *msg, char *sender)
 			}
 		}
 		else {
-			for (log = hwalk->logs; (log && (log->test != twalk)); log = log->next) ;
+			log = loghash_find(hwalk, twalk);
 			if (log) {
 				log->enabletime = expires;
 				log->validtime = (expires == DISABLED_UNTIL_OK) ? INT_MAX : log->validtime;
@@ -2038,6 +2419,7 @@ void handle_ack(char *msg, char *sender, xymond_log_t *log, int duration)
 	dbgprintf("->handle_ack\n");
 
 	log->acktime = getcurrenttime(NULL)+duration*60;
+	log_changed(log);
 	if (log->color > log->maxackedcolor) log->maxackedcolor = log->color;
 	if (log->validtime < log->acktime) log->validtime = log->acktime;
 
@@ -2096,7 +2478,7 @@ void handle_ackinfo(char *msg, char *sender, xymond_log_t *log)
 		dbgprintf("This ackinfo is %s\n", (isnew ? "new" : "old"));
 		if (isnew) {
 			dbgprintf("Creating new ackinfo record\n");
-			newack = (ackinfo_t *)malloc(sizeof(ackinfo_t));
+			newack = (ackinfo_t *)slab_alloc(sizeof(ackinfo_t));
 		}
 		else {
 			/* Drop the old data so we dont leak memory */
@@ -2115,6 +2497,7 @@ void handle_ackinfo(char *msg, char *sender, xymond_log_t *log)
 			newack->next = log->acklist;
 			log->acklist = newack;
 		}
+		log_changed(log);
 
 		if (ackinfologfd) {
 			char timestamp[25];
@@ -2249,7 +2632,7 @@ void flush_acklist(xymond_log_t *zombie, int flushall)
 		if (flushall || (tmp->cleartime < now) || (tmp->validuntil < now)) {
 			if (tmp->ackedby) xfree(tmp->ackedby);
 			if (tmp->msg) xfree(tmp->msg);
-			xfree(tmp);
+			slab_free(tmp, sizeof(ackinfo_t));
 		}
 		else {
 			/* We have a record we want to keep */
@@ -2302,85 +2685,32 @@ void free_log_t(xymond_log_t *zombie)
 
 		if (modtmp->source) xfree(modtmp->source);
 		if (modtmp->cause) xfree(modtmp->cause);
-		xfree(modtmp);
+		slab_free(modtmp, sizeof(modifier_t));
 	}
 
 	if (zombie->sender) xfree(zombie->sender);
-	if (zombie->message) xfree(zombie->message);
+	if (zombie->testflags) xfree(zombie->testflags);
+	if (zombie->message) msgbuf_put(zombie->message, zombie->msgsz);
 	if (zombie->dismsg) xfree(zombie->dismsg);
 	if (zombie->ackmsg) xfree(zombie->ackmsg);
 	if (zombie->grouplist) xfree(zombie->grouplist);
 	flush_acklist(zombie, 1);
-	xfree(zombie);
+	if (zombie->lastchange) slab_free(zombie->lastchange, ((flapcount > 0) ? flapcount : 1) * sizeof(time_t));
+	slab_free(zombie, sizeof(xymond_log_t));
 	dbgprintf("<- free_log_t\n");
 }
 
-void handle_dropnrename(enum droprencmd_t cmd, char *sender, char *hostname, char *n1, char *n2)
+void drop_hoststate(enum droprencmd_t cmd, char *hostname, char *n1, char *n2)
 {
 	char *hostip = NULL;
 	xtreePos_t hosthandle, testhandle;
 	xymond_hostlist_t *hwalk;
 	testinfo_t *twalk, *newt;
 	xymond_log_t *lwalk;
-	char *marker = NULL;
 	char *canonhostname;
 
-	dbgprintf("-> handle_dropnrename\n");
-
-	{
-		/*
-		 * We pass drop- and rename-messages to the workers, whether 
-		 * we know about this host or not. It could be that the drop command
-		 * arrived after we had already re-loaded the hosts.cfg file, and 
-		 * so the host is no longer known by us - but there is still some
-		 * data stored about it that needs to be cleaned up.
-		 */
-
-		char *msgbuf = (char *)malloc(20 + strlen(hostname) + (n1 ? strlen(n1) : 0) + (n2 ? strlen(n2) : 0));
-
-		*msgbuf = '\0';
-		switch (cmd) {
-		  case CMD_DROPTEST:
-			marker = "droptest";
-			sprintf(msgbuf, "%s|%s", hostname, n1);
-			break;
-		  case CMD_DROPHOST:
-			marker = "drophost";
-			sprintf(msgbuf, "%s", hostname);
-			break;
-		  case CMD_RENAMEHOST:
-			marker = "renamehost";
-			sprintf(msgbuf, "%s|%s", hostname, n1);
-			break;
-		  case CMD_RENAMETEST:
-			marker = "renametest";
-			sprintf(msgbuf, "%s|%s|%s", hostname, n1, n2);
-			break;
-		  case CMD_DROPSTATE:
-			marker = "dropstate";
-			sprintf(msgbuf, "%s", hostname);
-			break;
-		}
-
-		if (strlen(msgbuf)) {
-			/* Tell the workers */
-			posttochannel(statuschn, marker, NULL, sender, NULL, NULL, msgbuf);
-			posttochannel(stachgchn, marker, NULL, sender, NULL, NULL, msgbuf);
-			posttochannel(pagechn, marker, NULL, sender, NULL, NULL, msgbuf);
-			posttochannel(datachn, marker, NULL, sender, NULL, NULL, msgbuf);
-			posttochannel(noteschn, marker, NULL, sender, NULL, NULL, msgbuf);
-			posttochannel(enadischn, marker, NULL, sender, NULL, NULL, msgbuf);
-			posttochannel(clientchn, marker, NULL, sender, NULL, NULL, msgbuf);
-			posttochannel(clichgchn, marker, NULL, sender, NULL, NULL, msgbuf);
-			posttochannel(userchn, marker, NULL, sender, NULL, NULL, msgbuf);
-		}
-
-		xfree(msgbuf);
-	}
-
-
 	/*
-	 * Now clean up our internal state info, if there is any.
+	 * Clean up our internal state info, if there is any.
 	 * NB: knownhost() may return NULL, if the hosts.cfg file was re-loaded before
 	 * we got around to cleaning up a host.
 	 */
@@ -2397,7 +2727,7 @@ void handle_dropnrename(enum droprencmd_t cmd, char *sender, char *hostname, cha
 		if (testhandle == xtreeEnd(rbtests)) goto done;
 		twalk = xtreeData(rbtests, testhandle);
 
-		for (lwalk = hwalk->logs; (lwalk && (lwalk->test != twalk)); lwalk = lwalk->next) ;
+		lwalk = loghash_find(hwalk, twalk);
 		if (lwalk == NULL) goto done;
 		if (lwalk == hwalk->pinglog) hwalk->pinglog = NULL;
 		if (lwalk == hwalk->logs) {
@@ -2408,6 +2738,8 @@ void handle_dropnrename(enum droprencmd_t cmd, char *sender, char *hostname, cha
 			for (plog = hwalk->logs; (plog->next != lwalk); plog = plog->next) ;
 			plog->next = lwalk->next;
 		}
+		loghash_update(hwalk, twalk);
+		board_deleted(hwalk->hostname, twalk->name);
 		free_log_t(lwalk);
 		break;
 
@@ -2415,14 +2747,18 @@ void handle_dropnrename(enum droprencmd_t cmd, char *sender, char *hostname, cha
 	  case CMD_DROPSTATE:
 		/* Unlink the hostlist entry */
 		xtreeDelete(rbhosts, hostname);
+		hosttreegen++;
 		hostcount--;
+		board_deleted(hwalk->hostname, NULL);
 
 		/* Loop through the host logs and free them */
 		lwalk = hwalk->logs;
+		hwalk->logs = NULL;
 		while (lwalk) {
 			xymond_log_t *tmp = lwalk;
 			lwalk = lwalk->next;
 
+			loghash_update(hwalk, tmp->test);
 			free_log_t(tmp);
 		}
 
@@ -2437,14 +2773,19 @@ void handle_dropnrename(enum droprencmd_t cmd, char *sender, char *hostname, cha
 			xfree(czombie->msg);
 			xfree(czombie);
 		}
-		xfree(hwalk);
+		slab_free(hwalk, sizeof(xymond_hostlist_t));
 		break;
 
 	  case CMD_RENAMEHOST:
 		xtreeDelete(rbhosts, hostname);
+		board_deleted(hwalk->hostname, NULL);
 		xfree(hwalk->hostname);
 		hwalk->hostname = strdup(n1);
 		xtreeAdd(rbhosts, hwalk->hostname, hwalk);
+		hosttreegen++;
+		hostcfggen++;
+		hwalk->boardseq = ++boardseq;
+		for (lwalk = hwalk->logs; (lwalk); lwalk = lwalk->next) log_changed(lwalk);
 		break;
 
 	  case CMD_RENAMETEST:
@@ -2452,7 +2793,7 @@ void handle_dropnrename(enum droprencmd_t cmd, char *sender, char *hostname, cha
 		if (testhandle == xtreeEnd(rbtests)) goto done;
 		twalk = xtreeData(rbtests, testhandle);
 
-		for (lwalk = hwalk->logs; (lwalk && (lwalk->test != twalk)); lwalk = lwalk->next) ;
+		lwalk = loghash_find(hwalk, twalk);
 		if (lwalk == NULL) goto done;
 
 		if (lwalk == hwalk->pinglog) hwalk->pinglog = NULL;
@@ -2465,37 +2806,114 @@ void handle_dropnrename(enum droprencmd_t cmd, char *sender, char *hostname, cha
 			newt = xtreeData(rbtests, testhandle);
 		}
 		lwalk->test = newt;
+		loghash_update(hwalk, twalk);
+		loghash_update(hwalk, newt);
+		board_deleted(hwalk->hostname, twalk->name);
+		log_changed(lwalk);
 		break;
 	}
 
 done:
-	dbgprintf("<- handle_dropnrename\n");
-
 	return;
 }
 
-
-unsigned char *get_filecache(char *fn, long *len)
+void handle_dropnrename(enum droprencmd_t cmd, char *sender, char *hostname, char *n1, char *n2)
 {
-	xtreePos_t handle;
-	filecache_t *item;
-	unsigned char *result;
-
-	handle = xtreeFind(rbfilecache, fn);
-	if (handle == xtreeEnd(rbfilecache)) return NULL;
-
-	item = (filecache_t *)xtreeData(rbfilecache, handle);
-	if (item->len < 0) return NULL;
+	char *marker = NULL;
 
-	result = (unsigned char *)malloc(item->len);
-	memcpy(result, item->fdata, item->len);
-	*len = item->len;
+	dbgprintf("-> handle_dropnrename\n");
 
-	return result;
-}
+	{
+		/*
+		 * We pass drop- and rename-messages to the workers, whether 
+		 * we know about this host or not. It could be that the drop command
+		 * arrived after we had already re-loaded the hosts.cfg file, and 
+		 * so the host is no longer known by us - but there is still some
+		 * data stored about it that needs to be cleaned up.
+		 */
 
+		char *msgbuf = (char *)malloc(20 + strlen(hostname) + (n1 ? strlen(n1) : 0) + (n2 ? strlen(n2) : 0));
 
-void add_filecache(char *fn, unsigned char *buf, off_t buflen)
+		*msgbuf = '\0';
+		switch (cmd) {
+		  case CMD_DROPTEST:
+			marker = "droptest";
+			sprintf(msgbuf, "%s|%s", hostname, n1);
+			break;
+		  case CMD_DROPHOST:
+			marker = "drophost";
+			sprintf(msgbuf, "%s", hostname);
+			break;
+		  case CMD_RENAMEHOST:
+			marker = "renamehost";
+			sprintf(msgbuf, "%s|%s", hostname, n1);
+			break;
+		  case CMD_RENAMETEST:
+			marker = "renametest";
+			sprintf(msgbuf, "%s|%s|%s", hostname, n1, n2);
+			break;
+		  case CMD_DROPSTATE:
+			marker = "dropstate";
+			sprintf(msgbuf, "%s", hostname);
+			break;
+		}
+
+		if (strlen(msgbuf)) {
+			/* Tell the workers */
+			posttochannel(statuschn, marker, NULL, sender, NULL, NULL, msgbuf);
+			posttochannel(stachgchn, marker, NULL, sender, NULL, NULL, msgbuf);
+			posttochannel(pagechn, marker, NULL, sender, NULL, NULL, msgbuf);
+			posttochannel(datachn, marker, NULL, sender, NULL, NULL, msgbuf);
+			posttochannel(noteschn, marker, NULL, sender, NULL, NULL, msgbuf);
+			posttochannel(enadischn, marker, NULL, sender, NULL, NULL, msgbuf);
+			posttochannel(clientchn, marker, NULL, sender, NULL, NULL, msgbuf);
+			posttochannel(clichgchn, marker, NULL, sender, NULL, NULL, msgbuf);
+			posttochannel(userchn, marker, NULL, sender, NULL, NULL, msgbuf);
+		}
+
+		xfree(msgbuf);
+	}
+
+	/* Remember it for the checkpoint journal */
+	if (checkpointfn && (checkpointformat == CHK_BINARY)) {
+		chkop_t *newop = (chkop_t *)calloc(1, sizeof(chkop_t));
+
+		newop->gen = chkgen;
+		newop->cmd = cmd;
+		newop->hostname = strdup(hostname);
+		newop->n1 = (n1 ? strdup(n1) : NULL);
+		newop->n2 = (n2 ? strdup(n2) : NULL);
+		if (chkoptail) chkoptail->next = newop; else chkophead = newop;
+		chkoptail = newop;
+	}
+
+	drop_hoststate(cmd, hostname, n1, n2);
+
+	dbgprintf("<- handle_dropnrename\n");
+}
+
+
+unsigned char *get_filecache(char *fn, long *len)
+{
+	xtreePos_t handle;
+	filecache_t *item;
+	unsigned char *result;
+
+	handle = xtreeFind(rbfilecache, fn);
+	if (handle == xtreeEnd(rbfilecache)) return NULL;
+
+	item = (filecache_t *)xtreeData(rbfilecache, handle);
+	if (item->len < 0) return NULL;
+
+	result = (unsigned char *)malloc(item->len);
+	memcpy(result, item->fdata, item->len);
+	*len = item->len;
+
+	return result;
+}
+
+
+void add_filecache(char *fn, unsigned char *buf, off_t buflen)
 {
 	xtreePos_t handle;
 	filecache_t *newitem;
@@ -3129,6 +3547,344 @@ strbuffer_t *generate_hostinfo_outbuf(strbuffer_t **prebuf, boardfield_t *boardf
 	return buf;
 }
 
+static void board_freeplan(boardplan_t *plan)
+{
+	clear_filter(plan->logfilter);
+	if (plan->logfields) xfree(plan->logfields);
+	if (plan->hostknown) xfree(plan->hostknown);
+	if (plan->hostmatch) xfree(plan->hostmatch);
+	xfree(plan->key);
+	xfree(plan);
+}
+
+boardplan_t *board_getplan(char *request)
+{
+	/* Find the cached filter for this request, or set one up */
+	char *key, *p, *fields = NULL;
+	xtreePos_t handle;
+	boardplan_t *plan;
+	hostfilter_rec_t *fwalk;
+
+	/* The key is the request minus the command word, and without trailing whitespace */
+	key = request + strcspn(request, " \t\r\n");
+	key += strspn(key, " \t\r\n");
+	key = strdup(key);
+	p = key + strlen(key);
+	while ((p > key) && isspace((int)*(p-1))) p--;
+	*p = '\0';
+
+	handle = xtreeFind(rbboardplans, key);
+	if (handle != xtreeEnd(rbboardplans)) {
+		plan = (boardplan_t *)xtreeData(rbboardplans, handle);
+		if ((plan->hostcfggen == hostcfggen) || (plan->refcount > 0)) {
+			xfree(key);
+			plan->lastused = ++boardplanclock;
+			return plan;
+		}
+
+		/* Filter was set up before hosts.cfg was reloaded, and may refer to hostnames that have changed. Redo it. */
+		xtreeDelete(rbboardplans, plan->key);
+		board_freeplan(plan);
+		boardplancount--;
+	}
+
+	if (boardplancount >= BOARDPLAN_MAX) {
+		/* Make room by dropping the least recently used filter which is not in use */
+		boardplan_t *oldest = NULL;
+
+		for (handle = xtreeFirst(rbboardplans); (handle != xtreeEnd(rbboardplans)); handle = xtreeNext(rbboardplans, handle)) {
+			boardplan_t *pwalk = (boardplan_t *)xtreeData(rbboardplans, handle);
+			if ((pwalk->refcount == 0) && (!oldest || (pwalk->lastused < oldest->lastused))) oldest = pwalk;
+		}
+
+		if (oldest) {
+			xtreeDelete(rbboardplans, oldest->key);
+			board_freeplan(oldest);
+			boardplancount--;
+		}
+	}
+
+	plan = (boardplan_t *)calloc(1, sizeof(boardplan_t));
+	plan->key = key;
+	plan->acklevel = -1;
+	p = strdup(request);	/* setup_filter() chops up the request */
+	plan->logfilter = setup_filter(p, &fields, &plan->acklevel, &plan->havehostfilter);
+	if (!fields) fields = "hostname,testname,color,flags,lastchange,logtime,validtime,acktime,disabletime,sender,cookie,line1";
+	plan->logfields = setup_fields(fields);
+	xfree(p);
+
+	for (fwalk = plan->logfilter; (fwalk); fwalk = fwalk->next) {
+		if ((fwalk->filtertype == FILTER_DOWN) || (fwalk->filtertype == FILTER_NOTDOWN)) plan->dynamichostfilter = 1;
+	}
+
+	plan->hostcfggen = hostcfggen;
+	plan->lastused = ++boardplanclock;
+	xtreeAdd(rbboardplans, plan->key, plan);
+	boardplancount++;
+
+	return plan;
+}
+
+static int board_matchhost(boardplan_t *plan, xymond_hostlist_t *hwalk, void *hinfo)
+{
+	unsigned int byte = (hwalk->hostidx >> 3);
+	unsigned char bit = (1 << (hwalk->hostidx & 7));
+	int result;
+
+	if (plan->dynamichostfilter) return match_host_filter(hinfo, plan->logfilter, 0, NULL);
+
+	if (plan->hostcfggen != hostcfggen) {
+		/* hosts.cfg was reloaded, forget what we know */
+		if (plan->hostknown) memset(plan->hostknown, 0, plan->bitmapbytes);
+		plan->hostcfggen = hostcfggen;
+	}
+
+	if (byte >= plan->bitmapbytes) {
+		unsigned int newsz = ((nexthostidx >> 3) + 1) + 128;
+
+		plan->hostknown = (unsigned char *)realloc(plan->hostknown, newsz);
+		plan->hostmatch = (unsigned char *)realloc(plan->hostmatch, newsz);
+		memset(plan->hostknown + plan->bitmapbytes, 0, newsz - plan->bitmapbytes);
+		plan->bitmapbytes = newsz;
+	}
+
+	if (plan->hostknown[byte] & bit) return ((plan->hostmatch[byte] & bit) != 0);
+
+	result = match_host_filter(hinfo, plan->logfilter, 0, NULL);
+	plan->hostknown[byte] |= bit;
+	if (result) plan->hostmatch[byte] |= bit; else plan->hostmatch[byte] &= ~bit;
+
+	return result;
+}
+
+boardcursor_t *board_open(char *request, int xmlformat)
+{
+	boardcursor_t *cur;
+
+	cur = (boardcursor_t *)calloc(1, sizeof(boardcursor_t));
+	cur->xmlformat = xmlformat;
+	cur->plan = board_getplan(request);
+	cur->plan->refcount++;
+	if (!xmlformat) {
+		cur->dummytimes = (time_t *)calloc((flapcount > 0) ? flapcount : 1, sizeof(time_t));
+	}
+
+	return cur;
+}
+
+boardcursor_t *board_opensince(char *request)
+{
+	/*
+	 * "xymondboardsince CURSOR [CRITERIA]". CURSOR is what we returned
+	 * in the previous response, or 0 to get everything.
+	 */
+	char *cursortok, *p, *filterreq;
+	long epoch = 0;
+	unsigned long seq = 0;
+	boardcursor_t *cur;
+
+	cursortok = request + strcspn(request, " \t\r\n");
+	cursortok += strspn(cursortok, " \t\r\n");
+	p = cursortok + strcspn(cursortok, " \t\r\n");
+	if (sscanf(cursortok, "%ld.%lu", &epoch, &seq) != 2) epoch = seq = 0;
+
+	/* The criteria are as for xymondboard - just leave out the cursor */
+	filterreq = (char *)malloc(strlen(p) + 20);
+	sprintf(filterreq, "xymondboardsince%s", p);
+	cur = board_open(filterreq, 0);
+	xfree(filterreq);
+
+	cur->delta = 1;
+	cur->startseq = boardseq;
+	if ((epoch == boardepoch) && (seq >= boarddelbase) && (seq >= boardresyncseq) && (seq <= boardseq))
+		cur->sinceseq = seq;
+	else
+		cur->sinceseq = 0;	/* Too old or from an earlier run. Send everything */
+
+	return cur;
+}
+
+void board_close(boardcursor_t *cur)
+{
+	cur->plan->refcount--;
+	if (cur->dummytimes) xfree(cur->dummytimes);
+	if (cur->lasthost) xfree(cur->lasthost);
+	xfree(cur);
+}
+
+static void board_addhost(boardcursor_t *cur, xymond_hostlist_t *hwalk, strbuffer_t *response)
+{
+	xymond_log_t *lwalk, *firstlog;
+	xymond_log_t infologrec, rrdlogrec;
+	testinfo_t trendstest, infotest;
+	time_t now = getcurrenttime(NULL);
+
+	/* If there is a hostname filter, drop the "summary" 'hosts' */
+	if (cur->plan->havehostfilter && (hwalk->hosttype != H_NORMAL)) return;
+
+	firstlog = hwalk->logs;
+
+	if (!cur->xmlformat) {
+		/* Setup fake log-records for the "info" and "trends" data. */
+		memset(&infotest, 0, sizeof(infotest));
+		infotest.name = xgetenv("INFOCOLUMN");
+		memset(&infologrec, 0, sizeof(infologrec));
+		infologrec.test = &infotest;
+
+		memset(&trendstest, 0, sizeof(trendstest));
+		trendstest.name = xgetenv("TRENDSCOLUMN");
+		memset(&rrdlogrec, 0, sizeof(rrdlogrec));
+		rrdlogrec.test = &trendstest;
+
+		infologrec.color = rrdlogrec.color = COL_GREEN;
+		infologrec.message = rrdlogrec.message = "";
+		infologrec.sender = rrdlogrec.sender = "xymond";
+		infologrec.lastchange = rrdlogrec.lastchange = cur->dummytimes;
+		infologrec.boardseq = rrdlogrec.boardseq = hwalk->boardseq;
+		rrdlogrec.host = infologrec.host = hwalk;
+	}
+
+	if (hwalk->hosttype == H_NORMAL) {
+		void *hinfo = hostinfo(hwalk->hostname);
+
+		if (!hinfo) {
+			errprintf("Hostname '%s' in tree, but no host-info\n", hwalk->hostname);
+			return;
+		}
+
+		/* Host/pagename filter */
+		if (!board_matchhost(cur->plan, hwalk, hinfo)) return;
+
+		/* Handle NOINFO and NOTRENDS here */
+		if (!cur->xmlformat && !xmh_item(hinfo, XMH_FLAG_NOINFO)) {
+			infologrec.next = firstlog;
+			firstlog = &infologrec;
+		}
+		if (!cur->xmlformat && !xmh_item(hinfo, XMH_FLAG_NOTRENDS)) {
+			rrdlogrec.next = firstlog;
+			firstlog = &rrdlogrec;
+		}
+	}
+
+	for (lwalk = firstlog; (lwalk); lwalk = lwalk->next) {
+		char *eoln;
+
+		if (cur->sinceseq && (lwalk->boardseq <= cur->sinceseq)) continue;
+		if (!match_test_filter(lwalk, cur->plan->logfilter)) continue;
+
+		if (lwalk->message == NULL) {
+			errprintf("%s.%s has a NULL message\n", lwalk->host->hostname, lwalk->test->name);
+			lwalk->message = strdup("No data");
+			lwalk->msgsz = strlen(lwalk->message) + 1;
+		}
+
+		if (!cur->xmlformat) {
+			generate_outbuf(&response, cur->plan->logfields, hwalk, lwalk, cur->plan->acklevel);
+			continue;
+		}
+
+		eoln = strchr(lwalk->message, '\n');
+		if (eoln) *eoln = '\0';
+
+		addtobuffer_many(response, 
+			"  <ServerStatus>\n",
+			"    <ServerName>", hwalk->hostname, "</ServerName>\n",
+			"    <Type>", lwalk->test->name, "</Type>\n",
+			"    <Status>", colorname(lwalk->color), "</Status>\n",
+			"    <TestFlags>", (lwalk->testflags ? lwalk->testflags : ""), "</TestFlags>\n",
+			"    <LastChange>", timestr(lwalk->lastchange[0]), "</LastChange>\n",
+			"    <LogTime>", timestr(lwalk->logtime), "</LogTime>\n",
+			"    <ValidTime>", timestr(lwalk->validtime), "</ValidTime>\n",
+			"    <AckTime>", timestr(lwalk->acktime), "</AckTime>\n",
+			"    <DisableTime>", timestr(lwalk->enabletime), "</DisableTime>\n",
+			"    <Sender>", lwalk->sender, "</Sender>\n",
+			NULL);
+		timestr(-1);
+
+		if (lwalk->cookie && (lwalk->cookieexpires > now))
+			addtobuffer_many(response, "    <Cookie>", lwalk->cookie, "</Cookie>\n", NULL);
+		else
+			addtobuffer(response, "    <Cookie>N/A</Cookie>\n");
+
+		addtobuffer_many(response, 
+			"    <MessageSummary><![CDATA[", lwalk->message, "]]></MessageSummary>\n",
+			"  </ServerStatus>\n",
+			NULL);
+		if (eoln) *eoln = '\n';
+	}
+}
+
+int board_fill(boardcursor_t *cur, strbuffer_t *response, int minbytes)
+{
+	/*
+	 * Add hosts to the response until it holds at least minbytes, or
+	 * we have done all hosts (minbytes = 0 does them all).
+	 * Returns 1 if there is more to come, 0 when the response is complete.
+	 */
+	xtreePos_t hosthandle;
+	xymond_hostlist_t *hwalk;
+
+	if (cur->done) return 0;
+
+	if (cur->lasthost == NULL) {
+		if (cur->xmlformat) {
+			addtobuffer(response, "<?xml version='1.0' encoding='ISO-8859-1'?>\n");
+			addtobuffer(response, "<StatusBoard>\n");
+		}
+		else if (cur->delta) {
+			char l[100];
+			boarddel_t *dwalk;
+
+			sprintf(l, "@@SEQ|%ld.%lu|%s\n", (long)boardepoch, cur->startseq, (cur->sinceseq ? "delta" : "full"));
+			addtobuffer(response, l);
+			for (dwalk = boarddelhead; (cur->sinceseq && dwalk); dwalk = dwalk->next) {
+				if (dwalk->seq <= cur->sinceseq) continue;
+				addtobuffer_many(response, "@@DEL|", dwalk->hostname, "|", (dwalk->testname ? dwalk->testname : ""), "\n", NULL);
+			}
+		}
+		hosthandle = xtreeFirst(rbhosts);
+	}
+	else if (cur->treegen == hosttreegen) {
+		hosthandle = cur->nexthandle;
+	}
+	else {
+		/*
+		 * Hosts were added or removed since last time. Continue after the last
+		 * host we sent. This must walk from xtreeFirst(), since the positions
+		 * we hold may be gone and xtreeNext() is not valid after xtreeFind().
+		 */
+		for (hosthandle = xtreeFirst(rbhosts); 
+		     ((hosthandle != xtreeEnd(rbhosts)) && (strcasecmp(xtreeKey(rbhosts, hosthandle), cur->lasthost) <= 0)); 
+		     hosthandle = xtreeNext(rbhosts, hosthandle)) ;
+	}
+
+	while ((hosthandle != xtreeEnd(rbhosts)) && ((minbytes == 0) || (STRBUFLEN(response) < minbytes))) {
+		hwalk = xtreeData(rbhosts, hosthandle);
+		if (!hwalk) {
+			errprintf("host-tree has a record with no data\n");
+		}
+		else {
+			board_addhost(cur, hwalk, response);
+		}
+
+		if (cur->lasthost) xfree(cur->lasthost);
+		cur->lasthost = strdup(xtreeKey(rbhosts, hosthandle));
+		hosthandle = xtreeNext(rbhosts, hosthandle);
+	}
+
+	if (hosthandle == xtreeEnd(rbhosts)) {
+		if (cur->xmlformat) addtobuffer(response, "</StatusBoard>\n");
+		cur->done = 1;
+		return 0;
+	}
+
+	/* We stopped with more hosts to go */
+	if (cur->lasthost == NULL) cur->lasthost = strdup("");
+	cur->nexthandle = hosthandle;
+	cur->treegen = hosttreegen;
+	return 1;
+}
+
 void get_sender(conn_t *msg, char *msgtext, char *prestring)
 {
 	char *msgfrom;
@@ -3673,214 +4429,47 @@ void do_message(conn_t *msg, char *origin, int viabfq)
 			msg->bufp = msg->buf = grabstrbuffer(response);
 		}
 	}
-	else if ((strncmp(msg->buf, "xymondboard", 11) == 0) || (strncmp(msg->buf, "hobbitdboard", 12) == 0)) {
+	else if ((strncmp(msg->buf, "xymondboard", 11) == 0) || (strncmp(msg->buf, "hobbitdboard", 12) == 0) ||
+		 (strncmp(msg->buf, "xymondxboard", 12) == 0) || (strncmp(msg->buf, "hobbitdxboard", 13) == 0)) {
 		/* 
-		 * Request for a summmary of all known status logs
-		 *
+		 * Request for a summmary of all known status logs, in plain or XML format -
+		 * or with "xymondboardsince", only those that changed since last time.
+		 * For network clients the first part of the response is generated here,
+		 * and the rest as the client reads it. See server_callback().
 		 */
-		xtreePos_t hosthandle;
-		xymond_hostlist_t *hwalk;
-		xymond_log_t *lwalk, *firstlog;
-		xymond_log_t infologrec, rrdlogrec;
-		time_t *dummytimes;
-		testinfo_t trendstest, infotest;
-		hostfilter_rec_t *logfilter;
-		boardfield_t *logfields;
-		char *fields = NULL;
-		int acklevel = -1, havehostfilter = 0;
+		boardcursor_t *cur;
 		strbuffer_t *response;
-		static unsigned int lastboardsize = 0;
+		int xmlformat = ((strncmp(msg->buf, "xymondxboard", 12) == 0) || (strncmp(msg->buf, "hobbitdxboard", 13) == 0));
 
 		if (!oksender(wwwsenders, NULL, msg->sender, msg->buf)) goto done;
 
-		logfilter = setup_filter(msg->buf, &fields, &acklevel, &havehostfilter);
-		if (!fields) fields = "hostname,testname,color,flags,lastchange,logtime,validtime,acktime,disabletime,sender,cookie,line1";
-		logfields = setup_fields(fields);
-
-		response = newstrbuffer(lastboardsize);
-
-		/* Setup fake log-records for the "info" and "trends" data. */
-		dummytimes = (time_t *)calloc((flapcount > 0) ? flapcount : 1, sizeof(time_t));
-		memset(&infotest, 0, sizeof(infotest));
-		infotest.name = xgetenv("INFOCOLUMN");
-		memset(&infologrec, 0, sizeof(infologrec));
-		infologrec.test = &infotest;
-
-		memset(&trendstest, 0, sizeof(trendstest));
-		trendstest.name = xgetenv("TRENDSCOLUMN");
-		memset(&rrdlogrec, 0, sizeof(rrdlogrec));
-		rrdlogrec.test = &trendstest;
-
-		infologrec.color = rrdlogrec.color = COL_GREEN;
-		infologrec.message = rrdlogrec.message = "";
-		infologrec.sender = rrdlogrec.sender = "xymond";
-		infologrec.lastchange = rrdlogrec.lastchange = dummytimes;
-
-		for (hosthandle = xtreeFirst(rbhosts); (hosthandle != xtreeEnd(rbhosts)); hosthandle = xtreeNext(rbhosts, hosthandle)) {
-			hwalk = xtreeData(rbhosts, hosthandle);
-			if (!hwalk) {
-				errprintf("host-tree has a record with no data\n");
-				continue;
-			}
-
-			/* If there is a hostname filter, drop the "summary" 'hosts' */
-			if (havehostfilter && (hwalk->hosttype != H_NORMAL)) continue;
-
-			firstlog = hwalk->logs;
-
-			if (hwalk->hosttype == H_NORMAL) {
-				void *hinfo = hostinfo(hwalk->hostname);
-
-				if (!hinfo) {
-					errprintf("Hostname '%s' in tree, but no host-info\n", hwalk->hostname);
-					continue;
-				}
-
-				/* Host/pagename filter */
-				if (!match_host_filter(hinfo, logfilter, 0, NULL)) continue;
-
-				/* Handle NOINFO and NOTRENDS here */
-				if (!xmh_item(hinfo, XMH_FLAG_NOINFO)) {
-					infologrec.next = firstlog;
-					firstlog = &infologrec;
-				}
-				if (!xmh_item(hinfo, XMH_FLAG_NOTRENDS)) {
-					rrdlogrec.next = firstlog;
-					firstlog = &rrdlogrec;
-				}
-			}
-
-			rrdlogrec.host = infologrec.host = hwalk;
-
-			for (lwalk = firstlog; (lwalk); lwalk = lwalk->next) {
-				if (!match_test_filter(lwalk, logfilter)) continue;
-
-				if (lwalk->message == NULL) {
-					errprintf("%s.%s has a NULL message\n", lwalk->host->hostname, lwalk->test->name);
-					lwalk->message = strdup("No data");
-					lwalk->msgsz = strlen(lwalk->message) + 1;
-				}
-
-				response = generate_outbuf(&response, logfields, hwalk, lwalk, acklevel);
-			}
+		if (strncmp(msg->buf, "xymondboardsince", 16) == 0)
+			cur = board_opensince(msg->buf);
+		else
+			cur = board_open(msg->buf, xmlformat);
+		response = newstrbuffer(BOARDCHUNKSZ);
+		if (board_fill(cur, response, (msg->canstream ? BOARDCHUNKSZ : 0)) && msg->canstream) {
+			if (msg->board) board_close(msg->board);
+			msg->board = cur;
+		}
+		else {
+			board_close(cur);
 		}
-
-		if (STRBUFLEN(response) > lastboardsize) lastboardsize = STRBUFLEN(response);
 
 		xfree(msg->buf);
 		msg->doingwhat = RESPONDING;
 		msg->buflen = STRBUFLEN(response);
 		msg->bufp = msg->buf = grabstrbuffer(response);
-
-		clear_filter(logfilter);
-		xfree(logfields);
-		xfree(dummytimes);
 	}
-	else if ((strncmp(msg->buf, "xymondxboard", 12) == 0) || (strncmp(msg->buf, "hobbitdxboard", 13) == 0)) {
+	else if (strncmp(msg->buf, "hostinfo", 8) == 0) {
 		/* 
-		 * Request for a summmary of all known status logs in XML format
+		 * Request for host configuration info
 		 *
 		 */
-		xtreePos_t hosthandle;
-		xymond_hostlist_t *hwalk;
-		xymond_log_t *lwalk;
-		hostfilter_rec_t *logfilter;
-		char *fields = NULL;
-		int acklevel = -1, havehostfilter = 0;
-		static unsigned int lastboardsize = 0;
+		void *hinfo;
 		strbuffer_t *response;
-
-		if (!oksender(wwwsenders, NULL, msg->sender, msg->buf)) goto done;
-
-		logfilter = setup_filter(msg->buf, &fields, &acklevel, &havehostfilter);
-		response = newstrbuffer(lastboardsize);
-
-		addtobuffer(response, "<?xml version='1.0' encoding='ISO-8859-1'?>\n");
-		addtobuffer(response, "<StatusBoard>\n");
-
-		for (hosthandle = xtreeFirst(rbhosts); (hosthandle != xtreeEnd(rbhosts)); hosthandle = xtreeNext(rbhosts, hosthandle)) {
-			hwalk = xtreeData(rbhosts, hosthandle);
-			if (!hwalk) {
-				errprintf("host-tree has a record with no data\n");
-				continue;
-			}
-
-			/* If there is a hostname filter, drop the "summary" 'hosts' */
-			if (havehostfilter && (hwalk->hosttype != H_NORMAL)) continue;
-
-			if (hwalk->hosttype == H_NORMAL) {
-				void *hinfo;
-				hinfo = hostinfo(hwalk->hostname);
-
-				if (!hinfo) {
-					errprintf("Hostname '%s' in tree, but no host-info\n", hwalk->hostname);
-					continue;
-				}
-
-				/* Host/pagename filter */
-				if (!match_host_filter(hinfo, logfilter, 0, NULL)) continue;
-			}
-
-			for (lwalk = hwalk->logs; (lwalk); lwalk = lwalk->next) {
-				char *eoln;
-
-				if (!match_test_filter(lwalk, logfilter)) continue;
-
-				if (lwalk->message == NULL) {
-					errprintf("%s.%s has a NULL message\n", lwalk->host->hostname, lwalk->test->name);
-					lwalk->message = strdup("No data");
-					lwalk->msgsz = strlen(lwalk->message) + 1;
-				}
-
-				eoln = strchr(lwalk->message, '\n');
-				if (eoln) *eoln = '\0';
-
-				addtobuffer_many(response, 
-					"  <ServerStatus>\n",
-					"    <ServerName>", hwalk->hostname, "</ServerName>\n",
-					"    <Type>", lwalk->test->name, "</Type>\n",
-					"    <Status>", colorname(lwalk->color), "</Status>\n",
-					"    <TestFlags>", (lwalk->testflags ? lwalk->testflags : ""), "</TestFlags>\n",
-					"    <LastChange>", timestr(lwalk->lastchange[0]), "</LastChange>\n",
-					"    <LogTime>", timestr(lwalk->logtime), "</LogTime>\n",
-					"    <ValidTime>", timestr(lwalk->validtime), "</ValidTime>\n",
-					"    <AckTime>", timestr(lwalk->acktime), "</AckTime>\n",
-					"    <DisableTime>", timestr(lwalk->enabletime), "</DisableTime>\n",
-					"    <Sender>", lwalk->sender, "</Sender>\n",
-					NULL);
-				timestr(-1);
-
-				if (lwalk->cookie && (lwalk->cookieexpires > now))
-					addtobuffer_many(response, "    <Cookie>", lwalk->cookie, "</Cookie>\n", NULL);
-				else
-					addtobuffer(response, "    <Cookie>N/A</Cookie>\n");
-
-				addtobuffer_many(response, 
-					"    <MessageSummary><![CDATA[", lwalk->message, "]]></MessageSummary>\n",
-					"  </ServerStatus>\n",
-					NULL);
-				if (eoln) *eoln = '\n';
-			}
-		}
-		addtobuffer(response, "</StatusBoard>\n");
-
-		xfree(msg->buf);
-		msg->doingwhat = RESPONDING;
-		msg->buflen = STRBUFLEN(response);
-		msg->bufp = msg->buf = grabstrbuffer(response);
-		if (msg->buflen > lastboardsize) lastboardsize = msg->buflen;
-
-		clear_filter(logfilter);
-	}
-	else if (strncmp(msg->buf, "hostinfo", 8) == 0) {
-		/* 
-		 * Request for host configuration info
-		 *
-		 */
-		void *hinfo;
-		strbuffer_t *response;
-		static unsigned int lastboardsize = 0;
-		char *clonehost;
+		static unsigned int lastboardsize = 0;
+		char *clonehost;
 
 		if (!oksender(wwwsenders, NULL, msg->sender, msg->buf)) goto done;
 
@@ -4338,47 +4927,87 @@ done:
 }
 
 
-void save_checkpoint(void)
+/*
+ * The binary checkpoint format. The file starts with a chkfilehdr_t that
+ * identifies the full checkpoint it belongs to (for a journal: the full
+ * checkpoint it must be applied to). This is followed by records with a
+ * record type and the length of the record data. Numbers are stored as
+ * 64-bit values in native byte order; strings are stored with their length
+ * and are NUL-terminated, so they can be used directly from the file buffer
+ * when loading. The file ends with a CHKREC_END record.
+ */
+#define CHKBIN_MAGIC "@@XYMONDCHK-V2\n"
+#define CHKBIN_BOM 0x01020304
+
+enum chkkind_t { CHKFILE_FULL = 1, CHKFILE_JOURNAL = 2 };
+enum chkrectype_t { CHKREC_END, CHKREC_STATUS, CHKREC_ACK, CHKREC_TASK, CHKREC_DROPREN };
+
+typedef struct chkfilehdr_t {
+	char magic[16];
+	unsigned int bom, kind;
+	long long gen, tstamp;
+} chkfilehdr_t;
+
+/* A status record, as read from a checkpoint file */
+typedef struct chkstatus_t {
+	char *originname, *hostname, *testname, *sender, *testflags, *statusmsg, *disablemsg, *ackmsg, *cookie;
+	time_t logtime, lastchange, validtime, enabletime, acktime, cookieexpires, yellowstart, redstart;
+	int color, oldcolor;
+} chkstatus_t;
+
+static char *journalfilename(char *fn)
+{
+	char *result = (char *)malloc(strlen(fn) + 10);
+
+	sprintf(result, "%s.journal", fn);
+	return result;
+}
+
+static void flush_chkops(void)
+{
+	while (chkophead) {
+		chkop_t *zombie = chkophead;
+
+		chkophead = chkophead->next;
+		xfree(zombie->hostname);
+		if (zombie->n1) xfree(zombie->n1);
+		if (zombie->n2) xfree(zombie->n2);
+		xfree(zombie);
+	}
+	chkoptail = NULL;
+}
+
+static void expire_logdata(xymond_log_t *lwalk, time_t now)
+{
+	if (lwalk->dismsg && (lwalk->enabletime < now) && (lwalk->enabletime != DISABLED_UNTIL_OK)) {
+		xfree(lwalk->dismsg);
+		lwalk->dismsg = NULL;
+		lwalk->enabletime = 0;
+	}
+	if (lwalk->ackmsg && (lwalk->acktime < now)) {
+		xfree(lwalk->ackmsg);
+		lwalk->ackmsg = NULL;
+		lwalk->acktime = 0;
+	}
+	flush_acklist(lwalk, 0);
+}
+
+static int write_checkpoint_text(FILE *fd, time_t now)
 {
-	char *tempfn;
-	FILE *fd;
 	xtreePos_t hosthandle;
 	xymond_hostlist_t *hwalk;
 	xymond_log_t *lwalk;
-	time_t now = getcurrenttime(NULL);
 	scheduletask_t *swalk;
 	ackinfo_t *awalk;
 	int iores = 0;
 
-	if (checkpointfn == NULL) return;
-
-	dbgprintf("-> save_checkpoint\n");
-	tempfn = malloc(strlen(checkpointfn) + 20);
-	sprintf(tempfn, "%s.%d", checkpointfn, (int)now);
-	fd = fopen(tempfn, "w");
-	if (fd == NULL) {
-		errprintf("Cannot open checkpoint file %s : %s\n", tempfn, strerror(errno));
-		xfree(tempfn);
-		return;
-	}
-
 	for (hosthandle = xtreeFirst(rbhosts); ((hosthandle != xtreeEnd(rbhosts)) && (iores >= 0)); hosthandle = xtreeNext(rbhosts, hosthandle)) {
 		char *msgstr;
 
 		hwalk = xtreeData(rbhosts, hosthandle);
 
 		for (lwalk = hwalk->logs; (lwalk); lwalk = lwalk->next) {
-			if (lwalk->dismsg && (lwalk->enabletime < now) && (lwalk->enabletime != DISABLED_UNTIL_OK)) {
-				xfree(lwalk->dismsg);
-				lwalk->dismsg = NULL;
-				lwalk->enabletime = 0;
-			}
-			if (lwalk->ackmsg && (lwalk->acktime < now)) {
-				xfree(lwalk->ackmsg);
-				lwalk->ackmsg = NULL;
-				lwalk->acktime = 0;
-			}
-			flush_acklist(lwalk, 0);
+			expire_logdata(lwalk, now);
 			iores = fprintf(fd, "@@XYMONDCHK-V1|%s|%s|%s|%s|%s|%s|%s|%d|%d|%d|%d|%d|%s|%d|%s", 
 				lwalk->origin, hwalk->hostname, lwalk->test->name, lwalk->sender,
 				colnames[lwalk->color], 
@@ -4409,6 +5038,157 @@ void save_checkpoint(void)
 			swalk->id, (int)swalk->executiontime, swalk->sender, nlencode(swalk->command));
 	}
 
+	return iores;
+}
+
+static void chk_addnum(strbuffer_t *buf, long long val)
+{
+	addtobufferraw(buf, (char *)&val, sizeof(val));
+}
+
+static void chk_addstr(strbuffer_t *buf, char *val)
+{
+	unsigned int len = (val ? strlen(val) : 0);
+
+	addtobufferraw(buf, (char *)&len, sizeof(len));
+	if (len) addtobufferraw(buf, val, len);
+	addtobufferraw(buf, "", 1);
+}
+
+static int chk_writerec(FILE *fd, enum chkrectype_t rectype, strbuffer_t *buf)
+{
+	unsigned int rechdr[2];
+	int iores = 0;
+
+	rechdr[0] = rectype;
+	rechdr[1] = STRBUFLEN(buf);
+	if (fwrite(rechdr, sizeof(rechdr), 1, fd) != 1) iores = -1;
+	if ((iores == 0) && rechdr[1] && (fwrite(STRBUF(buf), rechdr[1], 1, fd) != 1)) iores = -1;
+	clearstrbuffer(buf);
+
+	return iores;
+}
+
+static int write_checkpoint_bin(FILE *fd, time_t now, int journal)
+{
+	chkfilehdr_t hdr;
+	strbuffer_t *buf = newstrbuffer(0);
+	xtreePos_t hosthandle;
+	xymond_hostlist_t *hwalk;
+	xymond_log_t *lwalk;
+	scheduletask_t *swalk;
+	ackinfo_t *awalk;
+	chkop_t *owalk;
+	int iores = 0;
+
+	memset(&hdr, 0, sizeof(hdr));
+	strcpy(hdr.magic, CHKBIN_MAGIC);
+	hdr.bom = CHKBIN_BOM;
+	hdr.kind = (journal ? CHKFILE_JOURNAL : CHKFILE_FULL);
+	hdr.gen = chkbasegen;
+	hdr.tstamp = chkbasetime;
+	if (fwrite(&hdr, sizeof(hdr), 1, fd) != 1) iores = -1;
+
+	/* The journal has the drop- and rename-commands done since the full checkpoint */
+	for (owalk = (journal ? chkophead : NULL); (owalk && (iores == 0)); owalk = owalk->next) {
+		chk_addnum(buf, owalk->cmd);
+		chk_addstr(buf, owalk->hostname);
+		chk_addstr(buf, owalk->n1);
+		chk_addstr(buf, owalk->n2);
+		iores = chk_writerec(fd, CHKREC_DROPREN, buf);
+	}
+
+	for (hosthandle = xtreeFirst(rbhosts); ((hosthandle != xtreeEnd(rbhosts)) && (iores == 0)); hosthandle = xtreeNext(rbhosts, hosthandle)) {
+		hwalk = xtreeData(rbhosts, hosthandle);
+
+		for (lwalk = hwalk->logs; (lwalk && (iores == 0)); lwalk = lwalk->next) {
+			/* The journal only has the statuses changed since the full checkpoint */
+			if (journal && (lwalk->chkgen <= chkbasegen)) continue;
+
+			expire_logdata(lwalk, now);
+			chk_addstr(buf, lwalk->origin);
+			chk_addstr(buf, hwalk->hostname);
+			chk_addstr(buf, lwalk->test->name);
+			chk_addstr(buf, lwalk->sender);
+			chk_addnum(buf, lwalk->color);
+			chk_addstr(buf, lwalk->testflags);
+			chk_addnum(buf, lwalk->oldcolor);
+			chk_addnum(buf, lwalk->logtime);
+			chk_addnum(buf, lwalk->lastchange[0]);
+			chk_addnum(buf, lwalk->validtime);
+			chk_addnum(buf, lwalk->enabletime);
+			chk_addnum(buf, lwalk->acktime);
+			chk_addstr(buf, lwalk->cookie);
+			chk_addnum(buf, lwalk->cookieexpires);
+			chk_addstr(buf, lwalk->message);
+			chk_addstr(buf, lwalk->dismsg);
+			chk_addstr(buf, lwalk->ackmsg);
+			chk_addnum(buf, lwalk->redstart);
+			chk_addnum(buf, lwalk->yellowstart);
+			iores = chk_writerec(fd, CHKREC_STATUS, buf);
+
+			for (awalk = lwalk->acklist; (awalk && (iores == 0)); awalk = awalk->next) {
+				chk_addstr(buf, hwalk->hostname);
+				chk_addstr(buf, lwalk->test->name);
+				chk_addnum(buf, awalk->received);
+				chk_addnum(buf, awalk->validuntil);
+				chk_addnum(buf, awalk->cleartime);
+				chk_addnum(buf, awalk->level);
+				chk_addstr(buf, awalk->ackedby);
+				chk_addstr(buf, awalk->msg);
+				iores = chk_writerec(fd, CHKREC_ACK, buf);
+			}
+		}
+	}
+
+	/* Tasks are always saved in full */
+	for (swalk = schedulehead; (swalk && (iores == 0)); swalk = swalk->next) {
+		chk_addnum(buf, swalk->id);
+		chk_addnum(buf, swalk->executiontime);
+		chk_addstr(buf, swalk->sender);
+		chk_addstr(buf, swalk->command);
+		iores = chk_writerec(fd, CHKREC_TASK, buf);
+	}
+
+	if (iores == 0) iores = chk_writerec(fd, CHKREC_END, buf);
+
+	freestrbuffer(buf);
+
+	return iores;
+}
+
+int save_checkpoint(int journal)
+{
+	/*
+	 * Save a full checkpoint, or the journal of changes since the last
+	 * full checkpoint. This normally runs in a child process, so that
+	 * xymond can continue processing messages while the file is written.
+	 */
+	char *fn, *tempfn;
+	FILE *fd;
+	time_t now = getcurrenttime(NULL);
+	int iores = 0;
+
+	if (checkpointfn == NULL) return -1;
+	if (journal && ((checkpointformat != CHK_BINARY) || (chkbasegen == 0))) return -1;
+
+	dbgprintf("-> save_checkpoint\n");
+	fn = (journal ? journalfilename(checkpointfn) : strdup(checkpointfn));
+	tempfn = malloc(strlen(fn) + 20);
+	sprintf(tempfn, "%s.%d", fn, (int)now);
+	fd = fopen(tempfn, "w");
+	if (fd == NULL) {
+		errprintf("Cannot open checkpoint file %s : %s\n", tempfn, strerror(errno));
+		xfree(tempfn);
+		xfree(fn);
+		return -1;
+	}
+
+	if (checkpointformat == CHK_BINARY)
+		iores = write_checkpoint_bin(fd, now, journal);
+	else
+		iores = write_checkpoint_text(fd, now);
+
 	if (iores < 0) {
 		errprintf("I/O error while saving the checkpoint file: %s\n", strerror(errno));
 		exit(1);
@@ -4420,33 +5200,187 @@ void save_checkpoint(void)
 		exit(1);
 	}
 
-	iores = rename(tempfn, checkpointfn);
+	iores = rename(tempfn, fn);
 	if (iores == -1) {
 		errprintf("I/O error while renaming the checkpoint file: %s\n", strerror(errno));
 		exit(1);
 	}
 
 	xfree(tempfn);
+	xfree(fn);
 	dbgprintf("<- save_checkpoint\n");
+
+	return 0;
 }
 
 
-void load_checkpoint(char *fn)
+static int restore_status(chkstatus_t *rec, unsigned long gen, xymond_log_t **ltail)
+{
+	/* "ltail" is the last status added by the caller; checkpoints are sorted by host, so it is usually the host's list tail */
+	char *hostname, *testname, *hostip = NULL;
+	xtreePos_t hosthandle, testhandle, originhandle;
+	xymond_hostlist_t *hitem;
+	testinfo_t *t;
+	char *origin;
+	xymond_log_t *log;
+
+	/* Only load hosts we know; they may have been dropped while we were offline */
+	hostname = knownhost(rec->hostname, &hostip, ghosthandling);
+	if (hostname == NULL) return 0;
+	testname = rec->testname;
+
+	/* Ignore the "info" and "trends" data, since we generate on the fly now. */
+	if (strcmp(testname, xgetenv("INFOCOLUMN")) == 0) return 0;
+	if (strcmp(testname, xgetenv("TRENDSCOLUMN")) == 0) return 0;
+
+	/* Rename the now-forgotten internal statuses */
+	if (strcmp(hostname, getenv("MACHINEDOTS")) == 0) {
+		if (strcmp(testname, "bbgen") == 0) testname = "xymongen";
+		else if (strcmp(testname, "bbtest") == 0) testname = "xymonnet";
+		else if (strcmp(testname, "hobbitd") == 0) testname = "xymond";
+	}
+
+	dbgprintf("Status: Host=%s, test=%s\n", hostname, testname);
+
+	hosthandle = xtreeFind(rbhosts, hostname);
+	if (hosthandle == xtreeEnd(rbhosts)) {
+		/* New host */
+		hitem = create_hostlist_t(hostname, hostip);
+		hostcount++;
+	}
+	else {
+		hitem = xtreeData(rbhosts, hosthandle);
+	}
+
+	testhandle = xtreeFind(rbtests, testname);
+	if (testhandle == xtreeEnd(rbtests)) {
+		t = create_testinfo(testname);
+	}
+	else t = xtreeData(rbtests, testhandle);
+
+	originhandle = xtreeFind(rborigins, rec->originname);
+	if (originhandle == xtreeEnd(rborigins)) {
+		origin = strdup(rec->originname);
+		xtreeAdd(rborigins, origin, origin);
+	}
+	else origin = xtreeData(rborigins, originhandle);
+
+	log = loghash_find(hitem, t);
+	if (log && (log->origin != origin)) {
+		for (log = hitem->logs; (log && ((log->test != t) || (log->origin != origin))); log = log->next) ;
+	}
+	if (log) {
+		/* We already have this status (when loading a journal), so replace it */
+		clear_cookie(log);
+		if (log->testflags) xfree(log->testflags);
+		if (log->sender) xfree(log->sender);
+		if (log->message) msgbuf_put(log->message, log->msgsz);
+		if (log->dismsg) xfree(log->dismsg);
+		if (log->ackmsg) xfree(log->ackmsg);
+		flush_acklist(log, 1);
+	}
+	else {
+		log = (xymond_log_t *) slab_alloc(sizeof(xymond_log_t));
+		log->lastchange = (time_t *)slab_alloc(((flapcount > 0) ? flapcount : 1) * sizeof(time_t));
+		if ((*ltail == NULL) || ((*ltail)->host != hitem) || (*ltail)->next) {
+			for (*ltail = hitem->logs; (*ltail && (*ltail)->next); *ltail = (*ltail)->next) ;
+		}
+		if (*ltail) (*ltail)->next = log; else hitem->logs = log;
+		*ltail = log;
+	}
+
+	if (strcmp(testname, xgetenv("PINGCOLUMN")) == 0) hitem->pinglog = log;
+
+	/* Fixup validtime in case of ack'ed or disabled tests */
+	if (rec->validtime < rec->acktime) rec->validtime = rec->acktime;
+	if (rec->validtime < rec->enabletime) rec->validtime = rec->enabletime;
+
+	log->test = t;
+	log->host = hitem;
+	log->origin = origin;
+	loghash_update(hitem, t);
+	log->color = rec->color;
+	log->oldcolor = rec->oldcolor;
+	log->activealert = (decide_alertstate(rec->color) == A_ALERT);
+	log->histsynced = 0;
+	log->testflags = ( (rec->testflags && strlen(rec->testflags)) ? strdup(rec->testflags) : NULL);
+	log->sender = strdup(rec->sender ? rec->sender : "");
+	log->logtime = rec->logtime;
+	log->lastchange[0] = rec->lastchange;
+	log->validtime = rec->validtime;
+	log->enabletime = rec->enabletime;
+	if (log->enabletime == DISABLED_UNTIL_OK) log->validtime = INT_MAX;
+	log->acktime = rec->acktime;
+	log->redstart = rec->redstart;
+	log->yellowstart = rec->yellowstart;
+	log->message = msgbuf_get(strlen(rec->statusmsg)+1, &log->msgsz);
+	strcpy(log->message, rec->statusmsg);
+	log->dismsg = ((rec->disablemsg && strlen(rec->disablemsg)) ? strdup(rec->disablemsg) : NULL);
+	log->ackmsg = ((rec->ackmsg && strlen(rec->ackmsg)) ? strdup(rec->ackmsg) : NULL);
+
+	if (rec->cookie && *rec->cookie) {
+		log->cookie = strdup(rec->cookie);
+		log->cookieexpires = rec->cookieexpires;
+		xtreeAdd(rbcookies, log->cookie, log);
+	}
+	else {
+		log->cookie = NULL;
+		log->cookieexpires = 0;
+	}
+
+	log->chkgen = gen;
+
+	return 1;
+}
+
+static void restore_ack(char *hostname, char *testname, ackinfo_t *newack)
+{
+	xtreePos_t hosthandle, testhandle;
+	xymond_hostlist_t *hitem = NULL;
+	testinfo_t *t = NULL;
+	xymond_log_t *log = NULL;
+
+	hosthandle = xtreeFind(rbhosts, hostname);
+	if (hosthandle != xtreeEnd(rbhosts)) hitem = xtreeData(rbhosts, hosthandle);
+	testhandle = xtreeFind(rbtests, testname);
+	if (testhandle != xtreeEnd(rbtests)) t = xtreeData(rbtests, testhandle);
+
+	if (hitem && t) log = loghash_find(hitem, t);
+
+	if (log && newack->msg) {
+		newack->next = log->acklist;
+		log->acklist = newack;
+	}
+	else {
+		if (newack->ackedby) xfree(newack->ackedby);
+		if (newack->msg) xfree(newack->msg);
+		slab_free(newack, sizeof(ackinfo_t));
+	}
+}
+
+static void restore_task(scheduletask_t *newtask)
+{
+	if (newtask->id && (newtask->executiontime > getcurrenttime(NULL)) && newtask->sender && newtask->command) {
+		newtask->next = schedulehead;
+		schedulehead = newtask;
+		if (newtask->id >= nextschedid) nextschedid = newtask->id + 1;
+	}
+	else {
+		if (newtask->sender) xfree(newtask->sender);
+		if (newtask->command) xfree(newtask->command);
+		xfree(newtask);
+	}
+}
+
+static void load_checkpoint_text(char *fn)
 {
 	FILE *fd;
 	strbuffer_t *inbuf;
 	char *item;
 	int i, err;
-	char *hostip = NULL;
-	xtreePos_t hosthandle, testhandle, originhandle;
-	xymond_hostlist_t *hitem = NULL;
-	testinfo_t *t = NULL;
-	char *origin = NULL;
-	xymond_log_t *ltail = NULL;
-	char *originname, *hostname, *testname, *sender, *testflags, *statusmsg, *disablemsg, *ackmsg, *cookie; 
-	time_t logtime, lastchange, validtime, enabletime, acktime, cookieexpires, yellowstart, redstart;
-	int color = COL_GREEN, oldcolor = COL_GREEN;
+	chkstatus_t rec;
 	int count = 0;
+	xymond_log_t *ltail = NULL;
 
 	fd = fopen(fn, "r");
 	if (fd == NULL) {
@@ -4457,8 +5391,8 @@ void load_checkpoint(char *fn)
 	inbuf = newstrbuffer(0);
 	initfgets(fd);
 	while (unlimfgets(inbuf, fd)) {
-		originname = hostname = testname = sender = testflags = statusmsg = disablemsg = ackmsg = cookie = NULL;
-		logtime = lastchange = validtime = enabletime = acktime = cookieexpires = yellowstart = redstart = 0;
+		memset(&rec, 0, sizeof(rec));
+		rec.color = rec.oldcolor = COL_GREEN;
 		err = 0;
 
 		if ((strncmp(STRBUF(inbuf), "@@XYMONDCHK-V1|.task.|", 22) == 0) || (strncmp(STRBUF(inbuf), "@@HOBBITDCHK-V1|.task.|", 23) == 0)) {
@@ -4478,24 +5412,13 @@ void load_checkpoint(char *fn)
 				item = gettok(NULL, "|\n"); i++;
 			}
 
-			if (newtask->id && (newtask->executiontime > getcurrenttime(NULL)) && newtask->sender && newtask->command) {
-				newtask->next = schedulehead;
-				schedulehead = newtask;
-			}
-			else {
-				if (newtask->sender) xfree(newtask->sender);
-				if (newtask->command) xfree(newtask->command);
-				xfree(newtask);
-			}
-
+			restore_task(newtask);
 			continue;
 		}
 
 		if ((strncmp(STRBUF(inbuf), "@@XYMONDCHK-V1|.acklist.|", 25) == 0) || (strncmp(STRBUF(inbuf), "@@HOBBITDCHK-V1|.acklist.|", 26) == 0)) {
-			xymond_log_t *log = NULL;
-			ackinfo_t *newack = (ackinfo_t *)calloc(1, sizeof(ackinfo_t));
-
-			hitem = NULL;
+			ackinfo_t *newack = (ackinfo_t *)slab_alloc(sizeof(ackinfo_t));
+			char *hostname = "", *testname = "";
 
 			item = gettok(STRBUF(inbuf), "|\n"); i = 0;
 			while (item) {
@@ -4503,14 +5426,8 @@ void load_checkpoint(char *fn)
 				switch (i) {
 				  case 0: break;
 				  case 1: break;
-				  case 2: 
-					hosthandle = xtreeFind(rbhosts, item); 
-					hitem = xtreeData(rbhosts, hosthandle);
-					break;
-				  case 3: 
-					testhandle = xtreeFind(rbtests, item);
-					t = (testhandle == xtreeEnd(rbtests)) ? NULL : xtreeData(rbtests, testhandle);
-					break;
+				  case 2: hostname = item; break;
+				  case 3: testname = item; break;
 				  case 4: newack->received = atoi(item); break;
 				  case 5: newack->validuntil = atoi(item); break;
 				  case 6: newack->cleartime = atoi(item); break;
@@ -4522,20 +5439,7 @@ void load_checkpoint(char *fn)
 				item = gettok(NULL, "|\n"); i++;
 			}
 
-			if (hitem && t) {
-				for (log = hitem->logs; (log && (log->test != t)); log = log->next) ;
-			}
-
-			if (log && newack->msg) {
-				newack->next = log->acklist;
-				log->acklist = newack;
-			}
-			else {
-				if (newack->ackedby) xfree(newack->ackedby);
-				if (newack->msg) xfree(newack->msg);
-				xfree(newack);
-			}
-
+			restore_ack(hostname, testname, newack);
 			continue;
 		}
 
@@ -4545,25 +5449,25 @@ void load_checkpoint(char *fn)
 		while (item && !err) {
 			switch (i) {
 			  case 0: err = ((strcmp(item, "@@XYMONDCHK-V1") != 0) && (strcmp(item, "@@HOBBITDCHK-V1") != 0) && (strcmp(item, "@@BBGENDCHK-V1") != 0)); break;
-			  case 1: originname = item; break;
-			  case 2: if (strlen(item)) hostname = item; else err=1; break;
-			  case 3: if (strlen(item)) testname = item; else err=1; break;
-			  case 4: sender = item; break;
-			  case 5: color = parse_color(item); if (color == -1) err = 1; break;
-			  case 6: testflags = item; break;
-			  case 7: oldcolor = parse_color(item); if (oldcolor == -1) oldcolor = NO_COLOR; break;
-			  case 8: logtime = atoi(item); break;
-			  case 9: lastchange = atoi(item); break;
-			  case 10: validtime = atoi(item); break;
-			  case 11: enabletime = atoi(item); break;
-			  case 12: acktime = atoi(item); break;
-			  case 13: cookie = item; break;
-			  case 14: cookieexpires = atoi(item); break;
-			  case 15: if (strlen(item)) statusmsg = item; else err=1; break;
-			  case 16: disablemsg = item; break;
-			  case 17: ackmsg = item; break;
-			  case 18: redstart = atoi(item); break;
-			  case 19: yellowstart = atoi(item); break;
+			  case 1: rec.originname = item; break;
+			  case 2: if (strlen(item)) rec.hostname = item; else err=1; break;
+			  case 3: if (strlen(item)) rec.testname = item; else err=1; break;
+			  case 4: rec.sender = item; break;
+			  case 5: rec.color = parse_color(item); if (rec.color == -1) err = 1; break;
+			  case 6: rec.testflags = item; break;
+			  case 7: rec.oldcolor = parse_color(item); if (rec.oldcolor == -1) rec.oldcolor = NO_COLOR; break;
+			  case 8: rec.logtime = atoi(item); break;
+			  case 9: rec.lastchange = atoi(item); break;
+			  case 10: rec.validtime = atoi(item); break;
+			  case 11: rec.enabletime = atoi(item); break;
+			  case 12: rec.acktime = atoi(item); break;
+			  case 13: rec.cookie = item; break;
+			  case 14: rec.cookieexpires = atoi(item); break;
+			  case 15: if (strlen(item)) rec.statusmsg = item; else err=1; break;
+			  case 16: rec.disablemsg = item; break;
+			  case 17: rec.ackmsg = item; break;
+			  case 18: rec.redstart = atoi(item); break;
+			  case 19: rec.yellowstart = atoi(item); break;
 			  default: err = 1;
 			}
 
@@ -4577,113 +5481,272 @@ void load_checkpoint(char *fn)
 
 		if (err) continue;
 
-		/* Only load hosts we know; they may have been dropped while we were offline */
-		hostname = knownhost(hostname, &hostip, ghosthandling);
-		if (hostname == NULL) continue;
+		nldecode(rec.statusmsg);
+		if (rec.disablemsg) nldecode(rec.disablemsg);
+		if (rec.ackmsg) nldecode(rec.ackmsg);
+		count += restore_status(&rec, 0, &ltail);
+	}
 
-		/* Ignore the "info" and "trends" data, since we generate on the fly now. */
-		if (strcmp(testname, xgetenv("INFOCOLUMN")) == 0) continue;
-		if (strcmp(testname, xgetenv("TRENDSCOLUMN")) == 0) continue;
+	fclose(fd);
+	freestrbuffer(inbuf);
+	dbgprintf("Loaded %d status logs\n", count);
+}
 
-		/* Rename the now-forgotten internal statuses */
-		if (strcmp(hostname, getenv("MACHINEDOTS")) == 0) {
-			if (strcmp(testname, "bbgen") == 0) testname = "xymongen";
-			else if (strcmp(testname, "bbtest") == 0) testname = "xymonnet";
-			else if (strcmp(testname, "hobbitd") == 0) testname = "xymond";
-		}
+static int chk_getnum(char **p, char *end, long long *val)
+{
+	if ((end - *p) < sizeof(*val)) return -1;
 
-		dbgprintf("Status: Host=%s, test=%s\n", hostname, testname); count++;
+	memcpy(val, *p, sizeof(*val));
+	*p += sizeof(*val);
+	return 0;
+}
 
-		hosthandle = xtreeFind(rbhosts, hostname);
-		if (hosthandle == xtreeEnd(rbhosts)) {
-			/* New host */
-			hitem = create_hostlist_t(hostname, hostip);
-			hostcount++;
-		}
-		else {
-			hitem = xtreeData(rbhosts, hosthandle);
-		}
+static int chk_gettime(char **p, char *end, time_t *val)
+{
+	long long n;
 
-		testhandle = xtreeFind(rbtests, testname);
-		if (testhandle == xtreeEnd(rbtests)) {
-			t = create_testinfo(testname);
-		}
-		else t = xtreeData(rbtests, testhandle);
+	if (chk_getnum(p, end, &n) != 0) return -1;
+	*val = (time_t)n;
+	return 0;
+}
 
-		originhandle = xtreeFind(rborigins, originname);
-		if (originhandle == xtreeEnd(rborigins)) {
-			origin = strdup(originname);
-			xtreeAdd(rborigins, origin, origin);
-		}
-		else origin = xtreeData(rborigins, originhandle);
+static int chk_getint(char **p, char *end, int *val)
+{
+	long long n;
 
-		if (hitem->logs == NULL) {
-			ltail = hitem->logs = (xymond_log_t *) calloc(1, sizeof(xymond_log_t));
-		}
-		else {
-			ltail->next = (xymond_log_t *)calloc(1, sizeof(xymond_log_t));
-			ltail = ltail->next;
-		}
-
-		if (strcmp(testname, xgetenv("PINGCOLUMN")) == 0) hitem->pinglog = ltail;
-
-		/* Fixup validtime in case of ack'ed or disabled tests */
-		if (validtime < acktime) validtime = acktime;
-		if (validtime < enabletime) validtime = enabletime;
-
-		ltail->test = t;
-		ltail->host = hitem;
-		ltail->origin = origin;
-		ltail->color = color;
-		ltail->oldcolor = oldcolor;
-		ltail->activealert = (decide_alertstate(color) == A_ALERT);
-		ltail->histsynced = 0;
-		ltail->testflags = ( (testflags && strlen(testflags)) ? strdup(testflags) : NULL);
-		ltail->sender = strdup(sender);
-		ltail->logtime = logtime;
-		ltail->lastchange = (time_t *)calloc((flapcount > 0) ? flapcount : 1, sizeof(time_t));
-		ltail->lastchange[0] = lastchange;
-		ltail->validtime = validtime;
-		ltail->enabletime = enabletime;
-		if (ltail->enabletime == DISABLED_UNTIL_OK) ltail->validtime = INT_MAX;
-		ltail->acktime = acktime;
-		ltail->redstart = redstart;
-		ltail->yellowstart = yellowstart;
-		nldecode(statusmsg);
-		ltail->message = strdup(statusmsg);
-		ltail->msgsz = strlen(statusmsg)+1;
-
-		if (disablemsg && strlen(disablemsg)) {
-			nldecode(disablemsg);
-			ltail->dismsg = strdup(disablemsg);
-		}
-		else 
-			ltail->dismsg = NULL;
-
-		if (ackmsg && strlen(ackmsg)) {
-			nldecode(ackmsg);
-			ltail->ackmsg = strdup(ackmsg);
-		}
-		else 
-			ltail->ackmsg = NULL;
-
-		if (cookie && *cookie) {
-			ltail->cookie = strdup(cookie);
-			ltail->cookieexpires = cookieexpires;
-			xtreeAdd(rbcookies, ltail->cookie, ltail);
-		}
-		else {
-			ltail->cookie = NULL;
-			ltail->cookieexpires = 0;
+	if (chk_getnum(p, end, &n) != 0) return -1;
+	*val = (int)n;
+	return 0;
+}
+
+static int chk_getstr(char **p, char *end, char **val)
+{
+	unsigned int len;
+
+	if ((end - *p) < sizeof(len)) return -1;
+	memcpy(&len, *p, sizeof(len));
+	*p += sizeof(len);
+
+	if (((end - *p) <= len) || (*(*p + len) != '\0')) return -1;
+	*val = *p;
+	*p += len+1;
+	return 0;
+}
+
+static int load_checkpoint_bin(char *fn, enum chkkind_t kind)
+{
+	/*
+	 * Load a binary checkpoint or journal file. Returns -1 if "fn" is not 
+	 * a binary checkpoint file, otherwise the number of statuses loaded.
+	 * The file is read in one go and parsed in-place.
+	 */
+	int fd, pass, count = 0, err = 0;
+	struct stat st;
+	char *fbuf = NULL, *p, *end, *recend = NULL;
+	chkfilehdr_t hdr;
+	unsigned int rechdr[2];
+	xymond_log_t *ltail = NULL;
+
+	fd = open(fn, O_RDONLY);
+	if (fd == -1) return -1;
+
+	if ((fstat(fd, &st) == -1) || (st.st_size < sizeof(hdr))) {
+		close(fd);
+		return -1;
+	}
+
+	fbuf = (char *)malloc(st.st_size);
+	if (read(fd, fbuf, st.st_size) != st.st_size) {
+		errprintf("Cannot read checkpoint file %s: %s\n", fn, strerror(errno));
+		close(fd);
+		xfree(fbuf);
+		return 0;
+	}
+	close(fd);
+
+	memcpy(&hdr, fbuf, sizeof(hdr));
+	if (memcmp(hdr.magic, CHKBIN_MAGIC, strlen(CHKBIN_MAGIC)) != 0) {
+		xfree(fbuf);
+		return -1;
+	}
+
+	if ((hdr.bom != CHKBIN_BOM) || (hdr.kind != kind)) {
+		errprintf("Checkpoint file %s is not usable (different architecture or wrong type)\n", fn);
+		xfree(fbuf);
+		return 0;
+	}
+
+	if ((kind == CHKFILE_JOURNAL) && ((hdr.gen != chkbasegen) || (hdr.tstamp != chkbasetime))) {
+		/* This journal belongs to an older checkpoint */
+		dbgprintf("Ignoring stale checkpoint journal %s\n", fn);
+		xfree(fbuf);
+		return 0;
+	}
+
+	end = fbuf + st.st_size;
+
+	/* 
+	 * First pass checks that the file is complete. For a journal, we
+	 * want all of it applied or nothing. The second pass loads the data.
+	 */
+	for (pass = 0; ((pass < 2) && !err); pass++) {
+		int done = 0;
+
+		if ((pass == 1) && (kind == CHKFILE_FULL)) {
+			/* Subsequent changes are relative to this checkpoint */
+			chkbasegen = hdr.gen;
+			chkbasetime = hdr.tstamp;
+			if (chkgen <= chkbasegen) chkgen = chkbasegen + 1;
+		}
+		else if ((pass == 1) && (kind == CHKFILE_JOURNAL)) {
+			/* The journal holds the complete list of scheduled tasks */
+			while (schedulehead) {
+				scheduletask_t *zombie = schedulehead;
+
+				schedulehead = schedulehead->next;
+				xfree(zombie->sender);
+				xfree(zombie->command);
+				xfree(zombie);
+			}
 		}
 
-		ltail->acklist = NULL;
-		ltail->next = NULL;
+		p = fbuf + sizeof(hdr);
+		while (!done && !err) {
+			if ((end - p) < sizeof(rechdr)) { err = 1; continue; }
+			memcpy(rechdr, p, sizeof(rechdr));
+			p += sizeof(rechdr);
+			recend = p + rechdr[1];
+			if (recend > end) { err = 1; continue; }
+
+			if (pass == 0) {
+				done = (rechdr[0] == CHKREC_END);
+				p = recend;
+				continue;
+			}
+
+			switch (rechdr[0]) {
+			  case CHKREC_END:
+				done = 1;
+				break;
+
+			  case CHKREC_STATUS:
+				{
+					chkstatus_t rec;
+
+					memset(&rec, 0, sizeof(rec));
+					if ( (chk_getstr(&p, recend, &rec.originname) == 0) && (chk_getstr(&p, recend, &rec.hostname) == 0) &&
+					     (chk_getstr(&p, recend, &rec.testname) == 0) && (chk_getstr(&p, recend, &rec.sender) == 0) &&
+					     (chk_getint(&p, recend, &rec.color) == 0) && (chk_getstr(&p, recend, &rec.testflags) == 0) &&
+					     (chk_getint(&p, recend, &rec.oldcolor) == 0) && (chk_gettime(&p, recend, &rec.logtime) == 0) &&
+					     (chk_gettime(&p, recend, &rec.lastchange) == 0) && (chk_gettime(&p, recend, &rec.validtime) == 0) &&
+					     (chk_gettime(&p, recend, &rec.enabletime) == 0) && (chk_gettime(&p, recend, &rec.acktime) == 0) &&
+					     (chk_getstr(&p, recend, &rec.cookie) == 0) && (chk_gettime(&p, recend, &rec.cookieexpires) == 0) &&
+					     (chk_getstr(&p, recend, &rec.statusmsg) == 0) && (chk_getstr(&p, recend, &rec.disablemsg) == 0) &&
+					     (chk_getstr(&p, recend, &rec.ackmsg) == 0) && (chk_gettime(&p, recend, &rec.redstart) == 0) &&
+					     (chk_gettime(&p, recend, &rec.yellowstart) == 0) &&
+					     (rec.color >= 0) && (rec.color < COL_COUNT) && (rec.oldcolor >= 0) && (rec.oldcolor <= NO_COLOR) ) {
+						count += restore_status(&rec, ((kind == CHKFILE_FULL) ? chkbasegen : chkgen), &ltail);
+					}
+					else {
+						errprintf("Bad status record in checkpoint file %s\n", fn);
+					}
+				}
+				break;
+
+			  case CHKREC_ACK:
+				{
+					ackinfo_t *newack = (ackinfo_t *)slab_alloc(sizeof(ackinfo_t));
+					char *hostname, *testname, *ackedby, *msg;
+
+					if ( (chk_getstr(&p, recend, &hostname) == 0) && (chk_getstr(&p, recend, &testname) == 0) &&
+					     (chk_gettime(&p, recend, &newack->received) == 0) && (chk_gettime(&p, recend, &newack->validuntil) == 0) &&
+					     (chk_gettime(&p, recend, &newack->cleartime) == 0) && (chk_getint(&p, recend, &newack->level) == 0) &&
+					     (chk_getstr(&p, recend, &ackedby) == 0) && (chk_getstr(&p, recend, &msg) == 0) ) {
+						newack->ackedby = strdup(ackedby);
+						newack->msg = strdup(msg);
+						restore_ack(hostname, testname, newack);
+					}
+					else {
+						errprintf("Bad ack record in checkpoint file %s\n", fn);
+						slab_free(newack, sizeof(ackinfo_t));
+					}
+				}
+				break;
+
+			  case CHKREC_TASK:
+				{
+					scheduletask_t *newtask = (scheduletask_t *)calloc(1, sizeof(scheduletask_t));
+					char *sender, *command;
+
+					if ( (chk_getint(&p, recend, &newtask->id) == 0) && (chk_gettime(&p, recend, &newtask->executiontime) == 0) &&
+					     (chk_getstr(&p, recend, &sender) == 0) && (chk_getstr(&p, recend, &command) == 0) ) {
+						newtask->sender = strdup(sender);
+						newtask->command = strdup(command);
+					}
+					restore_task(newtask);
+				}
+				break;
+
+			  case CHKREC_DROPREN:
+				{
+					int cmd;
+					char *hostname, *n1, *n2;
+
+					if ( (chk_getint(&p, recend, &cmd) == 0) && (chk_getstr(&p, recend, &hostname) == 0) &&
+					     (chk_getstr(&p, recend, &n1) == 0) && (chk_getstr(&p, recend, &n2) == 0) ) {
+						chkop_t *newop = (chkop_t *)calloc(1, sizeof(chkop_t));
+
+						if (*n1 == '\0') n1 = NULL;
+						if (*n2 == '\0') n2 = NULL;
+						drop_hoststate(cmd, hostname, n1, n2);
+
+						/* Keep it for the next journal we write */
+						newop->gen = chkgen;
+						newop->cmd = cmd;
+						newop->hostname = strdup(hostname);
+						newop->n1 = (n1 ? strdup(n1) : NULL);
+						newop->n2 = (n2 ? strdup(n2) : NULL);
+						if (chkoptail) chkoptail->next = newop; else chkophead = newop;
+						chkoptail = newop;
+					}
+				}
+				break;
+
+			  default:
+				/* Unknown record type - skip it */
+				break;
+			}
+
+			p = recend;
+		}
 	}
 
-	fclose(fd);
-	freestrbuffer(inbuf);
+	if (err) errprintf("Checkpoint file %s is incomplete or damaged, not loaded\n", fn);
+
+	xfree(fbuf);
+
+	return count;
+}
+
+void load_checkpoint(char *fn)
+{
+	char *journalfn;
+	int count;
+
+	count = load_checkpoint_bin(fn, CHKFILE_FULL);
+	if (count == -1) {
+		/* Not a binary checkpoint - try the text format */
+		load_checkpoint_text(fn);
+		return;
+	}
 	dbgprintf("Loaded %d status logs\n", count);
+
+	if (chkbasegen == 0) return;
+
+	journalfn = journalfilename(fn);
+	count = load_checkpoint_bin(journalfn, CHKFILE_JOURNAL);
+	if (count > 0) dbgprintf("Loaded %d status logs from journal %s\n", count, journalfn);
+	xfree(journalfn);
 }
 
 
@@ -4719,6 +5782,8 @@ void check_purple_status(void)
 						tmp = lwalk;
 						lwalk = lwalk->next;
 					}
+					loghash_update(hwalk, tmp->test);
+					board_deleted(hwalk->hostname, tmp->test->name);
 					free_log_t(tmp);
 				}
 				else {
@@ -4803,6 +5868,71 @@ void sig_handler(int signum)
 }
 
 
+void ingest_apply(ingestrec_t *rec)
+{
+	/* Called in the main thread with a message that has been decoded by an ingest thread */
+	int i;
+
+	if (rec->statscmd) update_statistics(rec->statscmd, 0);
+
+	for (i = 0; (i < rec->msgcount); i++) {
+		ingestmsg_t *imsg = &rec->msgs[i];
+		int isslice = !imsg->owned;
+		char savechar = '\0';
+		conn_t msg;
+
+		memset(&msg, 0, sizeof(msg));
+		msg.doingwhat = RECEIVING;
+		msg.sender = strdup(rec->sender);
+		msg.buf = imsg->buf;
+		msg.buflen = imsg->buflen;
+		msg.bufsz = msg.buflen + 1;
+		msg.bufp = msg.buf + msg.buflen;
+
+		if (isslice) {
+			/* A slice of a larger buffer */
+			savechar = *(msg.buf + msg.buflen);
+			*(msg.buf + msg.buflen) = '\0';
+		}
+		else {
+			/* We take over the buffer, since do_message() may replace it */
+			imsg->buf = NULL;
+			imsg->owned = 0;
+		}
+
+		do_message(&msg, "", 0);
+
+		if (isslice) {
+			*(msg.buf + msg.buflen) = savechar;
+		}
+		else if (msg.buf) {
+			xfree(msg.buf);
+		}
+		if (msg.sender) xfree(msg.sender);
+	}
+
+	if (rec->errtxt) errprintf("Message from %s: %s", rec->sender, rec->errtxt);
+}
+
+void dispatch_message(conn_t *conn)
+{
+	/*
+	 * Status updates and other messages without a response are decoded by
+	 * the ingest threads, if we have them. Anything that may need a
+	 * response is handled right away.
+	 */
+	if (ingest_wants(conn->buf)) {
+		ingest_submit(conn->buf, (conn->bufp - conn->buf), conn->sender);
+		conn->buf = conn->bufp = NULL;
+		conn->buflen = conn->bufsz = 0;
+		conn->doingwhat = NOTALK;
+	}
+	else {
+		do_message(conn, "", 0);
+	}
+}
+
+
 enum conn_cbresult_t server_callback(tcpconn_t *connection, enum conn_callback_t id, void *userdata)
 {
 	int n = 0;
@@ -4819,6 +5949,7 @@ enum conn_cbresult_t server_callback(tcpconn_t *connection, enum conn_callback_t
 		conn->bufp = conn->buf;
 		conn->buflen = 0;
 		conn->msgsz = -1;
+		conn->canstream = 1;
 		conn->sender = strdup(conn_print_ip(connection));
 		connection->userdata = conn;
 		break;
@@ -4856,7 +5987,7 @@ enum conn_cbresult_t server_callback(tcpconn_t *connection, enum conn_callback_t
 		if (n < 0) {
 			if (conn->buf && conn->buflen) {
 				*(conn->bufp) = '\0';
-				do_message(conn, "", 0);
+				dispatch_message(conn);
 			}
 			else {
 				conn->doingwhat = NOTALK;
@@ -4867,7 +5998,7 @@ enum conn_cbresult_t server_callback(tcpconn_t *connection, enum conn_callback_t
 			// dbgprintf("Got the entire message, preparing response\n");
 			conn->bufp += n;
 			*(conn->bufp) = '\0';
-			do_message(conn, "", 0);
+			dispatch_message(conn);
 		}
 		else {
 			*(conn->bufp + n) = '\0';
@@ -4905,7 +6036,7 @@ enum conn_cbresult_t server_callback(tcpconn_t *connection, enum conn_callback_t
 
 						// dbgprintf("Expect message of size %d, currently have %d\n", conn->msgsz, conn->buflen);
 						if (conn->buflen >= conn->msgsz)
-							do_message(conn, "", 0);
+							dispatch_message(conn);
 					}
 				}
 			}
@@ -4929,11 +6060,11 @@ enum conn_cbresult_t server_callback(tcpconn_t *connection, enum conn_callback_t
 			}
 			else if ((n == 0) && (connection->connstate == CONN_PLAINTEXT)) {
 				/* No more data */
-				do_message(conn, "", 0);
+				dispatch_message(conn);
 			}
 
 			/* Grow the input buffer - within reason ... */
-			if ((conn->bufsz - conn->buflen) < 2048) {
+			if ((conn->doingwhat == RECEIVING) && ((conn->bufsz - conn->buflen) < 2048)) {
 				if (conn->bufsz < MAX_XYMON_INBUFSZ) {
 					conn->bufsz += XYMON_INBUF_INCREMENT;
 					conn->buf = (unsigned char *) realloc(conn->buf, conn->bufsz);
@@ -4974,12 +6105,26 @@ enum conn_cbresult_t server_callback(tcpconn_t *connection, enum conn_callback_t
 
 		if (n < 0) {
 			conn->buflen = 0;
+			if (conn->board) { board_close(conn->board); conn->board = NULL; }
 		}
 		else {
 			conn->bufp += n;
 			conn->buflen -= n;
 		}
 
+		if ((conn->buflen == 0) && conn->board) {
+			/* Sent what we had of a xymondboard response, generate the next part */
+			strbuffer_t *response = newstrbuffer(BOARDCHUNKSZ);
+
+			if (!board_fill(conn->board, response, BOARDCHUNKSZ)) {
+				board_close(conn->board);
+				conn->board = NULL;
+			}
+			xfree(conn->buf);
+			conn->buflen = STRBUFLEN(response);
+			conn->bufp = conn->buf = grabstrbuffer(response);
+		}
+
 		if (conn->buflen == 0) {
 			if (conn->doingwhat == STARTTLSWAIT) {
 				conn->doingwhat = RECEIVING;
@@ -4994,7 +6139,8 @@ enum conn_cbresult_t server_callback(tcpconn_t *connection, enum conn_callback_t
 	  case CONN_CB_CLEANUP:                /* Client/server mode: Connection cleanup */
 		if (conn) {
 			xfree(conn->sender);
-			xfree(conn->buf);
+			if (conn->buf) xfree(conn->buf);
+			if (conn->board) board_close(conn->board);
 			xfree(conn);
 			conn = connection->userdata = NULL;
 		}
@@ -5026,6 +6172,8 @@ int main(int argc, char *argv[])
 	char *hostsfn = NULL;
 	char *restartfn = NULL;
 	int checkpointinterval = 900;
+	int journalinterval = 60;
+	time_t nextjournal = 0;
 	int do_purples = 1;
 	time_t nextpurpleupdate;
 	int lsocket, opt;
@@ -5038,15 +6186,19 @@ int main(int argc, char *argv[])
 	time_t conn_timeout = 30;
 	char *envarea = NULL;
 	int create_backfeedqueue = 0;
+	int use_epoll = 0;
+	int ingestthreads = 0;
 
 	MEMDEFINE(colnames);
 
 	libxymon_init(argv[0]);
 
 	boottimer = gettimer();
+	boardepoch = getcurrenttime(NULL);
 
 	/* Create our trees */
 	rbhosts = xtreeNew(strcasecmp);
+	rbboardplans = xtreeNew(strcmp);
 	rbtests = xtreeNew(strcasecmp);
 	rborigins = xtreeNew(strcasecmp);
 	rbcookies = xtreeNew(strcasecmp);
@@ -5128,6 +6280,19 @@ int main(int argc, char *argv[])
 			char *p = strchr(argv[argi], '=') + 1;
 			checkpointinterval = atoi(p);
 		}
+		else if (argnmatch(argv[argi], "--checkpoint-journal-interval=")) {
+			char *p = strchr(argv[argi], '=') + 1;
+			journalinterval = atoi(p);
+		}
+		else if (argnmatch(argv[argi], "--checkpoint-format=")) {
+			char *p = strchr(argv[argi], '=') + 1;
+			if (strcmp(p, "text") == 0) checkpointformat = CHK_TEXT;
+			else if (strcmp(p, "binary") == 0) checkpointformat = CHK_BINARY;
+			else {
+				errprintf("Unknown checkpoint format %s\n", p);
+				return 1;
+			}
+		}
 		else if (argnmatch(argv[argi], "--restart=")) {
 			char *p = strchr(argv[argi], '=') + 1;
 			restartfn = strdup(p);
@@ -5150,6 +6315,13 @@ int main(int argc, char *argv[])
 			char *p = strchr(argv[argi], '=') + 1;
 			listenq = atoi(p);
 		}
+		else if (strcmp(argv[argi], "--epoll") == 0) {
+			use_epoll = 1;
+		}
+		else if (argnmatch(argv[argi], "--ingest-threads=")) {
+			char *p = strchr(argv[argi], '=') + 1;
+			ingestthreads = atoi(p);
+		}
 		else if (argnmatch(argv[argi], "--daemon")) {
 			daemonize = 1;
 		}
@@ -5322,6 +6494,7 @@ int main(int argc, char *argv[])
 	}
 
 	nextcheckpoint = getcurrenttime(NULL) + checkpointinterval;
+	nextjournal = getcurrenttime(NULL) + journalinterval;
 	nextpurpleupdate = getcurrenttime(NULL) + 600;	/* Wait 10 minutes the first time */
 	last_stats_time = getcurrenttime(NULL);	/* delay sending of the first status report until we're fully running */
 
@@ -5330,6 +6503,10 @@ int main(int argc, char *argv[])
 	if (listenport) errprintf("Setting up network listener on IPv4 %s and IPv6 %s port %d\n", listenip4, listenip6, listenport);
 	if (listensslport && certfn && keyfn) errprintf("Setting up SSL network listener on IPv4 %s and IPv6 %s port %d\n", listenip4, listenip6, listensslport);
 	if (debug) conn_register_infohandler(NULL, INFO_DEBUG);
+	if (use_epoll && (conn_use_epoll() != 0)) {
+		errprintf("epoll not available, using select()\n");
+		use_epoll = 0;
+	}
 	conn_init_server(listenport, listenq, 1000000*conn_timeout,
 			 certfn, keyfn, listensslport, rootcafn, requireclientcert,
 			 listenip4, listenip6, server_callback);
@@ -5430,6 +6607,11 @@ int main(int argc, char *argv[])
 		if (dbgfd == NULL) errprintf("Cannot open debug file %s: %s\n", fname, strerror(errno));
 	}
 
+	if (ingestthreads > 0) {
+		int n = ingest_start(ingestthreads);
+		if (n > 0) errprintf("Started %d ingest threads\n", n);
+	}
+
 	errprintf("Setup complete\n");
 	do {
 		/*
@@ -5473,6 +6655,10 @@ int main(int argc, char *argv[])
 			loadresult = load_hostnames(hostsfn, NULL, get_fqdn());
 
 			if (loadresult == 0) {
+				/* Host definitions may have changed, so cached board filter matches are void */
+				hostcfggen++;
+				boardresyncseq = ++boardseq;
+
 				/* Scan our list of hosts and weed out those we do not know about any more */
 				hosthandle = xtreeFirst(rbhosts);
 				while (hosthandle != xtreeEnd(rbhosts)) {
@@ -5532,12 +6718,32 @@ int main(int argc, char *argv[])
 
 			reloadconfig = 1;
 			nextcheckpoint = now + checkpointinterval;
+			nextjournal = now + journalinterval;
+
+			/* Start a new checkpoint generation. Changes from now on go into the journal */
+			chkbasegen = chkgen++;
+			chkbasetime = now;
+			flush_chkops();
+
 			childpid = fork();
 			if (childpid == -1) {
 				errprintf("Could not fork checkpoint child:%s\n", strerror(errno));
 			}
 			else if (childpid == 0) {
-				save_checkpoint();
+				save_checkpoint(0);
+				exit(0);
+			}
+		}
+		else if ((journalinterval > 0) && (now > nextjournal) && (checkpointformat == CHK_BINARY) && chkbasegen) {
+			pid_t childpid;
+
+			nextjournal = now + journalinterval;
+			childpid = fork();
+			if (childpid == -1) {
+				errprintf("Could not fork checkpoint journal child:%s\n", strerror(errno));
+			}
+			else if (childpid == 0) {
+				save_checkpoint(1);
 				exit(0);
 			}
 		}
@@ -5571,13 +6777,19 @@ int main(int argc, char *argv[])
 		 * some time if there's nothing to do, but short enough for
 		 * us to attend to the housekeeping stuff without undue delay.
 		 */
-		maxfd = conn_fdset(&fdread, &fdwrite);
-		tmo.tv_sec = 0; tmo.tv_usec = 50000;
-		n = select(maxfd+1, &fdread, &fdwrite, NULL, &tmo);
+		if (use_epoll) {
+			/* epoll only reports the sockets with something to do, no fd_set's needed */
+			n = conn_epoll_wait(50);
+		}
+		else {
+			maxfd = conn_fdset(&fdread, &fdwrite);
+			tmo.tv_sec = 0; tmo.tv_usec = 50000;
+			n = select(maxfd+1, &fdread, &fdwrite, NULL, &tmo);
+		}
 		if (n < 0) {
 			/* Ignore EINTR, just carry on. All other errors are fatal. */
 			if (errno != EINTR) {
-				errprintf("Fatal error in select: %s\n", strerror(errno));
+				errprintf("Fatal error in %s: %s\n", (use_epoll ? "epoll_wait" : "select"), strerror(errno));
 				running = 0;
 				continue;
 			}
@@ -5591,6 +6803,9 @@ int main(int argc, char *argv[])
 		/* Pick up new connections */
 		conn_process_listeners(&fdread);
 
+		/* Apply the messages decoded by the ingest threads */
+		if (ingest_active()) ingest_drain(ingest_apply, 1000);
+
 		/* Any scheduled tasks that need attending to? */
 		{
 			scheduletask_t *swalk, *sprev;
@@ -5627,6 +6842,13 @@ int main(int argc, char *argv[])
 		}
 	} while (running);
 
+	/* Apply what the ingest threads still have in the pipeline */
+	if (ingest_active()) {
+		running = 1;   /* Same kludge as below, so the updates are posted to the channels */
+		ingest_stop(ingest_apply);
+		running = 0;
+	}
+
 	/* Tell the workers we to shutdown also */
 	running = 1;   /* Kludge, but it's the only way to get posttochannel to do something. */
 	posttoall("shutdown");
@@ -5646,7 +6868,14 @@ int main(int argc, char *argv[])
 	if (backfeedqueue > 0) close_feedback_queue(backfeedqueue, CHAN_MASTER);
 	if (bf_buf) xfree(bf_buf);
 
-	save_checkpoint();
+	chkbasegen = chkgen++;
+	chkbasetime = getcurrenttime(NULL);
+	if ((save_checkpoint(0) == 0) && (checkpointformat == CHK_BINARY)) {
+		/* The journal is now obsolete */
+		char *journalfn = journalfilename(checkpointfn);
+		unlink(journalfn);
+		xfree(journalfn);
+	}
 	unlink(pidfn);
 
 	if (dbgfd) fclose(dbgfd);
@@ -20,6 +20,7 @@ static char rcsid[] = "$Id$";
 #include <sys/sem.h>
 #include <sys/shm.h>
 #include <sys/time.h>
+#include <sys/uio.h>
 
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -94,6 +95,16 @@ static int messagetimeout = 30;
  */
 static int checksumsize = 0;
 
+/*
+ * With "--batch", each message is framed with a length header (which
+ * lives in front of the message buffer, like the checksum), and the
+ * peer queue is written out with a single writev() of up to batchsize
+ * messages instead of one write() per message.
+ */
+static int framehdrsize = 0;
+static int batchsize = 1;
+#define BATCHMAX 256
+
 void addnetpeer(char *peername)
 {
 	xymon_peer_t *newpeer;
@@ -304,13 +315,14 @@ int addmessage(char *inbuf)
 	xtreePos_t phandle;
 	xymon_peer_t *peer;
 	int bcastmsg = 0;
-	int inlen = strlen(inbuf);
+	char *msg = inbuf + framehdrsize;	/* Skip the frame header, if any */
+	int inlen = framehdrsize + strlen(msg);
 
 	if (locatorbased) {
 		char *hostname, *hostend, *peerlocation;
 
 		/* xymond sends us messages with the KEY in the first field, between a '/' and a '|' */
-		hostname = inbuf + strcspn(inbuf, "/|\r\n");
+		hostname = msg + strcspn(msg, "/|\r\n");
 		if (*hostname != '/') {
 			errprintf("No key field in message, dropping it\n");
 			return -1; /* Malformed input */
@@ -500,6 +512,18 @@ int main(int argc, char *argv[])
 		else if (argnmatch(argv[argi], "--no-md5")) {
 			checksumsize = 0;
 		}
+		else if (argnmatch(argv[argi], "--batch")) {
+			char *p = strchr(argv[argi], '=');
+
+			framehdrsize = CHANNEL_FRAMEHDRSZ;
+			batchsize = (p ? atoi(p+1) : 64);
+			if (batchsize < 1) batchsize = 1;
+			if (batchsize > BATCHMAX) batchsize = BATCHMAX;
+		}
+		else if (argnmatch(argv[argi], "--no-batch")) {
+			framehdrsize = 0;
+			batchsize = 1;
+		}
 		else {
 			char *childcmd;
 			char **childargs;
@@ -577,15 +601,14 @@ int main(int argc, char *argv[])
 
 	while (running) {
 		/* 
-		 * Wait for GOCLIENT to go up.
+		 * Pick up new messages from the channel ring.
 		 *
-		 * Note that we use IPC_NOWAIT if there are messages in the
-		 * queue, because then we just want to pick up a message if
-		 * there is one, and if not we want to continue pushing the
-		 * queued data to the worker.
+		 * We only wait for a message if there is nothing in the
+		 * queue, because then we just want to pick up what is there
+		 * and continue pushing the queued data to the worker.
 		 */
-		struct sembuf s;
-		int n;
+		int n, msgcount = 0;
+		unsigned long lostbefore = channel->lostcount;
 
 		if (deadpid != 0) {
 			char *cause = "Unknown";
@@ -597,106 +620,73 @@ int main(int argc, char *argv[])
 			deadpid = 0;
 		}
 
-		s.sem_num = GOCLIENT; s.sem_op  = -1; s.sem_flg = ((pendingcount > 0) ? IPC_NOWAIT : 0);
-		n = semop(channel->semid, &s, 1);
+		do {
+			char *inbuf = NULL, *msg;
+			int msgsz;
 
-		if (n == 0) {
-			/*
-			 * GOCLIENT went high, and so we got alerted about a new
-			 * message arriving. Copy the message to our own buffer queue.
-			 */
-			char *inbuf = NULL;
-			int msgsz = 0;
+			msgsz = channel_readmsg(channel, &inbuf, framehdrsize+checksumsize, ((pendingcount == 0) && (msgcount == 0)));
+			if (msgsz <= 0) break;
+			msgcount++;
 
-			if (!msgfilter || matchregex(channel->channelbuf, msgfilter) || matchregex(channel->channelbuf, stdfilter)) {
-				msgsz = strlen(channel->channelbuf);
-				inbuf = (char *)malloc(msgsz + checksumsize + 1);
-				memcpy(inbuf+checksumsize, channel->channelbuf, msgsz+1); /* Include \0 */
-			}
+			/* msg is where the message goes once the checksum (if any) has been added */
+			msg = inbuf + framehdrsize;
 
-			/* 
-			 * Now we have safely stored the new message in our buffer.
-			 * Wait until any other clients on the same channel have picked up 
-			 * this message (GOCLIENT reaches 0).
-			 *
-			 * We wrap this into an alarm handler, because it can occasionally
-			 * fail, causing the whole system to lock up. We dont want that....
-			 * We'll set the alarm to trigger after 1 second. Experience shows
-			 * that we'll either succeed in a few milliseconds, or fail completely
-			 * and wait the full alarm-timer duration.
-			 */
-			gotalarm = 0; signal(SIGALRM, sig_handler); alarm(2); 
-			do {
-				s.sem_num = GOCLIENT; s.sem_op  = 0; s.sem_flg = 0;
-				n = semop(channel->semid, &s, 1);
-			} while ((n == -1) && (errno == EAGAIN) && running && (!gotalarm));
-			signal(SIGALRM, SIG_IGN);
-
-			if (gotalarm) {
-				errprintf("Gave up waiting for GOCLIENT to go low.\n");
+			if (msgfilter && !matchregex(msg+checksumsize, msgfilter) && !matchregex(msg+checksumsize, stdfilter)) {
+				xfree(inbuf);
+				continue;
 			}
 
-			/* 
-			 * Let master know we got it by downing BOARDBUSY.
-			 * This should not block, since BOARDBUSY is upped
-			 * by the master just before he ups GOCLIENT.
+			/*
+			 * See if they want us to rotate logs. We pass this on to
+			 * the worker module as well, but must handle our own logfile.
 			 */
-			do {
-				s.sem_num = BOARDBUSY; s.sem_op  = -1; s.sem_flg = IPC_NOWAIT;
-				n = semop(channel->semid, &s, 1);
-			} while ((n == -1) && (errno == EINTR));
-			if (n == -1) {
-				errprintf("Tried to down BOARDBUSY: %s\n", strerror(errno));
+			if (strncmp(msg+checksumsize, "@@logrotate", 11) == 0) {
+				reopen_file(logfn, "a", stdout);
+				reopen_file(logfn, "a", stderr);
 			}
 
-			if (inbuf) {
-				/*
-				 * See if they want us to rotate logs. We pass this on to
-				 * the worker module as well, but must handle our own logfile.
-				 */
-				if (strncmp(inbuf+checksumsize, "@@logrotate", 11) == 0) {
-					reopen_file(logfn, "a", stdout);
-					reopen_file(logfn, "a", stderr);
-				}
+			if (checksumsize > 0) {
+				char *sep1 = msg + checksumsize + strcspn(msg+checksumsize, "#|\n");
 
-				if (checksumsize > 0) {
-					char *sep1 = inbuf + checksumsize + strcspn(inbuf+checksumsize, "#|\n");
-
-					if (*sep1 == '#') {
-						/* 
-						 * Add md5 hash of the message. I.e. transform the header line from
-						 *   "@@%s#%u/%s|%d.%06d| channelmarker, seq, hostname, tstamp.tv_sec, tstamp.tv_usec
-						 * to
-						 *   "@@%s:%s#%u/%s|%d.%06d| channelmarker, hashstr, seq, hostname, tstamp.tv_sec, tstamp.tv_usec
-						 */
-						char *hashstr = md5hash(inbuf+checksumsize);
-						int hlen = sep1 - (inbuf + checksumsize);
-
-						memmove(inbuf, inbuf+checksumsize, hlen);
-						*(inbuf + hlen) = ':';
-						memcpy(inbuf+hlen+1, hashstr, strlen(hashstr));
-					}
-					else {
-						/* No sequence number (control message). Skip checksum for these */
-						memmove(inbuf, inbuf+checksumsize, msgsz+1);
-					}
+				if (*sep1 == '#') {
+					/* 
+					 * Add md5 hash of the message. I.e. transform the header line from
+					 *   "@@%s#%u/%s|%d.%06d| channelmarker, seq, hostname, tstamp.tv_sec, tstamp.tv_usec
+					 * to
+					 *   "@@%s:%s#%u/%s|%d.%06d| channelmarker, hashstr, seq, hostname, tstamp.tv_sec, tstamp.tv_usec
+					 */
+					char *hashstr = md5hash(msg+checksumsize);
+					int hlen = sep1 - (msg + checksumsize);
+
+					memmove(msg, msg+checksumsize, hlen);
+					*(msg + hlen) = ':';
+					memcpy(msg+hlen+1, hashstr, strlen(hashstr));
 				}
+				else {
+					/* No sequence number (control message). Skip checksum for these */
+					memmove(msg, msg+checksumsize, msgsz+1);
+				}
+			}
 
+			if (framehdrsize > 0) {
+				/* Fill in the frame header. sprintf() would clobber the first byte of the message */
+				char framehdr[CHANNEL_FRAMEHDRSZ+1];
 
-				/*
-				 * Put the new message on our outbound queue.
-				 */
-				if (addmessage(inbuf) != 0) {
-					/* Failed to queue message, free the buffer */
-					xfree(inbuf);
-				}
+				sprintf(framehdr, CHANNEL_FRAMEHDR, (unsigned int)strlen(msg));
+				memcpy(inbuf, framehdr, CHANNEL_FRAMEHDRSZ);
 			}
-		}
-		else {
-			if (errno != EAGAIN) {
-				dbgprintf("Semaphore wait aborted: %s\n", strerror(errno));
-				continue;
+
+			/*
+			 * Put the new message on our outbound queue.
+			 */
+			if (addmessage(inbuf) != 0) {
+				/* Failed to queue message, free the buffer */
+				xfree(inbuf);
 			}
+		} while (running && (msgcount < 100));
+
+		if (channel->lostcount != lostbefore) {
+			errprintf("Lost %lu messages, could not keep up with xymond\n", (channel->lostcount - lostbefore));
 		}
 
 		/* 
@@ -770,11 +760,33 @@ int main(int argc, char *argv[])
 					continue;
 				}
 
-				n = write(pwalk->peersocket, pwalk->msghead->bufp, pwalk->msghead->buflen);
+				if (batchsize > 1) {
+					/* Push as many queued messages as we can in one go */
+					struct iovec iov[BATCHMAX];
+					xymon_msg_t *mwalk;
+					int iovcnt = 0;
+
+					for (mwalk = pwalk->msghead; (mwalk && (iovcnt < batchsize)); mwalk = mwalk->next) {
+						iov[iovcnt].iov_base = mwalk->bufp;
+						iov[iovcnt].iov_len = mwalk->buflen;
+						iovcnt++;
+					}
+					n = writev(pwalk->peersocket, iov, iovcnt);
+				}
+				else {
+					n = write(pwalk->peersocket, pwalk->msghead->bufp, pwalk->msghead->buflen);
+				}
+
 				if (n >= 0) {
-					pwalk->msghead->bufp += n;
-					pwalk->msghead->buflen -= n;
-					if (pwalk->msghead->buflen == 0) flushmessage(pwalk);
+					/* Account for what was written; this may span several messages */
+					while (n > 0) {
+						int used = ((n < pwalk->msghead->buflen) ? n : pwalk->msghead->buflen);
+
+						pwalk->msghead->bufp += used;
+						pwalk->msghead->buflen -= used;
+						n -= used;
+						if (pwalk->msghead->buflen == 0) flushmessage(pwalk);
+					}
 				}
 				else if (errno == EAGAIN) {
 					/*
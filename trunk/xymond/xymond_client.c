@@ -22,6 +22,10 @@ static char rcsid[] = "$Id$";
 #include <time.h>
 #include <ctype.h>
 #include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/wait.h>
 
 #include "libxymon.h"
 #include "xymond_worker.h"
@@ -1875,15 +1879,404 @@ void testmode(char *configfn)
 	exit(0);
 }
 
+static char *configfn = NULL;
+static char **collectors = NULL;
+static time_t nextconfigload = 0;
+
+static int handle_message(char *msg, int seq)
+{
+	/* Analyse one message from the client channel. Returns 0 on shutdown */
+	char *eoln, *restofmsg, *p;
+	char *metadata[MAX_META+1];
+	int metacount;
+	time_t nowtimer = gettimer();
+
+	if (reloadconfig || (nowtimer >= nextconfigload)) {
+		nextconfigload = nowtimer + 600;
+		reloadconfig = 0;
+		if (!localmode) load_hostnames(xgetenv("HOSTSCFG"), NULL, get_fqdn());
+		load_client_config(configfn);
+	}
+
+	/* Split the message in the first line (with meta-data), and the rest */
+	eoln = strchr(msg, '\n');
+	if (eoln) {
+		*eoln = '\0';
+		restofmsg = eoln+1;
+	}
+	else {
+		restofmsg = "";
+	}
+
+	metacount = 0; 
+	memset(&metadata, 0, sizeof(metadata));
+	p = gettok(msg, "|");
+	while (p && (metacount < MAX_META)) {
+		metadata[metacount++] = p;
+		p = gettok(NULL, "|");
+	}
+	metadata[metacount] = NULL;
+
+	if ((metacount > 4) && (strncmp(metadata[0], "@@client", 8) == 0)) {
+		int cnum, havecollector;
+		time_t timestamp = atoi(metadata[1]);
+		char *sender = metadata[2];
+		char *hostname = metadata[3];
+		char *clientos = metadata[4];
+		char *clientclass = metadata[5];
+		char *collectorid = metadata[6];
+		enum ostype_t os;
+		void *hinfo = NULL;
+
+		dbgprintf("Client report from host %s\n", (hostname ? hostname : "<unknown>"));
+
+		/* Check if we are running a collector module for this type of client */
+		if (!collectorid) collectorid = "";
+		for (cnum = 0, havecollector = 0; (collectors[cnum] && !havecollector); cnum++) 
+			havecollector = (strcmp(collectorid, collectors[cnum]) == 0);
+		if (!havecollector) return 1;
+
+		hinfo = (localmode ? localhostinfo(hostname) : hostinfo(hostname));
+		if (!hinfo) return 1;
+		os = get_ostype(clientos);
+
+		/* Default clientclass to the OS name */
+		if (!clientclass || (*clientclass == '\0')) clientclass = clientos;
+
+		/* Check for duplicates */
+		if (add_updateinfo(hostname, seq, timestamp) != 0) return 1;
+
+		if (usebackfeedqueue) combo_start_local(); else combo_start();
+		switch (os) {
+                          case OS_FREEBSD:
+                                handle_freebsd_client(hostname, clientclass, os, hinfo, sender, timestamp, restofmsg);
+                                break;
+
+                          case OS_NETBSD:
+                                handle_netbsd_client(hostname, clientclass, os, hinfo, sender, timestamp, restofmsg);
+                                break;
+
+                          case OS_OPENBSD:
+                                handle_openbsd_client(hostname, clientclass, os, hinfo, sender, timestamp, restofmsg);
+                                break;
+
+                          case OS_LINUX22:
+                          case OS_LINUX:
+                          case OS_RHEL3:
+                                handle_linux_client(hostname, clientclass, os, hinfo, sender, timestamp, restofmsg);
+                                break;
+
+                          case OS_DARWIN:
+                                handle_darwin_client(hostname, clientclass, os, hinfo, sender, timestamp, restofmsg);
+                                break;
+
+                          case OS_SOLARIS:
+                                handle_solaris_client(hostname, clientclass, os, hinfo, sender, timestamp, restofmsg);
+                                break;
+
+                          case OS_HPUX:
+                                handle_hpux_client(hostname, clientclass, os, hinfo, sender, timestamp, restofmsg);
+                                break;
+
+                          case OS_OSF:
+                                handle_osf_client(hostname, clientclass, os, hinfo, sender, timestamp, restofmsg);
+                                break;
+
+                          case OS_AIX:
+                                handle_aix_client(hostname, clientclass, os, hinfo, sender, timestamp, restofmsg);
+                                break;
+
+                          case OS_IRIX:
+                                handle_irix_client(hostname, clientclass, os, hinfo, sender, timestamp, restofmsg);
+                                break;
+
+                          case OS_SCO_SV:
+                                handle_sco_sv_client(hostname, clientclass, os, hinfo, sender, timestamp, restofmsg);
+                                break;
+
+                          case OS_WIN32_BBWIN:
+                                handle_win32_bbwin_client(hostname, clientclass, os, hinfo, sender, timestamp, restofmsg);
+                                break;
+
+		  case OS_WIN_POWERSHELL:
+			handle_powershell_client(hostname, clientclass, os, hinfo, sender, timestamp, restofmsg);
+			break;
+
+		  case OS_ZVM:
+			handle_zvm_client(hostname, clientclass, os, hinfo, sender, timestamp, restofmsg);
+			break;
+
+		  case OS_ZVSE:
+			handle_zvse_client(hostname, clientclass, os, hinfo, sender, timestamp, restofmsg);
+			break;
+
+		  case OS_ZOS:
+			handle_zos_client(hostname, clientclass, os, hinfo, sender, timestamp, restofmsg);
+			break;
+
+		  case OS_SNMPCOLLECT:
+			handle_snmpcollect_client(hostname, clientclass, os, hinfo, sender, timestamp, restofmsg);
+			break;
+
+		  case OS_MQCOLLECT:
+			handle_mqcollect_client(hostname, clientclass, os, hinfo, sender, timestamp, restofmsg);
+			break;
+
+		  default:
+			if (unknownclientosok) {
+				dbgprintf("No client backend for OS '%s' sent by %s; using generic\n", clientos, sender);
+				handle_generic_client(hostname, clientclass, os, hinfo, sender, timestamp, restofmsg);
+			}
+			else errprintf("No client backend for OS '%s' sent by %s\n", clientos, sender);
+                                break;
+		}
+		combo_end();
+	}
+	else if (strncmp(metadata[0], "@@shutdown", 10) == 0) {
+		printf("Shutting down\n");
+		return 0;
+	}
+	else if (strncmp(metadata[0], "@@logrotate", 11) == 0) {
+		char *fn = xgetenv("XYMONCHANNEL_LOGFILENAME");
+		if (fn && strlen(fn)) {
+			reopen_file(fn, "a", stdout);
+			reopen_file(fn, "a", stderr);
+		}
+	}
+	else if (strncmp(metadata[0], "@@reload", 8) == 0) {
+		reloadconfig = 1;
+	}
+	else {
+		/* Unknown message - ignore it */
+	}
+
+	return 1;
+}
+
+/*
+ * With --workers=N the client messages are analysed by N worker processes.
+ * All messages from one host go to the same worker, so the status messages
+ * for a host are still sent in the order the client messages arrived.
+ */
+typedef struct clientworker_t {
+	pid_t pid;
+	int cmdfd;
+} clientworker_t;
+static clientworker_t *clientworkers = NULL;
+static int clientworkercount = 0;
+
+typedef struct clientworkerhdr_t {
+	int seq;
+	int datalen;
+} clientworkerhdr_t;
+
+static int clientworker_io(int fd, void *buf, size_t len, int writing)
+{
+	char *p = (char *)buf;
+	ssize_t n;
+
+	while (len > 0) {
+		n = (writing ? write(fd, p, len) : read(fd, p, len));
+		if (n > 0) {
+			p += n;
+			len -= n;
+		}
+		else if ((n == -1) && (errno == EINTR)) {
+			continue;
+		}
+		else {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static void clientworker_main(int cmdfd)
+{
+	clientworkerhdr_t hdr;
+	char *data = NULL;
+	int datasz = 0;
+
+	while (clientworker_io(cmdfd, &hdr, sizeof(hdr), 0) == 0) {
+		if ((hdr.datalen + 1) > datasz) {
+			datasz = hdr.datalen + 1;
+			data = (char *)realloc(data, datasz);
+		}
+		if ((hdr.datalen > 0) && (clientworker_io(cmdfd, data, hdr.datalen, 0) != 0)) break;
+		data[hdr.datalen] = '\0';
+
+		if (!handle_message(data, hdr.seq)) break;
+	}
+
+	exit(0);
+}
+
+static int clientworker_fork(int idx)
+{
+	int cmdpipe[2];
+	pid_t childpid;
+	int i;
+
+	if (pipe(cmdpipe) == -1) {
+		errprintf("Could not get a pipe: %s\n", strerror(errno));
+		return -1;
+	}
+#ifdef F_SETPIPE_SZ
+	/* Let a worker fall further behind before we block */
+	fcntl(cmdpipe[1], F_SETPIPE_SZ, 1024*1024);
+#endif
+
+	fflush(stdout); fflush(stderr);
+	childpid = fork();
+	if (childpid == -1) {
+		errprintf("Could not fork client worker: %s\n", strerror(errno));
+		close(cmdpipe[0]); close(cmdpipe[1]);
+		return -1;
+	}
+	else if (childpid == 0) {
+		/* Close the descriptors belonging to the parent and to the other workers */
+		close(cmdpipe[1]);
+		close(STDIN_FILENO);
+		for (i = 0; (i < clientworkercount); i++) {
+			if ((i == idx) || (clientworkers[i].pid <= 0)) continue;
+			close(clientworkers[i].cmdfd);
+		}
+
+		clientworker_main(cmdpipe[0]);
+	}
+
+	close(cmdpipe[0]);
+	clientworkers[idx].pid = childpid;
+	clientworkers[idx].cmdfd = cmdpipe[1];
+
+	return 0;
+}
+
+static void clientworker_close(int idx)
+{
+	if (clientworkers[idx].pid <= 0) return;
+
+	close(clientworkers[idx].cmdfd);
+	waitpid(clientworkers[idx].pid, NULL, 0);
+	clientworkers[idx].pid = 0;
+}
+
+static void clientworker_send(int idx, char *msg, int seq)
+{
+	static char *buf = NULL;
+	static int bufsz = 0;
+	clientworkerhdr_t hdr;
+	int attempt;
+
+	hdr.seq = seq;
+	hdr.datalen = strlen(msg);
+	if ((sizeof(hdr) + hdr.datalen) > bufsz) {
+		bufsz = sizeof(hdr) + hdr.datalen + 4096;
+		buf = (char *)realloc(buf, bufsz);
+	}
+	memcpy(buf, &hdr, sizeof(hdr));
+	memcpy(buf + sizeof(hdr), msg, hdr.datalen);
+
+	for (attempt = 0; (attempt < 2); attempt++) {
+		if ((clientworkers[idx].pid > 0) && (clientworker_io(clientworkers[idx].cmdfd, buf, sizeof(hdr) + hdr.datalen, 1) == 0)) return;
+
+		/* The worker has died. Start a new one and try again */
+		errprintf("Client worker %d failed, restarting it\n", idx);
+		clientworker_close(idx);
+		if (clientworker_fork(idx) != 0) break;
+	}
+
+	errprintf("Could not pass message to client worker %d, message lost\n", idx);
+}
+
+static void clientworker_sendall(char *msg, int seq)
+{
+	int i;
+
+	for (i = 0; (i < clientworkercount); i++) clientworker_send(i, msg, seq);
+}
+
+static int clientworker_dispatch(char *msg, int seq)
+{
+	/* Pass a message to the workers. Returns 0 on shutdown */
+	char *p, *eoln;
+	unsigned int hashval = 0;
+	int i;
+
+	if (strncmp(msg, "@@client", 8) == 0) {
+		/* The hostname is the 4th field of the "@@client#seq|timestamp|sender|hostname|..." line */
+		eoln = msg + strcspn(msg, "\n");
+		for (i = 0, p = msg; (i < 3) && p; i++) {
+			p = strchr(p, '|');
+			if (p && (p < eoln)) p++; else p = NULL;
+		}
+		if (p == NULL) return 1;
+
+		while ((p < eoln) && (*p != '|')) hashval = (hashval * 31) + tolower((int)*(p++));
+		clientworker_send(hashval % clientworkercount, msg, seq);
+	}
+	else if (strncmp(msg, "@@shutdown", 10) == 0) {
+		printf("Shutting down\n");
+		return 0;
+	}
+	else if (strncmp(msg, "@@logrotate", 11) == 0) {
+		char *fn = xgetenv("XYMONCHANNEL_LOGFILENAME");
+		if (fn && strlen(fn)) {
+			reopen_file(fn, "a", stdout);
+			reopen_file(fn, "a", stderr);
+		}
+		clientworker_sendall(msg, seq);
+	}
+	else if (strncmp(msg, "@@reload", 8) == 0) {
+		clientworker_sendall(msg, seq);
+	}
+
+	return 1;
+}
+
+static void clientworker_stop(void)
+{
+	int i;
+
+	/* Closing the pipe makes the worker finish its queue and exit */
+	for (i = 0; (i < clientworkercount); i++) {
+		if (clientworkers[i].pid > 0) close(clientworkers[i].cmdfd);
+	}
+	for (i = 0; (i < clientworkercount); i++) {
+		if (clientworkers[i].pid > 0) waitpid(clientworkers[i].pid, NULL, 0);
+	}
+
+	if (clientworkers) xfree(clientworkers);
+	clientworkercount = 0;
+}
+
+static void clientworker_start(int count)
+{
+	int i;
+
+	if (count <= 0) return;
+
+	clientworkers = (clientworker_t *)calloc(count, sizeof(clientworker_t));
+	clientworkercount = count;
+	for (i = 0; (i < count); i++) {
+		if (clientworker_fork(i) != 0) {
+			errprintf("Could not start client workers, analysing messages directly\n");
+			clientworker_stop();
+			return;
+		}
+	}
+
+	errprintf("Started %d client workers\n", count);
+}
+
 int main(int argc, char *argv[])
 {
 	char *msg;
 	int running;
 	int argi, seq;
 	struct sigaction sa;
-	time_t nextconfigload = 0;
-	char *configfn = NULL;
-	char **collectors = NULL;
+	int workercount = 0;
 
 	/* Handle program options. */
 	libxymon_init(argv[0]);
@@ -1924,6 +2317,11 @@ int main(int argc, char *argv[])
 				tok = strtok(NULL, ",");
 			}
 		}
+		else if (argnmatch(argv[argi], "--workers=")) {
+			char *p = strchr(argv[argi], '=');
+			workercount = atoi(p+1);
+			if (workercount > 64) workercount = 64;
+		}
 		else if (strcmp(argv[argi], "--unknownclientosok") == 0) {
 			unknownclientosok = 1;
 		}
@@ -1970,12 +2368,10 @@ int main(int argc, char *argv[])
 
 	usebackfeedqueue = (sendmessage_init_local() > 0);
 
-	while (running) {
-		char *eoln, *restofmsg, *p;
-		char *metadata[MAX_META+1];
-		int metacount;
-		time_t nowtimer = gettimer();
+	/* Start the workers after setting up the signals, so they inherit the handlers */
+	clientworker_start(workercount);
 
+	while (running) {
 		msg = get_xymond_message(C_CLIENT, argv[0], &seq, NULL);
 		if (msg == NULL) {
 			if (!localmode) errprintf("Failed to get a message, terminating\n");
@@ -1983,168 +2379,20 @@ int main(int argc, char *argv[])
 			continue;
 		}
 
-		if (reloadconfig || (nowtimer >= nextconfigload)) {
-			nextconfigload = nowtimer + 600;
-			reloadconfig = 0;
-			if (!localmode) load_hostnames(xgetenv("HOSTSCFG"), NULL, get_fqdn());
-			load_client_config(configfn);
-		}
-
-		/* Split the message in the first line (with meta-data), and the rest */
- 		eoln = strchr(msg, '\n');
-		if (eoln) {
-			*eoln = '\0';
-			restofmsg = eoln+1;
-		}
-		else {
-			restofmsg = "";
-		}
-
-		metacount = 0; 
-		memset(&metadata, 0, sizeof(metadata));
-		p = gettok(msg, "|");
-		while (p && (metacount < MAX_META)) {
-			metadata[metacount++] = p;
-			p = gettok(NULL, "|");
-		}
-		metadata[metacount] = NULL;
-
-		if ((metacount > 4) && (strncmp(metadata[0], "@@client", 8) == 0)) {
-			int cnum, havecollector;
-			time_t timestamp = atoi(metadata[1]);
-			char *sender = metadata[2];
-			char *hostname = metadata[3];
-			char *clientos = metadata[4];
-			char *clientclass = metadata[5];
-			char *collectorid = metadata[6];
-			enum ostype_t os;
-			void *hinfo = NULL;
-
-			dbgprintf("Client report from host %s\n", (hostname ? hostname : "<unknown>"));
-
-			/* Check if we are running a collector module for this type of client */
-			if (!collectorid) collectorid = "";
-			for (cnum = 0, havecollector = 0; (collectors[cnum] && !havecollector); cnum++) 
-				havecollector = (strcmp(collectorid, collectors[cnum]) == 0);
-			if (!havecollector) continue;
-
-			hinfo = (localmode ? localhostinfo(hostname) : hostinfo(hostname));
-			if (!hinfo) continue;
-			os = get_ostype(clientos);
-
-			/* Default clientclass to the OS name */
-			if (!clientclass || (*clientclass == '\0')) clientclass = clientos;
-
-			/* Check for duplicates */
-			if (add_updateinfo(hostname, seq, timestamp) != 0) continue;
-
-			if (usebackfeedqueue) combo_start_local(); else combo_start();
-			switch (os) {
-                          case OS_FREEBSD:
-                                handle_freebsd_client(hostname, clientclass, os, hinfo, sender, timestamp, restofmsg);
-                                break;
-
-                          case OS_NETBSD:
-                                handle_netbsd_client(hostname, clientclass, os, hinfo, sender, timestamp, restofmsg);
-                                break;
-
-                          case OS_OPENBSD:
-                                handle_openbsd_client(hostname, clientclass, os, hinfo, sender, timestamp, restofmsg);
-                                break;
-
-                          case OS_LINUX22:
-                          case OS_LINUX:
-                          case OS_RHEL3:
-                                handle_linux_client(hostname, clientclass, os, hinfo, sender, timestamp, restofmsg);
-                                break;
-
-                          case OS_DARWIN:
-                                handle_darwin_client(hostname, clientclass, os, hinfo, sender, timestamp, restofmsg);
-                                break;
-
-                          case OS_SOLARIS:
-                                handle_solaris_client(hostname, clientclass, os, hinfo, sender, timestamp, restofmsg);
-                                break;
-
-                          case OS_HPUX:
-                                handle_hpux_client(hostname, clientclass, os, hinfo, sender, timestamp, restofmsg);
-                                break;
-
-                          case OS_OSF:
-                                handle_osf_client(hostname, clientclass, os, hinfo, sender, timestamp, restofmsg);
-                                break;
-
-                          case OS_AIX:
-                                handle_aix_client(hostname, clientclass, os, hinfo, sender, timestamp, restofmsg);
-                                break;
-
-                          case OS_IRIX:
-                                handle_irix_client(hostname, clientclass, os, hinfo, sender, timestamp, restofmsg);
-                                break;
-
-                          case OS_SCO_SV:
-                                handle_sco_sv_client(hostname, clientclass, os, hinfo, sender, timestamp, restofmsg);
-                                break;
-
-                          case OS_WIN32_BBWIN:
-                                handle_win32_bbwin_client(hostname, clientclass, os, hinfo, sender, timestamp, restofmsg);
-                                break;
-
-			  case OS_WIN_POWERSHELL:
-				handle_powershell_client(hostname, clientclass, os, hinfo, sender, timestamp, restofmsg);
-				break;
-
-			  case OS_ZVM:
-				handle_zvm_client(hostname, clientclass, os, hinfo, sender, timestamp, restofmsg);
-				break;
-
-			  case OS_ZVSE:
-				handle_zvse_client(hostname, clientclass, os, hinfo, sender, timestamp, restofmsg);
-				break;
-
-			  case OS_ZOS:
-				handle_zos_client(hostname, clientclass, os, hinfo, sender, timestamp, restofmsg);
-				break;
-
-			  case OS_SNMPCOLLECT:
-				handle_snmpcollect_client(hostname, clientclass, os, hinfo, sender, timestamp, restofmsg);
-				break;
-
-			  case OS_MQCOLLECT:
-				handle_mqcollect_client(hostname, clientclass, os, hinfo, sender, timestamp, restofmsg);
-				break;
-
-			  default:
-				if (unknownclientosok) {
-					dbgprintf("No client backend for OS '%s' sent by %s; using generic\n", clientos, sender);
-					handle_generic_client(hostname, clientclass, os, hinfo, sender, timestamp, restofmsg);
-				}
-				else errprintf("No client backend for OS '%s' sent by %s\n", clientos, sender);
-                                break;
+		if (clientworkercount > 0) {
+			if (reloadconfig) {
+				/* Pass a SIGHUP on to the workers */
+				reloadconfig = 0;
+				clientworker_sendall("@@reload", 0);
 			}
-			combo_end();
-		}
-		else if (strncmp(metadata[0], "@@shutdown", 10) == 0) {
-			printf("Shutting down\n");
-			running = 0;
-			continue;
-		}
-		else if (strncmp(metadata[0], "@@logrotate", 11) == 0) {
-			char *fn = xgetenv("XYMONCHANNEL_LOGFILENAME");
-			if (fn && strlen(fn)) {
-				reopen_file(fn, "a", stdout);
-				reopen_file(fn, "a", stderr);
-			}
-			continue;
-		}
-		else if (strncmp(metadata[0], "@@reload", 8) == 0) {
-			reloadconfig = 1;
+			running = clientworker_dispatch(msg, seq);
 		}
 		else {
-			/* Unknown message - ignore it */
+			running = handle_message(msg, seq);
 		}
 	}
 
+	clientworker_stop();
 	if (usebackfeedqueue) sendmessage_finish_local();
 
 	return 0;
@@ -57,6 +57,214 @@ typedef struct columndef_t {
 } columndef_t;
 void * columndefs;
 
+/*
+ * Batch mode (--batch=N): Keep up to N history files open between
+ * updates, and remember where the last (still open) entry of each file
+ * starts. A status change is then just a seek and a write, instead of
+ * opening the file and searching backwards for the last entry. The
+ * files are flushed after each update so the CGI's see the new data
+ * right away; with --sync-interval the data is also fsync'ed to disk,
+ * for all of the files changed in that interval at once.
+ * If a file is modified by someone else (e.g. trimhistory), the size or
+ * inode changes and we go back to reading the file.
+ */
+typedef struct histfile_t {
+	char *fn;
+	FILE *fd;
+	dev_t dev;
+	ino_t ino;
+	off_t size;		/* File size after our last write */
+	off_t lastpos;		/* Where the last entry starts, -1 for append-only files */
+	char lastcol[20];
+	time_t lastchg;
+	int dirty;		/* Written since last sync */
+	struct histfile_t *prev, *next;	/* Most recently used first */
+} histfile_t;
+
+static void *histfiles = NULL;
+static histfile_t *histfilehead = NULL, *histfiletail = NULL;
+static int histfilecount = 0;
+static int histfilemax = 0;
+static int syncinterval = 0;		/* Seconds between fsync's, 0 to leave it to the OS */
+static void *histlogdirs = NULL;	/* histlog directories known to exist */
+
+static unsigned long stat_events = 0, stat_cachehits = 0, stat_opens = 0;
+static unsigned long stat_syncs = 0, stat_syncfiles = 0;
+static double stat_syncms = 0.0;
+
+static void histfile_unlink(histfile_t *hf)
+{
+	if (hf->prev) hf->prev->next = hf->next; else histfilehead = hf->next;
+	if (hf->next) hf->next->prev = hf->prev; else histfiletail = hf->prev;
+	hf->prev = hf->next = NULL;
+}
+
+static void histfile_close(histfile_t *hf)
+{
+	/* Without --sync-interval we never fsync, same as when not batching */
+	if (hf->dirty && syncinterval) fsync(fileno(hf->fd));
+	fclose(hf->fd);
+
+	xtreeDelete(histfiles, hf->fn);
+	histfile_unlink(hf);
+	histfilecount--;
+	xfree(hf->fn);
+	xfree(hf);
+}
+
+static void histfile_closeall(void)
+{
+	/* Used when files are removed or renamed */
+	while (histfilehead) histfile_close(histfilehead);
+
+	if (histlogdirs) {
+		xtreePos_t handle;
+
+		while ((handle = xtreeFirst(histlogdirs)) != xtreeEnd(histlogdirs)) {
+			char *dirname = xtreeKey(histlogdirs, handle);
+
+			xtreeDelete(histlogdirs, dirname);
+			xfree(dirname);
+		}
+		xtreeDestroy(histlogdirs);
+		histlogdirs = NULL;
+	}
+
+	histlogstore_reset();
+}
+
+static histfile_t *histfile_get(char *fn)
+{
+	/* Returns the open file, if we still have it and nobody else changed it */
+	xtreePos_t handle;
+	histfile_t *hf;
+	struct stat st;
+
+	if (!histfiles) return NULL;
+
+	handle = xtreeFind(histfiles, fn);
+	if (handle == xtreeEnd(histfiles)) return NULL;
+	hf = (histfile_t *)xtreeData(histfiles, handle);
+
+	if ((stat(fn, &st) == -1) || (st.st_dev != hf->dev) || (st.st_ino != hf->ino) || (st.st_size != hf->size)) {
+		dbgprintf("History file %s changed, re-opening it\n", fn);
+		histfile_close(hf);
+		return NULL;
+	}
+
+	histfile_unlink(hf);
+	hf->next = histfilehead; if (histfilehead) histfilehead->prev = hf;
+	histfilehead = hf; if (!histfiletail) histfiletail = hf;
+	stat_cachehits++;
+
+	return hf;
+}
+
+static void histfile_keep(histfile_t *hf, char *fn, FILE *fd, off_t lastpos, char *lastcol, time_t lastchg)
+{
+	/* Keep the file open after an update, or close it if we are not batching */
+	struct stat st;
+
+	if ((histfilemax == 0) || (fflush(fd) != 0) || (fstat(fileno(fd), &st) == -1)) {
+		/* Closing it now, so this is the last chance to sync the update */
+		if (syncinterval) {
+			fflush(fd);
+			fsync(fileno(fd));
+			if (hf) hf->dirty = 0;
+		}
+		if (hf) histfile_close(hf); else fclose(fd);
+		return;
+	}
+
+	if (hf == NULL) {
+		if (!histfiles) histfiles = xtreeNew(strcmp);
+		if (histfilecount >= histfilemax) histfile_close(histfiletail);
+
+		hf = (histfile_t *)calloc(1, sizeof(histfile_t));
+		hf->fn = strdup(fn);
+		hf->fd = fd;
+		xtreeAdd(histfiles, hf->fn, hf);
+		hf->next = histfilehead; if (histfilehead) histfilehead->prev = hf;
+		histfilehead = hf; if (!histfiletail) histfiletail = hf;
+		histfilecount++;
+	}
+
+	hf->dev = st.st_dev;
+	hf->ino = st.st_ino;
+	hf->size = st.st_size;
+	hf->lastpos = lastpos;
+	if (lastcol) { strncpy(hf->lastcol, lastcol, sizeof(hf->lastcol)); hf->lastcol[sizeof(hf->lastcol)-1] = '\0'; }
+	hf->lastchg = lastchg;
+	hf->dirty = 1;
+}
+
+static void histfile_sync(FILE *alleventsfd)
+{
+	/* Group commit: fsync all of the files updated since last time, and the allevents file */
+	histfile_t *hf;
+	struct timespec starttime, endtime, tdiff;
+
+	getntimer(&starttime);
+	if (alleventsfd) {
+		fsync(fileno(alleventsfd));
+		stat_syncfiles++;
+	}
+	for (hf = histfilehead; (hf); hf = hf->next) {
+		if (!hf->dirty) continue;
+		fsync(fileno(hf->fd));
+		hf->dirty = 0;
+		stat_syncfiles++;
+	}
+	getntimer(&endtime);
+
+	tvdiff(&starttime, &endtime, &tdiff);
+	stat_syncms += tdiff.tv_sec*1000.0 + tdiff.tv_nsec/1000000.0;
+	stat_syncs++;
+}
+
+static void histlog_mkdir(char *dirname)
+{
+	/* Only need to create the histlog directories once */
+	if (histlogdirs && (xtreeFind(histlogdirs, dirname) != xtreeEnd(histlogdirs))) return;
+
+	mkdir(dirname, S_IRWXU|S_IRGRP|S_IXGRP|S_IROTH|S_IXOTH);
+	if (histfilemax > 0) {
+		char *key = strdup(dirname);
+
+		if (!histlogdirs) histlogdirs = xtreeNew(strcmp);
+		if (xtreeAdd(histlogdirs, key, key) != XTREE_STATUS_OK) xfree(key);
+	}
+}
+
+static char *historystats(time_t interval)
+{
+	static strbuffer_t *statsbuf = NULL;
+	char msgline[1024];
+
+	if (statsbuf == NULL) statsbuf = newstrbuffer(0); else clearstrbuffer(statsbuf);
+
+	if (interval <= 0) interval = 1;
+	sprintf(msgline, "Status changes since last report:\n");
+	addtobuffer(statsbuf, msgline);
+	sprintf(msgline, "- Status changes          : %10lu (%.2f/second)\n", stat_events, ((double)stat_events / interval));
+	addtobuffer(statsbuf, msgline);
+	sprintf(msgline, "- History files opened    : %10lu\n", stat_opens);
+	addtobuffer(statsbuf, msgline);
+	sprintf(msgline, "- History files kept open : %10lu\n", stat_cachehits);
+	addtobuffer(statsbuf, msgline);
+	sprintf(msgline, "- Open files now          : %10d (max %d)\n", histfilecount, histfilemax);
+	addtobuffer(statsbuf, msgline);
+	sprintf(msgline, "- Disk syncs              : %10lu (%lu files)\n", stat_syncs, stat_syncfiles);
+	addtobuffer(statsbuf, msgline);
+	sprintf(msgline, "- Avg. sync time (ms)     : %10.2f\n", (stat_syncs ? (stat_syncms / stat_syncs) : 0.0));
+	addtobuffer(statsbuf, msgline);
+
+	stat_events = stat_cachehits = stat_opens = stat_syncs = stat_syncfiles = 0;
+	stat_syncms = 0.0;
+
+	return STRBUF(statsbuf);
+}
+
 int main(int argc, char *argv[])
 {
 	time_t starttime = gettimer();
@@ -65,9 +273,11 @@ int main(int argc, char *argv[])
 	char *msg;
 	int argi, seq;
 	int save_allevents = 1;
+	int save_eventstore = 1;
 	int save_hostevents = 1;
 	int save_statusevents = 1;
 	int save_histlogs = 1, defaultsaveop = 1;
+	int packed_histlogs = 0;
 	FILE *alleventsfd = NULL;
 	int running = 1;
 	struct sigaction sa;
@@ -76,6 +286,10 @@ int main(int argc, char *argv[])
 	char alleventsfn[PATH_MAX];
 	int logdirfull = 0;
 	int minlogspace = 5;
+	time_t nextsync = 0;
+	char *statuscolumn = NULL;
+	time_t nextstatustime = 0, laststatustime = gettimer();
+	int usebackfeedqueue = 0;
 
 	MEMDEFINE(alleventsfn);
 	MEMDEFINE(newcol2);
@@ -100,6 +314,24 @@ int main(int argc, char *argv[])
 		else if (argnmatch(argv[argi], "--minimum-free=")) {
 			minlogspace = atoi(strchr(argv[argi], '=')+1);
 		}
+		else if (strcmp(argv[argi], "--packed-histlogs") == 0) {
+			packed_histlogs = 1;
+		}
+		else if (strcmp(argv[argi], "--no-eventstore") == 0) {
+			save_eventstore = 0;
+		}
+		else if (strcmp(argv[argi], "--batch") == 0) {
+			histfilemax = 500;
+		}
+		else if (argnmatch(argv[argi], "--batch=")) {
+			histfilemax = atoi(strchr(argv[argi], '=')+1);
+		}
+		else if (argnmatch(argv[argi], "--sync-interval=")) {
+			syncinterval = atoi(strchr(argv[argi], '=')+1);
+		}
+		else if (argnmatch(argv[argi], "--status-column=")) {
+			statuscolumn = strdup(strchr(argv[argi], '=')+1);
+		}
 		else if (standardoption(argv[argi])) {
 			if (showhelp) return 0;
 		}
@@ -170,6 +402,8 @@ int main(int argc, char *argv[])
 		setvbuf(alleventsfd, (char *)NULL, _IOLBF, 0);
 	}
 
+	if (statuscolumn) usebackfeedqueue = (sendmessage_init_local() > 0);
+
 	/* For picking up lost children */
 	setup_signalhandler("xymond_history");
 	memset(&sa, 0, sizeof(sa));
@@ -196,6 +430,7 @@ int main(int argc, char *argv[])
 		while (wait3(&childstat, WNOHANG, NULL) > 0) ;
 
 		if (rotatefiles && alleventsfd) {
+			if (syncinterval) fsync(fileno(alleventsfd));
 			fclose(alleventsfd);
 			alleventsfd = fopen(alleventsfn, "a");
 			if (alleventsfd == NULL) {
@@ -204,14 +439,49 @@ int main(int argc, char *argv[])
 			else {
 				setvbuf(alleventsfd, (char *)NULL, _IOLBF, 0);
 			}
+			eventstore_reopen();
+			histfile_closeall();
 		}
 
-		msg = get_xymond_message(C_STACHG, "xymond_history", &seq, NULL);
+		if ((histfilemax > 0) || syncinterval || statuscolumn) {
+			/* Wake up every second to sync the files and report our status */
+			struct timespec timeout;
+
+			timeout.tv_sec = 1; timeout.tv_nsec = 0;
+			msg = get_xymond_message(C_STACHG, "xymond_history", &seq, &timeout);
+		}
+		else {
+			msg = get_xymond_message(C_STACHG, "xymond_history", &seq, NULL);
+		}
 		if (msg == NULL) {
 			running = 0;
 			continue;
 		}
 
+		if (syncinterval && (nextsync <= gettimer())) {
+			histfile_sync(alleventsfd);
+			nextsync = gettimer() + syncinterval;
+		}
+
+		if (statuscolumn && (nextstatustime <= gettimer())) {
+			/* Report our own status */
+			strbuffer_t *statusmsg = newstrbuffer(0);
+			char msgline[1024];
+
+			init_timestamp();
+			snprintf(msgline, sizeof(msgline), "status+11 %s.%s green %s - xymond_history\nStatistics for xymond_history\n\n",
+				 xgetenv("MACHINE"), statuscolumn, timestamp);
+			addtobuffer(statusmsg, msgline);
+			addtobuffer(statusmsg, historystats(gettimer() - laststatustime));
+
+			if (usebackfeedqueue) combo_start_local(); else combo_start();
+			combo_add(statusmsg);
+			combo_end();
+			freestrbuffer(statusmsg);
+			laststatustime = gettimer();
+			nextstatustime = laststatustime + 300;
+		}
+
 		if (nextfscheck < gettimer()) {
 			logdirfull = (chkfreespace(histlogdir, minlogspace, minlogspace) != 0);
 			if (logdirfull) errprintf("Historylog directory %s has less than %d%% free space - disabling save of data for 5 minutes\n", histlogdir, minlogspace);
@@ -270,21 +540,37 @@ int main(int argc, char *argv[])
 				char statuslogfn[PATH_MAX];
 				int logexists;
 				FILE *statuslogfd;
+				off_t newpos;
 				char oldcol[100];
 				char timestamp[40];
 				struct stat st;
+				histfile_t *hf;
 
 				MEMDEFINE(statuslogfn);
 				MEMDEFINE(oldcol);
 				MEMDEFINE(timestamp);
 
+				stat_events++;
 				sprintf(statuslogfn, "%s/%s.%s", histdir, hostnamecommas, testname);
-				stat(statuslogfn, &st);
-				statuslogfd = fopen(statuslogfn, "r+");
+				hf = histfile_get(statuslogfn);
+				if (hf) {
+					statuslogfd = hf->fd;
+				}
+				else {
+					stat(statuslogfn, &st);
+					statuslogfd = fopen(statuslogfn, "r+");
+					stat_opens++;
+				}
 				logexists = (statuslogfd != NULL);
 				*oldcol = '\0';
 
-				if (logexists) {
+				if (hf) {
+					/* We know where the last entry starts, and what it says */
+					strcpy(oldcol, hf->lastcol);
+					lastchg = hf->lastchg;
+					fseeko(statuslogfd, hf->lastpos, SEEK_SET);
+				}
+				else if (logexists) {
 					/*
 					 * There is a fair chance xymond has not been
 					 * running all the time while this system was monitored.
@@ -373,7 +659,7 @@ int main(int argc, char *argv[])
 					}
 
 					if (hostnamecommas) xfree(hostnamecommas);
-					if (statuslogfd) fclose(statuslogfd);
+					if (statuslogfd && !hf) fclose(statuslogfd);
 
 					MEMUNDEFINE(statuslogfn);
 					MEMUNDEFINE(oldcol);
@@ -396,9 +682,18 @@ int main(int argc, char *argv[])
 					/* And the new record. */
 					memcpy(&tstamptm, localtime(&tstamp), sizeof(tstamptm));
 					strftime(timestamp, sizeof(timestamp), "%a %b %e %H:%M:%S %Y", &tstamptm);
+					newpos = ftello(statuslogfd);
 					fprintf(statuslogfd, "%s %s %d", timestamp, colorname(newcolor), (int)tstamp);
 
-					fclose(statuslogfd);
+					/* A new file is opened in append-mode, so we cannot keep that one */
+					if (logexists) 
+						histfile_keep(hf, statuslogfn, statuslogfd, newpos, colorname(newcolor), tstamp);
+					else
+						fclose(statuslogfd);
+
+					/* Update the index and daily rollups used by the availability reports */
+					historyindex_add(statuslogfn, tstamp, newpos);
+					if (logexists) historyrollup_add(statuslogfn, parse_color(oldcol), lastchg, tstamp - lastchg);
 				}
 
 				MEMUNDEFINE(statuslogfn);
@@ -410,91 +705,100 @@ int main(int argc, char *argv[])
 				char *hostdash;
 				char fname[PATH_MAX];
 				FILE *histlogfd;
+				strbuffer_t *logdata;
+				char msgline[1024];
+				/*
+				 * When a host gets disabled or goes purple, the status
+				 * message data is not changed - so it will include a
+				 * wrong color as the first word of the message.
+				 * Therefore we need to fixup this so it matches the
+				 * newcolor value.
+				 */
+				int txtcolor = parse_color(statusdata);
+				char *origstatus = statusdata;
+				char *eoln, *restofdata;
 
 				MEMDEFINE(fname);
 
-				p = hostdash = strdup(hostname); while ((p = strchr(p, '.')) != NULL) *p = '_';
-				sprintf(fname, "%s/%s", histlogdir, hostdash);
-				mkdir(fname, S_IRWXU|S_IRGRP|S_IXGRP|S_IROTH|S_IXOTH);
-				p = fname + sprintf(fname, "%s/%s/%s", histlogdir, hostdash, testname);
-				mkdir(fname, S_IRWXU|S_IRGRP|S_IXGRP|S_IROTH|S_IXOTH);
-				p += sprintf(p, "/%s", histlogtime(tstamp));
-
-				histlogfd = fopen(fname, "w");
-				if (histlogfd) {
-					/*
-					 * When a host gets disabled or goes purple, the status
-					 * message data is not changed - so it will include a
-					 * wrong color as the first word of the message.
-					 * Therefore we need to fixup this so it matches the
-					 * newcolor value.
-					 */
-					int txtcolor = parse_color(statusdata);
-					char *origstatus = statusdata;
-					char *eoln, *restofdata;
-					int written, closestatus, ok = 1;
-
-					if (txtcolor != -1) {
-						fprintf(histlogfd, "%s", colorname(newcolor));
-						statusdata += strlen(colorname(txtcolor));
-					}
+				logdata = newstrbuffer(strlen(statusdata) + 1024);
 
-					if (dismsg && *dismsg) nldecode(dismsg);
-					if (disabletime > 0) {
-						fprintf(histlogfd, " Disabled until %s\n%s\n\n", 
-							ctime(&disabletime), (dismsg ? dismsg : ""));
-						fprintf(histlogfd, "Status message when disabled follows:\n\n");
-						statusdata = origstatus;
-					}
-					else if (dismsg && *dismsg) {
-						fprintf(histlogfd, " Planned downtime: %s\n\n", dismsg);
-						fprintf(histlogfd, "Original status message follows:\n\n");
-						statusdata = origstatus;
-					}
+				if (txtcolor != -1) {
+					addtobuffer(logdata, colorname(newcolor));
+					statusdata += strlen(colorname(txtcolor));
+				}
 
-					restofdata = statusdata;
-					if (modifiers && *modifiers) {
-						char *modtxt;
+				if (dismsg && *dismsg) nldecode(dismsg);
+				if (disabletime > 0) {
+					addtobuffer_many(logdata, " Disabled until ", ctime(&disabletime), "\n",
+							 (dismsg ? dismsg : ""), "\n\n", NULL);
+					addtobuffer(logdata, "Status message when disabled follows:\n\n");
+					statusdata = origstatus;
+				}
+				else if (dismsg && *dismsg) {
+					addtobuffer_many(logdata, " Planned downtime: ", dismsg, "\n\n", NULL);
+					addtobuffer(logdata, "Original status message follows:\n\n");
+					statusdata = origstatus;
+				}
 
-						/* We must finish writing the first line before putting in the modifiers */
-						eoln = strchr(restofdata, '\n');
-						if (eoln) {
-							restofdata = eoln+1;
-							*eoln = '\0';
-							fprintf(histlogfd, "%s\n", statusdata);
-						}
+				restofdata = statusdata;
+				if (modifiers && *modifiers) {
+					char *modtxt;
 
-						nldecode(modifiers);
-						modtxt = strtok(modifiers, "\n");
-						while (modtxt) {
-							fprintf(histlogfd, "%s\n", modtxt);
-							modtxt = strtok(NULL, "\n");
-						}
+					/* We must finish writing the first line before putting in the modifiers */
+					eoln = strchr(restofdata, '\n');
+					if (eoln) {
+						restofdata = eoln+1;
+						*eoln = '\0';
+						addtobuffer_many(logdata, statusdata, "\n", NULL);
 					}
 
-					written = fwrite(restofdata, 1, strlen(restofdata), histlogfd);
-					if (written != strlen(restofdata)) {
-						ok = 0;
-						errprintf("Error writing to file %s: %s\n", fname, strerror(errno));
-						closestatus = fclose(histlogfd); /* Ignore any errors on close */
-					}
-					else {
-						fprintf(histlogfd, "Status unchanged in 0.00 minutes\n");
-						fprintf(histlogfd, "Message received from %s\n", metadata[2]);
-						if (clienttstamp) fprintf(histlogfd, "Client data ID %d\n", (int) clienttstamp);
-						closestatus = fclose(histlogfd);
-						if (closestatus != 0) {
-							ok = 0;
-							errprintf("Error writing to file %s: %s\n", fname, strerror(errno));
-						}
+					nldecode(modifiers);
+					modtxt = strtok(modifiers, "\n");
+					while (modtxt) {
+						addtobuffer_many(logdata, modtxt, "\n", NULL);
+						modtxt = strtok(NULL, "\n");
 					}
+				}
+
+				addtobuffer(logdata, restofdata);
+				addtobuffer(logdata, "Status unchanged in 0.00 minutes\n");
+				snprintf(msgline, sizeof(msgline), "Message received from %s\n", metadata[2]);
+				addtobuffer(logdata, msgline);
+				if (clienttstamp) {
+					snprintf(msgline, sizeof(msgline), "Client data ID %d\n", (int) clienttstamp);
+					addtobuffer(logdata, msgline);
+				}
 
-					if (!ok) remove(fname);
+				p = hostdash = strdup(hostname); while ((p = strchr(p, '.')) != NULL) *p = '_';
+
+				if (packed_histlogs) {
+					histlogstore_save(histlogdir, hostdash, testname, tstamp, STRBUF(logdata));
 				}
 				else {
-					errprintf("Cannot create histlog file '%s' : %s\n", fname, strerror(errno));
+					sprintf(fname, "%s/%s", histlogdir, hostdash);
+					histlog_mkdir(fname);
+					p = fname + sprintf(fname, "%s/%s/%s", histlogdir, hostdash, testname);
+					histlog_mkdir(fname);
+					p += sprintf(p, "/%s", histlogtime(tstamp));
+
+					histlogfd = fopen(fname, "w");
+					if (histlogfd) {
+						int ok;
+
+						ok = (fwrite(STRBUF(logdata), 1, STRBUFLEN(logdata), histlogfd) == STRBUFLEN(logdata));
+						if (fclose(histlogfd) != 0) ok = 0;
+						if (!ok) {
+							errprintf("Error writing to file %s: %s\n", fname, strerror(errno));
+							remove(fname);
+						}
+					}
+					else {
+						errprintf("Cannot create histlog file '%s' : %s\n", fname, strerror(errno));
+					}
 				}
+
 				xfree(hostdash);
+				freestrbuffer(logdata);
 
 				MEMUNDEFINE(fname);
 			}
@@ -511,16 +815,18 @@ int main(int argc, char *argv[])
 			if (save_hostevents) {
 				char hostlogfn[PATH_MAX];
 				FILE *hostlogfd;
+				histfile_t *hf;
 
 				MEMDEFINE(hostlogfn);
 
 				sprintf(hostlogfn, "%s/%s", histdir, hostname);
-				hostlogfd = fopen(hostlogfn, "a");
+				hf = histfile_get(hostlogfn);
+				hostlogfd = (hf ? hf->fd : fopen(hostlogfn, "a"));
 				if (hostlogfd) {
 					fprintf(hostlogfd, "%s %d %d %d %s %s %d\n",
 						testname, (int)tstamp, (int)lastchg, (int)(tstamp - lastchg),
 						newcol2, oldcol2, trend);
-					fclose(hostlogfd);
+					histfile_keep(hf, hostlogfn, hostlogfd, -1, NULL, 0);
 				}
 				else {
 					errprintf("Cannot open host logfile '%s' : %s\n", hostlogfn, strerror(errno));
@@ -530,6 +836,12 @@ int main(int argc, char *argv[])
 			}
 
 			if (save_allevents) {
+				/* The store first, so a newer event in allevents means the store is stale */
+				if (save_eventstore) {
+					eventstore_add(histdir, hostname, testname, tstamp, lastchg,
+						       eventcolor(newcol2), eventcolor(oldcol2), trend);
+				}
+
 				fprintf(alleventsfd, "%s %s %d %d %d %s %s %d\n",
 					hostname, testname, (int)tstamp, (int)lastchg, (int)(tstamp - lastchg),
 					newcol2, oldcol2, trend);
@@ -542,6 +854,7 @@ int main(int argc, char *argv[])
 			/* @@drophost|timestamp|sender|hostname */
 
 			hostname = metadata[3];
+			histfile_closeall();
 
 			if (save_histlogs) {
 				char *hostdash;
@@ -581,7 +894,7 @@ int main(int argc, char *argv[])
 
 				MEMDEFINE(statuslogfn);
 
-				/* Remove $XYMONVAR/hist/host,name.* */
+				/* Remove $XYMONVAR/hist/host,name.* and the index files .host,name.*.idx */
 				p = hostnamecommas = strdup(hostname); while ((p = strchr(p, '.')) != NULL) *p = ',';
 				hostlead = malloc(strlen(hostname) + 2);
 				strcpy(hostlead, hostnamecommas); strcat(hostlead, ".");
@@ -589,7 +902,9 @@ int main(int argc, char *argv[])
 				dirfd = opendir(histdir);
 				if (dirfd) {
 					while ((de = readdir(dirfd)) != NULL) {
-						if (strncmp(de->d_name, hostlead, strlen(hostlead)) == 0) {
+						char *fnam = ((*(de->d_name) == '.') ? de->d_name+1 : de->d_name);
+
+						if (strncmp(fnam, hostlead, strlen(hostlead)) == 0) {
 							sprintf(statuslogfn, "%s/%s", histdir, de->d_name);
 							if ((stat(statuslogfn, &st) == 0) && S_ISREG(st.st_mode)) {
 								unlink(statuslogfn);
@@ -609,6 +924,7 @@ int main(int argc, char *argv[])
 			/* @@droptest|timestamp|sender|hostname|testname */
 
 			hostname = metadata[3];
+			histfile_closeall();
 			testname = metadata[4];
 
 			if (save_histlogs) {
@@ -620,6 +936,7 @@ int main(int argc, char *argv[])
 				p = hostdash = strdup(hostname); while ((p = strchr(p, '.')) != NULL) *p = '_';
 				sprintf(testdir, "%s/%s/%s", histlogdir, hostdash, testname);
 				dropdirectory(testdir, 1);
+				histlogstore_droptest(histlogdir, hostdash, testname);
 				xfree(hostdash);
 
 				MEMUNDEFINE(testdir);
@@ -635,6 +952,8 @@ int main(int argc, char *argv[])
 				p = hostnamecommas = strdup(hostname); while ((p = strchr(p, '.')) != NULL) *p = ',';
 				sprintf(statuslogfn, "%s/%s.%s", histdir, hostnamecommas, testname);
 				if ((stat(statuslogfn, &st) == 0) && S_ISREG(st.st_mode)) unlink(statuslogfn);
+				unlink(historyindex_filename(statuslogfn));
+				unlink(historyrollup_filename(statuslogfn));
 				xfree(hostnamecommas);
 
 				MEMUNDEFINE(statuslogfn);
@@ -646,6 +965,7 @@ int main(int argc, char *argv[])
 
 			hostname = metadata[3];
 			newhostname = metadata[4];
+			histfile_closeall();
 
 			if (save_histlogs) {
 				char *hostdash;
@@ -699,10 +1019,13 @@ int main(int argc, char *argv[])
 				dirfd = opendir(histdir);
 				if (dirfd) {
 					while ((de = readdir(dirfd)) != NULL) {
-						if (strncmp(de->d_name, hostlead, strlen(hostlead)) == 0) {
-							char *testname = strchr(de->d_name, '.');
+						char *fnam = ((*(de->d_name) == '.') ? de->d_name+1 : de->d_name);
+
+						if (strncmp(fnam, hostlead, strlen(hostlead)) == 0) {
+							char *testname = strchr(fnam, '.');
 							sprintf(statuslogfn, "%s/%s", histdir, de->d_name);
-							sprintf(newlogfn, "%s/%s%s", histdir, newhostnamecommas, testname);
+							sprintf(newlogfn, "%s/%s%s%s", histdir, 
+								((fnam == de->d_name) ? "" : "."), newhostnamecommas, testname);
 							rename(statuslogfn, newlogfn);
 						}
 					}
@@ -723,6 +1046,7 @@ int main(int argc, char *argv[])
 			hostname = metadata[3];
 			testname = metadata[4];
 			newtestname = metadata[5];
+			histfile_closeall();
 
 			if (save_histlogs) {
 				char *hostdash;
@@ -735,6 +1059,7 @@ int main(int argc, char *argv[])
 				sprintf(olddir, "%s/%s/%s", histlogdir, hostdash, testname);
 				sprintf(newdir, "%s/%s/%s", histlogdir, hostdash, newtestname);
 				rename(olddir, newdir);
+				histlogstore_renametest(histlogdir, hostdash, testname, newtestname);
 				xfree(hostdash);
 
 				MEMUNDEFINE(newdir); MEMUNDEFINE(olddir);
@@ -744,6 +1069,7 @@ int main(int argc, char *argv[])
 				char *hostnamecommas;
 				char statuslogfn[PATH_MAX];
 				char newstatuslogfn[PATH_MAX];
+				char sidecarfn[PATH_MAX];
 
 				MEMDEFINE(statuslogfn); MEMDEFINE(newstatuslogfn);
 
@@ -751,6 +1077,10 @@ int main(int argc, char *argv[])
 				sprintf(statuslogfn, "%s/%s.%s", histdir, hostnamecommas, testname);
 				sprintf(newstatuslogfn, "%s/%s.%s", histdir, hostnamecommas, newtestname);
 				rename(statuslogfn, newstatuslogfn);
+				strcpy(sidecarfn, historyindex_filename(statuslogfn));
+				rename(sidecarfn, historyindex_filename(newstatuslogfn));
+				strcpy(sidecarfn, historyrollup_filename(statuslogfn));
+				rename(sidecarfn, historyrollup_filename(newstatuslogfn));
 				xfree(hostnamecommas);
 
 				MEMUNDEFINE(newstatuslogfn); MEMUNDEFINE(statuslogfn);
@@ -779,6 +1109,7 @@ int main(int argc, char *argv[])
 	MEMUNDEFINE(oldcol2);
 	MEMUNDEFINE(alleventsfn);
 
+	histfile_closeall();
 	fclose(alleventsfd);
 	unlink(pidfn);
 
@@ -0,0 +1,468 @@
+/*----------------------------------------------------------------------------*/
+/* Xymon message daemon.                                                      */
+/*                                                                            */
+/* This module handles the decoding of incoming messages in a pool of         */
+/* threads. The network I/O and all updates of the xymond state stay in the   */
+/* main thread; the ingest threads only do the parsing work that does not     */
+/* depend on the state: decompressing messages, and splitting "combo" and     */
+/* "extcombo" messages into the individual messages they carry. The result    */
+/* is handed back to the main thread through a per-thread ring, so there is   */
+/* still only a single writer of the xymond state.                            */
+/*                                                                            */
+/* Messages from the same sender always go to the same thread, so they are    */
+/* applied in the order they were received. Only requests that need a         */
+/* response (the queries) are handled directly by the main thread.            */
+/*                                                                            */
+/* Copyright (C) 2004-2011 Henrik Storner <henrik@hswn.dk>                    */
+/*                                                                            */
+/* This program is released under the GNU General Public License (GPL),       */
+/* version 2. See the file "COPYING" for details.                             */
+/*                                                                            */
+/*----------------------------------------------------------------------------*/
+
+static char rcsid[] = "$Id$";
+
+#include "config.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <signal.h>
+
+#ifdef HAVE_PTHREADS
+#include <pthread.h>
+#endif
+
+#include "libxymon.h"
+
+#include "xymond_ingest.h"
+
+#ifdef HAVE_PTHREADS
+
+#define INGEST_RINGSIZE 4096	/* Must be a power of 2 */
+#define INGEST_MAXTHREADS 64
+
+typedef struct ingestqueue_t {
+	int id;
+	pthread_t thread;
+
+	/* Input queue: Filled by the main thread, emptied by the ingest thread */
+	pthread_mutex_t lock;
+	pthread_cond_t wakeup;
+	ingestrec_t *head, *tail;
+	int stopping;
+
+	/*
+	 * Output ring: Single producer (the ingest thread), single consumer (the main thread).
+	 * rhead is only moved by the producer, rtail only by the consumer; both are read and
+	 * updated with the atomic builtins, which also act as the memory barriers.
+	 */
+	ingestrec_t **ring;
+	unsigned int rhead, rtail;
+	int finished;
+
+	/* Statistics. "submitted" is only updated by the main thread, the others only by the ingest thread */
+	unsigned long submitted, completed, garbled, ringwaits;
+} ingestqueue_t;
+
+static ingestqueue_t *queues = NULL;
+static int queuecount = 0;
+
+
+/*
+ * Messages that do not change the message buffer (i.e. never send a response)
+ * can be passed to do_message() as a slice of the original buffer. Anything
+ * else is copied to a buffer of its own.
+ */
+static char *sliceable[] = {
+	"status", "combo\n", "extcombo ", "data", "summary", "modify", "notes", "usermsg",
+	"enable", "disable", "drop ", "rename ", "notify", "dummy", NULL
+};
+
+static int is_sliceable(char *msg)
+{
+	int i;
+
+	for (i = 0; (sliceable[i]); i++) {
+		if (strncmp(msg, sliceable[i], strlen(sliceable[i])) == 0) return 1;
+	}
+
+	return 0;
+}
+
+static void add_message(ingestrec_t *rec, char *msg, int msglen, int owned)
+{
+	if ((rec->msgcount % 64) == 0) {
+		rec->msgs = (ingestmsg_t *)realloc(rec->msgs, (rec->msgcount + 64) * sizeof(ingestmsg_t));
+	}
+
+	if (!owned && !is_sliceable(msg)) {
+		char *copy = (char *)malloc(msglen + 1);
+
+		memcpy(copy, msg, msglen);
+		*(copy + msglen) = '\0';
+		msg = copy;
+		owned = 1;
+	}
+
+	rec->msgs[rec->msgcount].buf = msg;
+	rec->msgs[rec->msgcount].buflen = msglen;
+	rec->msgs[rec->msgcount].owned = owned;
+	rec->msgcount++;
+}
+
+static void set_error(ingestrec_t *rec, char *fmt, int v1, int v2)
+{
+	char errtxt[200];
+
+	snprintf(errtxt, sizeof(errtxt), fmt, v1, v2);
+	rec->errtxt = strdup(errtxt);
+}
+
+static void decode_extcombo(ingestrec_t *rec)
+{
+	/* Same rules as the extcombo handling in do_message() */
+	char *ofsline, *p, *tokr, *ofsstr;
+	int startofs, endofs;
+
+	rec->statscmd = "extcombo";
+
+	ofsline = rec->buf;
+	p = strchr(ofsline, '\n');
+	if (!p) return;
+	*p = '\0';
+
+	ofsstr = strtok_r(ofsline+9, " ", &tokr);
+	startofs = (ofsstr ? atoi(ofsstr) : 0);
+	if ((startofs <= 0) || (startofs >= rec->buflen)) {
+		set_error(rec, "Invalid start-offset in extcombo: startofs=%d, buflen=%d\n", startofs, rec->buflen);
+		return;
+	}
+
+	do {
+		ofsstr = strtok_r(NULL, " ", &tokr);
+		if (!ofsstr) continue;
+
+		endofs = atoi(ofsstr);
+		if ((endofs <= 0) || (endofs <= startofs) || (endofs > rec->buflen)) {
+			set_error(rec, "Invalid end-offset in extcombo: endofs=%d, buflen=%d\n", endofs, rec->buflen);
+			return;
+		}
+
+		add_message(rec, rec->buf + startofs, (endofs - startofs), 0);
+		startofs = endofs;
+	} while (ofsstr);
+}
+
+static void decode_combo(ingestrec_t *rec)
+{
+	char *currmsg, *nextmsg;
+
+	rec->statscmd = "combo";
+
+	currmsg = rec->buf+6;
+	do {
+		nextmsg = strstr(currmsg, "\n\nstatus");
+		if (nextmsg) { *(nextmsg+1) = '\0'; nextmsg += 2; }
+
+		add_message(rec, currmsg, strlen(currmsg), 0);
+		currmsg = nextmsg;
+	} while (currmsg);
+}
+
+static void decode_message(ingestrec_t *rec, void *zstrm)
+{
+	if (strncmp(rec->buf, "compress:zlib ", 14) == 0) {
+		strbuffer_t *expbuf = NULL;
+		char *cbegin;
+		int expandedsz;
+
+		expandedsz = atoi(rec->buf+14);
+		cbegin = strchr(rec->buf, '\n');
+		if (cbegin && zstrm) {
+			cbegin++;
+			expbuf = uncompress_buffer_r(zstrm, cbegin, rec->buflen - (cbegin - rec->buf), NULL);
+		}
+
+		if (!expbuf || (STRBUFLEN(expbuf) != expandedsz)) {
+			set_error(rec, "Garbled compressed message, expected %d bytes, expansion got %d\n",
+				  expandedsz, (expbuf ? STRBUFLEN(expbuf) : -1));
+			if (expbuf) freestrbuffer(expbuf);
+			return;
+		}
+
+		xfree(rec->buf);
+		rec->buflen = STRBUFLEN(expbuf);
+		rec->buf = grabstrbuffer(expbuf);
+
+		if (strncmp(rec->buf, "compress:", 9) == 0) {
+			set_error(rec, "Nested compressed message (%d/%d bytes), dropped\n", expandedsz, rec->buflen);
+			return;
+		}
+	}
+
+	if (strncmp(rec->buf, "extcombo ", 9) == 0) {
+		decode_extcombo(rec);
+	}
+	else if (strncmp(rec->buf, "combo\n", 6) == 0) {
+		decode_combo(rec);
+	}
+	else {
+		/* A single message: Hand over the buffer as it is */
+		add_message(rec, rec->buf, rec->buflen, 1);
+		rec->buf = NULL;
+	}
+}
+
+static void deliver(ingestqueue_t *q, ingestrec_t *rec)
+{
+	while ((q->rhead - __sync_fetch_and_add(&q->rtail, 0)) >= INGEST_RINGSIZE) {
+		/* Main thread is behind, wait for it to catch up */
+		q->ringwaits++;
+		usleep(1000);
+	}
+
+	q->ring[q->rhead & (INGEST_RINGSIZE-1)] = rec;
+	__sync_fetch_and_add(&q->rhead, 1);	/* Publishes the record to the main thread */
+}
+
+static void *ingest_worker(void *arg)
+{
+	ingestqueue_t *q = (ingestqueue_t *)arg;
+	ingestrec_t *batch, *rec;
+	void *zstrm;
+
+	zstrm = uncompress_stream_init();
+
+	while (1) {
+		/* Grab everything that is queued for us */
+		pthread_mutex_lock(&q->lock);
+		while (!q->head && !q->stopping) pthread_cond_wait(&q->wakeup, &q->lock);
+		batch = q->head;
+		q->head = q->tail = NULL;
+		pthread_mutex_unlock(&q->lock);
+
+		/* Nothing queued means we are stopping */
+		if (!batch) break;
+
+		while (batch) {
+			rec = batch;
+			batch = batch->next;
+			rec->next = NULL;
+
+			decode_message(rec, zstrm);
+			if (rec->errtxt) q->garbled++;
+			q->completed++;
+			deliver(q, rec);
+		}
+	}
+
+	if (zstrm) uncompress_stream_done(zstrm);
+
+	__sync_fetch_and_add(&q->finished, 1);
+
+	return NULL;
+}
+
+
+int ingest_start(int nthreads)
+{
+	int i;
+	sigset_t allsigs, oldsigs;
+
+	if (nthreads <= 0) return 0;
+	if (nthreads > INGEST_MAXTHREADS) nthreads = INGEST_MAXTHREADS;
+
+	/* Signals must be handled by the main thread, so block them in the ingest threads */
+	sigfillset(&allsigs);
+	pthread_sigmask(SIG_BLOCK, &allsigs, &oldsigs);
+
+	queues = (ingestqueue_t *)calloc(nthreads, sizeof(ingestqueue_t));
+	for (i = 0; (i < nthreads); i++) {
+		ingestqueue_t *q = &queues[i];
+
+		q->id = i;
+		q->ring = (ingestrec_t **)calloc(INGEST_RINGSIZE, sizeof(ingestrec_t *));
+		pthread_mutex_init(&q->lock, NULL);
+		pthread_cond_init(&q->wakeup, NULL);
+
+		if (pthread_create(&q->thread, NULL, ingest_worker, q) != 0) {
+			errprintf("Cannot create ingest thread %d, using %d threads\n", i, queuecount);
+			pthread_mutex_destroy(&q->lock);
+			pthread_cond_destroy(&q->wakeup);
+			xfree(q->ring);
+			break;
+		}
+
+		queuecount++;
+	}
+
+	pthread_sigmask(SIG_SETMASK, &oldsigs, NULL);
+
+	if (queuecount == 0) {
+		xfree(queues);
+		return -1;
+	}
+
+	return queuecount;
+}
+
+int ingest_active(void)
+{
+	return (queuecount > 0);
+}
+
+int ingest_wants(char *buf)
+{
+	if (queuecount == 0) return 0;
+
+	/*
+	 * Everything that does not send a response goes through the sender's
+	 * queue, so e.g. a "drop" cannot overtake the sender's earlier statuses.
+	 */
+	return ( (strncmp(buf, "compress:zlib ", 14) == 0) || is_sliceable(buf) );
+}
+
+int ingest_submit(char *buf, int buflen, char *sender)
+{
+	/* NB: We take over ownership of buf */
+	ingestqueue_t *q;
+	ingestrec_t *rec;
+	unsigned int hash = 5381;
+	char *p;
+
+	for (p = sender; (*p); p++) hash = ((hash << 5) + hash) + (unsigned char)*p;
+	q = &queues[hash % queuecount];
+
+	rec = (ingestrec_t *)calloc(1, sizeof(ingestrec_t));
+	rec->buf = buf;
+	rec->buflen = buflen;
+	rec->sender = strdup(sender);
+
+	pthread_mutex_lock(&q->lock);
+	if (q->tail) q->tail->next = rec; else q->head = rec;
+	q->tail = rec;
+	pthread_cond_signal(&q->wakeup);
+	pthread_mutex_unlock(&q->lock);
+
+	q->submitted++;
+
+	return 0;
+}
+
+int ingest_drain(ingest_apply_fn_t *applyfn, int maxrecs)
+{
+	int i, count = 0, gotone;
+
+	/* Round-robin over the threads, so a busy sender cannot starve the others */
+	do {
+		gotone = 0;
+
+		for (i = 0; (i < queuecount); i++) {
+			ingestqueue_t *q = &queues[i];
+			ingestrec_t *rec;
+
+			if (q->rtail == __sync_fetch_and_add(&q->rhead, 0)) continue;
+
+			rec = q->ring[q->rtail & (INGEST_RINGSIZE-1)];
+			__sync_fetch_and_add(&q->rtail, 1);	/* Releases the slot to the ingest thread */
+
+			applyfn(rec);
+			ingest_free(rec);
+			count++; gotone = 1;
+		}
+	} while (gotone && ((maxrecs == 0) || (count < maxrecs)));
+
+	return count;
+}
+
+void ingest_free(ingestrec_t *rec)
+{
+	int i;
+
+	for (i = 0; (i < rec->msgcount); i++) {
+		if (rec->msgs[i].owned) xfree(rec->msgs[i].buf);
+	}
+	if (rec->msgs) xfree(rec->msgs);
+	if (rec->buf) xfree(rec->buf);
+	if (rec->errtxt) xfree(rec->errtxt);
+	xfree(rec->sender);
+	xfree(rec);
+}
+
+void ingest_stop(ingest_apply_fn_t *applyfn)
+{
+	int i, alldone;
+
+	if (queuecount == 0) return;
+
+	for (i = 0; (i < queuecount); i++) {
+		pthread_mutex_lock(&queues[i].lock);
+		queues[i].stopping = 1;
+		pthread_cond_signal(&queues[i].wakeup);
+		pthread_mutex_unlock(&queues[i].lock);
+	}
+
+	/* Keep applying results until all threads have emptied their queues */
+	do {
+		alldone = 1;
+		for (i = 0; (i < queuecount); i++) if (!__sync_fetch_and_add(&queues[i].finished, 0)) alldone = 0;
+
+		if ((ingest_drain(applyfn, 0) == 0) && !alldone) usleep(1000);
+	} while (!alldone);
+	ingest_drain(applyfn, 0);
+
+	for (i = 0; (i < queuecount); i++) {
+		pthread_join(queues[i].thread, NULL);
+		pthread_mutex_destroy(&queues[i].lock);
+		pthread_cond_destroy(&queues[i].wakeup);
+		xfree(queues[i].ring);
+	}
+
+	xfree(queues);
+	queuecount = 0;
+}
+
+char *ingest_stats(void)
+{
+	static strbuffer_t *statsbuf = NULL;
+	char msgline[1024];
+	int i;
+
+	if (statsbuf == NULL) statsbuf = newstrbuffer(1024); else clearstrbuffer(statsbuf);
+
+	if (queuecount == 0) return STRBUF(statsbuf);
+
+	sprintf(msgline, "Ingest threads         : %10d\n", queuecount);
+	addtobuffer(statsbuf, msgline);
+	for (i = 0; (i < queuecount); i++) {
+		ingestqueue_t *q = &queues[i];
+
+		sprintf(msgline, "- thread %-13d : %10lu (%lu queued, %lu ready, %lu garbled, %lu ring waits)\n",
+			i, q->completed, (q->submitted - q->completed), (unsigned long)(q->rhead - q->rtail),
+			q->garbled, q->ringwaits);
+		addtobuffer(statsbuf, msgline);
+	}
+
+	return STRBUF(statsbuf);
+}
+
+#else
+
+int ingest_start(int nthreads)
+{
+	if (nthreads > 0) errprintf("Threads not supported on this platform, ingest threads disabled\n");
+	return -1;
+}
+
+int ingest_active(void) { return 0; }
+int ingest_wants(char *buf) { return 0; }
+int ingest_submit(char *buf, int buflen, char *sender) { return -1; }
+int ingest_drain(ingest_apply_fn_t *applyfn, int maxrecs) { return 0; }
+void ingest_free(ingestrec_t *rec) { }
+void ingest_stop(ingest_apply_fn_t *applyfn) { }
+char *ingest_stats(void) { return ""; }
+
+#endif
+
@@ -0,0 +1,43 @@
+/*----------------------------------------------------------------------------*/
+/* Xymon message daemon.                                                      */
+/*                                                                            */
+/* Copyright (C) 2004-2011 Henrik Storner <henrik@hswn.dk>                    */
+/*                                                                            */
+/* This program is released under the GNU General Public License (GPL),       */
+/* version 2. See the file "COPYING" for details.                             */
+/*                                                                            */
+/*----------------------------------------------------------------------------*/
+
+#ifndef __XYMOND_INGEST_H__
+#define __XYMOND_INGEST_H__
+
+typedef struct ingestmsg_t {
+	char *buf;		/* Start of a single message (points into the record buffer unless owned) */
+	int buflen;
+	int owned;		/* buf is a separate allocation which the receiver must free */
+} ingestmsg_t;
+
+typedef struct ingestrec_t {
+	char *buf;		/* The buffer as received from the network */
+	int buflen;
+	char *sender;
+	char *statscmd;		/* Container message to count once in the statistics (combo/extcombo) */
+	char *errtxt;		/* Set if the message could not be decoded */
+	int msgcount;
+	ingestmsg_t *msgs;
+	struct ingestrec_t *next;
+} ingestrec_t;
+
+typedef void (ingest_apply_fn_t)(ingestrec_t *rec);
+
+extern int ingest_start(int nthreads);
+extern int ingest_active(void);
+extern int ingest_wants(char *buf);
+extern int ingest_submit(char *buf, int buflen, char *sender);
+extern int ingest_drain(ingest_apply_fn_t *applyfn, int maxrecs);
+extern void ingest_free(ingestrec_t *rec);
+extern void ingest_stop(ingest_apply_fn_t *applyfn);
+extern char *ingest_stats(void);
+
+#endif
+
@@ -28,7 +28,6 @@ static char rcsid[] = "$Id$";
 #include <sys/un.h>
 #include <fcntl.h>
 #include <errno.h>
-#include <libgen.h>
 
 #include "libxymon.h"
 #include "xymond_worker.h"
@@ -194,6 +193,11 @@ int main(int argc, char *argv[])
 	struct sockaddr_un ctlsockaddr;
 	int ctlsocket;
 	int usebackfeedqueue = 0;
+	int writercount = 0;
+	int nodscache = 0;
+	char *statuscolumn = NULL;
+	time_t nextstatustime = 0;
+	struct timespec timeout;
 
 	/* Handle program options. */
 	for (argi = 1; (argi < argc); argi++) {
@@ -219,9 +223,41 @@ int main(int argc, char *argv[])
 		else if (strcmp(argv[argi], "--no-cache") == 0) {
 			use_rrd_cache = 0;
 		}
+		else if (argnmatch(argv[argi], "--cache-maxage=")) {
+			char *p = strchr(argv[argi], '=');
+			rrdcache_maxage = atoi(p+1);
+			if (rrdcache_maxage < 60) rrdcache_maxage = 60;
+		}
+		else if (argnmatch(argv[argi], "--cache-memory=")) {
+			char *p = strchr(argv[argi], '=');
+			rrdcache_maxmem = 1024*1024*atol(p+1);
+		}
+		else if (argnmatch(argv[argi], "--status-column=")) {
+			char *p = strchr(argv[argi], '=');
+			statuscolumn = strdup(p+1);
+		}
 		else if (strcmp(argv[argi], "--no-rrd") == 0) {
 			no_rrd = 1;
 		}
+		else if (argnmatch(argv[argi], "--backend=")) {
+			char *p = strchr(argv[argi], '=');
+			if (rrdbackend_select(p+1) != 0) {
+				errprintf("Unknown storage backend '%s'\n", p+1);
+				return 1;
+			}
+		}
+		else if (argnmatch(argv[argi], "--dscache=")) {
+			char *p = strchr(argv[argi], '=');
+			dscachefn = strdup(p+1);
+		}
+		else if (strcmp(argv[argi], "--no-dscache") == 0) {
+			nodscache = 1;
+		}
+		else if (argnmatch(argv[argi], "--writers=")) {
+			char *p = strchr(argv[argi], '=');
+			writercount = atoi(p+1);
+			if (writercount > 64) writercount = 64;
+		}
 		else if (net_worker_option(argv[argi])) {
 			/* Handled in the subroutine */
 		}
@@ -235,6 +271,14 @@ int main(int argc, char *argv[])
 		rrddir = strdup(xgetenv("XYMONRRDS"));
 	}
 
+	if (nodscache) {
+		dscachefn = NULL;
+	}
+	else if ((dscachefn == NULL) && xgetenv("XYMONTMP")) {
+		dscachefn = (char *)malloc(strlen(xgetenv("XYMONTMP")) + 30);
+		sprintf(dscachefn, "%s/xymond_rrd.dscache", xgetenv("XYMONTMP"));
+	}
+
 	if (exthandler && extids) setup_exthandler(exthandler, extids);
 
 	usebackfeedqueue = (sendmessage_init_local() > 0);
@@ -274,6 +318,9 @@ int main(int argc, char *argv[])
 	/* Load the RRD definitions */
 	load_rrddefs();
 
+	/* Start the RRD writers before the external processor, so they do not inherit the pipe to it */
+	if (!no_rrd) rrdwriter_start(writercount);
+
 	/* If we are passing data to an external processor, create the pipe to it */
 	setup_extprocessor(processor);
 
@@ -317,13 +364,16 @@ int main(int argc, char *argv[])
 			}
 		} while (gotcachectlmessage);
 
-		/* Get next message */
-		msg = get_xymond_message(C_LAST, argv[0], &seq, NULL);
+		/* Get next message. Wake up every second to flush the cached updates that are due */
+		timeout.tv_sec = 1; timeout.tv_nsec = 0;
+		msg = get_xymond_message(C_LAST, argv[0], &seq, &timeout);
 		if (msg == NULL) {
 			running = 0;
 			continue;
 		}
 
+		rrdcacheflushdue();
+
 		now = gettimer();
 		if (reloadtime < now) {
 			/* Reload configuration files */
@@ -332,6 +382,26 @@ int main(int argc, char *argv[])
 			reloadtime = now + 600;
 		}
 
+		if (statuscolumn && (nextstatustime <= now)) {
+			/* Report our own status */
+			strbuffer_t *statusmsg = newstrbuffer(0);
+			char msgline[1024];
+
+			init_timestamp();
+			snprintf(msgline, sizeof(msgline), "status+11 %s.%s green %s - xymond_rrd\nStatistics for xymond_rrd\n\n",
+				 xgetenv("MACHINE"), statuscolumn, timestamp);
+			addtobuffer(statusmsg, msgline);
+			addtobuffer(statusmsg, rrdcachestats());
+			addtobuffer(statusmsg, "\n");
+			addtobuffer(statusmsg, rrdhandlerstats());
+
+			if (usebackfeedqueue) combo_start_local(); else combo_start();
+			combo_add(statusmsg);
+			combo_end();
+			freestrbuffer(statusmsg);
+			nextstatustime = now + 300;
+		}
+
 		/* Split the message in the first line (with meta-data), and the rest */
  		eoln = strchr(msg, '\n');
 		if (eoln) {
@@ -426,15 +496,8 @@ int main(int argc, char *argv[])
 			reloadtime = 0;
 		}
 		else if ((metacount > 3) && (strncmp(metadata[0], "@@drophost", 10) == 0)) {
-			char hostdir[PATH_MAX];
 			hostname = metadata[3];
-
-			MEMDEFINE(hostdir);
-
-			sprintf(hostdir, "%s/%s", rrddir, basename(hostname));
-			dropdirectory(hostdir, 1);
-
-			MEMUNDEFINE(hostdir);
+			rrddrophost(hostname);
 		}
 		else if ((metacount > 4) && (strncmp(metadata[0], "@@droptest", 10) == 0)) {
 			/*
@@ -444,23 +507,13 @@ int main(int argc, char *argv[])
 			 */
 		}
 		else if ((metacount > 4) && (strncmp(metadata[0], "@@renamehost", 12) == 0)) {
-			char oldhostdir[PATH_MAX];
-			char newhostdir[PATH_MAX];
 			char *newhostname;
 
-			MEMDEFINE(oldhostdir);
-			MEMDEFINE(newhostdir);
-
 			hostname = metadata[3];
 			newhostname = metadata[4];
-			sprintf(oldhostdir, "%s/%s", rrddir, hostname);
-			sprintf(newhostdir, "%s/%s", rrddir, newhostname);
-			rename(oldhostdir, newhostdir);
+			rrdrenamehost(hostname, newhostname);
 
 			if (net_worker_locatorbased()) locator_rename_host(hostname, newhostname, ST_RRD);
-
-			MEMUNDEFINE(newhostdir);
-			MEMUNDEFINE(oldhostdir);
 		}
 		else if ((metacount > 5) && (strncmp(metadata[0], "@@renametest", 12) == 0)) {
 			/* Not implemented. See "droptest". */
@@ -478,7 +531,9 @@ int main(int argc, char *argv[])
 	/* Flush all cached updates to disk */
 	errprintf("Shutting down, flushing cached updates to disk\n");
 	rrdcacheflushall();
+	rrdwriter_stop();
 	errprintf("Cache flush completed\n");
+	rrddscachesave();
 
 	/* Close the external processor */
 	shutdown_extprocessor();
@@ -324,6 +324,34 @@ void net_worker_run(enum locator_servicetype_t svc, enum locator_sticky_t sticky
 }
 
 
+static char *find_msgend(char *start, char *fill, char *srch)
+{
+	/*
+	 * Find the end-of-message marker for the message beginning at "start".
+	 * Messages framed by "xymond_channel --batch" carry their length in a
+	 * header, so we can go directly to the marker instead of scanning all
+	 * of the data for it. Returns NULL if the message is incomplete.
+	 */
+	if (strncmp(start, "@@>", 3) == 0) {
+		unsigned long len;
+		char *p;
+
+		if ((fill - start) < CHANNEL_FRAMEHDRSZ) return NULL;
+
+		len = strtoul(start+3, &p, 16);
+		if ((p == (start + CHANNEL_FRAMEHDRSZ - 1)) && (*p == '\n') && (len >= 4)) {
+			if ((fill - start) < (CHANNEL_FRAMEHDRSZ + len)) return NULL;
+
+			p = start + CHANNEL_FRAMEHDRSZ + len - 4;
+			if (strncmp(p, "\n@@\n", 4) == 0) return p;
+		}
+
+		/* Bad frame - fall back to scanning, the message is dropped later */
+	}
+
+	return strstr(srch, "\n@@\n");
+}
+
 unsigned char *get_xymond_message(enum msgchannels_t chnid, char *id, int *seq, struct timespec *timeout)
 {
 	static unsigned int seqnum = 0;
@@ -337,7 +365,7 @@ unsigned char *get_xymond_message(enum msgchannels_t chnid, char *id, int *seq,
 	static char *endpos;	/* Where the first message ends */
 	static char *fillpos;	/* Where our unused data ends (the \0 byte) */
 
-	int truncated = 0;
+	int truncated = 0, framed;
 	struct timespec cutoff;
 	int maymove, needmoredata;
 	char *endsrch;		/* Where in the buffer do we start looking for the end-message marker */
@@ -365,6 +393,13 @@ unsigned char *get_xymond_message(enum msgchannels_t chnid, char *id, int *seq,
 	 * a pointer to our input buffer. The only time we 
 	 * need to shuffle data around is if the buffer
 	 * does not have room left to hold a complete message.
+	 * When all of the data in the buffer has been used, we
+	 * start filling it from the beginning again.
+	 *
+	 * If xymond_channel runs with "--batch", each message
+	 * has a frame header with the message length. We then
+	 * know where the message ends without searching for the
+	 * end-of-message marker, and exactly how much room it needs.
 	 */
 
 	if (buf == NULL) {
@@ -441,7 +476,13 @@ startagain:
 	 * See if the current available buffer space is enough to hold a full message.
 	 * If not, then flag that we may do a memmove() of the buffer data.
 	 */
-	maymove = ((startpos + maxmsgsize) >= (buf + bufsz));
+	if ((strncmp(startpos, "@@>", 3) == 0) && ((fillpos - startpos) >= CHANNEL_FRAMEHDRSZ)) {
+		/* Framed message - we know how large it is */
+		maymove = ((startpos + CHANNEL_FRAMEHDRSZ + strtoul(startpos+3, NULL, 16)) > (buf + bufsz));
+	}
+	else {
+		maymove = ((startpos + maxmsgsize) >= (buf + bufsz));
+	}
 
 	/* We only need to read data, if we do not have an end-of-message marker */
 	needmoredata = (endpos == NULL);
@@ -457,7 +498,15 @@ startagain:
 		dbgprintf("Want msg %d, startpos %ld, fillpos %ld, endpos %ld, usedbytes=%ld, bufleft=%ld\n",
 			  (seqnum+1), (startpos-buf), (fillpos-buf), (endpos ? (endpos-buf) : -1), usedbytes, bufleft);
 
-		if (usedbytes >= maxmsgsize) {
+		if ((usedbytes == 0) && (startpos != buf)) {
+			/* Everything has been used, so start over at the beginning of the buffer */
+			*buf = '\0';
+			startpos = fillpos = endsrch = buf;
+			maymove = 0;
+			bufleft = bufsz;
+		}
+
+		if (usedbytes >= (maxmsgsize + CHANNEL_FRAMEHDRSZ)) {
 			/* Over-size message. Truncate it. */
 			errprintf("Got over-size message, truncating at %d bytes (max: %d)\n", usedbytes, maxmsgsize);
 			endpos = startpos + usedbytes - 5;
@@ -545,7 +594,7 @@ startagain:
 					fillpos += res;
 
 					/* Did we get an end-of-message marker ? Then we're done. */
-					endpos = strstr(endsrch, "\n@@\n");
+					endpos = find_msgend(startpos, fillpos, endsrch);
 					needmoredata = (endpos == NULL);
 
 					/*
@@ -562,16 +611,32 @@ startagain:
 	/* We have a complete message between startpos and endpos */
 	result = startpos;
 	*endpos = '\0';
+	if (strncmp(result, "@@>", 3) == 0) {
+		/* Framed message - check that the length in the frame header matches where the message ended */
+		framed = ((endpos - result) == (CHANNEL_FRAMEHDRSZ + strtoul(result+3, NULL, 16) - 4)) ? 1 : -1;
+	}
+	else {
+		framed = 0;
+	}
 	if (truncated) {
 		startpos = fillpos = buf;
 		endpos = NULL;
 	}
 	else {
 		startpos = endpos+4; /* +4 because we skip the "\n@@\n" end-marker from the previous message */
-		endpos = strstr(startpos, "\n@@\n");	/* To see if we already have a full message loaded */
+		endpos = find_msgend(startpos, fillpos, startpos);	/* To see if we already have a full message loaded */
 		/* fillpos stays where it is */
 	}
 
+	if (framed == -1) {
+		errprintf("Dropping message with bad frame header\n");
+		goto startagain;
+	}
+	else if (framed == 1) {
+		/* Skip the frame header */
+		result += CHANNEL_FRAMEHDRSZ;
+	}
+
 	/* Check that it really is a message, and not just some garbled data */
 	if (strncmp(result, "@@", 2) != 0) {
 		errprintf("Dropping (more) garbled data\n");
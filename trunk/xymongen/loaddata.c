@@ -17,11 +17,13 @@ static char rcsid[] = "$Id$";
 #include <string.h>
 #include <stdlib.h>
 #include <ctype.h>
+#include <errno.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <dirent.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <sys/wait.h>
 
 #include "xymongen.h"
 #include "util.h"
@@ -37,6 +39,8 @@ time_t		recentgif_limit = 86400;		/* Limit for recent-gifs display, in seconds *
 
 xymongen_col_t 	null_column = { "", NULL };		/* Null column */
 
+int		reportworkers = 1;			/* Processes calculating the availability */
+
 char		*purplelogfn = NULL;
 static FILE	*purplelog = NULL;
 int		colorcount[COL_COUNT] = { 0, };
@@ -54,6 +58,15 @@ typedef struct compact_t {
 
 
 
+typedef struct reportresult_t {
+	int color;
+	int fileok;
+	reportinfo_t repinfo;
+} reportresult_t;
+
+static void *reportresults = NULL;
+
+
 typedef struct logdata_t {
 	/* hostname|testname|color|testflags|lastchange|logtime|validtime|acktime|disabletime|sender|cookie|1st line of message */
 	char *hostname;
@@ -123,6 +136,18 @@ int unwantedcolumn(char *hostname, char *testname)
 }
 
 
+static int history_report(FILE *fd, char *fullfn, host_t *host, char *hostname, char *testname, reportinfo_t *repinfo)
+{
+	/* Determine "color" for this test from the historical data */
+	return parse_historyfile(fd, fullfn, repinfo, 
+				(dynamicreport ? NULL: hostname), (dynamicreport ? NULL : testname), 
+				reportstart, reportend, 0, 
+				(host ? host->reportwarnlevel : reportwarnlevel), 
+				reportgreenlevel,
+				(host ? host->reportwarnstops : reportwarnstops), 
+				(host ? host->reporttime : NULL));
+}
+
 state_t *init_state(char *filename, logdata_t *log)
 {
 	FILE 		*fd = NULL;
@@ -261,21 +286,29 @@ state_t *init_state(char *filename, logdata_t *log)
 	newstate->entry->sumurl = NULL;
 
 	if (reportstart) {
-		/* Determine "color" for this test from the historical data */
+		reportresult_t *res = NULL;
+
+		if (reportresults) {
+			xtreePos_t handle = xtreeFind(reportresults, filename);
+			if (handle != xtreeEnd(reportresults)) res = (reportresult_t *)xtreeData(reportresults, handle);
+		}
+
 		newstate->entry->repinfo = (reportinfo_t *) calloc(1, sizeof(reportinfo_t));
-		newstate->entry->color = parse_historyfile(fd, newstate->entry->repinfo, 
-				(dynamicreport ? NULL: hostname), (dynamicreport ? NULL : testname), 
-				reportstart, reportend, 0, 
-				(host ? host->reportwarnlevel : reportwarnlevel), 
-				reportgreenlevel,
-				(host ? host->reportwarnstops : reportwarnstops), 
-				(host ? host->reporttime : NULL));
+		if (res) {
+			/* Already done by one of the report workers */
+			memcpy(newstate->entry->repinfo, &res->repinfo, sizeof(reportinfo_t));
+			newstate->entry->repinfo->fstate = (res->fileok ? "OK" : "NOTOK");
+			newstate->entry->color = res->color;
+		}
+		else {
+			newstate->entry->color = history_report(fd, fullfn, host, hostname, testname, newstate->entry->repinfo);
+		}
 		newstate->entry->causes = (dynamicreport ? NULL : save_replogs());
 	}
 	else if (snapshot) {
 		time_t fileage;
 
-		newstate->entry->color = history_color(fd, snapshot, &histentry_start, &newstate->entry->histlogname);
+		newstate->entry->color = history_color(fd, fullfn, snapshot, &histentry_start, &newstate->entry->histlogname);
 		fileage = snapshot - histentry_start;
 
 		newstate->entry->oldage = (fileage >= recentgif_limit);
@@ -468,6 +501,124 @@ void generate_compactitems(state_t **topstate)
 }
 
 
+static void run_reportworkers(char *board)
+{
+	/*
+	 * For a report covering many statuses, most of the time goes into
+	 * reading the history files. Split the statuses between a number of
+	 * worker processes, and let init_state() pick up their results.
+	 * Only done for dynamic reports, since the pre-built reports also
+	 * need the list of events for each status.
+	 */
+	char *boardcopy, *bol, **hostnames = NULL, **filenames = NULL;
+	int filecount = 0, i, w;
+	pid_t *workers;
+
+	boardcopy = strdup(board);
+	for (bol = strtok(boardcopy, "\n"); (bol); bol = strtok(NULL, "\n")) {
+		char *testname, *p;
+		char fn[PATH_MAX];
+
+		testname = strchr(bol, '|');
+		if (!testname) continue;
+		*testname = '\0'; testname++;
+		p = strchr(testname, '|'); if (p) *p = '\0';
+
+		sprintf(fn, "%s.%s", commafy(bol), testname);
+		if (strncmp(fn, "summary.", 8) == 0) continue;
+		if (strcmp(testname, xgetenv("INFOCOLUMN")) == 0) continue;
+		if (strcmp(testname, xgetenv("TRENDSCOLUMN")) == 0) continue;
+
+		hostnames = (char **)realloc(hostnames, (filecount+1)*sizeof(char *));
+		filenames = (char **)realloc(filenames, (filecount+1)*sizeof(char *));
+		hostnames[filecount] = strdup(bol);
+		filenames[filecount] = strdup(fn);
+		filecount++;
+	}
+	xfree(boardcopy);
+
+	if (filecount < 2*reportworkers) goto cleanup;
+
+	workers = (pid_t *)calloc(reportworkers, sizeof(pid_t));
+	for (w = 0; (w < reportworkers); w++) {
+		char resultfn[PATH_MAX];
+
+		sprintf(resultfn, "%s/xymongen.%d.%d", xgetenv("XYMONTMP"), (int)getpid(), w);
+		workers[w] = fork();
+		if (workers[w] == 0) {
+			FILE *resultfd;
+
+			resultfd = fopen(resultfn, "w");
+			if (resultfd == NULL) exit(1);
+
+			for (i = w; (i < filecount); i += reportworkers) {
+				char fullfn[PATH_MAX];
+				char *testname = strrchr(filenames[i], '.') + 1;
+				FILE *fd;
+				reportresult_t res;
+				int namelen;
+
+				sprintf(fullfn, "%s/%s", xgetenv("XYMONHISTDIR"), filenames[i]);
+				fd = fopen(fullfn, "r");
+				if (fd == NULL) continue;
+
+				memset(&res, 0, sizeof(res));
+				res.color = history_report(fd, fullfn, find_host(hostnames[i]), hostnames[i], testname, &res.repinfo);
+				res.fileok = (strcmp(res.repinfo.fstate, "OK") == 0);
+				res.repinfo.fstate = NULL;
+				fclose(fd);
+
+				namelen = strlen(filenames[i]);
+				fwrite(&namelen, sizeof(namelen), 1, resultfd);
+				fwrite(filenames[i], namelen, 1, resultfd);
+				fwrite(&res, sizeof(res), 1, resultfd);
+			}
+
+			exit((fclose(resultfd) == 0) ? 0 : 1);
+		}
+		else if (workers[w] == -1) {
+			errprintf("Cannot fork report worker: %s\n", strerror(errno));
+		}
+	}
+
+	reportresults = xtreeNew(strcmp);
+	for (w = 0; (w < reportworkers); w++) {
+		char resultfn[PATH_MAX];
+		int status, namelen;
+		FILE *resultfd;
+
+		if (workers[w] <= 0) continue;
+
+		/* If a worker failed, init_state() does its statuses */
+		sprintf(resultfn, "%s/xymongen.%d.%d", xgetenv("XYMONTMP"), (int)getpid(), w);
+		if ((waitpid(workers[w], &status, 0) == workers[w]) && WIFEXITED(status) && (WEXITSTATUS(status) == 0) &&
+		    ((resultfd = fopen(resultfn, "r")) != NULL)) {
+			while (fread(&namelen, sizeof(namelen), 1, resultfd) == 1) {
+				char *fn;
+				reportresult_t *res;
+
+				if ((namelen <= 0) || (namelen >= PATH_MAX)) break;
+				fn = (char *)malloc(namelen+1);
+				res = (reportresult_t *)malloc(sizeof(reportresult_t));
+				if ((fread(fn, namelen, 1, resultfd) != 1) || (fread(res, sizeof(reportresult_t), 1, resultfd) != 1)) {
+					xfree(fn); xfree(res);
+					break;
+				}
+				fn[namelen] = '\0';
+				if (xtreeAdd(reportresults, fn, res) != XTREE_STATUS_OK) { xfree(fn); xfree(res); }
+			}
+			fclose(resultfd);
+		}
+		unlink(resultfn);
+	}
+	xfree(workers);
+
+cleanup:
+	for (i = 0; (i < filecount); i++) { xfree(hostnames[i]); xfree(filenames[i]); }
+	if (hostnames) xfree(hostnames);
+	if (filenames) xfree(filenames);
+}
+
 state_t *load_state(dispsummary_t **sumhead)
 {
 	int 		xymondresult;
@@ -531,6 +682,8 @@ state_t *load_state(dispsummary_t **sumhead)
 		oldestentry = getcurrenttime(NULL);
 		purplelog = NULL;
 		purplelogfn = NULL;
+
+		if (reportstart && dynamicreport && (reportworkers > 1)) run_reportworkers(board);
 	}
 	else {
 		if (purplelogfn) {
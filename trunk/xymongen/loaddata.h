@@ -17,6 +17,7 @@ extern char     *ignorecolumns;
 extern char	*dialupskin;
 extern char	*reverseskin;
 extern time_t   recentgif_limit;
+extern int	reportworkers;
 
 extern char 	*purplelogfn;
 extern int      colorcount[];
@@ -24,6 +24,7 @@ static char rcsid[] = "$Id$";
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <sys/wait.h>
 
 #include "xymongen.h"
 #include "util.h"
@@ -1049,16 +1050,307 @@ void do_one_page(xymongen_page_t *page, dispsummary_t *sums, int embedded)
 }
 
 
-void do_page_with_subs(xymongen_page_t *curpage, dispsummary_t *sums)
+/*
+ * Incremental page generation (--incremental). A signature of what is
+ * shown on each page is saved in $XYMONTMP between runs, and a page is
+ * only written when its signature changes. The signature covers the
+ * colors and flags of the tests on the page, the hosts and groups, and
+ * the colors of the subpages - so when a page changes color, the pages
+ * above it are also written. Things that only depend on the time (the
+ * "Status unchanged" text in tooltips, and the header/footer dates) are
+ * not part of it; they are updated when all pages are written, which is
+ * done every "incrementalpages" seconds.
+ */
+int incrementalpages = 0;
+int pagesgenerated = 0;
+static char *pagesigfn = NULL;
+static void *pagesigs = NULL;
+static strbuffer_t *newpagesigs = NULL;
+static time_t lastfullpages = 0;
+
+void load_pagesigs(char *pageset)
+{
+	FILE *fd;
+	char l[1024];
+	long lastfull = 0;
+
+	pagesigfn = (char *)malloc(strlen(xgetenv("XYMONTMP")) + (pageset ? strlen(pageset) : 0) + 30);
+	sprintf(pagesigfn, "%s/xymongen%s%s.pages", xgetenv("XYMONTMP"), (pageset ? "." : ""), (pageset ? pageset : ""));
+
+	pagesigs = xtreeNew(strcmp);
+	newpagesigs = newstrbuffer(0);
+	lastfullpages = getcurrenttime(NULL);
+
+	fd = fopen(pagesigfn, "r");
+	if (fd == NULL) return;
+
+	if (fgets(l, sizeof(l), fd) && (sscanf(l, "full %ld", &lastfull) == 1) && 
+	    ((lastfullpages - lastfull) < incrementalpages)) {
+		lastfullpages = lastfull;
+
+		while (fgets(l, sizeof(l), fd)) {
+			char *sig, *p;
+
+			p = strchr(l, '\n'); if (p) *p = '\0';
+			sig = strrchr(l, ' ');
+			if (!sig) continue;
+			*sig = '\0'; sig++;
+			xtreeAdd(pagesigs, strdup(l), strdup(sig));
+		}
+	}
+	else {
+		dbgprintf("Writing all pages\n");
+	}
+
+	fclose(fd);
+}
+
+void save_pagesigs(void)
+{
+	char tmpfn[PATH_MAX];
+	FILE *fd;
+	int ok;
+
+	if (!pagesigfn) return;
+
+	sprintf(tmpfn, "%s.tmp", pagesigfn);
+	fd = fopen(tmpfn, "w");
+	if (fd == NULL) {
+		errprintf("Cannot create %s: %s\n", tmpfn, strerror(errno));
+		return;
+	}
+
+	ok = (fprintf(fd, "full %ld\n", (long)lastfullpages) > 0);
+	if (ok && STRBUFLEN(newpagesigs)) ok = (fwrite(STRBUF(newpagesigs), STRBUFLEN(newpagesigs), 1, fd) == 1);
+	if (fclose(fd) != 0) ok = 0;
+	if (!ok || (rename(tmpfn, pagesigfn) == -1)) {
+		errprintf("Cannot save page signatures to %s: %s\n", pagesigfn, strerror(errno));
+		unlink(tmpfn);
+	}
+}
+
+static void hosts_signature(strbuffer_t *buf, host_t *head)
+{
+	host_t *h;
+	entry_t *e;
+	char num[100];
+
+	for (h = head; (h); h = h->next) {
+		/* hostnamehtml() shows the displayname, comment and description */
+		addtobuffer_many(buf, "H|", h->hostname, "|", textornull(h->ip), "|", textornull(h->pretitle), 
+				 "|", textornull(h->displayname), "|", textornull(h->comment), "|", textornull(h->description), NULL);
+		sprintf(num, "|%d|%d\n", h->color, h->dialup);
+		addtobuffer(buf, num);
+
+		for (e = h->entries; (e); e = e->next) {
+			addtobuffer_many(buf, "E|", e->column->name, "|", textornull(e->skin), "|", textornull(e->sumurl), 
+					 "|", textornull(e->histlogname), NULL);
+			sprintf(num, "|%d|%d|%d|%d\n", e->color, e->acked, e->oldage, e->propagate);
+			addtobuffer(buf, num);
+		}
+	}
+}
+
+static char *page_signature(xymongen_page_t *page, dispsummary_t *sums)
+{
+	strbuffer_t *buf = newstrbuffer(0);
+	xymongen_page_t *sub;
+	group_t *g;
+	dispsummary_t *s;
+	char num[100];
+	char *result;
+
+	/* The pretitle is shown on the parent page (and do_one_page() may change it) */
+	addtobuffer_many(buf, "P|", page->name, "|", textornull(page->title), NULL);
+	sprintf(num, "|%d|%d\n", page->color, page->oldage);
+	addtobuffer(buf, num);
+
+	for (sub = page->subpages; (sub); sub = sub->next) {
+		addtobuffer_many(buf, "S|", sub->name, "|", textornull(sub->title), "|", textornull(sub->pretitle), NULL);
+		sprintf(num, "|%d|%d\n", sub->color, sub->oldage);
+		addtobuffer(buf, num);
+	}
+
+	hosts_signature(buf, page->hosts);
+	for (g = page->groups; (g); g = g->next) {
+		addtobuffer_many(buf, "G|", textornull(g->title), "|", textornull(g->onlycols), "|", 
+				 textornull(g->exceptcols), "|", textornull(g->pretitle), "\n", NULL);
+		hosts_signature(buf, g->hosts);
+	}
+
+	for (s = sums; (s); s = s->next) {
+		addtobuffer_many(buf, "D|", s->row, "|", s->column, "|", textornull(s->url), NULL);
+		sprintf(num, "|%d\n", s->color);
+		addtobuffer(buf, num);
+	}
+
+	result = strdup(md5hash(STRBUF(buf)));
+	freestrbuffer(buf);
+
+	return result;
+}
+
+static int page_changed(xymongen_page_t *page, dispsummary_t *sums, char **sigline)
+{
+	/* Returns 1 if the page must be written. The line for the new signatures file is returned in sigline */
+	char key[PATH_MAX], tmppath[PATH_MAX];
+	char *sig;
+	xymongen_page_t *pgwalk;
+	xtreePos_t handle;
+	int changed;
+
+	strcpy(key, "");
+	for (pgwalk = page; (pgwalk); pgwalk = pgwalk->parent) {
+		if (strlen(pgwalk->name)) {
+			sprintf(tmppath, "/%s%s", pgwalk->name, key);
+			strcpy(key, tmppath);
+		}
+	}
+	sprintf(tmppath, "xymon%s", key);
+	strcpy(key, tmppath);
+
+	sig = page_signature(page, sums);
+	handle = xtreeFind(pagesigs, key);
+	changed = ((handle == xtreeEnd(pagesigs)) || (strcmp((char *)xtreeData(pagesigs, handle), sig) != 0));
+	*sigline = (char *)malloc(strlen(key) + strlen(sig) + 3);
+	sprintf(*sigline, "%s %s\n", key, sig);
+	xfree(sig);
+
+	if (!changed) dbgprintf("Page %s has not changed\n", key);
+	return changed;
+}
+
+/*
+ * Parallel page generation (--page-workers). Once the state is loaded
+ * the pages do not depend on each other, so they are split between a
+ * number of worker processes that each write their share of the pages.
+ * The main process goes on with the non-green pages meanwhile, and
+ * waits for the workers in wait_pageworkers(). The signatures of the
+ * pages a worker did not write are left out, so they are written again
+ * the next time.
+ */
+int pageworkers = 1;
+
+typedef struct pagework_t {
+	xymongen_page_t *page;
+	dispsummary_t *sums;
+	char *sigline;		/* For the page signatures file, if --incremental */
+} pagework_t;
+static pagework_t *pagework = NULL;
+static int pageworkcount = 0;
+static pid_t *pageworkerpids = NULL;
+
+static int pagedir_exists(xymongen_page_t *page)
+{
+	char pagepath[PATH_MAX], tmppath[PATH_MAX];
+	xymongen_page_t *pgwalk;
+	struct stat st;
+
+	if (page->parent == NULL) return 1;
+
+	pagepath[0] = '\0';
+	for (pgwalk = page; (pgwalk); pgwalk = pgwalk->parent) {
+		if (strlen(pgwalk->name)) {
+			sprintf(tmppath, "%s/%s/", pgwalk->name, pagepath);
+			strcpy(pagepath, tmppath);
+		}
+	}
+
+	return ((stat(pagepath, &st) == 0) && S_ISDIR(st.st_mode));
+}
+
+static void collect_pages(xymongen_page_t *curpage, dispsummary_t *sums)
 {
 	xymongen_page_t *levelpage;
 
 	for (levelpage = curpage; (levelpage); levelpage = levelpage->next) {
-		do_one_page(levelpage, sums, 0);
-		do_page_with_subs(levelpage->subpages, NULL);
+		char *sigline = NULL;
+
+		if (!pagesigs || page_changed(levelpage, sums, &sigline)) {
+			pagesgenerated++;
+
+			if ((pageworkers > 1) && pagedir_exists(levelpage)) {
+				pagework = (pagework_t *)realloc(pagework, (pageworkcount+1)*sizeof(pagework_t));
+				pagework[pageworkcount].page = levelpage;
+				pagework[pageworkcount].sums = sums;
+				pagework[pageworkcount].sigline = sigline;
+				pageworkcount++;
+				sigline = NULL;
+			}
+			else {
+				/* 
+				 * Done right away, so the directories (and their
+				 * index-links) are set up in the normal order.
+				 */
+				do_one_page(levelpage, sums, 0);
+			}
+		}
+		if (sigline) {
+			addtobuffer(newpagesigs, sigline);
+			xfree(sigline);
+		}
+		collect_pages(levelpage->subpages, NULL);
 	}
 }
 
+void do_page_with_subs(xymongen_page_t *curpage, dispsummary_t *sums)
+{
+	int w, i;
+
+	collect_pages(curpage, sums);
+	if (pageworkcount == 0) return;
+
+	dbgprintf("Writing %d pages with %d workers\n", pageworkcount, pageworkers);
+	fflush(stdout); fflush(stderr);
+
+	pageworkerpids = (pid_t *)calloc(pageworkers, sizeof(pid_t));
+	for (w = 0; (w < pageworkers); w++) {
+		pageworkerpids[w] = fork();
+		if (pageworkerpids[w] == 0) {
+			for (i = w; (i < pageworkcount); i += pageworkers) {
+				do_one_page(pagework[i].page, pagework[i].sums, 0);
+			}
+			exit(0);
+		}
+		else if (pageworkerpids[w] == -1) {
+			errprintf("Cannot fork page worker: %s\n", strerror(errno));
+
+			/* Do its pages ourselves */
+			for (i = w; (i < pageworkcount); i += pageworkers) {
+				do_one_page(pagework[i].page, pagework[i].sums, 0);
+			}
+		}
+	}
+}
+
+void wait_pageworkers(void)
+{
+	int w, i;
+
+	if (!pageworkerpids) return;
+
+	for (w = 0; (w < pageworkers); w++) {
+		int status, ok = 1;
+
+		/* If the fork failed, we did the pages ourselves */
+		if ((pageworkerpids[w] > 0) && 
+		    ((waitpid(pageworkerpids[w], &status, 0) != pageworkerpids[w]) || !WIFEXITED(status) || (WEXITSTATUS(status) != 0))) {
+			errprintf("Page worker %d failed\n", w);
+			ok = 0;
+		}
+
+		for (i = w; (i < pageworkcount); i += pageworkers) {
+			if (!pagework[i].sigline) continue;
+			if (ok) addtobuffer(newpagesigs, pagework[i].sigline);
+			xfree(pagework[i].sigline);
+		}
+	}
+
+	xfree(pageworkerpids);
+	if (pagework) xfree(pagework);
+	pageworkcount = 0;
+}
+
 
 static void do_nongreenext(FILE *output, char *extenv, char *family)
 {
@@ -1236,6 +1528,9 @@ int do_nongreen_page(char *nssidebarfilename, int summarytype, char *filenamebas
 	}
 
 	sprintf(tmpfilename, "%s.tmp", filename);
+
+	/* Start the anchors from scratch, whichever pages were written before this one */
+	hostblkidx = 0;
 	output = fopen(tmpfilename, "w");
 	if (output == NULL) {
 		errprintf("Cannot create file %s: %s\n", tmpfilename, strerror(errno));
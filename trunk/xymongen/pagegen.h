@@ -40,10 +40,16 @@ extern int  nongreenacklogmaxtime;
 extern char *logcritstatus;
 extern int  critonlyreds;
 extern int  wantrss;
+extern int  incrementalpages;
+extern int  pagesgenerated;
+extern int  pageworkers;
 
 extern void select_headers_and_footers(char *prefix);
 extern void do_one_page(xymongen_page_t *page, dispsummary_t *sums, int embedded);
+extern void load_pagesigs(char *pageset);
+extern void save_pagesigs(void);
 extern void do_page_with_subs(xymongen_page_t *curpage, dispsummary_t *sums);
+extern void wait_pageworkers(void);
 extern int  do_nongreen_page(char *nssidebarfilename, int summarytype, char *filenamebase);
 
 #endif
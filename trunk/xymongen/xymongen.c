@@ -258,6 +258,24 @@ int main(int argc, char *argv[])
 			select_headers_and_footers("rep");
 			sethostenv_report(reportstart, reportend, reportwarnlevel, reportgreenlevel);
 		}
+		else if (argnmatch(argv[i], "--report-workers=")) {
+			char *lp = strchr(argv[i], '=');
+
+			reportworkers = atoi(lp+1);
+			if (reportworkers < 1) reportworkers = 1;
+		}
+		else if (argnmatch(argv[i], "--page-workers=")) {
+			char *lp = strchr(argv[i], '=');
+
+			pageworkers = atoi(lp+1);
+			if (pageworkers < 1) pageworkers = 1;
+		}
+		else if (argnmatch(argv[i], "--incremental=") || (strcmp(argv[i], "--incremental") == 0)) {
+			char *lp = strchr(argv[i], '=');
+
+			incrementalpages = (lp ? atoi(lp+1) : 3600);
+			if (incrementalpages < 0) incrementalpages = 0;
+		}
 		else if (argnmatch(argv[i], "--csv="))  {
 			char *lp = strchr(argv[i], '=');
 			csvfile = strdup(lp+1);
@@ -473,11 +491,14 @@ int main(int argc, char *argv[])
 			printf("    --no-eventlog               : Do not generate the non-green eventlog display\n");
 			printf("    --no-acklog                 : Do not generate the non-green ack-log display\n");
 			printf("    --no-pages                  : Generate only the nongreen and critical pages\n");
+			printf("    --incremental[=N]           : Only write pages that changed. All pages are written every N seconds\n");
+			printf("    --page-workers=N            : Use N processes to write the pages\n");
 			printf("    --docurl=documentation-URL  : Hostnames link to a general (dynamic) web page for docs\n");
 			printf("    --doc-window                : Open doc-links in a new browser window\n");
 			printf("    --htmlextension=.EXT        : Sets filename extension for generated file (default: .html\n");
 			printf("    --report[=COLUMNNAME]       : Send a status report about the running of xymongen\n");
 			printf("    --reportopts=ST:END:DYN:STL : Run in Xymon Reporting mode\n");
+			printf("    --report-workers=N          : For Xymon Reporting, use N processes to read the history\n");
 			printf("    --csv=FILENAME              : For Xymon Reporting, output CSV file\n");
 			printf("    --csvdelim=CHARACTER        : Delimiter in CSV file output (default: comma)\n");
 			printf("    --snapshot=TIME             : Snapshot mode\n");
@@ -640,12 +661,16 @@ int main(int argc, char *argv[])
 		csv_availability(csvfile, csvdelim);
 	}
 	if (do_normal) {
+		int incremental = (incrementalpages && !reportstart && !snapshot);
+
+		if (incremental) load_pagesigs(pageset);
 		do_page_with_subs(pagehead, dispsums);
 	}
 	add_timestamp("Xymon pagegen done");
 
 	if (reportstart) {
 		/* Reports end here */
+		wait_pageworkers();
 		return 0;
 	}
 
@@ -664,6 +689,7 @@ int main(int argc, char *argv[])
 
 	if (snapshot) {
 		/* Snapshots end here */
+		wait_pageworkers();
 		return 0;
 	}
 
@@ -679,6 +705,14 @@ int main(int argc, char *argv[])
 		add_timestamp("WML generation done");
 	}
 
+	if (pageworkers > 1) {
+		wait_pageworkers();
+		add_timestamp("Page workers done");
+	}
+
+	/* Not until the page workers are done, so the pages of a failed worker are left out */
+	save_pagesigs();
+
 	/* Need to do this before sending in our report */
 	add_timestamp("Run completed");
 
@@ -709,6 +743,10 @@ int main(int argc, char *argv[])
 		addtostatus(msgline);
 		sprintf(msgline, " Pages                      : %5d\n", pagecount);
 		addtostatus(msgline);
+		if (incrementalpages) {
+			sprintf(msgline, " Pages written              : %5d\n", pagesgenerated);
+			addtostatus(msgline);
+		}
 		sprintf(msgline, " Status messages            : %5d\n", statuscount);
 		addtostatus(msgline);
 		sprintf(msgline, " - Red                      : %5d (%5.2f %%)\n",